@@ -19,7 +19,9 @@
 
 #include "lock.h"
 #include "log.h"
+#include "sha256.h"
 #include "tarfile.h"
+#include "threads.h"
 
 #include <string.h>
 #include <sys/stat.h>
@@ -51,6 +53,7 @@ Backup::Backup(ptr<FileSystem> origin_fs)
     pthread_mutexattr_settype(&global_attr, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&global, &global_attr);
     origin_fs_ = origin_fs;
+    num_threads_ = numCores();
 }
 
 RecurseOption Backup::addTarEntry(Path *abspath, FileStat *st)
@@ -143,7 +146,6 @@ RecurseOption Backup::addTarEntry(Path *abspath, FileStat *st)
     if (te->isDirectory()) {
         // Storing the path in the lookup
         directories[te->path()] = te;
-        //origin_fs_->addWatch(abspath); avoid inotify watch for now
         debug(BACKUP, "added dir >%s< %p %p\n", te->path()->c_str(), te->path(), directories[te->path()]);
     }
     return RecurseContinue;
@@ -366,20 +368,31 @@ void Backup::pruneDirectories() {
 
 size_t Backup::findNumTarsFromSize(size_t amount, size_t total_size) {
     // We have 128M of data
-    // The amount (= min tar size) is 10M, how many tars?
-    // 1 -> 10
-    // 2 -> 20
-    // 4 -> 40
-    // 8 -> 80
-    // 16 -> 160 which is larger than 128
-    // thus return that we should use 8 tar files.
-    size_t n = 1;
-
-    while (amount < total_size) {
-        amount *= 2;
-        n*=2;
-    }
-    return n;
+    // The amount (= target tar size) is 10M, how many tars?
+    // The tars are picked using a linear hash (see findTarFromHash), where
+    // the tars not yet split hold twice as much as the split tars.
+    // With 26 tars, 20 tars hold 4M each and the 6 tars not yet split
+    // hold 8M each, which is below the target size.
+    // Thus return that we should use 26 tar files.
+    if (total_size <= amount) return 1;
+    return (2*total_size + amount - 1) / amount;
+}
+
+size_t findTarFromHash(uint32_t hash, size_t num_tars)
+{
+    // Linear hashing. Going from n to n+1 tars splits a single tar into two
+    // and the files in all the other tars stay where they are. A plain hash % n
+    // would move almost every file to another tar, and every tar in the tar
+    // collection dir would have to be stored again.
+    //
+    // With the smallest power of two p >= n, a hash picks the tar hash % p,
+    // but the tars from n to p-1 do not exist yet. Their files are still in the
+    // tar that will be split, hash % (p/2).
+    size_t p = 1;
+    while (p < num_tars) p *= 2;
+    size_t o = hash % p;
+    if (o >= num_tars) o = hash % (p/2);
+    return o;
 }
 
 void Backup::calculateNumTars(TarEntry *te,
@@ -438,10 +451,11 @@ void Backup::calculateNumTars(TarEntry *te,
     if (small_files_size <= tar_target_size ||
         medium_files_size <= tar_target_size) {
         // Either the small tar or the medium tar is not big enough.
-        // Put them all in a single tar and hope that they together are as large as
-        // the target tar size.
+        // Put the small and medium files together in small tars, as many
+        // as their combined size needs, which is a single tar unless they
+        // together are larger than the target tar size.
         *sc = medium_size;
-        *nst = *nst + *nmt - 1;
+        *nst = findNumTarsFromSize(tar_target_size, small_files_size + medium_files_size);
         *sfs = *sfs + *mfs;
         *nmt = 0;
         *mfs = 0;
@@ -554,337 +568,531 @@ void Backup::fixTarPaths() {
     }
 }
 
-size_t Backup::groupFilesIntoTars()
+bool Backup::isSealed(TarEntry *te)
 {
-    size_t num_virtual_tars = 0;
-    size_t count = 0;
-    size_t total = tar_storage_directories.size();
-
-    for (auto & e : files)
-    {
-        TarEntry *te = &e.second;
-        te->calculateHash();
+    for (auto &g : seals) {
+        if (g.match(te->path()->c_str())) return true;
     }
+    return false;
+}
 
-
-    for (auto & e : tar_storage_directories)
+size_t Backup::createSealedTars(TarEntry *te, size_t mediumcomp)
+{
+    // In a dir that only gains new files, like a maildir or a log archive,
+    // the new files have the most recent mtimes. Filling the tars in mtime order
+    // puts the new files into the last tar and into new tars, the older tars
+    // keep their contents and their names and are not stored again.
+    //
+    // A tar is cut where the tarpath hash of a file says so, once the tar is
+    // half the target size. Thus a removed or changed old file only changes
+    // the tars around it, the following tars are cut at the same files as before.
+    // A tar that becomes small is merged with the next tar by the same rule.
+    vector<TarEntry*> entries;
+    for (auto & entry : te->entries())
     {
-        TarEntry *te = e.second;
+        if (entry->isDirectory() || entry->isHardLink()) continue;
+        if (entry->blockedSize() >= mediumcomp) continue;
+        entries.push_back(entry);
+    }
+    sort(entries.begin(), entries.end(), [](TarEntry *a, TarEntry *b) {
+            struct timespec *am = &a->stat()->st_mtim;
+            struct timespec *bm = &b->stat()->st_mtim;
+            if (am->tv_sec != bm->tv_sec) return am->tv_sec < bm->tv_sec;
+            if (am->tv_nsec != bm->tv_nsec) return am->tv_nsec < bm->tv_nsec;
+            return strcmp(a->tarpath()->c_str(), b->tarpath()->c_str()) < 0;
+        });
 
-        if (count % 100 == 0)
+    size_t n = 0;
+    size_t size = 0;
+    for (TarEntry *entry : entries)
+    {
+        if (size == 0) te->createSmallTar(n++);
+        te->smallTar(n-1)->addEntryLast(entry);
+        size += entry->blockedSize();
+        if (size >= tar_target_size ||
+            (size >= tar_target_size/2 && entry->tarpathHash() % 4 == 0))
         {
-            UI::clearLine();
-            info(BACKUP, "Organizing files into %zu/%zu dirs.", count, total);
+            size = 0;
         }
-        count++;
+    }
+    debug(BACKUP, "sealed %zu files into %zu tars in %s\n", entries.size(), n, te->path()->c_str());
+    return n;
+}
+
+size_t Backup::groupTarCollectionDir(TarEntry *te)
+{
+    debug(BACKUP, "TAR COLLECTION DIR >%s<\n", te->path()->c_str());
+
+    size_t num_virtual_tars = 0;
+    size_t nst,nmt,nlt,sfs,mfs,lfs,smallcomp,mediumcomp;
+    calculateNumTars(te, &nst,&nmt,&nlt,&sfs,&mfs,&lfs,
+                     &smallcomp,&mediumcomp);
 
-        debug(BACKUP, "TAR COLLECTION DIR >%s< >%s<\n", e.first->c_str(), te->path()->c_str());
+    debug(BACKUP, "TAR COLLECTION DIR nst=%zu nmt=%zu nlt=%zu sfs=%zu mfs=%zu lfs=%zu\n",
+          nst,nmt,nlt,sfs,mfs,lfs);
 
-        size_t nst,nmt,nlt,sfs,mfs,lfs,smallcomp,mediumcomp;
-        calculateNumTars(te, &nst,&nmt,&nlt,&sfs,&mfs,&lfs,
-                         &smallcomp,&mediumcomp);
+    // This is the taz file that store sub directories for this tar collection dir.
+    te->registerTazFile();
+    te->registerGzFile();
 
-        debug(BACKUP, "TAR COLLECTION DIR nst=%zu nmt=%zu nlt=%zu sfs=%zu mfs=%zu lfs=%zu\n",
-              nst,nmt,nlt,sfs,mfs,lfs);
+    bool sealed = isSealed(te);
+    if (sealed)
+    {
+        // The small and medium files are already in their tars.
+        createSealedTars(te, mediumcomp);
+        nst = 0;
+        nmt = 0;
+    }
 
-        // This is the taz file that store sub directories for this tar collection dir.
-        te->registerTazFile();
-        te->registerGzFile();
+    // Order of creation: l m r z
+    TarFile *curr = NULL;
+    // Create the small files tars
+    for (size_t i=0; i<nst; ++i)
+    {
+        te->createSmallTar(i);
+    }
+    // Create the medium files tars
+    for (size_t i=0; i<nmt; ++i)
+    {
+        te->createMediumTar(i);
+    }
+
+    // Add the tar entries to the tar files.
+    for(auto & entry : te->entries())
+    {
+        // The entries must be files inside the tar collection directory,
+        // or subdirectories inside the tar collection subdirectory!
+        //assert(entry->path()->depth() > te->path()->depth());
 
-        // Order of creation: l m r z
-        TarFile *curr = NULL;
-        // Create the small files tars
-        for (size_t i=0; i<nst; ++i)
+        if (entry->isDirectory())
         {
-            te->createSmallTar(i);
+            te->tazFile()->addEntryLast(entry);
         }
-        // Create the medium files tars
-        for (size_t i=0; i<nmt; ++i)
+        else if (entry->isHardLink())
         {
-            te->createMediumTar(i);
+        	te->tazFile()->addEntryFirst(entry);
         }
-
-        // Add the tar entries to the tar files.
-        for(auto & entry : te->entries())
+        else
         {
-            // The entries must be files inside the tar collection directory,
-            // or subdirectories inside the tar collection subdirectory!
-            //assert(entry->path()->depth() > te->path()->depth());
+            bool skip = false;
 
-            if (entry->isDirectory())
+            if (!skip)
             {
-                te->tazFile()->addEntryLast(entry);
-            }
-            else if (entry->isHardLink())
-            {
-            	te->tazFile()->addEntryFirst(entry);
-            }
-            else
-            {
-                bool skip = false;
-
-                if (!skip)
+                if (sealed && entry->blockedSize() < mediumcomp)
                 {
-                    if (entry->blockedSize() < smallcomp)
-                    {
-                        size_t o = entry->tarpathHash() % nst;
-                        curr = te->smallTar(o);
-                    }
-                    else if (entry->blockedSize() < mediumcomp)
+                    continue;
+                }
+                else if (entry->blockedSize() < smallcomp)
+                {
+                    size_t o = findTarFromHash(entry->tarpathHash(), nst);
+                    curr = te->smallTar(o);
+                }
+                else if (entry->blockedSize() < mediumcomp)
+                {
+                    size_t o = findTarFromHash(entry->tarpathHash(), nmt);
+                    curr = te->mediumTar(o);
+                }
+                else
+                {
+                    // Create the large files tar here.
+                    if (!te->hasLargeTar(entry->tarpathHash()))
                     {
-                        size_t o = entry->tarpathHash() % nmt;
-                        curr = te->mediumTar(o);
+                        assert(entry != NULL);
+                        te->createLargeTar(entry->tarpathHash());
+                        curr = te->largeTar(entry->tarpathHash());
                     }
                     else
                     {
-                        // Create the large files tar here.
-                        if (!te->hasLargeTar(entry->tarpathHash()))
-                        {
-                            assert(entry != NULL);
-                            te->createLargeTar(entry->tarpathHash());
-                            curr = te->largeTar(entry->tarpathHash());
-                        }
-                        else
-                        {
-                            curr = te->largeTar(entry->tarpathHash());
-                        }
+                        curr = te->largeTar(entry->tarpathHash());
                     }
-                    curr->addEntryLast(entry);
                 }
+                curr->addEntryLast(entry);
             }
         }
+    }
 
-        // Finalize the tar files and add them to the contents listing.
-        for (auto & t : te->largeTars())
+    // Finalize the tar files and add them to the contents listing.
+    for (auto & t : te->largeTars())
+    {
+        TarFile *tf = t.second;
+        tf->fixSize(tar_split_size, tarheaderstyle_, tarfilepaddingstyle_, tar_target_size);
+        tf->calculateHash();
+        if (tf->currentTarOffset() > 0)
         {
-            TarFile *tf = t.second;
-            tf->fixSize(tar_split_size, tarheaderstyle_, tarfilepaddingstyle_, tar_target_size);
-            tf->calculateHash();
-            if (tf->currentTarOffset() > 0)
-            {
-                debug(BACKUP,"%s%s size became GURKA parts %zu\n", te->path()->c_str(), "NAMEHERE");
-                te->appendBeakFile(tf);
-                te->largeHashTars()[tf->hash()] = tf;
-                num_virtual_tars += tf->numParts();
-            }
+            debug(BACKUP,"%s%s size became GURKA parts %zu\n", te->path()->c_str(), "NAMEHERE");
+            te->appendBeakFile(tf);
+            te->largeHashTars()[tf->hash()] = tf;
+            num_virtual_tars += tf->numParts();
         }
-        for (auto & t : te->mediumTars())
+    }
+    for (auto & t : te->mediumTars())
+    {
+        TarFile *tf = t.second;
+        tf->fixSize(tar_split_size, tarheaderstyle_, tarfilepaddingstyle_, tar_target_size);
+        tf->calculateHash();
+        if (tf->currentTarOffset() > 0)
         {
-            TarFile *tf = t.second;
-            tf->fixSize(tar_split_size, tarheaderstyle_, tarfilepaddingstyle_, tar_target_size);
-            tf->calculateHash();
-            if (tf->currentTarOffset() > 0)
-            {
-                debug(BACKUP,"%s%s size became\n", te->path()->c_str(), "NAMEHERE");
-                te->appendBeakFile(tf);
-                te->mediumHashTars()[tf->hash()] = tf;
-                num_virtual_tars += tf->numParts();
-            }
+            debug(BACKUP,"%s%s size became\n", te->path()->c_str(), "NAMEHERE");
+            te->appendBeakFile(tf);
+            te->mediumHashTars()[tf->hash()] = tf;
+            num_virtual_tars += tf->numParts();
         }
-        for (auto & t : te->smallTars()) {
-            TarFile *tf = t.second;
-            tf->fixSize(tar_split_size, tarheaderstyle_, tarfilepaddingstyle_, tar_target_size);
-            tf->calculateHash();
-            if (tf->currentTarOffset() > 0) {
-                debug(BACKUP,"%s%s size ecame GURKA\n", te->path()->c_str(), "NAMEHERE");
-                te->appendBeakFile(tf);
-                te->smallHashTars()[tf->hash()] = tf;
-                num_virtual_tars += tf->numParts();
-            }
+    }
+    for (auto & t : te->smallTars()) {
+        TarFile *tf = t.second;
+        tf->fixSize(tar_split_size, tarheaderstyle_, tarfilepaddingstyle_, tar_target_size);
+        tf->calculateHash();
+        if (tf->currentTarOffset() > 0) {
+            debug(BACKUP,"%s%s size ecame GURKA\n", te->path()->c_str(), "NAMEHERE");
+            te->appendBeakFile(tf);
+            te->smallHashTars()[tf->hash()] = tf;
+            num_virtual_tars += tf->numParts();
         }
+    }
+
+    te->tazFile()->fixSize(tar_split_size, tarheaderstyle_, tarfilepaddingstyle_, tar_target_size);
+    te->tazFile()->calculateHash();
 
-        te->tazFile()->fixSize(tar_split_size, tarheaderstyle_, tarfilepaddingstyle_, tar_target_size);
-        te->tazFile()->calculateHash();
+    return num_virtual_tars;
+}
 
-        set<uid_t> uids;
-        set<gid_t> gids;
+TarEntry *Backup::createIndex(TarEntry *te, IndexTimes *times)
+{
+    uint64_t start = clockGetTimeMicroSeconds();
 
-        for(auto & entry : te->entries()) {
-            uids.insert(entry->stat()->st_uid);
-            gids.insert(entry->stat()->st_gid);
-        }
+    set<uid_t> uids;
+    set<gid_t> gids;
 
-        vector<pair<TarFile*,TarEntry*>> tars;
-        for (auto & st : tar_storage_directories) {
-            TarEntry *ste = st.second;
-            bool b = ste->path()->isBelowOrEqual(te->path());
-            if (b) {
-                for (auto & tf : ste->tars()) {
-                    if (tf->contentSize() > 0 ) {
-                        tars.push_back({tf,ste});
-                        // Make sure the gzfile timestamp is the latest
-                        // of all subtars as well.
-                        tf->updateMtim(te->gzFile()->mtim());
-                    }
+    for(auto & entry : te->entries()) {
+        uids.insert(entry->stat()->st_uid);
+        gids.insert(entry->stat()->st_gid);
+    }
+
+    vector<pair<TarFile*,TarEntry*>> tars;
+    for (auto & st : tar_storage_directories) {
+        TarEntry *ste = st.second;
+        bool b = ste->path()->isBelowOrEqual(te->path());
+        if (b) {
+            for (auto & tf : ste->tars()) {
+                if (tf->contentSize() > 0 ) {
+                    tars.push_back({tf,ste});
+                    // Make sure the gzfile timestamp is the latest
+                    // of all subtars as well.
+                    tf->updateMtim(te->gzFile()->mtim());
                 }
             }
         }
-        // Finally update with the latest mtime of the current storage directory!
-        te->updateMtim(te->gzFile()->mtim());
+    }
+    // Finally update with the latest mtime of the current storage directory!
+    te->updateMtim(te->gzFile()->mtim());
 
-        size_t backup_size = 0;
-        for (auto & p : tars) {
-            backup_size += p.first->contentSize();
-        }
+    size_t backup_size = 0;
+    for (auto & p : tars) {
+        backup_size += p.first->contentSize();
+    }
 
-        string gzfile_contents;
+    string gzfile_contents;
 
-        gzfile_contents.append("#beak 0.9\n");
-        gzfile_contents.append("#config ");
-        gzfile_contents.append(config_);
-        gzfile_contents.append("\n");
-        gzfile_contents.append("#size ");
-        gzfile_contents.append(to_string(backup_size));
-        gzfile_contents.append("\n");
-        gzfile_contents.append("#uids");
-        for (auto & x : uids) {
-            gzfile_contents.append(" ");
-            gzfile_contents.append(to_string(x));
-        }
-        gzfile_contents.append("\n");
-        gzfile_contents.append("#gids");
-        for (auto & x : gids) {
-            gzfile_contents.append(" ");
-            gzfile_contents.append(to_string(x));
-        }
-        gzfile_contents.append("\n");
-        gzfile_contents.append("#delta");
-        gzfile_contents.append("\n");
-        gzfile_contents.append("#files ");
-        gzfile_contents.append(to_string(te->entries().size()));
+    gzfile_contents.append("#beak 0.9\n");
+    gzfile_contents.append("#config ");
+    gzfile_contents.append(config_);
+    gzfile_contents.append("\n");
+    gzfile_contents.append("#size ");
+    gzfile_contents.append(to_string(backup_size));
+    gzfile_contents.append("\n");
+    gzfile_contents.append("#uids");
+    for (auto & x : uids) {
         gzfile_contents.append(" ");
-        gzfile_contents.append(cookColumns());
-        gzfile_contents.append("\n");
-        gzfile_contents.append(separator_string);
+        gzfile_contents.append(to_string(x));
+    }
+    gzfile_contents.append("\n");
+    gzfile_contents.append("#gids");
+    for (auto & x : gids) {
+        gzfile_contents.append(" ");
+        gzfile_contents.append(to_string(x));
+    }
+    gzfile_contents.append("\n");
+    gzfile_contents.append("#delta");
+    gzfile_contents.append("\n");
+    gzfile_contents.append("#files ");
+    gzfile_contents.append(to_string(te->entries().size()));
+    gzfile_contents.append(" ");
+    gzfile_contents.append(cookColumns(content_hash_));
+    gzfile_contents.append("\n");
+    gzfile_contents.append(separator_string);
 
-        for(auto & entry : te->entries()) {
-            cookEntry(&gzfile_contents, entry);
-            // Make sure the gzfile timestamp is the latest
-            // changed timestamp of all included entries!
-            entry->updateMtim(te->gzFile()->mtim());
-        }
+    for(auto & entry : te->entries()) {
+        cookEntry(&gzfile_contents, entry, content_hash_);
+        // Make sure the gzfile timestamp is the latest
+        // changed timestamp of all included entries!
+        entry->updateMtim(te->gzFile()->mtim());
+    }
 
-        // Hash the hashes of all the other tar and gz files.
-        te->gzFile()->calculateHash(tars, gzfile_contents);
+    // Hash the hashes of all the other tar and gz files.
+    te->gzFile()->calculateHash(tars, gzfile_contents);
 
-        gzfile_contents.append("#tars ");
-        gzfile_contents.append(to_string(tars.size()));
-        gzfile_contents.append(" with 4 columns: backup_location basis_tarfile delta_tarfile tarfile\n");
-        gzfile_contents.append(separator_string);
+    gzfile_contents.append("#tars ");
+    gzfile_contents.append(to_string(tars.size()));
+    gzfile_contents.append(" with 4 columns: backup_location basis_tarfile delta_tarfile tarfile\n");
+    gzfile_contents.append(separator_string);
 
-        for (pair<TarFile*,TarEntry*> &p : tars)
+    for (pair<TarFile*,TarEntry*> &p : tars)
+    {
+        char filename[1024];
+        TarFileName tfn(p.first, 0);
+        Path *path = p.second != NULL ? p.second->path() : NULL;
+        Path *safepath = p.second != NULL ? p.second->safepath() : NULL;
+        if (path) {
+            path = path->subpath(te->path()->depth());
+        }
+        if (safepath) {
+            safepath = safepath->subpath(te->safepath()->depth());
+        }
+        gzfile_contents.append("/");
+        if (path->str().length() > 0)
         {
-            char filename[1024];
-            TarFileName tfn(p.first, 0);
-            Path *path = p.second != NULL ? p.second->path() : NULL;
-            Path *safepath = p.second != NULL ? p.second->safepath() : NULL;
-            if (path) {
-                path = path->subpath(te->path()->depth());
-            }
-            if (safepath) {
-                safepath = safepath->subpath(te->safepath()->depth());
-            }
+            gzfile_contents.append(path->str());
             gzfile_contents.append("/");
-            if (path->str().length() > 0)
-            {
-                gzfile_contents.append(path->str());
-                gzfile_contents.append("/");
-            }
-            debug(BACKUP, "Added backup_location %s\n", path->c_str());
-            gzfile_contents.append(separator_string);
+        }
+        debug(BACKUP, "Added backup_location %s\n", path->c_str());
+        gzfile_contents.append(separator_string);
 
-            debug(BACKUP, "Added basis tarfile %s\n", "");
-            gzfile_contents.append(separator_string);
+        debug(BACKUP, "Added basis tarfile %s\n", "");
+        gzfile_contents.append(separator_string);
 
-            debug(BACKUP, "Added delta tarfile %s\n", "");
-            gzfile_contents.append(separator_string);
+        debug(BACKUP, "Added delta tarfile %s\n", "");
+        gzfile_contents.append(separator_string);
 
-            tfn.writeTarFileNameIntoBuffer(filename, sizeof(filename), safepath);
-            int drop_slash = (filename[0]=='/'?1:0);
-            debug(BACKUP, "Added tar filename %s\n", filename+drop_slash);
+        tfn.writeTarFileNameIntoBuffer(filename, sizeof(filename), safepath);
+        int drop_slash = (filename[0]=='/'?1:0);
+        debug(BACKUP, "Added tar filename %s\n", filename+drop_slash);
+        gzfile_contents.append(filename+drop_slash);
+        if (p.first->numParts() > 1)
+        {
+            TarFileName tfnn(p.first, p.first->numParts()-1);
+            tfnn.writeTarFileNameIntoBuffer(filename, sizeof(filename), safepath);
+            debug(BACKUP, "Appended last multipart tar filename %s\n", filename+drop_slash);
+            gzfile_contents.append(" ... ");
             gzfile_contents.append(filename+drop_slash);
-            if (p.first->numParts() > 1)
-            {
-                TarFileName tfnn(p.first, p.first->numParts()-1);
-                tfnn.writeTarFileNameIntoBuffer(filename, sizeof(filename), safepath);
-                debug(BACKUP, "Appended last multipart tar filename %s\n", filename+drop_slash);
-                gzfile_contents.append(" ... ");
-                gzfile_contents.append(filename+drop_slash);
-            }
-            gzfile_contents.append("\n");
-            gzfile_contents.append(separator_string);
-        }
-
-        uint num_content_splits = 0;
-        for (auto & t : tars) {
-            TarFile *tf = t.first;
-            if (tf->type() == TarContents::CONTENT_SPLIT_LARGE_FILE_TAR) {
-                num_content_splits++;
-            }
         }
-        gzfile_contents.append("#parts ");
-        gzfile_contents.append(to_string(num_content_splits));
         gzfile_contents.append("\n");
         gzfile_contents.append(separator_string);
+    }
 
-        for (auto & t : tars) {
-            TarFile *tf = t.first;
-            if (tf->type() == TarContents::CONTENT_SPLIT_LARGE_FILE_TAR)
-            {
-                TarEntry *te = t.first->singleContent();
-                gzfile_contents.append(te->tarpath()->str());
-                gzfile_contents.append(separator_string);
-                gzfile_contents.append(to_string(t.first->numParts()));
-                gzfile_contents.append("\n");
-                gzfile_contents.append(separator_string);
-            }
+    uint num_content_splits = 0;
+    for (auto & t : tars) {
+        TarFile *tf = t.first;
+        if (tf->type() == TarContents::CONTENT_SPLIT_LARGE_FILE_TAR) {
+            num_content_splits++;
         }
-        vector<char> sha256_hash;
-        string cont = gzfile_contents;
-        sha256_hash.resize(SHA256_DIGEST_LENGTH);
+    }
+    gzfile_contents.append("#parts ");
+    gzfile_contents.append(to_string(num_content_splits));
+    gzfile_contents.append("\n");
+    gzfile_contents.append(separator_string);
+
+    for (auto & t : tars) {
+        TarFile *tf = t.first;
+        if (tf->type() == TarContents::CONTENT_SPLIT_LARGE_FILE_TAR)
         {
-            SHA256_CTX sha256ctx;
-            SHA256_Init(&sha256ctx);
-            SHA256_Update(&sha256ctx, cont.c_str(), cont.length());
-            SHA256_Final((unsigned char*)&sha256_hash[0], &sha256ctx);
+            TarEntry *te = t.first->singleContent();
+            gzfile_contents.append(te->tarpath()->str());
+            gzfile_contents.append(separator_string);
+            gzfile_contents.append(to_string(t.first->numParts()));
+            gzfile_contents.append("\n");
+            gzfile_contents.append(separator_string);
         }
-        gzfile_contents.append("#end ");
-        gzfile_contents.append(toHex(sha256_hash));
-        gzfile_contents.append("\n");
-        gzfile_contents.append(separator_string);
+    }
+    uint64_t stop = clockGetTimeMicroSeconds();
+    times->listing += stop-start;
+    start = stop;
+
+    vector<char> sha256_hash;
+    sha256(gzfile_contents.c_str(), gzfile_contents.length(), &sha256_hash);
+    gzfile_contents.append("#end ");
+    gzfile_contents.append(toHex(sha256_hash));
+    gzfile_contents.append("\n");
+    gzfile_contents.append(separator_string);
+
+    stop = clockGetTimeMicroSeconds();
+    times->sha256 += stop-start;
+    start = stop;
+
+    size_t taz_size = te->tazFile()->contentSize();
+    if (taz_size > 0)
+    {
+        // On the heap, the taz of a dir with many subdirs is too large for a thread stack.
+        vector<char> buf(taz_size);
+        te->tazFile()->readVirtualTar(&buf[0], taz_size, 0, origin_fs_, 0);
+        gzfile_contents.append(&buf[0], taz_size);
+    }
+
+    stop = clockGetTimeMicroSeconds();
+    times->taz += stop-start;
+    start = stop;
+
+    vector<char> compressed_gzfile_contents;
+    gzipit(&gzfile_contents, &compressed_gzfile_contents);
+
+    stop = clockGetTimeMicroSeconds();
+    times->gzip += stop-start;
+
+    TarEntry *dirs = new TarEntry(compressed_gzfile_contents.size(), tarheaderstyle_);
+    dirs->setContent(compressed_gzfile_contents);
+    te->gzFile()->addEntryLast(dirs);
+    te->gzFile()->fixSize(tar_split_size, tarheaderstyle_, tarfilepaddingstyle_, tar_target_size);
+
+    /*
+    if (te->tazFile()->contentSize() > 0 )
+    {
+        debug(BACKUP,"%s%s size became %zu\n", te->path()->c_str(),
+              "NAMEHERE", te->tazFile()->contentSize());
+
+        //te->appendBeakFile(te->tazFile());
+        //te->enableTazFile();
+        //has_dir = 1;
+        }*/
+    te->appendBeakFile(te->gzFile());
+    te->enableGzFile();
+    return dirs;
+}
+
+size_t Backup::groupFilesIntoTars()
+{
+    uint64_t start = clockGetTimeMicroSeconds();
+
+    // The meta hashes are independent of each other, calculate them in parallel.
+    vector<TarEntry*> entries;
+    entries.reserve(files.size());
+    for (auto & e : files)
+    {
+        entries.push_back(&e.second);
+    }
+    parallelFor(entries.size(), num_threads_, [&](size_t i) { entries[i]->calculateHash(); });
 
-        size_t taz_size = te->tazFile()->contentSize();
-        if (taz_size > 0)
+    uint64_t stop = clockGetTimeMicroSeconds();
+    uint64_t hash_time = stop - start;
+    start = stop;
+
+    if (content_hash_)
+    {
+        // Reading all file contents is io bound, but it is still worth
+        // to keep several reads in flight.
+        if (show_progress_)
         {
-            char buf[taz_size];
-            te->tazFile()->readVirtualTar(buf, taz_size, 0, origin_fs_, 0);
-            gzfile_contents.append(string(buf, taz_size));
+            UI::clearLine();
+            info(BACKUP, "Hashing file contents...");
         }
+        parallelFor(entries.size(), num_threads_*2, [&](size_t i) {
+                if (entries[i]->calculateContentHash(origin_fs_, content_hash_cache_.get()).isErr())
+                {
+                    content_hash_failures_++;
+                }
+            });
+    }
 
-        vector<char> compressed_gzfile_contents;
-        gzipit(&gzfile_contents, &compressed_gzfile_contents);
+    stop = clockGetTimeMicroSeconds();
+    uint64_t content_hash_time = stop - start;
+    start = stop;
 
-        TarEntry *dirs = new TarEntry(compressed_gzfile_contents.size(), tarheaderstyle_);
-        dirs->setContent(compressed_gzfile_contents);
-        te->gzFile()->addEntryLast(dirs);
-        dynamics.push_back(unique_ptr<TarEntry>(dirs));
-        te->gzFile()->fixSize(tar_split_size, tarheaderstyle_, tarfilepaddingstyle_, tar_target_size);
+    // The tar collection dirs in depth first order, ie the subdirs before their parent.
+    vector<TarEntry*> tcds;
+    tcds.reserve(tar_storage_directories.size());
+    for (auto & e : tar_storage_directories)
+    {
+        tcds.push_back(e.second);
+    }
+    size_t total = tcds.size();
 
-        /*
-        if (te->tazFile()->contentSize() > 0 )
+    // Grouping the entries of a tar collection dir into tars only touches
+    // its own entries and tars, thus the dirs are grouped in parallel.
+    vector<size_t> num_tars(total);
+    size_t count = 0;
+    pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+    parallelFor(total, num_threads_, [&](size_t i) {
+            if (show_progress_)
+            {
+                LOCK(&progress_lock);
+                if (count % 100 == 0)
+                {
+                    UI::clearLine();
+                    info(BACKUP, "Organizing files into %zu/%zu dirs.", count, total);
+                }
+                count++;
+                UNLOCK(&progress_lock);
+            }
+            num_tars[i] = groupTarCollectionDir(tcds[i]);
+        });
+
+    stop = clockGetTimeMicroSeconds();
+    uint64_t group_time = stop - start;
+    start = stop;
+
+    // The index of a tar collection dir lists the tars and indexes of all
+    // the tar collection dirs below it, these must be complete first.
+    // The height of a dir is the longest chain of tar collection dirs below it,
+    // the dirs of the same height are not below each other and are indexed
+    // in parallel, the lowest height first.
+    map<Path*,size_t> position;
+    for (size_t i = 0; i < total; ++i)
+    {
+        position[tcds[i]->path()] = i;
+    }
+    vector<size_t> height(total);
+    size_t max_height = 0;
+    for (size_t i = 0; i < total; ++i)
+    {
+        // The subdirs come before their parent, thus the height is final here.
+        max_height = max(max_height, height[i]);
+        for (Path *p = tcds[i]->path()->parent(); p != NULL; p = p->parent())
         {
-            debug(BACKUP,"%s%s size became %zu\n", te->path()->c_str(),
-                  "NAMEHERE", te->tazFile()->contentSize());
+            auto j = position.find(p);
+            if (j != position.end())
+            {
+                height[j->second] = max(height[j->second], height[i]+1);
+                break;
+            }
+        }
+    }
+    vector<TarEntry*> indexes(total);
+    vector<IndexTimes> times(total);
+    for (size_t h = 0; h <= max_height && total > 0; ++h)
+    {
+        vector<size_t> wave;
+        for (size_t i = 0; i < total; ++i)
+        {
+            if (height[i] == h) wave.push_back(i);
+        }
+        parallelFor(wave.size(), num_threads_, [&](size_t w) {
+                size_t i = wave[w];
+                indexes[i] = createIndex(tcds[i], &times[i]);
+            });
+    }
 
-            //te->appendBeakFile(te->tazFile());
-            //te->enableTazFile();
-            //has_dir = 1;
-            }*/
-        te->appendBeakFile(te->gzFile());
-        te->enableGzFile();
-        num_virtual_tars++; // Count the index file.
+    // Summed in the depth first order, the result does not depend on the scheduling.
+    size_t num_virtual_tars = 0;
+    IndexTimes sum;
+    for (size_t i = 0; i < total; ++i)
+    {
+        dynamics.push_back(unique_ptr<TarEntry>(indexes[i]));
+        num_virtual_tars += num_tars[i] + 1; // Count the index file.
+        sum.listing += times[i].listing;
+        sum.sha256 += times[i].sha256;
+        sum.taz += times[i].taz;
+        sum.gzip += times[i].gzip;
     }
-    UI::clearLine();
+    if (show_progress_) UI::clearLine();
+
+    stop = clockGetTimeMicroSeconds();
+    uint64_t index_time = stop - start;
+
+    debug(BACKUP, "grouped %zu dirs into %zu virtual tars using %d threads: "
+          "hash %jdms content hash %jdms group %jdms index %jdms in %zu waves\n",
+          total, num_virtual_tars, num_threads_,
+          hash_time / 1000, content_hash_time / 1000, group_time / 1000, index_time / 1000,
+          total > 0 ? max_height+1 : 0);
+    debug(BACKUP, "index cpu time: listing %jdms sha256 %jdms taz %jdms gzip %jdms\n",
+          sum.listing / 1000, sum.sha256 / 1000, sum.taz / 1000, sum.gzip / 1000);
 
     return num_virtual_tars;
 }
@@ -1134,7 +1342,8 @@ struct BackupFuseAPI : FuseAPI
     }
 };
 
-RC Backup::scanFileSystem(Argument *origin, Settings *settings, ProgressStatistics *progress)
+RC Backup::scanFileSystem(Argument *origin, Settings *settings, ProgressStatistics *progress,
+                          CompletedSubtree completed)
 {
     if (origin->type == ArgOrigin && origin->origin) {
         root_dir_path = origin->origin;
@@ -1242,6 +1451,15 @@ RC Backup::scanFileSystem(Argument *origin, Settings *settings, ProgressStatisti
     }
     config += "-ts "+to_string(tar_split_size)+" ";
 
+    if (settings->contenthash)
+    {
+        setContentHash(true);
+        config += "--contenthash ";
+        // Only the files changed since the previous backup are read to hash them.
+        content_hash_cache_ = newContentHashCache(origin_fs_, root_dir_path);
+        content_hash_cache_->load();
+    }
+
     for (auto &e : settings->triggerglob) {
         Match m;
         bool rc = m.use(e);
@@ -1253,18 +1471,42 @@ RC Backup::scanFileSystem(Argument *origin, Settings *settings, ProgressStatisti
         config += "-tx '"+e+"' ";
     }
 
+    for (auto &e : settings->sealglob) {
+        Match m;
+        bool rc = m.use(e);
+        if (!rc) {
+            error(COMMANDLINE, "Not a valid glob \"%s\"\n", e.c_str());
+        }
+        seals.push_back(m);
+        debug(COMMANDLINE, "Seals tars in \"%s\"\n", e.c_str());
+        config += "-sx '"+e+"' ";
+    }
+
     debug(COMMANDLINE, "Target tar size \"%zu\", trigger size %zu, split size %zu\n",
           tar_target_size,
           tar_trigger_size,
           tar_split_size);
 
     setConfig(config);
+    relax_time_checks_ = settings->relaxtimechecks;
+    if (completed && forced_tar_collection_dir_depth != 2)
+    {
+        // Only the first level subdirs are always tar collection dirs, at other
+        // depths the layout of a subtree depends on the rest of the origin.
+        verbose(BACKUP, "Not storing subtrees while scanning, since the depth is %d.\n",
+                forced_tar_collection_dir_depth);
+        completed = NULL;
+    }
+    if (watch_changes_)
+    {
+        watching_ = origin_fs_->enableWatch(root_dir_path).isOk();
+    }
     info(BACKUP, "Indexing %s ...", root_dir.c_str());
     uint64_t start = clockGetTimeMicroSeconds();
 
     size_t sizes = 0;
     int num = -1; // Do not count the root directory, which is not added.
-    origin_fs_->recurse(root_dir_path, [this, &sizes, &num](Path *p, FileStat *st) {
+    origin_fs_->recurse(root_dir_path, [this, &sizes, &num, &completed](Path *p, FileStat *st) {
             sizes += st->st_size;
             num++;
             if (num % 1000 == 0)
@@ -1273,8 +1515,16 @@ RC Backup::scanFileSystem(Argument *origin, Settings *settings, ProgressStatisti
                 string s = humanReadable(sizes);
                 info(BACKUP, "Indexing %s %d files à %s.", root_dir.c_str(), num, s.c_str());
             }
-            return this->addTarEntry(p, st);
+            RecurseOption ro = this->addTarEntry(p, st);
+            // The watch is in place before the entries in the directory are scanned.
+            if (watching_ && ro == RecurseContinue && st->isDirectory()) origin_fs_->addWatch(p);
+            if (completed) streamSubtree(p, completed);
+            return ro;
         });
+    // The last subtree is stored with the rest of the backup.
+    scanning_subtree_ = NULL;
+    subtree_entries_.clear();
+    subtree_links_.clear();
 
     UI::clearLine();
     string s = humanReadable(sizes);
@@ -1289,49 +1539,151 @@ RC Backup::scanFileSystem(Argument *origin, Settings *settings, ProgressStatisti
     uint64_t scan_time = stop - start;
     start = stop;
 
+    size_t num_tars = organizeFiles();
+
+    stop = clockGetTimeMicroSeconds();
+    uint64_t group_time = stop - start;
+    string scant = humanReadableTimeTwoDecimals(scan_time);
+    string groupt = humanReadableTimeTwoDecimals(group_time);
+    info(BACKUP, "Organized files into %zu dirs with %zu virtual tars (scan %jdms group %jdms)\n",
+         tar_storage_directories.size(),
+         num_tars,
+         scan_time / 1000, group_time / 1000);
+
+    if (content_hash_cache_) content_hash_cache_->save();
+    if (content_hash_failures_ > 0)
+    {
+        failure(BACKUP, "The contents of %zu files could not be hashed.\n", (size_t)content_hash_failures_);
+        return RC::ERR;
+    }
+    return RC::OK;
+}
+
+size_t Backup::organizeFiles()
+{
+    auto progress = [this](const char *msg) {
+        if (!show_progress_) return;
+        UI::clearLine();
+        info(BACKUP, "%s", msg);
+    };
     // Find hard links and mark them
-    UI::clearLine();
-    info(BACKUP, "Finding hardlinks...");
+    progress("Finding hardlinks...");
     findHardLinks();
     // Find suitable directories points where virtual tars will be created.
-    UI::clearLine();
-    info(BACKUP, "Finding suitable indexing points...");
+    progress("Finding suitable indexing points...");
     findTarCollectionDirs();
     // Remove all other directories that will be hidden inside tars.
-    UI::clearLine();
-    info(BACKUP, "Prune directories...");
+    progress("Prune directories...");
     pruneDirectories();
     // Add remaining dirs as dir entries to their parent directories.
-    UI::clearLine();
-    info(BACKUP, "Create directory structure...");
+    progress("Create directory structure...");
     addDirsToDirectories();
     // Add content (files and directories) to the tar collection dirs.
-    UI::clearLine();
-    info(BACKUP, "Add entries to indexing points...");
+    progress("Add entries to indexing points...");
     addEntriesToTarCollectionDirs();
     // Remove prefixes from hard links, and potentially move them up.
-    UI::clearLine();
-    info(BACKUP, "Fix hard links...");
+    progress("Fix hard links...");
     fixHardLinks();
     // Remove prefixes from paths and store the result in tarpath.
-    UI::clearLine();
-    info(BACKUP, "Fix tar paths...");
+    progress("Fix tar paths...");
     fixTarPaths();
     // Group the entries into tar files.
     size_t num_tars = groupFilesIntoTars();
     // Sort the entries in a tar friendly order.
     sortTarCollectionEntries();
+    return num_tars;
+}
 
-    stop = clockGetTimeMicroSeconds();
-    uint64_t group_time = stop - start;
-    string scant = humanReadableTimeTwoDecimals(scan_time);
-    string groupt = humanReadableTimeTwoDecimals(group_time);
-    info(BACKUP, "Organized files into %zu dirs with %zu virtual tars (scan %jdms group %jdms)\n",
-         tar_storage_directories.size(),
-         num_tars,
-         scan_time / 1000, group_time / 1000);
+void Backup::streamSubtree(Path *abspath, CompletedSubtree &completed)
+{
+    // The scan visits a directory and then everything below it, before
+    // it continues with the next entry of the parent directory. Thus the
+    // subtree of a first level subdir is complete when the scan leaves it.
+    Path *path = abspath->subpath(root_dir_path->depth())->prepend(Path::lookupRoot());
+    Path *subtree = path;
+    while (subtree->depth() > 2) subtree = subtree->parent();
+
+    if (subtree != scanning_subtree_)
+    {
+        if (scanning_subtree_) completeSubtree(completed);
+        bool subdir = subtree->depth() == 2 && directories.count(subtree) > 0;
+        scanning_subtree_ = subdir ? subtree : NULL;
+        subtree_entries_.clear();
+        subtree_links_.clear();
+    }
+    if (scanning_subtree_ == NULL || files.count(path) == 0) return;
 
-    return RC::OK;
+    subtree_entries_.push_back(path);
+    TarEntry *te = &files[path];
+    if (!te->isDirectory() && te->stat()->st_nlink > 1)
+    {
+        auto &links = subtree_links_[te->stat()->st_ino];
+        links.first++;
+        links.second = te->stat()->st_nlink;
+    }
+}
+
+void Backup::completeSubtree(CompletedSubtree &completed)
+{
+    if (found_future_dated_file_ && !relax_time_checks_) return;
+    for (auto &l : subtree_links_)
+    {
+        if (l.second.first != l.second.second)
+        {
+            // A hard link to a file outside of the subtree can move the file to another tar.
+            debug(BACKUP, "subtree %s has hard links to the outside, stored with the rest\n",
+                  scanning_subtree_->c_str());
+            return;
+        }
+    }
+
+    unique_ptr<Backup> partial = newBackup(origin_fs_);
+    partial->root_dir = root_dir;
+    partial->root_dir_path = root_dir_path;
+    partial->tar_target_size = tar_target_size;
+    partial->tar_trigger_size = tar_trigger_size;
+    partial->tar_split_size = tar_split_size;
+    partial->forced_tar_collection_dir_depth = forced_tar_collection_dir_depth;
+    partial->triggers = triggers;
+    partial->seals = seals;
+    partial->config_ = config_;
+    partial->tarheaderstyle_ = tarheaderstyle_;
+    partial->tarfilepaddingstyle_ = tarfilepaddingstyle_;
+    partial->content_hash_ = content_hash_;
+    partial->content_hash_cache_ = content_hash_cache_;
+    partial->show_progress_ = false;
+    partial->num_threads_ = num_threads_;
+
+    // The root must be there for the subtree to hang from.
+    subtree_entries_.push_back(Path::lookupRoot());
+    for (Path *p : subtree_entries_)
+    {
+        partial->files[p] = files[p];
+        TarEntry *te = &partial->files[p];
+        if (te->isDirectory()) partial->directories[p] = te;
+    }
+    debug(BACKUP, "subtree %s completed with %zu entries\n",
+          scanning_subtree_->c_str(), subtree_entries_.size());
+    completed(move(partial), scanning_subtree_);
+}
+
+bool Backup::hasChanged(TarEntry *te)
+{
+    FileStat st;
+    RC rc = origin_fs_->stat(te->abspath(), &st);
+    if (rc.isErr())
+    {
+        UI::clearLine();
+        warning(BACKUP, "File lost %s\n", te->abspath()->c_str());
+        return true;
+    }
+    if (!te->stat()->equal(&st))
+    {
+        UI::clearLine();
+        warning(BACKUP, "File changed %s\n", te->abspath()->c_str());
+        return true;
+    }
+    return false;
 }
 
 int Backup::checkIfFilesHaveChanged()
@@ -1340,6 +1692,26 @@ int Backup::checkIfFilesHaveChanged()
     int num = 0;
     size_t total = files.size();
 
+    if (watching_)
+    {
+        watching_ = false;
+        vector<Path*> changed;
+        if (origin_fs_->endWatch(&changed).isOk())
+        {
+            // Only the entries touched during the backup can have changed.
+            for (Path *abspath : changed)
+            {
+                if (!abspath->isBelowOrEqual(root_dir_path)) continue;
+                Path *path = abspath->subpath(root_dir_path->depth())->prepend(Path::lookupRoot());
+                auto i = files.find(path);
+                if (i != files.end() && hasChanged(&i->second)) count++;
+            }
+            debug(BACKUP, "checked %zu watched changes\n", changed.size());
+            return count;
+        }
+        verbose(BACKUP, "Changes to %s might have been missed, checking every file.\n", root_dir.c_str());
+    }
+
     for(auto & e : files)
     {
         if (num % 1000 == 0)
@@ -1349,24 +1721,7 @@ int Backup::checkIfFilesHaveChanged()
         }
         num++;
 
-        TarEntry *te = &e.second;
-        FileStat st;
-        RC rc = origin_fs_->stat(te->abspath(), &st);
-        if (rc.isErr())
-        {
-            count++;
-            UI::clearLine();
-            warning(BACKUP, "File lost %s\n", te->abspath()->c_str());
-        }
-        else
-        {
-            if (!te->stat()->equal(&st))
-            {
-                count++;
-                UI::clearLine();
-                warning(BACKUP, "File changed %s\n", te->abspath()->c_str());
-            }
-        }
+        if (hasChanged(&e.second)) count++;
     }
     UI::clearLine();
 
@@ -1383,7 +1738,15 @@ struct BeakFS : FileSystem
     }
     ssize_t pread(Path *p, char *buf, size_t size, off_t offset)
     {
-        return 0;
+        LOCK(&forw_->global);
+        uint partnr;
+        ssize_t n = -1;
+        TarFile *tar = forw_->findTarFromPath(p, &partnr);
+        if (tar) {
+            n = tar->readVirtualTar(buf, size, offset, forw_->originFileSystem(), partnr);
+        }
+        UNLOCK(&forw_->global);
+        return n;
     }
 
     RC recurse(Path *root, std::function<RecurseOption(Path *path, FileStat *stat)> cb)
@@ -1504,7 +1867,7 @@ struct BeakFS : FileSystem
     {
         return false;
     }
-    RC enableWatch()
+    RC enableWatch(Path *root)
     {
         return RC::ERR;
     }
@@ -1512,9 +1875,9 @@ struct BeakFS : FileSystem
     {
         return RC::ERR;
     }
-    int endWatch()
+    RC endWatch(std::vector<Path*> *changed)
     {
-        return 0;
+        return RC::ERR;
     }
     FILE *openAsFILE(Path *f, const char *mode)
     {
@@ -20,6 +20,7 @@
 
 #include "always.h"
 #include "beak.h"
+#include "contenthashcache.h"
 #include "filesystem.h"
 #include "match.h"
 #include "tarentry.h"
@@ -33,7 +34,10 @@
 #include <pthread.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <atomic>
+#include <functional>
 #include <map>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -47,9 +51,36 @@ struct Filter {
     Filter(std::string rule_, FilterType type_) : rule(rule_), type(type_) { }
 };
 
+struct Backup;
+
+// The time spent creating the indexes, in microseconds.
+struct IndexTimes
+{
+    uint64_t listing {};
+    uint64_t sha256 {};
+    uint64_t taz {};
+    uint64_t gzip {};
+};
+
+// Receives a partial backup of a subtree of the origin, as soon as the scan has
+// completed the subtree. The partial backup holds the scanned entries of the subtree
+// and its parents, call organizeFiles on it. The tars of the tar collection dirs
+// at and below dir are then identical to those of the full backup.
+typedef std::function<void(std::unique_ptr<Backup> partial, Path *dir)> CompletedSubtree;
+
 struct Backup
 {
-    RC scanFileSystem(Argument *origin, Settings *settings, ProgressStatistics *progress);
+    // The completed subtrees are handed over while the scan continues,
+    // when the layout of the backup allows it. See streamSubtree.
+    RC scanFileSystem(Argument *origin, Settings *settings, ProgressStatistics *progress,
+                      CompletedSubtree completed = NULL);
+    // Find the tar collection dirs and group the scanned entries into virtual tars.
+    // Returns the number of virtual tars.
+    size_t organizeFiles();
+    // Watch the origin for changes from the start of the scan. Then
+    // checkIfFilesHaveChanged only restats the entries that were touched.
+    void watchForChanges() { watch_changes_ = true; }
+    // Returns the number of entries changed or lost since the scan.
     int checkIfFilesHaveChanged();
 
     pthread_mutex_t global;
@@ -80,6 +111,8 @@ struct Backup
 
     std::vector<std::pair<Filter,Match>> filters;
     std::vector<Match> triggers;
+    // Tar collection dirs where the files are grouped into sealed tars.
+    std::vector<Match> seals;
     std::vector<Match> contentsplits;
 
     int recurse();
@@ -107,22 +140,58 @@ struct Backup
     void setConfig(std::string c) { config_ = c; }
     void setTarHeaderStyle(TarHeaderStyle ths) { tarheaderstyle_= ths; }
     void setTarFilePaddingStyle(TarFilePaddingStyle pad) { tarfilepaddingstyle_= pad; }
+    void setContentHash(bool ch) { content_hash_ = ch; }
+    // The number of threads that hash, group and index the files, the number of cores by default.
+    void setNumThreads(int n) { num_threads_ = n; }
+    // The number of files whose contents could not be hashed.
+    size_t numContentHashFailures() { return content_hash_failures_; }
+    // The number of files whose contents changed after they were hashed, found when storing them.
+    size_t numChangedContents() { return content_hash_cache_ ? content_hash_cache_->numChanged() : 0; }
     Backup(ptr<FileSystem> origin_fs);
 
     virtual ~Backup() = default;
 
 private:
+    bool hasChanged(TarEntry *te);
+    void streamSubtree(Path *path, CompletedSubtree &completed);
+    void completeSubtree(CompletedSubtree &completed);
     size_t findNumTarsFromSize(size_t amount, size_t total_size);
+    bool isSealed(TarEntry *te);
+    size_t createSealedTars(TarEntry *te, size_t mediumcomp);
+    // Group the entries of the tar collection dir into tars, returns the number of virtual tars.
+    size_t groupTarCollectionDir(TarEntry *te);
+    // Create the index of the tar collection dir, the tar collection dirs
+    // below it must already be indexed. Returns the entry holding the index.
+    TarEntry *createIndex(TarEntry *te, IndexTimes *times);
     void calculateNumTars(TarEntry *te, size_t *nst, size_t *nmt, size_t *nlt,
                           size_t *sfs, size_t *mfs, size_t *lfs,
                           size_t *sc, size_t *mc);
     std::string config_;
     TarHeaderStyle tarheaderstyle_;
     TarFilePaddingStyle tarfilepaddingstyle_;
+    // Store the sha256 of the file contents in the index.
+    bool content_hash_ {};
+    // The hashes of the previous backup, shared with the partial backups.
+    std::shared_ptr<ContentHashCache> content_hash_cache_;
+    std::atomic<size_t> content_hash_failures_ {};
 
     FileSystem* origin_fs_;
+    int num_threads_ {};
 
     bool found_future_dated_file_ {};
+    bool relax_time_checks_ {};
+    bool watch_changes_ {};
+    // The origin file system is watched since the start of the scan.
+    bool watching_ {};
+
+    // Print the progress of organizing the files, not done for partial backups.
+    bool show_progress_ = true;
+    // The subtree being scanned, that is handed over when completed.
+    Path *scanning_subtree_ {};
+    // The entries scanned in the subtree.
+    std::vector<Path*> subtree_entries_;
+    // The hard linked inodes in the subtree, with the links found and the link count.
+    std::map<ino_t,std::pair<nlink_t,nlink_t>> subtree_links_;
 
     std::unique_ptr<FileSystem> as_file_system_;
     std::unique_ptr<FuseAPI> as_fuse_api_;
@@ -130,4 +199,8 @@ private:
 
 std::unique_ptr<Backup> newBackup(ptr<FileSystem> fs);
 
+// Pick which of the num_tars small or medium tars a file with this tarpath hash goes into.
+// One more tar splits a single tar in two, the other tars keep their files.
+size_t findTarFromHash(uint32_t hash, size_t num_tars);
+
 #endif
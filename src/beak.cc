@@ -193,14 +193,17 @@ unique_ptr<Restore> BeakImplementation::accessBackup_(Argument *storage,
     FileSystem *backup_fs = local_fs_;
     if (storage->storage->type == RCloneStorage ||
         storage->storage->type == RSyncStorage) {
-        backup_fs = storage_tool_->asCachedReadOnlyFS(storage->storage, monitor);
+        backup_fs = storage_tool_->asCachedReadOnlyFS(storage->storage, monitor, true, false);
     }
     unique_ptr<Restore> restore  = newRestore(backup_fs);
     if (out_backup_fs) { *out_backup_fs = backup_fs; }
     if (out_root) { *out_root = storage->storage->storage_location; }
 
-    rc = restore->lookForPointsInTime(PointInTimeFormat::absolute_point,
-                                      storage->storage->storage_location);
+    vector<string> index_files;
+    rc = storage_tool_->listPointsInTime(storage->storage, &index_files, false);
+    if (rc.isOk()) {
+        rc = restore->lookForPointsInTime(PointInTimeFormat::absolute_point, index_files);
+    }
 
     if (rc.isErr()) {
         error(COMMANDLINE, "no points in time found in storage: %s\n", storage->storage->storage_location->c_str());
@@ -224,6 +227,88 @@ unique_ptr<Restore> BeakImplementation::accessBackup_(Argument *storage,
     return restore;
 }
 
+unique_ptr<Restore> BeakImplementation::accessReferences_(Argument *storage,
+                                                          Monitor *monitor,
+                                                          bool fresh,
+                                                          FileSystem **out_backup_fs,
+                                                          Path **out_root,
+                                                          unique_ptr<RefIndex> *out_refs)
+{
+    assert(storage->type == ArgStorage);
+    FileSystem *backup_fs = local_fs_;
+    if (storage->storage->type == RCloneStorage ||
+        storage->storage->type == RSyncStorage) {
+        // Only the index files of points in time not in the reference index are read.
+        backup_fs = storage_tool_->asCachedReadOnlyFS(storage->storage, monitor, false, fresh);
+    }
+    unique_ptr<Restore> restore  = newRestore(backup_fs);
+    Path *root = storage->storage->storage_location;
+    if (out_backup_fs) { *out_backup_fs = backup_fs; }
+    if (out_root) { *out_root = root; }
+
+    vector<string> index_files;
+    // Prune deletes the files not referenced by these points, a point stored
+    // by another host since the manifest was saved must not be missed.
+    RC rc = storage_tool_->listPointsInTime(storage->storage, &index_files, fresh);
+    if (rc.isOk()) {
+        rc = restore->lookForPointsInTime(PointInTimeFormat::absolute_point, index_files);
+    }
+    if (rc.isErr()) {
+        error(COMMANDLINE, "no points in time found in storage: %s\n", root->c_str());
+        return NULL;
+    }
+    restore->setRootDir(root);
+
+    // The reference index is cached locally, only index files of points in time
+    // not seen before have to be fetched and parsed.
+    Path *cache_dir = cacheDir();
+    local_fs_->mkDirpWriteable(cache_dir);
+    char name[64];
+    snprintf(name, sizeof(name), "refindex_%08x", hashString(root->str()));
+    Path *cache_file = cache_dir->append(name);
+
+    unique_ptr<RefIndex> refs = newRefIndex();
+    FileStat st;
+    if (local_fs_->stat(cache_file, &st).isOk() && refs->load(local_fs_, cache_file).isErr()) {
+        refs = newRefIndex();
+    }
+
+    vector<string> filenames;
+    map<string,PointInTime*> points;
+    for (auto &point : restore->historyOldToNew())
+    {
+        filenames.push_back(point.filename);
+        points[point.filename] = &point;
+    }
+    size_t num_points = refs->numPointsInTime();
+    size_t num_loaded = 0;
+    vector<string> failed;
+    rc = refs->updatePointsInTime(filenames,
+        [&restore,&points](string &filename, size_t *size, vector<Path*> *beak_files)
+        {
+            PointInTime *point = points[filename];
+            Path *gz = Path::lookup(restore->rootDir()->str() + "/" + filename);
+            if (!restore->loadGz(point, gz, NULL)) {
+                return RC::ERR;
+            }
+            *size = point->size;
+            beak_files->push_back(Path::lookup(filename));
+            for (auto t : *(point->tarfiles())) beak_files->push_back(t);
+            return RC::OK;
+        }, &num_loaded, &failed);
+
+    // Without the references of every point in time, files still in use would look unused.
+    if (rc.isErr()) {
+        error(COMMANDLINE, "Refusing to continue, the index of %zu point(s) in time in %s could not be loaded.\n",
+              failed.size(), root->c_str());
+    }
+    if (num_loaded > 0 || num_points != refs->numPointsInTime()) {
+        refs->save(local_fs_, cache_file);
+    }
+    *out_refs = std::move(refs);
+    return restore;
+}
+
 RC BeakImplementation::umountDaemon(Settings *settings)
 {
     return sys_->umountDaemon(settings->from.dir);
@@ -267,8 +352,8 @@ RC BeakImplementation::mountBackup(Settings *settings, Monitor *monitor)
 RC BeakImplementation::umountBackup(Settings *settings)
 {
     ptr<FileSystem> fs = origin_tool_->fs();
-    int unpleasant_modifications = fs->endWatch();
-    if (unpleasant_modifications > 0) {
+    vector<Path*> changed;
+    if (fs->endWatch(&changed).isOk() && changed.size() > 0) {
         warning(COMMANDLINE, "Warning! Origin directory modified while being mounted for backup!\n");
     }
     sys_->umount(backup_fuse_mount_);
@@ -307,37 +392,6 @@ RC BeakImplementation::umountRestore(Settings *settings)
     return RC::OK;
 }
 
-thread_local struct timespec mtim_max {};  /* time of last modification */
-thread_local struct timespec ctim_max {};  /* time of last meta data modification */
-
-void update_mctim_maxes(const struct stat *sb)
-{
-#if HAS_ST_MTIM
-    const struct timespec *mt = &sb->st_mtim;
-    const struct timespec *ct = &sb->st_ctim;
-#elif HAS_ST_MTIME
-    struct timespec smt {};
-    smt.tv_sec = sb->st_mtime;
-    const struct timespec *mt = &smt;
-    struct timespec sct {};
-    sct.tv_sec = sb->st_ctime;
-    const struct timespec *ct = &sct;
-#else
-#error
-#endif
-
-    if (mt->tv_sec > mtim_max.tv_sec || (mt->tv_sec == mtim_max.tv_sec && mt->tv_nsec > mtim_max.tv_nsec))
-    {
-        // Found a more recent timestamp for mtime.
-        mtim_max = *mt;
-    }
-    if (ct->tv_sec > ctim_max.tv_sec || (ct->tv_sec == ctim_max.tv_sec && ct->tv_nsec > ctim_max.tv_nsec))
-    {
-        // Found a more recent timestamp for mtime.
-        ctim_max = *ct;
-    }
-}
-
 bool BeakImplementation::hasPointsInTime_(Path *path, FileSystem *fs)
 {
     if (path == NULL) return false;
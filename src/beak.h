@@ -153,11 +153,12 @@ LIST_OF_COMMANDS
 
 #define LIST_OF_OPTIONS \
     X(OptionType::LOCAL_PRIMARY,c,cache,std::string,true,"Directory to store cached files when mounting a remote storage.") \
+    X(OptionType::LOCAL_SECONDARY,,contenthash,bool,false,"Store the sha256 of each file's content in the index, checked by fsck --deepcheck.") \
     X(OptionType::LOCAL_PRIMARY,,contentsplit,std::vector<std::string>,true,"Split matching files based on content. E.g. --contentsplit='*.vdi'") \
     X(OptionType::LOCAL_PRIMARY,,deepcheck,bool,false,"Do deep checking of backup integrity.") \
     X(OptionType::LOCAL_PRIMARY,,delta,bool,true,"Use delta compression.")    \
     X(OptionType::LOCAL_PRIMARY,,depth,int,true,"Force all dirs at this depth to contain tars. 1 is the root, 2 is the first subdir. The default is 2.")    \
-    X(OptionType::LOCAL_PRIMARY,,dryrun,bool,false,"Print what would be done, do not actually perform the prune/store.") \
+    X(OptionType::LOCAL_PRIMARY,,dryrun,bool,false,"Print what would be done, do not actually perform the prune/pull/store.") \
     X(OptionType::LOCAL_SECONDARY,f,foreground,bool,false,"When mounting do not spawn a daemon.")   \
     X(OptionType::LOCAL_SECONDARY,fd,fusedebug,bool,false,"Enable fuse debug mode, this also triggers foreground.") \
     X(OptionType::LOCAL_PRIMARY,bg,background,bool,false,"Enter background mode, the progress can be monitored using \"beak monitor\".") \
@@ -172,7 +173,11 @@ LIST_OF_COMMANDS
     X(OptionType::LOCAL_SECONDARY,,tarheader,TarHeaderStyle,true,"Style of tar headers used. E.g. --tarheader=simple Alternatives are: none,simple,full Default is simple.")    \
     X(OptionType::LOCAL_PRIMARY,,now,std::string,true,"When pruning use this date time as now.") \
     X(OptionType::LOCAL_SECONDARY,,padding,TarFilePaddingStyle,true,"Style of padding of tarfiles. E.g. --padding=absolute Alternatives are: none,relative,absolute Default is relative.")    \
+    X(OptionType::LOCAL_SECONDARY,sx,sealglob,std::vector<std::string>,true,"Fill the tars of matching tar collection dirs in mtime order, for dirs that only gain new files. E.g. -sx '/logs'") \
+    X(OptionType::LOCAL_SECONDARY,,stream,bool,false,"Store the tars of each completed subdirectory while the scan of the origin continues.") \
+    X(OptionType::LOCAL_SECONDARY,,track,bool,false,"Keep running and track the changes of the origin, then beak status answers instantly.") \
     X(OptionType::LOCAL_SECONDARY,ta,targetsize,size_t,true,"Tar target size. E.g. --targetsize=20M and the default is 10M.") \
+    X(OptionType::LOCAL_PRIMARY,j,threads,int,true,"Number of worker threads, or concurrent uploads when storing. E.g. -j 4") \
     X(OptionType::LOCAL_SECONDARY,tr,triggersize,size_t,true,"Trigger tar generation in dir at size. E.g. -tr 40M and the default is 20M.")    \
     X(OptionType::GLOBAL_SECONDARY,,trace,bool,true,"Log the most detailed trace information.") \
     X(OptionType::LOCAL_SECONDARY,ts,splitsize,size_t,true,"Split large files into smaller chunks. E.g. -ts 40M and the default is 50M.")    \
@@ -192,18 +197,19 @@ LIST_OF_OPTIONS
 };
 
 #define LIST_OF_OPTIONS_PER_COMMAND \
-    X(bmount_cmd, (16, contentsplit_option, depth_option, foreground_option, fusedebug_option, splitsize_option, tarheader_option, targetsize_option, triggersize_option, triggerglob_option, exclude_option, include_option, progress_option, padding_option, relaxtimechecks_option, tarheader_option, yesorigin_option) ) \
+    X(bmount_cmd, (18, contenthash_option, contentsplit_option, depth_option, foreground_option, fusedebug_option, sealglob_option, splitsize_option, tarheader_option, targetsize_option, triggersize_option, triggerglob_option, exclude_option, include_option, progress_option, padding_option, relaxtimechecks_option, tarheader_option, yesorigin_option) ) \
     X(config_cmd, (0) ) \
     X(diff_cmd, (1, depth_option) ) \
-    X(fsck_cmd, (1, deepcheck_option) ) \
-    X(store_cmd, (14, background_option, contentsplit_option, delta_option, depth_option, splitsize_option, targetsize_option, triggersize_option, triggerglob_option, exclude_option, include_option, padding_option, progress_option, relaxtimechecks_option, tarheader_option, yesorigin_option) ) \
-    X(stored_cmd, (14, background_option, contentsplit_option, delta_option, depth_option, splitsize_option, targetsize_option, triggersize_option, triggerglob_option, exclude_option, include_option, padding_option, progress_option, relaxtimechecks_option, tarheader_option, yesorigin_option) ) \
+    X(fsck_cmd, (2, deepcheck_option, threads_option) ) \
+    X(store_cmd, (19, background_option, contenthash_option, contentsplit_option, delta_option, depth_option, sealglob_option, splitsize_option, stream_option, targetsize_option, threads_option, triggersize_option, triggerglob_option, exclude_option, include_option, padding_option, progress_option, relaxtimechecks_option, tarheader_option, yesorigin_option) ) \
+    X(stored_cmd, (18, background_option, contenthash_option, contentsplit_option, delta_option, depth_option, sealglob_option, splitsize_option, targetsize_option, threads_option, triggersize_option, triggerglob_option, exclude_option, include_option, padding_option, progress_option, relaxtimechecks_option, tarheader_option, yesorigin_option) ) \
     X(mount_cmd, (3, progress_option,foreground_option, fusedebug_option ) )  \
-    X(prune_cmd, (3, keep_option, now_option, yesprune_option) ) \
-    X(pull_cmd, (2, background_option, progress_option) ) \
-    X(push_cmd, (2, background_option, delta_option, progress_option) )  \
-    X(pushd_cmd, (2, background_option, delta_option, progress_option) ) \
-    X(restore_cmd, (2, background_option, progress_option) )
+    X(prune_cmd, (4, dryrun_option, keep_option, now_option, yesprune_option) ) \
+    X(pull_cmd, (4, background_option, dryrun_option, progress_option, threads_option) ) \
+    X(push_cmd, (4, background_option, delta_option, progress_option, threads_option) )  \
+    X(pushd_cmd, (4, background_option, delta_option, progress_option, threads_option) ) \
+    X(restore_cmd, (2, background_option, progress_option) ) \
+    X(status_cmd, (1, track_option) )
 
 
 struct CommandOption
@@ -364,6 +364,9 @@ Command BeakImplementation::parseCommandLine(int argc, char **argv, Settings *se
             case cache_option:
                 settings->cache = value;
                 break;
+            case contenthash_option:
+                settings->contenthash = true;
+                break;
             case contentsplit_option:
                 settings->contentsplit.push_back(value);
                 break;
@@ -450,6 +453,12 @@ Command BeakImplementation::parseCommandLine(int argc, char **argv, Settings *se
             case relaxtimechecks_option:
                 settings->relaxtimechecks = true;
                 break;
+            case stream_option:
+                settings->stream = true;
+                break;
+            case track_option:
+                settings->track = true;
+                break;
             case tarheader_option:
             {
                 if (value == "none") settings->tarheader = TarHeaderStyle::None;
@@ -475,6 +484,13 @@ Command BeakImplementation::parseCommandLine(int argc, char **argv, Settings *se
                 settings->targetsize_supplied = true;
             }
             break;
+            case threads_option:
+                settings->threads = atoi(value.c_str());
+                settings->threads_supplied = true;
+                if (settings->threads < 1) {
+                    error(COMMANDLINE, "The number of threads (-j) must be at least 1.\n");
+                }
+                break;
             case trace_option:
                 settings->trace = true;
                 setLogLevel(TRACE);
@@ -512,6 +528,9 @@ Command BeakImplementation::parseCommandLine(int argc, char **argv, Settings *se
                 settings->splitsize_supplied = true;
             }
             break;
+            case sealglob_option:
+                settings->sealglob.push_back(value);
+                break;
             case triggerglob_option:
                 settings->triggerglob.push_back(value);
                 break;
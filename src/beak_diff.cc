@@ -88,9 +88,17 @@ RC BeakImplementation::diff(Settings *settings, Monitor *monitor)
     }
 
     auto d = newDiff(settings->verbose, settings->depth);
-    rc = d->diff(old_fs, old_path,
-                 curr_fs, curr_path,
-                 progress.get());
+    if (restore_old && restore_curr)
+    {
+        // Two points in time, there is no need to recurse all of their contents.
+        rc = d->diffPoints(restore_old.get(), restore_curr.get(), progress.get());
+    }
+    else
+    {
+        rc = d->diff(old_fs, old_path,
+                     curr_fs, curr_path,
+                     progress.get());
+    }
     d->report();
     return rc;
 }
@@ -18,12 +18,439 @@
 #include "beak.h"
 #include "beak_implementation.h"
 #include "backup.h"
+#include "index.h"
+#include "lock.h"
 #include "log.h"
 #include "origintool.h"
+#include "sha256.h"
 #include "storagetool.h"
+#include "tar.h"
+#include "threads.h"
+
+#include <algorithm>
+#include <atomic>
+#include <string.h>
 
 static ComponentId FSCK = registerLogComponent("fsck");
 
+// A tar file, or all the parts of a split file, to be verified by the deep check.
+struct DeepCheckTar
+{
+    // The tar file (or the first part) relative to the storage root.
+    Path *tar {};
+    // The index file that listed the entries.
+    Path *gz {};
+    // The parts relative to the storage root and the parts with the root prepended.
+    vector<Path*> parts;
+    vector<Path*> part_files;
+    vector<size_t> part_sizes;
+    // The entries stored in this tar, sorted on offset.
+    vector<IndexEntry> entries;
+    // Used to map file offsets into parts, when the tar stores a split file.
+    RestoreEntry split;
+    bool has_headers {};
+    size_t size {};
+};
+
+static size_t parseOctal(const char *s, size_t len)
+{
+    size_t v = 0;
+    for (size_t i = 0; i < len && s[i] >= '0' && s[i] <= '7'; ++i)
+    {
+        v = v*8 + (s[i]-'0');
+    }
+    return v;
+}
+
+static bool checksumOk(TarHeaderContents *h)
+{
+    // The checksum is calculated with the checksum field itself filled with spaces.
+    unsigned char *b = (unsigned char*)h;
+    size_t sum = 0;
+    for (size_t i = 0; i < T_BLOCKSIZE; ++i) sum += b[i];
+    for (size_t i = 0; i < sizeof(h->checksum_); ++i) sum += ' ' - (unsigned char)h->checksum_[i];
+    return sum == parseOctal(h->checksum_, sizeof(h->checksum_));
+}
+
+// Read exactly len bytes or report failure. The read lock is only supplied
+// when the backup file system cannot serve concurrent reads.
+static bool readFully(FileSystem *fs, Path *file, char *buf, size_t len, off_t offset,
+                      pthread_mutex_t *read_lock)
+{
+    while (len > 0)
+    {
+        if (read_lock) LOCK(read_lock);
+        ssize_t n = fs->pread(file, buf, len, offset);
+        if (read_lock) UNLOCK(read_lock);
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool checkHeader(IndexEntry *e, Path *part, size_t header_offset,
+                        char expected_type, size_t expected_size, size_t expected_offset,
+                        FileSystem *fs, pthread_mutex_t *read_lock, size_t *bytes_read)
+{
+    TarHeaderContents h;
+    static_assert(sizeof(h) == T_BLOCKSIZE, "Tar header must be exactly one block.");
+
+    if (!readFully(fs, part, (char*)&h, T_BLOCKSIZE, header_offset, read_lock))
+    {
+        failure(FSCK, "Could not read tar header at offset %zu in %s\n", header_offset, part->c_str());
+        return false;
+    }
+    *bytes_read += T_BLOCKSIZE;
+
+    if (!checksumOk(&h))
+    {
+        failure(FSCK, "Bad tar header checksum for %s at offset %zu in %s\n",
+                e->path->c_str(), header_offset, part->c_str());
+        return false;
+    }
+    if (h.typeflag_ != expected_type)
+    {
+        failure(FSCK, "Expected tar header type '%c' but found '%c' for %s in %s\n",
+                expected_type, h.typeflag_, e->path->c_str(), part->c_str());
+        return false;
+    }
+    // Sizes from 8GiB and up do not fit in the octal size field.
+    if (expected_size < 8589934592ull && parseOctal(h.size_, sizeof(h.size_)) != expected_size)
+    {
+        failure(FSCK, "Tar header size %zu does not match the index size %zu for %s in %s\n",
+                parseOctal(h.size_, sizeof(h.size_)), expected_size, e->path->c_str(), part->c_str());
+        return false;
+    }
+    if (expected_type == 'M' && parseOctal(h.offset, sizeof(h.offset)) != expected_offset)
+    {
+        failure(FSCK, "Multivol offset %zu does not match the expected offset %zu for %s in %s\n",
+                parseOctal(h.offset, sizeof(h.offset)), expected_offset, e->path->c_str(), part->c_str());
+        return false;
+    }
+    if (expected_type == '0' && e->path->str().length() < sizeof(h.name_) &&
+        strncmp(h.name_, e->path->c_str(), sizeof(h.name_)))
+    {
+        failure(FSCK, "Tar header name does not match %s in %s\n", e->path->c_str(), part->c_str());
+        return false;
+    }
+    return true;
+}
+
+// Stream through the tar, or all its parts, in offset order and
+// verify the headers and any recorded content hashes. Returns the number of errors.
+static size_t deepCheckTar(DeepCheckTar *t, FileSystem *fs, pthread_mutex_t *read_lock, size_t *bytes_read)
+{
+    size_t errors = 0;
+    vector<char> buf(1024*1024);
+    SHA256Hasher hasher;
+    vector<char> hash;
+
+    for (auto &e : t->entries)
+    {
+        bool is_file = e.fs.isRegularFile() && !e.is_hard_link;
+        if (t->has_headers && e.offset >= T_BLOCKSIZE && is_file)
+        {
+            if (!checkHeader(&e, t->part_files[0], e.offset-T_BLOCKSIZE, '0', e.fs.st_size, 0,
+                             fs, read_lock, bytes_read)) errors++;
+        }
+        if (t->has_headers && e.num_parts > 1)
+        {
+            // Every following part starts with a multivol header telling how much
+            // of the file was stored in the previous parts.
+            size_t stored = t->split.part_size - e.offset;
+            for (uint k = 1; k < e.num_parts; ++k)
+            {
+                if (!checkHeader(&e, t->part_files[k], e.part_offset-T_BLOCKSIZE, 'M',
+                                 e.fs.st_size-stored, stored, fs, read_lock, bytes_read)) errors++;
+                stored += e.contentSize(k) - e.part_offset;
+            }
+        }
+        if (!is_file || e.content_hash.length() == 0) continue;
+
+        bool ok = true;
+        for (size_t off = 0; ok && off < (size_t)e.fs.st_size; off += buf.size())
+        {
+            size_t len = std::min(buf.size(), (size_t)e.fs.st_size-off);
+            if (e.num_parts == 1)
+            {
+                ok = readFully(fs, t->part_files[0], &buf[0], len, e.offset+off, read_lock);
+            }
+            else
+            {
+                ssize_t n = t->split.readParts(off, &buf[0], len,
+                     [t,fs,read_lock](uint partnr, off_t offset_inside_part, char *buffer, size_t length_to_read)
+                     {
+                         if (!readFully(fs, t->part_files[partnr], buffer, length_to_read, offset_inside_part, read_lock))
+                         {
+                             return (ssize_t)0;
+                         }
+                         return (ssize_t)length_to_read;
+                     });
+                ok = n == (ssize_t)len;
+            }
+            if (ok)
+            {
+                hasher.update(&buf[0], len);
+                *bytes_read += len;
+            }
+        }
+        hasher.final(&hash);
+        if (!ok)
+        {
+            failure(FSCK, "Could not read contents of %s from %s\n", e.path->c_str(), t->tar->c_str());
+            errors++;
+        }
+        else if (toHex(hash) != e.content_hash)
+        {
+            failure(FSCK, "Content hash mismatch for %s in %s\n", e.path->c_str(), t->tar->c_str());
+            errors++;
+        }
+    }
+    return errors;
+}
+
+// Collect every tar of every point in time exactly once, together with
+// the index entries stored in it. Returns the number of errors found.
+static size_t collectDeepCheckTars(RefIndex *refs, FileSystem *backup_fs, Path *root,
+                                   map<Path*,size_t> &existing_sizes,
+                                   vector<DeepCheckTar> *tars)
+{
+    size_t errors = 0;
+    vector<Path*> referenced;
+    refs->referencedFiles(&referenced);
+    set<Path*> gzs;
+    for (auto f : referenced)
+    {
+        if (TarFileName::isIndexFile(f)) gzs.insert(f);
+    }
+
+    map<Path*,DeepCheckTar> found;
+    // Whether the tars listed by an index file were stored with tar headers.
+    map<Path*,bool> gz_has_headers;
+    for (auto gz : gzs)
+    {
+        vector<char> buf, contents;
+        RC rc = backup_fs->loadVector(gz->prepend(root), T_BLOCKSIZE, &buf);
+        if (rc.isOk()) rc = gunzipit(&buf, &contents);
+        if (rc.isErr())
+        {
+            failure(FSCK, "Could not load index file %s\n", gz->c_str());
+            errors++;
+            continue;
+        }
+        auto i = contents.begin();
+        IndexEntry index_entry;
+        IndexTar index_tar;
+        size_t size = 0;
+        string config;
+        rc = Index::loadIndex(contents, i, &index_entry, &index_tar, NULL, gz->parent(), &size,
+                              [&found,gz](IndexEntry *ie)
+                              {
+                                  if (ie->tarr.length() == 0) return;
+                                  DeepCheckTar *t = &found[Path::lookup(ie->tarr)];
+                                  // The same tar can be listed by a single index file only.
+                                  if (t->gz != NULL && t->gz != gz) return;
+                                  t->gz = gz;
+                                  t->entries.push_back(*ie);
+                              },
+                              [](IndexTar *it) {},
+                              &config);
+        if (rc.isErr())
+        {
+            failure(FSCK, "Could not parse index file %s\n", gz->c_str());
+            errors++;
+            continue;
+        }
+        gz_has_headers[gz] = config.find("--tarheader=0 ") == string::npos;
+    }
+
+    for (auto& p : found)
+    {
+        DeepCheckTar *t = &p.second;
+        t->tar = p.first;
+        auto h = gz_has_headers.find(t->gz);
+        if (h != gz_has_headers.end()) t->has_headers = h->second;
+        sort(t->entries.begin(), t->entries.end(),
+             [](const IndexEntry &a, const IndexEntry &b) { return a.offset < b.offset; });
+
+        TarFileName tfn;
+        if (!tfn.parseFileName(t->tar->str()))
+        {
+            failure(FSCK, "Bad tar file name %s\n", t->tar->c_str());
+            errors++;
+            continue;
+        }
+        IndexEntry *first = &t->entries[0];
+        if (first->num_parts > 1)
+        {
+            if (t->entries.size() != 1)
+            {
+                failure(FSCK, "Split file %s shares its parts with other files in %s\n",
+                        first->path->c_str(), t->tar->c_str());
+                errors++;
+                continue;
+            }
+            // The content of the first part starts after the file header, the following parts
+            // start after their multivol headers, the sum must cover the file size.
+            size_t capacity = first->part_size - first->offset +
+                (first->num_parts-2)*(first->part_size - first->part_offset) +
+                first->last_part_size - first->part_offset;
+            if (capacity < (size_t)first->fs.st_size || capacity - first->fs.st_size >= T_BLOCKSIZE)
+            {
+                failure(FSCK, "The %u parts of %s store %zu bytes but the file size is %zu\n",
+                        first->num_parts, first->path->c_str(), capacity, (size_t)first->fs.st_size);
+                errors++;
+                continue;
+            }
+            t->split.loadFromIndex(first);
+            for (uint k = 0; k < first->num_parts; ++k)
+            {
+                tfn.part_nr = k;
+                tfn.size = first->contentSize(k);
+                tfn.ondisk_size = first->diskSize(k);
+                tfn.num_parts = first->num_parts;
+                t->parts.push_back(tfn.asPathWithDir(t->tar->parent()));
+                t->part_sizes.push_back(tfn.ondisk_size);
+            }
+        }
+        else
+        {
+            t->parts.push_back(t->tar);
+            t->part_sizes.push_back(tfn.ondisk_size);
+        }
+
+        bool ok = true;
+        for (size_t k = 0; k < t->parts.size(); ++k)
+        {
+            auto e = existing_sizes.find(t->parts[k]);
+            if (e == existing_sizes.end())
+            {
+                failure(FSCK, "Missing tar part %s\n", t->parts[k]->c_str());
+                ok = false;
+            }
+            else if (e->second != t->part_sizes[k])
+            {
+                failure(FSCK, "Tar part %s has size %zu but its name says %zu\n",
+                        t->parts[k]->c_str(), e->second, t->part_sizes[k]);
+                ok = false;
+            }
+            t->part_files.push_back(t->parts[k]->prepend(root));
+            t->size += t->part_sizes[k];
+        }
+        for (auto& e : t->entries)
+        {
+            if (e.num_parts == 1 && e.fs.isRegularFile() && !e.is_hard_link &&
+                e.offset + e.fs.st_size > t->part_sizes[0])
+            {
+                failure(FSCK, "%s at offset %zu with size %zu does not fit inside %s\n",
+                        e.path->c_str(), e.offset, (size_t)e.fs.st_size, t->tar->c_str());
+                ok = false;
+            }
+        }
+        if (!ok)
+        {
+            errors++;
+            continue;
+        }
+        tars->push_back(*t);
+    }
+    return errors;
+}
+
+static RC deepCheck(Settings *settings, RefIndex *refs, FileSystem *backup_fs, Path *root,
+                    FileSystem *local_fs, map<Path*,size_t> &existing_sizes)
+{
+    uint64_t start = clockGetTimeMicroSeconds();
+    vector<DeepCheckTar> tars;
+    size_t errors = collectDeepCheckTars(refs, backup_fs, root, existing_sizes, &tars);
+
+    // Tars verified by an interrupted deep check are listed in the journal and are skipped.
+    Path *cache_dir = cacheDir();
+    local_fs->mkDirpWriteable(cache_dir);
+    char name[64];
+    snprintf(name, sizeof(name), "fsck_%08x.journal", hashString(settings->from.storage->storage_location->str()));
+    Path *journal = cache_dir->append(name);
+    set<string> already_verified;
+    FileStat st;
+    if (local_fs->stat(journal, &st).isOk())
+    {
+        vector<char> buf;
+        local_fs->loadVector(journal, T_BLOCKSIZE, &buf);
+        auto i = buf.begin();
+        bool eof = false, err = false;
+        while (i != buf.end() && !eof && !err)
+        {
+            string line = eatTo(buf, i, '\n', 4096, &eof, &err);
+            if (line.length() > 0) already_verified.insert(line);
+        }
+    }
+    vector<DeepCheckTar*> todo;
+    size_t total_size = 0;
+    for (auto& t : tars)
+    {
+        if (already_verified.count(t.tar->str()) > 0) continue;
+        todo.push_back(&t);
+        total_size += t.size;
+    }
+    if (todo.size() < tars.size())
+    {
+        info(FSCK, "Resuming deep check, skipping %zu already verified tars.\n", tars.size()-todo.size());
+    }
+
+    FILE *journal_file = local_fs->openAsFILE(journal, "a");
+    int num_threads = settings->threads_supplied ? settings->threads : numCores();
+    // The cached file systems used for rclone and rsync storages cannot serve concurrent reads.
+    pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_t *rl = settings->from.storage->type == FileSystemStorage ? NULL : &read_lock;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    atomic<size_t> bytes_read {0};
+    atomic<size_t> content_errors {0};
+    size_t num_done = 0;
+    size_t size_done = 0;
+
+    parallelFor(todo.size(), num_threads, [&](size_t i)
+    {
+        DeepCheckTar *t = todo[i];
+        size_t n = 0;
+        size_t e = deepCheckTar(t, backup_fs, rl, &n);
+        bytes_read += n;
+        content_errors += e;
+
+        LOCK(&lock);
+        if (e == 0 && journal_file)
+        {
+            fprintf(journal_file, "%s\n", t->tar->c_str());
+            fflush(journal_file);
+        }
+        num_done++;
+        size_done += t->size;
+        UI::clearLine();
+        info(FSCK, "Deep check %zu/%zu tars %s/%s", num_done, todo.size(),
+             humanReadable(size_done).c_str(), humanReadable(total_size).c_str());
+        UNLOCK(&lock);
+    });
+    UI::clearLine();
+
+    if (journal_file) fclose(journal_file);
+    // The check ran to completion, the next one starts from scratch.
+    local_fs->deleteFile(journal);
+
+    errors += content_errors;
+    uint64_t micros = clockGetTimeMicroSeconds() - start;
+    size_t per_second = micros > 0 ? (size_t)(bytes_read * 1000000.0 / micros) : 0;
+    UI::output("Deep checked %zu tar(s) (%s read) in %s using %d thread(s), %s/s. Found %zu error(s).\n",
+               todo.size(),
+               humanReadable(bytes_read).c_str(),
+               humanReadableTimeTwoDecimals(micros).c_str(),
+               num_threads,
+               humanReadable(per_second).c_str(),
+               errors);
+
+    return errors > 0 ? RC::ERR : RC::OK;
+}
+
 RC BeakImplementation::fsck(Settings *settings, Monitor *monitor)
 {
     RC rc = RC::OK;
@@ -31,29 +458,32 @@ RC BeakImplementation::fsck(Settings *settings, Monitor *monitor)
     assert(settings->from.type == ArgStorage);
 
     auto progress = monitor->newProgressStatistics(buildJobName("fsck", settings));
+
+    // Do not trust the cached listing of a remote storage, list it again.
+    size_t num_listing_differences = 0;
+    rc = storage_tool_->relistStorage(settings->from.storage, &num_listing_differences);
+    if (rc.isErr())
+    {
+        error(FSCK, "Could not list storage %s\n", settings->from.storage->storage_location->c_str());
+    }
+    if (num_listing_differences > 0)
+    {
+        UI::output("The cached listing of the storage was out of date for %zu file(s), it has been refreshed.\n",
+                   num_listing_differences);
+    }
+
     FileSystem *backup_fs;
     Path *root;
-    auto restore = accessBackup_(&settings->from, "", monitor, &backup_fs, &root);
+    unique_ptr<RefIndex> refs;
+    // The storage was just relisted.
+    auto restore = accessReferences_(&settings->from, monitor, false, &backup_fs, &root, &refs);
 
-    set<Path*> required_beak_files;
     vector<pair<Path*,FileStat>> existing_beak_files;
     set<Path*> set_of_existing_beak_files;
     size_t total_files_size = 0;
 
-    for (auto& i : restore->historyOldToNew())
-    {
-        Path *p = Path::lookup(i.filename);
-        required_beak_files.insert(p);
-        for (auto& t : *(i.tarfiles()))
-        {
-            required_beak_files.insert(t);
-        }
-    }
-
     vector<Path*> superfluous_files;
     size_t superfluous_files_size = 0;
-    //vector<Path*> lost_files;
-    //size_t lost_files_size = 0;
     vector<Path*> broken_points_in_time;
 
     backup_fs->listFilesBelow(root, &existing_beak_files, SortOrder::Unspecified);
@@ -62,7 +492,7 @@ RC BeakImplementation::fsck(Settings *settings, Monitor *monitor)
         debug(FSCK, "existing: %s\n", p.first->c_str());
         set_of_existing_beak_files.insert(p.first);
         total_files_size += p.second.st_size;
-        if (required_beak_files.count(p.first) == 0)
+        if (refs->numReferences(p.first) == 0)
         {
             verbose(FSCK, "superfluous: %s\n", p.first->c_str());
             superfluous_files.push_back(p.first);
@@ -70,48 +500,56 @@ RC BeakImplementation::fsck(Settings *settings, Monitor *monitor)
         }
     }
 
+    // Every point in time that references a lost file is broken.
+    vector<Path*> required_beak_files;
+    refs->referencedFiles(&required_beak_files);
+    vector<bool> broken(refs->numPointsInTime());
     bool lost_file = false;
     for (auto p : required_beak_files)
     {
         if (set_of_existing_beak_files.count(p) == 0)
         {
-            verbose(FSCK, "lost: %s\n", p->c_str());
+            vector<size_t> points;
+            refs->pointsReferencing(p, &points);
+            verbose(FSCK, "lost: %s (breaks %zu points in time)\n", p->c_str(), points.size());
             lost_file = true;
-            //lost_files.push_back(p);
-            //lost_files_size += p.second.st_size;
+            for (auto i : points) broken[i] = true;
         }
     }
 
+    vector<PointInTime> &history = restore->historyOldToNew();
     if (lost_file) {
         // Ouch, a backup file was lost. Are there any ok points in time?
-        for (auto& i : restore->historyOldToNew())
+        for (size_t i = 0; i < history.size(); ++i)
         {
-            Path *p = Path::lookup(i.filename);
-            bool missing = 0 == set_of_existing_beak_files.count(p);
-            if (!missing)
-            {
-                for (auto& t : *(i.tarfiles()))
-                {
-                    if (set_of_existing_beak_files.count(t) == 0) {
-                        missing = true;
-                        break;
-                    }
-                }
-            }
-            if (missing) {
-                warning(FSCK, "Broken %s\n", i.datetime.c_str());
-                broken_points_in_time.push_back(Path::lookup(i.filename));
+            if (broken[i]) {
+                warning(FSCK, "Broken %s\n", history[i].datetime.c_str());
+                broken_points_in_time.push_back(Path::lookup(history[i].filename));
             } else {
-                warning(FSCK, "OK     %s\n", i.datetime.c_str());
+                warning(FSCK, "OK     %s\n", history[i].datetime.c_str());
             }
         }
     } else {
-        string last_size = humanReadableTwoDecimals(restore->historyOldToNew().back().size);
+        string last_size = humanReadableTwoDecimals(refs->pointSize(history.size()-1));
         string kept_size = humanReadableTwoDecimals(total_files_size);
         UI::output("OK! Last backup %s, all backups %s (%d points in time).\n",
                    last_size.c_str(),
                    kept_size.c_str(),
-                   restore->historyOldToNew().size());
+                   history.size());
+    }
+
+    if (settings->deepcheck)
+    {
+        if (lost_file)
+        {
+            warning(FSCK, "Skipping the deep check since backup files are lost.\n");
+        }
+        else
+        {
+            map<Path*,size_t> existing_sizes;
+            for (auto& p : existing_beak_files) existing_sizes[p.first] = p.second.st_size;
+            rc = deepCheck(settings, refs.get(), backup_fs, root, local_fs_, existing_sizes);
+        }
     }
 
     int sn = superfluous_files.size();
@@ -125,9 +563,11 @@ RC BeakImplementation::fsck(Settings *settings, Monitor *monitor)
 
         if (proceed == UIYes)
         {
-            storage_tool_->removeBackupFiles(settings->from.storage,
-                                             superfluous_files,
-                                             progress.get());
+            if (storage_tool_->removeBackupFiles(settings->from.storage,
+                                                 superfluous_files,
+                                                 progress.get()).isErr()) {
+                return RC::ERR;
+            }
             UI::output("Superflous files are now deleted.\n");
         }
     }
@@ -142,9 +582,11 @@ RC BeakImplementation::fsck(Settings *settings, Monitor *monitor)
 
         if (proceed == UIYes)
         {
-            storage_tool_->removeBackupFiles(settings->from.storage,
-                                             broken_points_in_time,
-                                             progress.get());
+            if (storage_tool_->removeBackupFiles(settings->from.storage,
+                                                 broken_points_in_time,
+                                                 progress.get()).isErr()) {
+                return RC::ERR;
+            }
             UI::output("Broken points in time are now deleted. Run fsck again.\n");
         }
     }
@@ -17,6 +17,7 @@
 
 #include "beak.h"
 
+#include "refindex.h"
 #include "restore.h"
 
 #include <map>
@@ -104,6 +105,15 @@ struct BeakImplementation : Beak {
                                       Monitor *monitor,
                                       FileSystem **out_backup_fs = NULL,
                                       Path **out_root = NULL);
+    // Find the points in time in the storage and the beak files each of them references,
+    // without loading the full beak file system. Fresh lists a remote storage now,
+    // which is needed before deleting anything in it.
+    unique_ptr<Restore> accessReferences_(Argument *storage,
+                                          Monitor *monitor,
+                                          bool fresh,
+                                          FileSystem **out_backup_fs,
+                                          Path **out_root,
+                                          unique_ptr<RefIndex> *out_refs);
     RC mountRestoreInternal_(Settings *settings, bool daemon, Monitor *monitor);
     bool hasPointsInTime_(Path *path, FileSystem *fs);
 
@@ -22,6 +22,9 @@
 #include "prune.h"
 #include "storagetool.h"
 
+#include <algorithm>
+#include <unordered_set>
+
 static ComponentId PRUNE = registerLogComponent("prune");
 
 RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
@@ -33,7 +36,8 @@ RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
     auto progress = monitor->newProgressStatistics(buildJobName("prune", settings));
     FileSystem *backup_fs;
     Path *root;
-    auto restore = accessBackup_(&settings->from, "", monitor, &backup_fs, &root);
+    unique_ptr<RefIndex> refs;
+    auto restore = accessReferences_(&settings->from, monitor, true, &backup_fs, &root, &refs);
     Keep keep("all:2d daily:2w weekly:2m monthly:2y");
     if (settings->keep_supplied) {
         bool ok = keep.parse(settings->keep);
@@ -49,14 +53,12 @@ RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
         if (rc.isErr())
         {
             usageError(PRUNE, "Cannot parse date time \"%s\"\n", settings->now.c_str());
-            assert(0);
         }
         now_nanos = ((uint64_t)nowt)*1000000000ull;
     }
 
     auto prune = newPrune(now_nanos, keep);
 
-    set<Path*> required_beak_files;
     int num_existing_points_in_time = 0;
 
     // Iterate over the points in time, from the oldest to the newest!
@@ -65,7 +67,6 @@ RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
         if (i.point() > now_nanos) {
             verbose(PRUNE, "Found point in time \"%s\" which is in the future.\n", i.datetime.c_str());
             usageError(PRUNE, "Cowardly refusing to prune a storage with point in times from the future!\n");
-            assert(0);
         }
         prune->addPointInTime(i.point());
         num_existing_points_in_time++;
@@ -77,24 +78,33 @@ RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
     prune->prune(&keeps);
 
     int num_kept_points_in_time = 0;
+    vector<PointInTime> &history = restore->historyOldToNew();
+    vector<bool> remove(history.size());
 
-    for (PointInTime& i : restore->historyOldToNew())
+    for (size_t i = 0; i < history.size(); ++i)
     {
-        if (keeps[i.point()]) {
-            // We should keep this point in time, lets remember all the tars required.
+        // Without the references of a point in time, its files would look unreferenced.
+        if (refs->numReferences(Path::lookup(history[i].filename)) == 0)
+        {
+            usageError(PRUNE, "Could not load the index of %s, cowardly refusing to prune.\n",
+                       history[i].datetime.c_str());
+        }
+        if (keeps[history[i].point()]) {
             num_kept_points_in_time++;
-            for (auto& t : *(i.tarfiles())) {
-                required_beak_files.insert(t);
-            }
-            Path *p = Path::lookup(i.filename);
-            required_beak_files.insert(p);
+        } else {
+            remove[i] = true;
         }
     }
 
+    // The files only referenced by removed points in time are no longer needed.
+    vector<Path*> freed;
+    refs->filesFreedByRemoving(remove, &freed);
+    unordered_set<Path*> set_of_freed_beak_files(freed.begin(), freed.end());
+
     vector<pair<Path*,FileStat>> existing_beak_files;
     backup_fs->listFilesBelow(root, &existing_beak_files, SortOrder::Unspecified);
 
-    set<Path*> set_of_existing_beak_files;
+    unordered_set<Path*> set_of_existing_beak_files(existing_beak_files.size());
     for (auto& p : existing_beak_files)
     {
         set_of_existing_beak_files.insert(p.first);
@@ -103,12 +113,19 @@ RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
     vector<Path*> beak_files_to_delete;
     size_t total_size_removed = 0;
     size_t total_size_kept = 0;
+    // The bytes freed by each removed point in time. A file shared by several removed
+    // points is counted for the newest of them, the last point that needed it.
+    vector<size_t> size_freed_by_point(history.size());
+    size_t size_unreferenced = 0;
+    vector<size_t> points;
 
     int num_lost = 0;
     // Check that all expected tars actually exist in the storage location.
-    for (auto p : required_beak_files)
+    vector<Path*> referenced;
+    refs->referencedFiles(&referenced);
+    for (auto p : referenced)
     {
-        if (set_of_existing_beak_files.count(p) == 0)
+        if (set_of_freed_beak_files.count(p) == 0 && set_of_existing_beak_files.count(p) == 0)
         {
             warning(PRUNE, "storage lost: %s\n", p->c_str());
             num_lost++;
@@ -117,8 +134,8 @@ RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
 
     for (auto &p : existing_beak_files)
     {
-        // Should we delete this file, check if the file is found in required_beak_files...
-        if (required_beak_files.count(p.first) > 0)
+        // Should we delete this file, check if a kept point in time references it...
+        if (refs->numReferences(p.first) > 0 && set_of_freed_beak_files.count(p.first) == 0)
         {
             total_size_kept += p.second.st_size;
         }
@@ -128,6 +145,16 @@ RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
             // Lets queue it up for deletion.
             beak_files_to_delete.push_back(p.first);
             total_size_removed += p.second.st_size;
+            points.clear();
+            refs->pointsReferencing(p.first, &points);
+            if (points.size() > 0)
+            {
+                size_freed_by_point[*max_element(points.begin(), points.end())] += p.second.st_size;
+            }
+            else
+            {
+                size_unreferenced += p.second.st_size;
+            }
 
             if (settings->dryrun == true) {
                 verbose(PRUNE, "would remove %s\n", p.first->c_str());
@@ -138,7 +165,7 @@ RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
     }
 
     string removed_size = humanReadableTwoDecimals(total_size_removed);
-    string last_size = humanReadableTwoDecimals(restore->historyOldToNew().back().size);
+    string last_size = humanReadableTwoDecimals(refs->pointSize(history.size()-1));
     string kept_size = humanReadableTwoDecimals(total_size_kept);
 
     if (total_size_removed == 0)
@@ -156,6 +183,25 @@ RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
                    num_existing_points_in_time - num_kept_points_in_time,
                    kept_size.c_str(),
                    num_kept_points_in_time);
+        for (size_t i = 0; i < history.size(); ++i)
+        {
+            if (!remove[i]) continue;
+            string freed_size = humanReadableTwoDecimals(size_freed_by_point[i]);
+            if (settings->dryrun) {
+                UI::output("    %s %s\n", history[i].datetime.c_str(), freed_size.c_str());
+            } else {
+                verbose(PRUNE, "removing %s frees %s\n", history[i].datetime.c_str(), freed_size.c_str());
+            }
+        }
+        if (size_unreferenced > 0)
+        {
+            string unreferenced_size = humanReadableTwoDecimals(size_unreferenced);
+            if (settings->dryrun) {
+                UI::output("    unreferenced files %s\n", unreferenced_size.c_str());
+            } else {
+                verbose(PRUNE, "unreferenced files %s\n", unreferenced_size.c_str());
+            }
+        }
     }
 
     if (num_lost > 0)
@@ -175,9 +221,13 @@ RC BeakImplementation::prune(Settings *settings, Monitor *monitor)
         progress->startDisplayOfProgress();
         if (proceed == UIYes)
         {
-            storage_tool_->removeBackupFiles(settings->from.storage,
-                                             beak_files_to_delete,
-                                             progress.get());
+            rc = storage_tool_->removeBackupFiles(settings->from.storage,
+                                                  beak_files_to_delete,
+                                                  progress.get());
+            if (rc.isErr()) {
+                failure(PRUNE, "Could not delete all pruned backup files, run fsck.\n");
+                return rc;
+            }
             UI::output("Backup is now pruned.\n");
         }
     }
@@ -24,6 +24,49 @@
 
 static ComponentId PULL = registerLogComponent("pull");
 
+// The most recent point in time of the rule, in the local storage or in one of
+// the remote storages. The root of each storage is listed, not its cached manifest,
+// since the point to pull was most likely stored by another host. Nothing is fetched.
+// Returns NULL if there is no backup.
+static Storage *findMostRecentBackup(Rule *rule, StorageTool *storage_tool, string *index_file)
+{
+    vector<Storage*> storages;
+    // The local storage comes first, it is chosen when a remote has the same backup.
+    if (rule->local.type == FileSystemStorage && rule->local.storage_location != NULL)
+    {
+        storages.push_back(&rule->local);
+    }
+    for (Storage *s : rule->sortedStorages())
+    {
+        if (s != &rule->local) storages.push_back(s);
+    }
+
+    Storage *found = NULL;
+    TarFileName most_recent;
+    for (Storage *s : storages)
+    {
+        vector<string> index_files;
+        if (storage_tool->listPointsInTime(s, &index_files, true).isErr())
+        {
+            warning(PULL, "Could not list the points in time of %s\n", s->storage_location->c_str());
+            continue;
+        }
+        for (auto &f : index_files)
+        {
+            TarFileName tfn;
+            if (!tfn.parseFileName(f)) continue;
+            if (found == NULL || tfn.sec > most_recent.sec ||
+                (tfn.sec == most_recent.sec && tfn.nsec > most_recent.nsec))
+            {
+                found = s;
+                most_recent = tfn;
+                *index_file = f;
+            }
+        }
+    }
+    return found;
+}
+
 RC BeakImplementation::pull(Settings *settings, Monitor *monitor)
 {
     RC rc = RC::OK;
@@ -34,5 +77,118 @@ RC BeakImplementation::pull(Settings *settings, Monitor *monitor)
 
     assert(rule != NULL);
 
+    uint64_t start = clockGetTimeMicroSeconds();
+    umask(0);
+
+    string index_file;
+    Storage *storage = findMostRecentBackup(rule, storage_tool_, &index_file);
+    if (storage == NULL)
+    {
+        usageError(PULL, "There is no backup of the rule \"%s\" to pull.\n", rule->name.c_str());
+    }
+
+    // The pull is a restore of the most recent backup into the origin of the rule.
+    Settings restore_settings = *settings;
+    restore_settings.from.type = ArgStorage;
+    restore_settings.from.storage = storage;
+    restore_settings.to.type = ArgOrigin;
+    restore_settings.to.origin = rule->origin_path;
+
+    FileSystem *backup_fs = local_fs_;
+    if (storage->type == RCloneStorage ||
+        storage->type == RSyncStorage) {
+        // Only the index files of the most recent point in time are fetched.
+        // The listing must include what other hosts have stored.
+        backup_fs = storage_tool_->asCachedReadOnlyFS(storage, monitor, false, true);
+    }
+    unique_ptr<Restore> restore = newRestore(backup_fs);
+    vector<string> index_files;
+    index_files.push_back(index_file);
+    rc = restore->lookForPointsInTime(PointInTimeFormat::absolute_point, index_files);
+    if (rc.isErr()) return rc;
+    auto point = restore->setPointInTime("@0");
+    rc = restore->loadBeakFileSystem(storage);
+    if (rc.isErr())
+    {
+        error(PULL, "Could not load the backup %s in %s\n", index_file.c_str(), storage->storage_location->c_str());
+    }
+    vector<Path*> gz_files;
+    for (auto t : *point->tarfiles())
+    {
+        if (TarFileName::isIndexFile(t)) gz_files.push_back(t->prepend(storage->storage_location));
+    }
+    backup_fs->prefetch(&gz_files);
+
+    info(PULL, "Pulling %s from %s into %s\n", point->datetime.c_str(),
+         storage->storage_location->c_str(), rule->origin_path->c_str());
+
+    auto progress = monitor->newProgressStatistics(buildJobName("pull", settings));
+
+    // Compare the index of the backup with the origin, the tars are not needed for this.
+    FileSystem *backup_contents_fs = restore->asFileSystem();
+    FileSystem *origin_fs = origin_tool_->fs();
+    size_t num_kept = 0;
+    backup_contents_fs->recurse(Path::lookupRoot(), [&](Path *path, FileStat *stat) {
+            origin_tool_->addRestoreWork(progress.get(), path, stat, &restore_settings, restore.get(), point);
+            if (stat->hard_link || !stat->isRegularFile() || stat->disk_update != Store) return RecurseContinue;
+            // A merge keeps the files that were changed in the origin after the backup.
+            FileStat old_stat;
+            Path *file = path->prepend(rule->origin_path);
+            if (origin_fs->stat(file, &old_stat).isOk() &&
+                (old_stat.st_mtim.tv_sec > stat->st_mtim.tv_sec ||
+                 (old_stat.st_mtim.tv_sec == stat->st_mtim.tv_sec &&
+                  old_stat.st_mtim.tv_nsec > stat->st_mtim.tv_nsec)))
+            {
+                stat->disk_update = NoUpdate;
+                progress->stats.num_files_to_store--;
+                progress->stats.size_files_to_store -= stat->st_size;
+                num_kept++;
+                verbose(PULL, "Keeping %s, it is newer than the backup.\n", file->c_str());
+            }
+            return RecurseContinue;
+        });
+
+    vector<Path*> tars;
+    origin_tool_->findTarsToFetch(backup_contents_fs, restore.get(), point, &restore_settings, &tars);
+    size_t size_tars = 0;
+    for (Path *t : tars)
+    {
+        FileStat st;
+        if (backup_fs->stat(t, &st).isOk()) size_tars += st.st_size;
+    }
+    string files_size = humanReadable(progress->stats.size_files_to_store);
+    string tars_size = humanReadable(size_tars);
+
+    if (settings->dryrun)
+    {
+        UI::output("Pull would write %zu files (%s) from %zu tars (%s) in %s.\n",
+                   progress->stats.num_files_to_store, files_size.c_str(),
+                   tars.size(), tars_size.c_str(), storage->storage_location->c_str());
+        if (num_kept > 0)
+        {
+            UI::output("Pull would keep %zu files that are newer in the origin.\n", num_kept);
+        }
+        return RC::OK;
+    }
+
+    info(PULL, "Fetching %zu tars (%s) for %zu files (%s).\n", tars.size(), tars_size.c_str(),
+         progress->stats.num_files_to_store, files_size.c_str());
+    progress->startDisplayOfProgress();
+    origin_tool_->restoreFileSystem(backup_fs, backup_contents_fs, restore.get(), point, &restore_settings, progress.get());
+    progress->finishProgress();
+
+    uint64_t stop = clockGetTimeMicroSeconds();
+    if (progress->stats.num_files_stored == 0 && progress->stats.num_symbolic_links_stored == 0 &&
+        progress->stats.num_dirs_updated == 0) {
+        info(PULL, "No pull needed, the origin was up to date.\n");
+    } else {
+        string stored_size = humanReadable(progress->stats.size_files_stored);
+        info(PULL, "Pulled %ju files (%s) in %jdms.\n", progress->stats.num_files_stored,
+             stored_size.c_str(), (stop - start) / 1000);
+    }
+    if (num_kept > 0)
+    {
+        info(PULL, "Kept %zu files that are newer in the origin.\n", num_kept);
+    }
     return rc;
 }
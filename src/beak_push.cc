@@ -71,6 +71,7 @@ RC BeakImplementation::storeRuleLocallyThenRemotely(Rule *rule, Settings *settin
     unique_ptr<ProgressStatistics> progress = monitor->newProgressStatistics(buildJobName("store", settings));
 
     unique_ptr<Backup> backup  = newBackup(origin_tool_->fs());
+    backup->watchForChanges();
 
     // This command scans the origin file system and builds
     // an in memory representation of the backup file system,
@@ -78,49 +79,57 @@ RC BeakImplementation::storeRuleLocallyThenRemotely(Rule *rule, Settings *settin
     progress->startDisplayOfProgress();
     rc = backup->scanFileSystem(&settings->from, settings, progress.get());
 
-    settings->to.storage = &rule->local;
-    // Now store the beak file system into the selected storage.
-    storage_tool_->storeBackupIntoStorage(backup->asFileSystem(),
-                                          backup->originFileSystem(),
-                                          backup.get(),
-                                          &rule->local,
-                                          settings,
-                                          progress.get(),
-                                          monitor);
-
-    if (progress->stats.num_files_stored == 0 && progress->stats.num_dirs_updated == 0) {
-        info(PUSH, "No stores needed, local backup is up to date.\n");
-    }
-
-    uint64_t start = clockGetTimeMicroSeconds();
-    int unpleasant_modifications = backup->checkIfFilesHaveChanged();
-    uint64_t stop = clockGetTimeMicroSeconds();
-    uint64_t scan_time = stop - start;
-    if (scan_time > 2000000)
+    // The remote storages are fed concurrently from the local storage,
+    // each tar is copied as soon as it has been written locally.
+    vector<Storage*> remotes;
+    vector<unique_ptr<ProgressStatistics>> remote_progress;
+    vector<ProgressStatistics*> remote_progress_ptrs;
+    for (auto & p : rule->storages)
     {
-        info(PUSH, "Rescanned indexed files. (%jdms)\n", scan_time / 1000);
-    }
-    if (unpleasant_modifications > 0) {
-        warning(PUSH, "Warning! Origin directory modified while doing local backup!\n");
+        remotes.push_back(&p.second);
+        remote_progress.push_back(monitor->newProgressStatistics(buildJobName("copy", settings)));
+        remote_progress.back()->startDisplayOfProgress();
+        remote_progress_ptrs.push_back(remote_progress.back().get());
     }
 
-    info(PUSH, "Local backup copy is now complete. It is now safe to work in your origin directory.\n");
+    settings->to.storage = &rule->local;
+    // Now store the beak file system into the local storage and copy it on to the remotes.
+    RC copy_rc = storage_tool_->storeBackupLocallyThenRemotely(backup->asFileSystem(),
+                                                               backup->originFileSystem(),
+                                                               backup.get(),
+                                                               &rule->local,
+                                                               remotes,
+                                                               settings,
+                                                               progress.get(),
+                                                               remote_progress_ptrs,
+                                                               [&]() {
+        if (progress->stats.num_files_stored == 0 && progress->stats.num_dirs_updated == 0) {
+            info(PUSH, "No stores needed, local backup is up to date.\n");
+        }
 
-    for (auto & p : rule->storages)
-    {
-        unique_ptr<ProgressStatistics> progress = monitor->newProgressStatistics(buildJobName("copy", settings));
-        progress->startDisplayOfProgress();
-        info(PUSH, "Copying local backup into %s\n", p.second.storage_location->c_str());
-        storage_tool_->copyBackupIntoStorage(local_fs_, // copy from file system.
-                                             rule->local.storage_location, // copy from here
-                                             &p.second, // copy to here
-                                             settings,
-                                             progress.get());
+        // The rescan runs while the copying to the remote storages continues.
+        uint64_t start = clockGetTimeMicroSeconds();
+        int unpleasant_modifications = backup->checkIfFilesHaveChanged();
+        uint64_t stop = clockGetTimeMicroSeconds();
+        uint64_t scan_time = stop - start;
+        if (scan_time > 2000000)
+        {
+            info(PUSH, "Rescanned indexed files. (%jdms)\n", scan_time / 1000);
+        }
+        if (unpleasant_modifications > 0) {
+            warning(PUSH, "Warning! Origin directory modified while doing local backup!\n");
+        }
 
-        if (progress->stats.num_files_stored == 0 && progress->stats.num_dirs_updated == 0) {
-            info(PUSH, "No copying needed, remote backup is up to date.\n");
+        info(PUSH, "Local backup copy is now complete. It is now safe to work in your origin directory.\n");
+    });
+
+    for (size_t i = 0; i < remotes.size(); ++i)
+    {
+        if (remote_progress[i]->stats.num_files_stored == 0 && remote_progress[i]->stats.num_dirs_updated == 0) {
+            info(PUSH, "No copying needed, remote backup %s is up to date.\n", remotes[i]->storage_location->c_str());
         }
     }
+    if (copy_rc.isErr()) rc = copy_rc;
 
     return rc;
 }
@@ -132,6 +141,7 @@ RC BeakImplementation::storeRuleRemotely(Rule *rule, Settings *settings, Monitor
     unique_ptr<ProgressStatistics> progress = monitor->newProgressStatistics(buildJobName("store", settings));
 
     unique_ptr<Backup> backup  = newBackup(origin_tool_->fs());
+    backup->watchForChanges();
 
     // This command scans the origin file system and builds
     // an in memory representation of the backup file system,
@@ -169,5 +179,5 @@ RC BeakImplementation::storeRuleRemotely(Rule *rule, Settings *settings, Monitor
             warning(PUSH, "Warning! Origin directory modified while doing backup!\n");
         }
     }
-    return RC::OK;
+    return rc;
 }
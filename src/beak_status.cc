@@ -18,50 +18,125 @@
 #include "beak.h"
 #include "beak_implementation.h"
 #include "backup.h"
+#include "changetracker.h"
+#include "listingcache.h"
 #include "log.h"
 #include "origintool.h"
 #include "storagetool.h"
 
 static ComponentId STATUS = registerLogComponent("status");
 
-extern void update_mctim_maxes(const struct stat *sb);
+static string timeString(struct timespec ts)
+{
+    char buf[20];
+    memset(buf, 0, sizeof(buf));
+    strftime(buf, 20, "%Y-%m-%d_%H:%M:%S", localtime(&ts.tv_sec));
+    return buf;
+}
 
 RC BeakImplementation::status(Settings *settings, Monitor *monitor)
 {
     RC rc = RC::OK;
-    struct timespec mtim_max {};  /* time of last modification */
-    struct timespec ctim_max {};  /* time of last meta data modification */
-
-    assert(settings->from.type == ArgRule || settings->from.type == ArgNone);
-
-    Rule *rule = settings->from.rule;
-
-    info(STATUS, "Scanning %s...", rule->origin_path->c_str());
-
-    memset(&mtim_max, 0, sizeof(mtim_max));
-    memset(&ctim_max, 0, sizeof(ctim_max));
-    uint64_t start = clockGetTimeMicroSeconds();
-    auto progress = monitor->newProgressStatistics(buildJobName("status", settings));
-    rc = origin_tool_->fs()->recurse(rule->origin_path,
-                                     [=](const char *path, const struct stat *sb) {
-                                         update_mctim_maxes(sb);
-                                         return RecurseContinue;
-                                     });
-
-    uint64_t stop = clockGetTimeMicroSeconds();
-    uint64_t store_time = stop - start;
-
-    info(STATUS, "in %jdms.\n", store_time / 1000);
-
-    char most_recent_mtime[20];
-    memset(most_recent_mtime, 0, sizeof(most_recent_mtime));
-    strftime(most_recent_mtime, 20, "%Y-%m-%d_%H:%M:%S", localtime(&mtim_max.tv_sec));
-
-    char most_recent_ctime[20];
-    memset(most_recent_ctime, 0, sizeof(most_recent_ctime));
-    strftime(most_recent_ctime, 20, "%Y-%m-%d_%H:%M:%S", localtime(&ctim_max.tv_sec));
 
-    info(STATUS, "mtime=%s ctime=%s\n", most_recent_mtime, most_recent_ctime);
+    assert(settings->from.type == ArgRule || settings->from.type == ArgNone || settings->from.type == ArgUnspecified);
+
+    vector<Rule*> rules;
+    if (settings->from.type == ArgRule) rules.push_back(settings->from.rule);
+    else rules = configuration_->sortedRules();
+
+    if (settings->track)
+    {
+        if (rules.size() != 1)
+        {
+            usageError(STATUS, "You must specify the rule to track.\n");
+        }
+        Rule *rule = rules[0];
+        Path *storage = rule->local.type == FileSystemStorage ? rule->local.storage_location : NULL;
+        auto tracker = newChangeTracker(sys_, origin_tool_->fs(), rule->origin_path, storage);
+        return tracker->track();
+    }
+
+    for (Rule *rule : rules)
+    {
+        Path *storage = rule->local.type == FileSystemStorage ? rule->local.storage_location : NULL;
+        auto tracker = newChangeTracker(sys_, origin_tool_->fs(), rule->origin_path, storage);
+        OriginChanges changes;
+
+        uint64_t start = clockGetTimeMicroSeconds();
+        if (tracker->load(&changes).isOk())
+        {
+            uint64_t stop = clockGetTimeMicroSeconds();
+            info(STATUS, "Changes of %s tracked by %d in %jdms.\n", rule->origin_path->c_str(),
+                 changes.tracker, (stop - start) / 1000);
+        }
+        else
+        {
+            info(STATUS, "Scanning %s...", rule->origin_path->c_str());
+            RC r = tracker->scan(&changes);
+            if (r.isErr()) rc = r;
+            uint64_t stop = clockGetTimeMicroSeconds();
+            info(STATUS, "in %jdms.\n", (stop - start) / 1000);
+            verbose(STATUS, "Run \"beak status --track %s\" to answer instantly.\n", rule->name.c_str());
+        }
+
+        info(STATUS, "mtime=%s ctime=%s\n",
+             timeString(changes.mtim_max).c_str(), timeString(changes.ctim_max).c_str());
+        if (storage == NULL)
+        {
+            info(STATUS, "%zu files (%s) in %zu directories, there is no local storage to compare with.\n",
+                 changes.num_files, humanReadable(changes.size_files).c_str(), changes.dirs.size());
+        }
+        else if (changes.since.tv_sec == 0)
+        {
+            info(STATUS, "%zu files (%s) to back up, there is no backup in %s\n",
+                 changes.num_files, humanReadable(changes.size_files).c_str(), storage->c_str());
+        }
+        else
+        {
+            info(STATUS, "%zu files (%s) in %zu directories changed since the backup %s\n",
+                 changes.num_files, humanReadable(changes.size_files).c_str(), changes.dirs.size(),
+                 timeString(changes.since).c_str());
+        }
+        for (Path *d : changes.dirs)
+        {
+            verbose(STATUS, "    %s\n", d->c_str());
+        }
+
+        // The remote storages are not listed, only their manifests of points in time are read.
+        for (Storage *remote : rule->sortedStorages())
+        {
+            if (remote->type != RCloneStorage && remote->type != RSyncStorage) continue;
+            vector<string> index_files;
+            auto cache = newListingCache(local_fs_, remote->storage_location);
+            if (cache->loadPointsInTime(&index_files).isErr())
+            {
+                info(STATUS, "%s has not been listed yet.\n", remote->storage_location->c_str());
+                continue;
+            }
+            struct timespec most_recent {};
+            for (auto &f : index_files)
+            {
+                TarFileName tfn;
+                if (!tfn.parseFileName(f)) continue;
+                if (tfn.sec > most_recent.tv_sec ||
+                    (tfn.sec == most_recent.tv_sec && tfn.nsec > most_recent.tv_nsec))
+                {
+                    most_recent.tv_sec = tfn.sec;
+                    most_recent.tv_nsec = tfn.nsec;
+                }
+            }
+            if (index_files.size() == 0)
+            {
+                info(STATUS, "%s has no backups.\n", remote->storage_location->c_str());
+            }
+            else
+            {
+                info(STATUS, "%s has %zu points in time, the most recent %s, listed %s ago.\n",
+                     remote->storage_location->c_str(), index_files.size(),
+                     timeString(most_recent).c_str(), humanReadableTime((int)cache->age(), true).c_str());
+            }
+        }
+    }
 
     return rc;
 }
@@ -35,7 +35,7 @@ RC BeakImplementation::store(Settings *settings, Monitor *monitor)
     Storage *storage = settings->to.storage;
     if (storage->type == RCloneStorage ||
         storage->type == RSyncStorage) {
-        storage_fs = storage_tool_->asCachedReadOnlyFS(storage, monitor);
+        storage_fs = storage_tool_->asCachedReadOnlyFS(storage, monitor, false, false);
     }
 
     storage_fs->recurse(Path::lookupRoot(),
@@ -45,11 +45,27 @@ RC BeakImplementation::store(Settings *settings, Monitor *monitor)
     progress->startDisplayOfProgress();
 
     unique_ptr<Backup> backup  = newBackup(origin_tool_->fs());
+    backup->watchForChanges();
 
     // This command scans the origin file system and builds
     // an in memory representation of the backup file system,
     // with tar files,index files and directories.
-    rc = backup->scanFileSystem(&settings->from, settings, progress.get());
+    unique_ptr<SubtreeStore> subtree_store;
+    CompletedSubtree completed;
+    if (settings->stream)
+    {
+        subtree_store = storage_tool_->newSubtreeStore(backup->originFileSystem(), storage, settings, progress.get());
+        if (subtree_store)
+        {
+            completed = [&](unique_ptr<Backup> partial, Path *dir) { subtree_store->add(move(partial), dir); };
+        }
+        else
+        {
+            info(STORE, "Storing while scanning is only done for local storages.\n");
+        }
+    }
+    rc = backup->scanFileSystem(&settings->from, settings, progress.get(), completed);
+    if (subtree_store && subtree_store->finish().isErr()) rc = RC::ERR;
 
     // Now store the beak file system into the selected storage.
     storage_tool_->storeBackupIntoStorage(backup->asFileSystem(),
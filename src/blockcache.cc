@@ -0,0 +1,301 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "blockcache.h"
+
+#include "lock.h"
+#include "log.h"
+
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+static ComponentId BLOCKCACHE = registerLogComponent("blockcache");
+
+using namespace std;
+
+// Read aheads beyond this are dropped, the reader has moved on anyway.
+static const size_t max_queued_readaheads = 64;
+
+typedef pair<Path*,size_t> BlockKey;
+
+struct Block
+{
+    shared_ptr<vector<char>> data;
+    list<BlockKey>::iterator lru;
+};
+
+// How far a file has been read and how many reads in a row followed each other.
+struct Stream
+{
+    off_t next {};
+    int streak {};
+};
+
+// The blocks first to last of a file to read in the background.
+struct ReadAhead
+{
+    Path *file {};
+    size_t first {};
+    size_t last {};
+};
+
+struct BlockCacheImplementation : public BlockCache
+{
+    BlockCacheImplementation(FileSystem *fs, pthread_mutex_t *fs_lock,
+                             size_t block_size, size_t max_blocks, size_t readahead_blocks);
+    ~BlockCacheImplementation();
+
+    ssize_t pread(Path *file, char *buf, size_t size, off_t offset);
+    bool isSequential(Path *file);
+    void readAhead(Path *file, off_t offset, size_t size);
+    void waitForReadAhead();
+
+    size_t numHits() { return hits_; }
+    size_t numMisses() { return misses_; }
+
+    void work();
+
+private:
+
+    // The cached block, or NULL. Must be called with the lock held.
+    shared_ptr<vector<char>> lookup_(BlockKey key);
+    // Read the block from the file system and cache it, NULL if it could not be read.
+    shared_ptr<vector<char>> load_(BlockKey key);
+
+    FileSystem *fs_ {};
+    pthread_mutex_t *fs_lock_ {};
+    size_t block_size_ {};
+    size_t max_blocks_ {};
+    size_t readahead_blocks_ {};
+
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t changed_ = PTHREAD_COND_INITIALIZER;
+    map<BlockKey,Block> blocks_;
+    // The most recently used block first.
+    list<BlockKey> lru_;
+    map<Path*,Stream> streams_;
+    deque<ReadAhead> queue_;
+    // The first block of the queued read aheads.
+    set<BlockKey> queued_;
+    size_t hits_ {};
+    size_t misses_ {};
+
+    // The worker is started by the first read ahead.
+    pthread_t thread_ {};
+    bool running_ {};
+    bool working_ {};
+    bool stop_ {};
+};
+
+static void *blockCacheThread(void *data)
+{
+    ((BlockCacheImplementation*)data)->work();
+    return NULL;
+}
+
+unique_ptr<BlockCache> newBlockCache(ptr<FileSystem> fs, pthread_mutex_t *fs_lock,
+                                     size_t block_size, size_t max_blocks, size_t readahead_blocks)
+{
+    return unique_ptr<BlockCache>(new BlockCacheImplementation(fs, fs_lock, block_size,
+                                                               max_blocks, readahead_blocks));
+}
+
+BlockCacheImplementation::BlockCacheImplementation(FileSystem *fs, pthread_mutex_t *fs_lock,
+                                                   size_t block_size, size_t max_blocks,
+                                                   size_t readahead_blocks)
+    : fs_(fs), fs_lock_(fs_lock), block_size_(block_size), max_blocks_(max_blocks),
+      readahead_blocks_(readahead_blocks)
+{
+}
+
+BlockCacheImplementation::~BlockCacheImplementation()
+{
+    if (!running_) return;
+    LOCK(&lock_);
+    stop_ = true;
+    pthread_cond_broadcast(&changed_);
+    UNLOCK(&lock_);
+    pthread_join(thread_, NULL);
+}
+
+shared_ptr<vector<char>> BlockCacheImplementation::lookup_(BlockKey key)
+{
+    auto i = blocks_.find(key);
+    if (i == blocks_.end()) return NULL;
+    lru_.splice(lru_.begin(), lru_, i->second.lru);
+    return i->second.data;
+}
+
+shared_ptr<vector<char>> BlockCacheImplementation::load_(BlockKey key)
+{
+    shared_ptr<vector<char>> data = make_shared<vector<char>>(block_size_);
+    LOCK(fs_lock_);
+    ssize_t n = fs_->pread(key.first, &(*data)[0], block_size_, key.second*block_size_);
+    UNLOCK(fs_lock_);
+    if (n < 0) return NULL;
+    data->resize(n);
+
+    LOCK(&lock_);
+    if (blocks_.count(key) == 0)
+    {
+        lru_.push_front(key);
+        blocks_[key] = { data, lru_.begin() };
+        while (blocks_.size() > max_blocks_)
+        {
+            blocks_.erase(lru_.back());
+            lru_.pop_back();
+        }
+    }
+    UNLOCK(&lock_);
+    return data;
+}
+
+ssize_t BlockCacheImplementation::pread(Path *file, char *buf, size_t size, off_t offset)
+{
+    LOCK(&lock_);
+    Stream &s = streams_[file];
+    s.streak = (offset == s.next) ? s.streak+1 : 0;
+    s.next = offset+size;
+    bool sequential = s.streak > 0;
+    UNLOCK(&lock_);
+
+    ssize_t n = 0;
+    while (size > 0)
+    {
+        BlockKey key = { file, offset/block_size_ };
+        size_t inside = offset%block_size_;
+        LOCK(&lock_);
+        shared_ptr<vector<char>> data = lookup_(key);
+        if (data) hits_++; else misses_++;
+        UNLOCK(&lock_);
+        if (!data) data = load_(key);
+        if (!data) return n > 0 ? n : -1;
+        if (inside >= data->size()) break;
+
+        size_t len = data->size()-inside;
+        if (len > size) len = size;
+        memcpy(buf, &(*data)[inside], len);
+        n += len;
+        buf += len;
+        offset += len;
+        size -= len;
+        // A short block is the end of the file.
+        if (data->size() < block_size_) break;
+    }
+
+    if (sequential)
+    {
+        readAhead(file, offset, readahead_blocks_*block_size_);
+    }
+    return n;
+}
+
+bool BlockCacheImplementation::isSequential(Path *file)
+{
+    LOCK(&lock_);
+    bool sequential = streams_.count(file) > 0 && streams_[file].streak > 0;
+    UNLOCK(&lock_);
+    return sequential;
+}
+
+void BlockCacheImplementation::readAhead(Path *file, off_t offset, size_t size)
+{
+    if (size == 0) return;
+    ReadAhead ra;
+    ra.file = file;
+    ra.first = offset/block_size_;
+    ra.last = (offset+size-1)/block_size_;
+
+    LOCK(&lock_);
+    // Skip the blocks already cached, the previous read ahead fetched most of them.
+    while (ra.first <= ra.last && blocks_.count({ file, ra.first }) > 0) ra.first++;
+    if (ra.first > ra.last ||
+        queued_.count({ file, ra.first }) > 0 ||
+        queue_.size() >= max_queued_readaheads)
+    {
+        UNLOCK(&lock_);
+        return;
+    }
+    if (!running_)
+    {
+        running_ = pthread_create(&thread_, NULL, blockCacheThread, this) == 0;
+        if (!running_)
+        {
+            UNLOCK(&lock_);
+            return;
+        }
+    }
+    debug(BLOCKCACHE, "read ahead blocks %zu to %zu of %s\n", ra.first, ra.last, file->c_str());
+    queue_.push_back(ra);
+    queued_.insert({ file, ra.first });
+    pthread_cond_broadcast(&changed_);
+    UNLOCK(&lock_);
+}
+
+void BlockCacheImplementation::waitForReadAhead()
+{
+    LOCK(&lock_);
+    while (queue_.size() > 0 || working_)
+    {
+        pthread_cond_wait(&changed_, &lock_);
+    }
+    UNLOCK(&lock_);
+}
+
+void BlockCacheImplementation::work()
+{
+    for (;;)
+    {
+        LOCK(&lock_);
+        while (queue_.size() == 0 && !stop_)
+        {
+            pthread_cond_wait(&changed_, &lock_);
+        }
+        if (stop_)
+        {
+            UNLOCK(&lock_);
+            break;
+        }
+        ReadAhead ra = queue_.front();
+        queue_.pop_front();
+        queued_.erase({ ra.file, ra.first });
+        working_ = true;
+        UNLOCK(&lock_);
+
+        for (size_t b = ra.first; b <= ra.last; ++b)
+        {
+            LOCK(&lock_);
+            bool skip = blocks_.count({ ra.file, b }) > 0;
+            bool stop = stop_;
+            UNLOCK(&lock_);
+            if (stop) break;
+            if (skip) continue;
+            shared_ptr<vector<char>> data = load_({ ra.file, b });
+            if (!data || data->size() < block_size_) break;
+        }
+
+        LOCK(&lock_);
+        working_ = false;
+        pthread_cond_broadcast(&changed_);
+        UNLOCK(&lock_);
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "always.h"
+#include "filesystem.h"
+
+#include <memory>
+#include <pthread.h>
+
+// A cache of the blocks read from the files in a file system, used when the
+// files inside the tars of a backup are read through the mounted restore.
+// The reads of each file are tracked, when a file is read sequentially the
+// following blocks are read ahead by a background thread, so that the next
+// read is served from memory. The least recently used blocks are dropped
+// when the cache is full.
+//
+// The cache is thread safe. The file system is only called with the fs lock
+// held, since the file system of a restore is not thread safe.
+struct BlockCache
+{
+    // Read through the cache, returns the number of bytes read or -1.
+    virtual ssize_t pread(Path *file, char *buf, size_t size, off_t offset) = 0;
+    // The most recent reads of the file followed each other.
+    virtual bool isSequential(Path *file) = 0;
+    // Read the blocks of the range in the background, unless they are cached.
+    // Reading stops at the end of the file.
+    virtual void readAhead(Path *file, off_t offset, size_t size) = 0;
+    // Wait for the queued read aheads to complete.
+    virtual void waitForReadAhead() = 0;
+
+    // The number of blocks found in the cache and read from the file system.
+    virtual size_t numHits() = 0;
+    virtual size_t numMisses() = 0;
+
+    virtual ~BlockCache() = default;
+};
+
+// The fs lock must be recursive if it is held when calling the cache.
+std::unique_ptr<BlockCache> newBlockCache(ptr<FileSystem> fs,
+                                          pthread_mutex_t *fs_lock,
+                                          size_t block_size,
+                                          size_t max_blocks,
+                                          size_t readahead_blocks);
+
+#endif
@@ -0,0 +1,412 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "changetracker.h"
+
+#include "log.h"
+#include "monitor.h"
+#include "tarfile.h"
+#include "util.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+static ComponentId CHANGES = registerLogComponent("changes");
+
+using namespace std;
+
+// The tracker polls the watch events and rechecks the local storage this often.
+static const int track_interval_secs = 1;
+
+// Set from the signal handler when the tracker process is told to terminate.
+static volatile sig_atomic_t tracker_terminated_ = 0;
+
+static bool isNewer(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+static bool isSame(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+struct Changed
+{
+    size_t size {};
+    bool is_dir {};
+    // The most recent of the mtime and the ctime, in micro seconds.
+    struct timespec tim {};
+};
+
+struct ChangeTrackerImplementation : public ChangeTracker
+{
+    ChangeTrackerImplementation(ptr<System> sys, ptr<FileSystem> fs, Path *origin, Path *local_storage);
+
+    RC load(OriginChanges *changes);
+    RC scan(OriginChanges *changes);
+    RC track();
+
+private:
+
+    struct timespec mostRecentBackup();
+    void addEntry(Path *path, FileStat *st);
+    RC scanBelow(Path *dir, bool watch);
+    void update(Path *path);
+    void forgetBelow(Path *path);
+    void pruneOlderThan(struct timespec since);
+    void collect(OriginChanges *changes);
+    RC save();
+
+    System *sys_ {};
+    FileSystem *fs_ {};
+    Path *origin_ {};
+    Path *storage_ {};
+    // The changes are kept here by the tracker.
+    Path *file_ {};
+
+    struct timespec since_ {};
+    struct timespec mtim_max_ {};
+    struct timespec ctim_max_ {};
+    // The mtime of the local storage dir, it changes when a backup is added or pruned.
+    struct timespec storage_mtim_ {};
+    // The entries modified after since_.
+    map<Path*,Changed> changed_;
+    // The directories that are scanned, and watched by the tracker.
+    set<Path*> known_dirs_;
+};
+
+unique_ptr<ChangeTracker> newChangeTracker(ptr<System> sys, ptr<FileSystem> fs, Path *origin, Path *local_storage)
+{
+    return unique_ptr<ChangeTracker>(new ChangeTrackerImplementation(sys, fs, origin, local_storage));
+}
+
+ChangeTrackerImplementation::ChangeTrackerImplementation(ptr<System> sys, ptr<FileSystem> fs,
+                                                         Path *origin, Path *local_storage)
+    : sys_(sys), fs_(fs), origin_(origin), storage_(local_storage)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "changes_%08x", hashString(origin->str()));
+    file_ = beakSharedDir(sys, fs)->append(name);
+}
+
+struct timespec ChangeTrackerImplementation::mostRecentBackup()
+{
+    struct timespec most_recent {};
+    if (storage_ == NULL) return most_recent;
+
+    FileStat st;
+    if (fs_->stat(storage_, &st).isOk()) storage_mtim_ = st.st_mtim;
+    vector<Path*> contents;
+    if (!fs_->readdir(storage_, &contents)) return most_recent;
+    for (auto f : contents)
+    {
+        TarFileName tfn;
+        if (!tfn.parseFileName(f->str()) || !tfn.isIndexFile()) continue;
+        struct timespec ts {};
+        ts.tv_sec = tfn.sec;
+        ts.tv_nsec = tfn.nsec;
+        if (isNewer(ts, most_recent)) most_recent = ts;
+    }
+    return most_recent;
+}
+
+void ChangeTrackerImplementation::addEntry(Path *path, FileStat *st)
+{
+    if (isNewer(st->st_mtim, mtim_max_)) mtim_max_ = st->st_mtim;
+    if (isNewer(st->st_ctim, ctim_max_)) ctim_max_ = st->st_ctim;
+    if (st->isDirectory()) known_dirs_.insert(path);
+
+    struct timespec tim = isNewer(st->st_ctim, st->st_mtim) ? st->st_ctim : st->st_mtim;
+    // The point in time of a backup is stored with micro second precision.
+    tim.tv_nsec -= tim.tv_nsec % 1000;
+    if (isNewer(tim, since_))
+    {
+        Changed &c = changed_[path];
+        c.is_dir = st->isDirectory();
+        c.size = c.is_dir ? 0 : st->st_size;
+        c.tim = tim;
+    }
+    else
+    {
+        changed_.erase(path);
+    }
+}
+
+RC ChangeTrackerImplementation::scanBelow(Path *dir, bool watch)
+{
+    RC rc = RC::OK;
+    fs_->recurse(dir, [&](Path *path, FileStat *st)
+                 {
+                     addEntry(path, st);
+                     // The watch is in place before the entries in the directory are scanned.
+                     if (watch && st->isDirectory() && fs_->addWatch(path).isErr()) rc = RC::ERR;
+                     return RecurseContinue;
+                 });
+    return rc;
+}
+
+void ChangeTrackerImplementation::forgetBelow(Path *path)
+{
+    for (auto i = changed_.begin(); i != changed_.end(); )
+    {
+        if (i->first->isBelowOrEqual(path)) i = changed_.erase(i);
+        else ++i;
+    }
+    for (auto i = known_dirs_.begin(); i != known_dirs_.end(); )
+    {
+        if ((*i)->isBelowOrEqual(path)) i = known_dirs_.erase(i);
+        else ++i;
+    }
+}
+
+void ChangeTrackerImplementation::update(Path *path)
+{
+    FileStat st;
+    if (fs_->stat(path, &st).isErr())
+    {
+        forgetBelow(path);
+        return;
+    }
+    if (st.isDirectory() && known_dirs_.count(path) == 0)
+    {
+        // A new or moved in directory, its contents have not been seen.
+        if (scanBelow(path, true).isErr())
+        {
+            verbose(CHANGES, "Could not watch %s\n", path->c_str());
+        }
+        return;
+    }
+    addEntry(path, &st);
+}
+
+void ChangeTrackerImplementation::pruneOlderThan(struct timespec since)
+{
+    for (auto i = changed_.begin(); i != changed_.end(); )
+    {
+        if (!isNewer(i->second.tim, since)) i = changed_.erase(i);
+        else ++i;
+    }
+}
+
+void ChangeTrackerImplementation::collect(OriginChanges *changes)
+{
+    changes->since = since_;
+    changes->mtim_max = mtim_max_;
+    changes->ctim_max = ctim_max_;
+    changes->num_files = 0;
+    changes->size_files = 0;
+    changes->dirs.clear();
+
+    set<Path*> dirs;
+    for (auto &p : changed_)
+    {
+        if (p.second.is_dir)
+        {
+            dirs.insert(p.first);
+        }
+        else
+        {
+            changes->num_files++;
+            changes->size_files += p.second.size;
+            dirs.insert(p.first->parent());
+        }
+    }
+    changes->dirs.insert(changes->dirs.end(), dirs.begin(), dirs.end());
+    sort(changes->dirs.begin(), changes->dirs.end(),
+         [](Path *a, Path *b) { return strcmp(a->c_str(), b->c_str()) < 0; });
+}
+
+RC ChangeTrackerImplementation::save()
+{
+    OriginChanges changes;
+    collect(&changes);
+
+    string s;
+    strprintf(s, "#beak changes 1\npid %d\nsince %jd.%09ld\nmtime %jd.%09ld\nctime %jd.%09ld\nfiles %zu %zu\n",
+              getpid(),
+              (intmax_t)changes.since.tv_sec, changes.since.tv_nsec,
+              (intmax_t)changes.mtim_max.tv_sec, changes.mtim_max.tv_nsec,
+              (intmax_t)changes.ctim_max.tv_sec, changes.ctim_max.tv_nsec,
+              changes.num_files, changes.size_files);
+    s += origin_->str();
+    s += separator_string;
+    for (Path *d : changes.dirs)
+    {
+        s += d->str();
+        s += separator_string;
+    }
+
+    // Replace the file in one step, beak status can read it at any time.
+    vector<char> buf(s.begin(), s.end());
+    Path *tmp = file_->parent()->append(string(".")+file_->name()->str());
+    RC rc = fs_->createFile(tmp, &buf);
+    if (rc.isOk()) rc = fs_->rename(tmp, file_);
+    if (rc.isErr())
+    {
+        warning(CHANGES, "Could not write %s\n", file_->c_str());
+    }
+    return rc;
+}
+
+RC ChangeTrackerImplementation::load(OriginChanges *changes)
+{
+    vector<char> buf;
+    FileStat st;
+    if (fs_->stat(file_, &st).isErr()) return RC::ERR;
+    RC rc = fs_->loadVector(file_, 65536, &buf);
+    if (rc.isErr()) return rc;
+
+    auto i = buf.begin();
+    bool eof = false, err = false;
+    string type = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (type != "#beak changes 1")
+    {
+        warning(CHANGES, "Not a proper changes file %s\n", file_->c_str());
+        return RC::ERR;
+    }
+    int pid = 0;
+    long long since_sec, mtime_sec, ctime_sec;
+    long since_nsec, mtime_nsec, ctime_nsec;
+    unsigned long long num_files, size_files;
+    string line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (sscanf(line.c_str(), "pid %d", &pid) != 1) return RC::ERR;
+    line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (sscanf(line.c_str(), "since %lld.%ld", &since_sec, &since_nsec) != 2) return RC::ERR;
+    line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (sscanf(line.c_str(), "mtime %lld.%ld", &mtime_sec, &mtime_nsec) != 2) return RC::ERR;
+    line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (sscanf(line.c_str(), "ctime %lld.%ld", &ctime_sec, &ctime_nsec) != 2) return RC::ERR;
+    line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (sscanf(line.c_str(), "files %llu %llu", &num_files, &size_files) != 2) return RC::ERR;
+    string origin = eatTo(buf, i, separator, 4096, &eof, &err);
+    if (err || origin != origin_->str()) return RC::ERR;
+
+    // The changes are only kept up to date while the tracker runs.
+    if (pid <= 0 || !sys_->processExists(pid))
+    {
+        debug(CHANGES, "tracker %d of %s is not running\n", pid, origin_->c_str());
+        return RC::ERR;
+    }
+
+    changes->tracker = pid;
+    changes->since.tv_sec = since_sec;
+    changes->since.tv_nsec = since_nsec;
+    changes->mtim_max.tv_sec = mtime_sec;
+    changes->mtim_max.tv_nsec = mtime_nsec;
+    changes->ctim_max.tv_sec = ctime_sec;
+    changes->ctim_max.tv_nsec = ctime_nsec;
+    changes->num_files = num_files;
+    changes->size_files = size_files;
+    changes->dirs.clear();
+    while (!eof)
+    {
+        string dir = eatTo(buf, i, separator, 4096, &eof, &err);
+        if (err || dir.length() == 0) break;
+        changes->dirs.push_back(Path::lookup(dir));
+    }
+    return RC::OK;
+}
+
+RC ChangeTrackerImplementation::scan(OriginChanges *changes)
+{
+    since_ = mostRecentBackup();
+    RC rc = scanBelow(origin_, false);
+    collect(changes);
+    changes->tracker = 0;
+    return rc;
+}
+
+RC ChangeTrackerImplementation::track()
+{
+    if (fs_->enableWatch(origin_).isErr())
+    {
+        warning(CHANGES, "Cannot watch %s for changes.\n", origin_->c_str());
+        return RC::ERR;
+    }
+    info(CHANGES, "Scanning %s...\n", origin_->c_str());
+    since_ = mostRecentBackup();
+    bool ok = scanBelow(origin_, true).isOk();
+    vector<Path*> changed;
+    if (ok) ok = fs_->pollWatch(&changed).isOk();
+    if (!ok)
+    {
+        fs_->endWatch(&changed);
+        warning(CHANGES, "Cannot watch all directories below %s for changes.\n", origin_->c_str());
+        return RC::ERR;
+    }
+    save();
+    info(CHANGES, "Tracking changes of %s\n", origin_->c_str());
+
+    onTerminated("change tracker", []() { tracker_terminated_ = 1; });
+
+    while (!tracker_terminated_)
+    {
+        sleep(track_interval_secs);
+        bool modified = false;
+        changed.clear();
+        if (fs_->pollWatch(&changed).isErr())
+        {
+            verbose(CHANGES, "Changes to %s might have been missed, scanning again.\n", origin_->c_str());
+            changed_.clear();
+            known_dirs_.clear();
+            changed.clear();
+            if (scanBelow(origin_, true).isErr() || fs_->pollWatch(&changed).isErr())
+            {
+                fs_->endWatch(&changed);
+                warning(CHANGES, "Cannot watch all directories below %s for changes.\n", origin_->c_str());
+                return RC::ERR;
+            }
+            modified = true;
+        }
+        for (Path *p : changed)
+        {
+            if (!p->isBelowOrEqual(origin_)) continue;
+            update(p);
+            modified = true;
+        }
+
+        // A store or prune in the local storage moves the point in time to compare with.
+        FileStat st;
+        if (storage_ != NULL && fs_->stat(storage_, &st).isOk() && !isSame(st.st_mtim, storage_mtim_))
+        {
+            struct timespec since = mostRecentBackup();
+            if (isNewer(since_, since))
+            {
+                // Older entries are not remembered, scan them again.
+                since_ = since;
+                scanBelow(origin_, false);
+            }
+            else
+            {
+                since_ = since;
+                pruneOlderThan(since_);
+            }
+            debug(CHANGES, "most recent backup is now %jd\n", (intmax_t)since_.tv_sec);
+            modified = true;
+        }
+
+        if (modified) save();
+    }
+    fs_->endWatch(&changed);
+    verbose(CHANGES, "Stopped tracking changes of %s\n", origin_->c_str());
+    return RC::OK;
+}
@@ -0,0 +1,69 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHANGETRACKER_H
+#define CHANGETRACKER_H
+
+#include "always.h"
+#include "filesystem.h"
+#include "system.h"
+
+#include <memory>
+#include <vector>
+
+// The changes of an origin since its most recent backup in the local storage.
+struct OriginChanges
+{
+    // The point in time of the most recent backup, zero if there is none.
+    struct timespec since {};
+    // The most recent modification and meta data modification in the origin.
+    struct timespec mtim_max {};
+    struct timespec ctim_max {};
+    // The files modified after the most recent backup.
+    size_t num_files {};
+    size_t size_files {};
+    // The directories that are modified, or contain modified files.
+    std::vector<Path*> dirs;
+    // The process that tracks the changes, zero if they were scanned now.
+    pid_t tracker {};
+};
+
+// Finds the changes of an origin, either by recursing the whole origin, or
+// by asking the tracker of the origin. The tracker is a long running beak process
+// that watches the origin and keeps the changes up to date in the shared dir
+// of the beak processes. Thus it can answer beak status in milliseconds,
+// a recurse of a large origin takes minutes.
+struct ChangeTracker
+{
+    // Load the changes kept by the running tracker. Fails if there is no tracker.
+    virtual RC load(OriginChanges *changes) = 0;
+    // Recurse the whole origin to find its changes.
+    virtual RC scan(OriginChanges *changes) = 0;
+    // Become the tracker, watch the origin until the process is terminated.
+    // Fails if the origin cannot be watched.
+    virtual RC track() = 0;
+
+    virtual ~ChangeTracker() = default;
+};
+
+// The local storage is used to find the most recent backup, it can be NULL.
+std::unique_ptr<ChangeTracker> newChangeTracker(ptr<System> sys,
+                                                ptr<FileSystem> fs,
+                                                Path *origin,
+                                                Path *local_storage);
+
+#endif
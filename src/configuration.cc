@@ -17,6 +17,7 @@
 
 #include "beak.h"
 #include "filesystem.h"
+#include "journal.h"
 #include "log.h"
 #include "configuration.h"
 #include "system.h"
@@ -44,6 +45,8 @@ using namespace std;
     X(remote_type,"FileSystemStorage, RCloneStorage or RSyncStorage.")              \
     X(remote_usage,"Always,RoundRobin,IfAvailable,WhenRequested.")                  \
     X(remote_keep,"Keep rule for local storage.")                                   \
+    X(remote_bwlimit,"Bandwidth limit for the storage, e.g. 08:00,512K 18:00,off")  \
+    X(remote_ionice,"NormalIO, LowIO or IdleIO when sending to the storage.")       \
 
 enum RuleKeyWord : short {
 #define X(name,info) name##_key,
@@ -87,6 +90,12 @@ LIST_OF_STORAGE_USAGES
 #undef X
 };
 
+const char *io_priority_names_[] = {
+#define X(name,info) #name,
+LIST_OF_IO_PRIORITIES
+#undef X
+};
+
 // Logging must be enabled with env var BEAK_LOG_configuration since
 // this code runs before command line parsing!
 static ComponentId CONFIGURATION = registerLogComponent("configuration");
@@ -309,6 +318,25 @@ bool ConfigurationImplementation::parseRow(string key, string value,
                 error(CONFIGURATION, "Invalid keep rule \"%s\" at line %d.\n", value.c_str(), line);
             }
             break;
+        case remote_bwlimit_key:
+            if (!(*current_storage)) {
+                error(CONFIGURATION, "Remote must be specified before bandwidth limit, see line %d.\n", line);
+            }
+            if (!(*current_storage)->bwlimit.parse(value)) {
+                error(CONFIGURATION, "Invalid bandwidth limit \"%s\" at line %d.\n", value.c_str(), line);
+            }
+            break;
+        case remote_ionice_key:
+            if (!(*current_storage)) {
+                error(CONFIGURATION, "Remote must be specified before io priority, see line %d.\n", line);
+            }
+            {
+                IOPriority iop {};
+                lookupKeyword(value,IOPriority,io_priority_names_,iop,ok);
+                if (!ok) error(CONFIGURATION, "No such io priority \"%s\" at line %d.\n", value.c_str(), line);
+                (*current_storage)->ionice = iop;
+            }
+            break;
         }
         return true;
     }
@@ -400,6 +428,12 @@ bool ConfigurationImplementation::save()
             conf += "remote_type = " + string(storage_type_names_[storage->type]) + "\n";
             conf += "remote_usage = " + string(storage_usage_names_[storage->usage]) + "\n";
             conf += "remote_keep = " + storage->keep.str() + "\n";
+            if (storage->bwlimit.isSet()) {
+                conf += "remote_bwlimit = " + storage->bwlimit.str() + "\n";
+            }
+            if (storage->ionice != NormalIO) {
+                conf += "remote_ionice = " + string(io_priority_names_[storage->ionice]) + "\n";
+            }
         }
     }
     vector<char> buf(conf.begin(), conf.end());
@@ -938,6 +972,78 @@ string Keep::str()
     return s;
 }
 
+bool BandwidthLimit::parse(string s)
+{
+    // Example:    "10M"
+    // Example:    "08:00,512K 18:00,off"
+    slots.clear();
+    vector<char> data(s.begin(), s.end());
+    auto i = data.begin();
+    bool eof = false, err = false;
+
+    while (!eof) {
+        string entry = eatToSkipWhitespace(data, i, ' ', 64, &eof, &err);
+        if (!eof && err) return false;
+        if (entry == "") continue;
+        int minute = 0;
+        string rate = entry;
+        size_t comma = entry.find(',');
+        if (comma != string::npos) {
+            int h, m;
+            char c;
+            if (sscanf(entry.substr(0, comma).c_str(), "%d:%d%c", &h, &m, &c) != 2) return false;
+            if (h < 0 || h > 23 || m < 0 || m > 59) return false;
+            minute = h*60+m;
+            rate = entry.substr(comma+1);
+        }
+        else if (slots.size() > 0) {
+            // Only a timetable can have more than one rate.
+            return false;
+        }
+        size_t bps = 0;
+        if (rate != "off") {
+            if (rate == "" || !isdigit(rate[0])) return false;
+            if (parseHumanReadable(rate, &bps).isErr() || bps == 0) return false;
+        }
+        slots.push_back({minute, bps});
+    }
+    sort(slots.begin(), slots.end());
+    if (slots.size() == 1 && slots[0].second == 0) slots.clear();
+    return true;
+}
+
+string BandwidthLimit::str()
+{
+    string s;
+    for (auto &slot : slots) {
+        string rate = "off";
+        if (slot.second != 0) {
+            if (slot.second % 1024 == 0) rate = to_string(slot.second / 1024)+"K";
+            else rate = to_string(slot.second)+"B";
+        }
+        if (slots.size() == 1 && slot.first == 0) return rate;
+        char hm[16];
+        snprintf(hm, sizeof(hm), "%02d:%02d,", slot.first / 60, slot.first % 60);
+        s += string(hm)+rate+" ";
+    }
+    if (s.size() > 0 && s.back() == ' ') s.pop_back();
+    return s;
+}
+
+size_t BandwidthLimit::bytesPerSecond(time_t now)
+{
+    if (slots.size() == 0) return 0;
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int minute = tm.tm_hour*60+tm.tm_min;
+    // Before the first slot of the day, the last slot of yesterday still applies.
+    size_t bps = slots.back().second;
+    for (auto &slot : slots) {
+        if (slot.first <= minute) bps = slot.second;
+    }
+    return bps;
+}
+
 bool Keep::subsetOf(const Keep &keep) {
     if (all > keep.all) return false;
     if (daily > keep.daily) return false;
@@ -968,6 +1074,12 @@ void ConfigurationImplementation::outputStorage(Storage *s, std::vector<ChoiceEn
     strprintf(msg, "        Keep: %s", s->keep.str().c_str());
     if (!buf) UI::outputln(msg);
     else buf->push_back(ChoiceEntry(msg, [=](){ editRemoteKeep(s); }));
+
+    if (!buf)
+    {
+        if (s->bwlimit.isSet()) UI::outputln("     Bwlimit: "+s->bwlimit.str());
+        if (s->ionice != NormalIO) UI::outputln("      Ionice: "+string(io_priority_names_[s->ionice]));
+    }
 }
 
 bool ConfigurationImplementation::editRemoteTarget(Storage *s)
@@ -1065,7 +1177,9 @@ bool ConfigurationImplementation::isFileSystemStorage(Path *storage_location, Co
     {
         return false;
     }
-    return cmd == importmedia_cmd || has_index_files_or_is_empty_(fs_, storage_location);
+    if (cmd == importmedia_cmd || has_index_files_or_is_empty_(fs_, storage_location)) return true;
+    // The first store into it was interrupted before any index file was written.
+    return newJournal(sys_, fs_, rp)->load().isOk();
 }
 
 bool ConfigurationImplementation::isRCloneStorage(Path *storage_location, string *type)
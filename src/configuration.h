@@ -20,6 +20,7 @@
 
 #include "always.h"
 #include "filesystem.h"
+#include "system.h"
 #include "ui.h"
 
 #include<map>
@@ -71,6 +72,26 @@ struct Keep
     bool equals(Keep& k) { return all==k.all && daily==k.daily && weekly==k.weekly && monthly==k.monthly; }
 };
 
+// Bandwidth limit examples, in the same format as the rclone --bwlimit timetable:
+// 10M
+// 08:00,512K 18:00,off
+// The rate is in bytes per second, without a time the limit applies all day.
+
+struct BandwidthLimit
+{
+    // Minute of the day when the rate starts to apply and the rate in bytes
+    // per second, zero means unlimited. Sorted on minute.
+    std::vector<std::pair<int,size_t>> slots;
+
+    BandwidthLimit() = default;
+    BandwidthLimit(std::string s) { parse(s); }
+    bool parse(std::string s);
+    std::string str();
+    bool isSet() { return slots.size() > 0; }
+    // The limit in bytes per second at this local time, zero means unlimited.
+    size_t bytesPerSecond(time_t now);
+};
+
 #define LIST_OF_STORAGE_TYPES \
     X(NoSuchStorage, "Not a storage")                                   \
     X(FileSystemStorage, "Store to a directory")                         \
@@ -108,6 +129,10 @@ struct Storage
     Path *storage_location {};
     // The keep rule for the storage, default setting is keep everything.
     Keep keep;
+    // Cap the transfers to/from the storage, for example during office hours.
+    BandwidthLimit bwlimit;
+    // The io priority when reading and writing the files sent to the storage.
+    IOPriority ionice {};
 
     Storage() = default;
     Storage(StorageType ty, Path *sl, std::string ke) : type(ty), storage_location(sl), keep(ke) { }
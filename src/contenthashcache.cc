@@ -0,0 +1,213 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "contenthashcache.h"
+
+#include "lock.h"
+#include "log.h"
+#include "util.h"
+
+#include <map>
+#include <pthread.h>
+
+static ComponentId CONTENTHASHCACHE = registerLogComponent("contenthashcache");
+
+using namespace std;
+
+struct CachedHash
+{
+    size_t size {};
+    ino_t ino {};
+    struct timespec mtim {};
+    struct timespec ctim {};
+    vector<char> hash;
+    // Looked up or added since the cache was loaded.
+    bool used {};
+};
+
+struct ContentHashCacheImplementation : public ContentHashCache
+{
+    ContentHashCacheImplementation(ptr<FileSystem> fs, Path *origin);
+
+    RC load();
+    RC save();
+
+    bool lookup(Path *file, FileStat *stat, vector<char> *hash);
+    void add(Path *file, FileStat *stat, vector<char> &hash);
+    void changed(Path *file);
+    size_t numChanged();
+    void remove();
+
+private:
+
+    FileSystem *fs_ {};
+    Path *file_ {};
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    map<Path*,CachedHash> hashes_;
+    size_t num_changed_ {};
+};
+
+unique_ptr<ContentHashCache> newContentHashCache(ptr<FileSystem> fs, Path *origin)
+{
+    return unique_ptr<ContentHashCache>(new ContentHashCacheImplementation(fs, origin));
+}
+
+ContentHashCacheImplementation::ContentHashCacheImplementation(ptr<FileSystem> fs, Path *origin)
+    : fs_(fs)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "contenthashes_%08x", hashString(origin->str()));
+    file_ = cacheDir()->append(name);
+}
+
+static bool sameTime(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+RC ContentHashCacheImplementation::load()
+{
+    vector<char> buf;
+    FileStat st;
+    if (fs_->stat(file_, &st).isErr()) return RC::ERR;
+    RC rc = fs_->loadVector(file_, 65536, &buf);
+    if (rc.isErr()) return rc;
+
+    auto i = buf.begin();
+    bool eof = false, err = false;
+    string type = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (type != "#beak contenthashes 1")
+    {
+        warning(CONTENTHASHCACHE, "Not a proper content hash cache %s\n", file_->c_str());
+        return RC::ERR;
+    }
+    size_t num_files = 0;
+    string line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (err || sscanf(line.c_str(), "#files %zu", &num_files) != 1) return RC::ERR;
+
+    LOCK(&lock_);
+    hashes_.clear();
+    for (size_t f = 0; f < num_files; ++f)
+    {
+        line = eatTo(buf, i, separator, 4096, &eof, &err);
+        char hex[65];
+        unsigned long long size, ino;
+        long long msec, csec;
+        long mnsec, cnsec;
+        int n = 0;
+        if (err ||
+            sscanf(line.c_str(), "%64s %llu %llu %lld.%ld %lld.%ld %n",
+                   hex, &size, &ino, &msec, &mnsec, &csec, &cnsec, &n) != 7 || n == 0)
+        {
+            hashes_.clear();
+            UNLOCK(&lock_);
+            return RC::ERR;
+        }
+        CachedHash &c = hashes_[Path::lookup(line.substr(n))];
+        c.size = size;
+        c.ino = ino;
+        c.mtim.tv_sec = msec;
+        c.mtim.tv_nsec = mnsec;
+        c.ctim.tv_sec = csec;
+        c.ctim.tv_nsec = cnsec;
+        hex2bin(hex, &c.hash);
+    }
+    debug(CONTENTHASHCACHE, "loaded %zu hashes from %s\n", hashes_.size(), file_->c_str());
+    UNLOCK(&lock_);
+    return RC::OK;
+}
+
+RC ContentHashCacheImplementation::save()
+{
+    string s;
+    size_t num_files = 0;
+    LOCK(&lock_);
+    for (auto &p : hashes_)
+    {
+        CachedHash &c = p.second;
+        if (!c.used) continue;
+        string entry;
+        strprintf(entry, "%s %zu %ju %jd.%09ld %jd.%09ld %s", toHex(c.hash).c_str(), c.size, (uintmax_t)c.ino,
+                  (intmax_t)c.mtim.tv_sec, c.mtim.tv_nsec, (intmax_t)c.ctim.tv_sec, c.ctim.tv_nsec, p.first->c_str());
+        s += entry+separator_string;
+        num_files++;
+    }
+    UNLOCK(&lock_);
+    s = "#beak contenthashes 1\n#files "+to_string(num_files)+"\n"+s;
+
+    vector<char> buf(s.begin(), s.end());
+    fs_->mkDirpWriteable(file_->parent());
+    RC rc = fs_->createFile(file_, &buf);
+    debug(CONTENTHASHCACHE, "saved %zu hashes to %s\n", num_files, file_->c_str());
+    return rc;
+}
+
+bool ContentHashCacheImplementation::lookup(Path *file, FileStat *stat, vector<char> *hash)
+{
+    bool found = false;
+    LOCK(&lock_);
+    auto i = hashes_.find(file);
+    if (i != hashes_.end() &&
+        i->second.size == (size_t)stat->st_size &&
+        i->second.ino == stat->st_ino &&
+        sameTime(i->second.mtim, stat->st_mtim) &&
+        sameTime(i->second.ctim, stat->st_ctim))
+    {
+        i->second.used = true;
+        *hash = i->second.hash;
+        found = true;
+    }
+    UNLOCK(&lock_);
+    return found;
+}
+
+void ContentHashCacheImplementation::add(Path *file, FileStat *stat, vector<char> &hash)
+{
+    LOCK(&lock_);
+    CachedHash &c = hashes_[file];
+    c.size = stat->st_size;
+    c.ino = stat->st_ino;
+    c.mtim = stat->st_mtim;
+    c.ctim = stat->st_ctim;
+    c.hash = hash;
+    c.used = true;
+    UNLOCK(&lock_);
+}
+
+void ContentHashCacheImplementation::changed(Path *file)
+{
+    LOCK(&lock_);
+    // The hash is never saved, the file is hashed again by the next backup.
+    hashes_.erase(file);
+    num_changed_++;
+    UNLOCK(&lock_);
+    save();
+}
+
+size_t ContentHashCacheImplementation::numChanged()
+{
+    LOCK(&lock_);
+    size_t n = num_changed_;
+    UNLOCK(&lock_);
+    return n;
+}
+
+void ContentHashCacheImplementation::remove()
+{
+    FileStat st;
+    if (fs_->stat(file_, &st).isOk()) fs_->deleteFile(file_);
+}
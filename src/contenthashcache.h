@@ -0,0 +1,58 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTENTHASHCACHE_H
+#define CONTENTHASHCACHE_H
+
+#include "always.h"
+#include "filesystem.h"
+
+#include <memory>
+#include <vector>
+
+// The sha256 of the contents of the files in an origin, persisted in the cache dir.
+// A backup with --contenthash then only has to read the files that changed since
+// the previous backup, the index of the backup must be complete before any tar is
+// written, thus the contents cannot only be hashed while they are stored.
+//
+// A file is unchanged if it has the same size, inode, mtime and ctime. A change
+// that keeps all of them is caught when the contents are hashed again while they
+// are stored, the file is then reported as changed and dropped from the cache.
+// Only the files looked up or added since the cache was loaded are saved,
+// files removed from the origin are thus dropped. The cache is thread safe.
+struct ContentHashCache
+{
+    // Load the cache. Fails if there is none.
+    virtual RC load() = 0;
+    virtual RC save() = 0;
+
+    // The hash of the file, if it has not changed since it was added.
+    virtual bool lookup(Path *file, FileStat *stat, std::vector<char> *hash) = 0;
+    virtual void add(Path *file, FileStat *stat, std::vector<char> &hash) = 0;
+    // The stored contents of the file did not have the hash it was given.
+    virtual void changed(Path *file) = 0;
+    // The number of files reported as changed.
+    virtual size_t numChanged() = 0;
+    // Remove the saved cache.
+    virtual void remove() = 0;
+
+    virtual ~ContentHashCache() = default;
+};
+
+std::unique_ptr<ContentHashCache> newContentHashCache(ptr<FileSystem> fs, Path *origin);
+
+#endif
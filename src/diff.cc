@@ -19,7 +19,9 @@
 
 #include"fileinfo.h"
 #include"log.h"
+#include"restore.h"
 
+#include<algorithm>
 #include<map>
 #include<set>
 #include<utility>
@@ -79,12 +81,40 @@ private:
     bool dir_added_ = false;
 };
 
+// An entry of a dir being diffed, the path is relative to the diffed root.
+struct DiffEntry
+{
+    Path *path {};
+    FileStat stat;
+};
+
+// One of the two file systems being diffed.
+struct DiffSide
+{
+    FileSystem *fs {};
+    // The root dir being diffed, NULL is the root of the file system.
+    Path *root {};
+    // Set when the file system is a point in time.
+    Restore *restore {};
+    PointInTime *point {};
+    // The targets of hard links, looked up when a hard link is compared.
+    map<Path*,FileStat> hard_links;
+
+    Path *fsPath(Path *p)
+    {
+        if (p == NULL) return root ? root : Path::lookupRoot();
+        return root ? p->prepend(root) : p;
+    }
+};
+
 class DiffImplementation : public Diff
 {
 public:
     RC diff(FileSystem *old_fs, Path *old_path,
             FileSystem *curr_fs, Path *curr_path,
             ProgressStatistics *progress);
+    RC diffPoints(Restore *old_restore, Restore *curr_restore,
+                  ProgressStatistics *progress);
 
     void report();
 
@@ -96,15 +126,28 @@ public:
     ~DiffImplementation() = default;
 
 private:
-    map<Path*,FileStat,TarSort> old;
-    map<Path*,FileStat,TarSort> curr;
     map<Path*,DirSummary,TarSort> dirs;
     Atom *dotgit_;
     bool detailed_;
     int depth_;
 
+    DiffSide old_;
+    DiffSide curr_;
+    size_t num_skipped_dirs_ {};
+
     void addStats(Action a, Path *p, FileStat *stat);
     void addToDirSummary(Action a, Path *file_or_dir, FileStat *stat);
+    // The stats are those of the entries, hard links are followed when comparing.
+    void compareFiles(Path *p, FileStat *oldentry, FileStat *newentry);
+
+    // The contents of a dir, dir is relative to the root of the side, NULL is the root.
+    bool sortedDirContents(DiffSide *side, Path *dir, vector<DiffEntry> *contents);
+    FileStat *followHardLink(DiffSide *side, FileStat *stat);
+    // The hex sha256 of the contents stored in the index, empty if there is none.
+    std::string contentHash(DiffSide *side, Path *p, FileStat *stat);
+    // The dir has the same index file in both points in time.
+    bool sameIndex(Path *dir);
+    void diffDirs(vector<DiffEntry> &olds, vector<DiffEntry> &currs);
 
     bool should_hide_(Path *p)
     {
@@ -237,113 +280,181 @@ RC DiffImplementation::diff(FileSystem *old_fs, Path *old_path,
                             FileSystem *curr_fs, Path *curr_path,
                             ProgressStatistics *progress)
 {
-    RC rc = RC::OK;
-    int old_depth = old_path ? old_path->depth() : 0;
-    int curr_depth = curr_path ? curr_path->depth() : 0;
-    Atom *dotbeak = Atom::lookup(".beak");
+    old_.fs = old_fs;
+    old_.root = old_path;
+    curr_.fs = curr_fs;
+    curr_.root = curr_path;
 
-    // Recurse the old file system
-    rc = old_fs->recurse(old_path,
-                         [&](Path *path, FileStat *stat)
-                         {
-                             assert(path->depth() >= old_depth);
-                             if (path->depth() == old_depth) return RecurseContinue;
-                             if (path->name() == dotbeak) {
-                                 // Ignore .beak directories and their contents.
-                                 debug(DIFF, "Skipping in old: \"%s\"\n", path->c_str());
-                                 return RecurseSkipSubTree;
-                             }
-                             Path *p = path->subpath(old_depth);
-                             old[p] = *stat;
-                             if (logLevel() >= DEBUG) {
-                                 string time = timeToString(stat->st_mtim.tv_sec);
-                                 debug(DIFF, "Old %s %zu \"%s\" \n", time.c_str(),
-                                       stat->st_size, p->c_str());
-                             }
-                             return RecurseContinue;
-                         }
-        );
-
-    // Recurse the new file system
-    rc = curr_fs->recurse(curr_path,
-                            [&](Path *path, FileStat *stat)
-                            {
-                                assert(path->depth() >= curr_depth);
-                                if (path->depth() == curr_depth) return RecurseContinue;
-                                if (path->name() == dotbeak) {
-                                    // Ignore .beak directories and their contents.
-                                    debug(DIFF, "Skipping \"%s\"\n", path->c_str());
-                                    return RecurseSkipSubTree;
-                                }
-                                Path *p = path->subpath(curr_depth);
-                                curr[p] = *stat;
-                                if (logLevel() >= DEBUG) {
-                                    string time = timeToString(stat->st_mtim.tv_sec);
-                                    debug(DIFF, "Curr %s %zu \"%s\" \n", time.c_str(),
-                                          stat->st_size, p->c_str());
-                                }
-                                return RecurseContinue;
-                            }
-        );
-
-    for (auto& p : curr)
+    vector<DiffEntry> olds, currs;
+    if (!sortedDirContents(&old_, NULL, &olds))
+    {
+        failure(DIFF, "Could not list \"%s\"\n", old_.fsPath(NULL)->c_str());
+        return RC::ERR;
+    }
+    if (!sortedDirContents(&curr_, NULL, &currs))
     {
-        Path *entry = p.first;
+        failure(DIFF, "Could not list \"%s\"\n", curr_.fsPath(NULL)->c_str());
+        return RC::ERR;
+    }
+    diffDirs(olds, currs);
+    debug(DIFF, "skipped %zu unchanged dirs\n", num_skipped_dirs_);
+    return RC::OK;
+}
+
+RC DiffImplementation::diffPoints(Restore *old_restore, Restore *curr_restore,
+                                  ProgressStatistics *progress)
+{
+    old_.restore = old_restore;
+    old_.point = old_restore->singlePointInTime();
+    curr_.restore = curr_restore;
+    curr_.point = curr_restore->singlePointInTime();
+    assert(old_.point && curr_.point);
 
-        if (old.count(entry) == 1)
+    return diff(old_restore->asFileSystem(), NULL, curr_restore->asFileSystem(), NULL, progress);
+}
+
+void DiffImplementation::compareFiles(Path *p, FileStat *oldentry, FileStat *newentry)
+{
+    FileStat *oldstat = followHardLink(&old_, oldentry);
+    FileStat *newstat = followHardLink(&curr_, newentry);
+    bool size_same = newstat->sameSize(oldstat);
+    bool mtime_same = newstat->sameMTime(oldstat);
+    bool changed = !size_same || !mtime_same;
+    if (size_same)
+    {
+        // A touched file with the same contents has not changed.
+        string old_hash = contentHash(&old_, p, oldentry);
+        string curr_hash = contentHash(&curr_, p, newentry);
+        if (old_hash.length() > 0 && curr_hash.length() > 0)
         {
-            // File exists in curr and old, lets compare the stats.
-            FileStat *newstat = &p.second;
-            FileStat *oldstat = &old[entry];
-            if (newstat->isRegularFile())
-            {
-                if (newstat->hard_link) {
-                    debug(DIFF, "Hard link in new: %s\n", newstat->hard_link->c_str());
-                    if (curr.count(newstat->hard_link) > 0) {
-                        newstat = &old[newstat->hard_link];
-                        debug(DIFF, "Followed new hard link\n");
-                    }
-                }
-                if (oldstat->hard_link) {
-                    debug(DIFF, "Hard link in old: %s\n", oldstat->hard_link->c_str());
-                    if (old.count(oldstat->hard_link) > 0) {
-                        oldstat = &old[oldstat->hard_link];
-                        debug(DIFF, "Followed old hard link\n");
-                    }
-                }
-                bool size_same = newstat->sameSize(oldstat);
-                bool mtime_same = newstat->sameMTime(oldstat);
-                if (!size_same || !mtime_same)
-                {
-                    debug(DIFF, "content diff (%s %s) %s\n",
-                          size_same?"":"size", mtime_same?"":"mtime",
-                          p.first->c_str());
-                    addToDirSummary(Action::Changed, p.first, newstat);
-                }
-                if (!newstat->samePermissions(oldstat))
-                {
-                    debug(DIFF, "permission diff %s\n", p.first->c_str());
-                    addToDirSummary(Action::Permission, p.first, newstat);
-                }
-            }
-        } else {
-            debug(DIFF, "new entry found %s\n", p.first->c_str());
-            addToDirSummary(Action::Added, p.first, &p.second);
+            changed = old_hash != curr_hash;
         }
     }
-
-    for (auto& p : old)
+    if (changed)
     {
-        Path *entry = p.first;
+        debug(DIFF, "content diff (%s %s) %s\n",
+              size_same?"":"size", mtime_same?"":"mtime",
+              p->c_str());
+        addToDirSummary(Action::Changed, p, newstat);
+    }
+    if (!newstat->samePermissions(oldstat))
+    {
+        debug(DIFF, "permission diff %s\n", p->c_str());
+        addToDirSummary(Action::Permission, p, newstat);
+    }
+}
 
-        if (curr.count(entry) == 0)
+bool DiffImplementation::sortedDirContents(DiffSide *side, Path *dir, vector<DiffEntry> *contents)
+{
+    vector<Path*> names;
+    if (!side->fs->readdir(side->fsPath(dir), &names)) return false;
+
+    Atom *dot = Atom::lookup(".");
+    Atom *dotdot = Atom::lookup("..");
+    Atom *dotbeak = Atom::lookup(".beak");
+    for (Path *n : names)
+    {
+        Atom *name = n->name();
+        if (name == dot || name == dotdot) continue;
+        if (name == dotbeak) {
+            // Ignore .beak directories and their contents.
+            debug(DIFF, "Skipping \"%s\"\n", n->c_str());
+            continue;
+        }
+        DiffEntry e;
+        e.path = dir ? dir->appendName(name) : Path::lookup(name->str());
+        if (side->fs->stat(side->fsPath(e.path), &e.stat).isErr())
         {
-            debug(DIFF, "removed entry found %s\n", p.first->c_str());
-            addToDirSummary(Action::Removed, p.first, &p.second);
+            // Removed while being diffed.
+            continue;
         }
+        contents->push_back(e);
     }
+    sort(contents->begin(), contents->end(),
+         [](const DiffEntry &a, const DiffEntry &b) { return TarSort::lessthan(a.path, b.path); });
+    return true;
+}
+
+FileStat *DiffImplementation::followHardLink(DiffSide *side, FileStat *stat)
+{
+    if (!stat->hard_link) return stat;
+    debug(DIFF, "Hard link %s\n", stat->hard_link->c_str());
+    auto i = side->hard_links.find(stat->hard_link);
+    if (i == side->hard_links.end())
+    {
+        FileStat target;
+        if (side->fs->stat(side->fsPath(stat->hard_link), &target).isErr()) return stat;
+        i = side->hard_links.insert({stat->hard_link, target}).first;
+    }
+    return &i->second;
+}
+
+string DiffImplementation::contentHash(DiffSide *side, Path *p, FileStat *stat)
+{
+    if (!side->point) return "";
+    // The contents of hard linked files are hashed in the entry of the target.
+    RestoreEntry *e = side->restore->findEntry(side->point, side->fsPath(stat->hard_link ? stat->hard_link : p));
+    if (!e) return "";
+    return e->content_hash;
+}
+
+bool DiffImplementation::sameIndex(Path *dir)
+{
+    if (!old_.point || !curr_.point) return false;
+    Path *old_gz = old_.point->getGzFile(dir);
+    if (old_gz == NULL || old_gz != curr_.point->getGzFile(dir)) return false;
+    // Hard links into the subtree can be stored in an index further up,
+    // they are not covered by the name of this index.
+    if (old_.restore->hasEntriesAbove(old_.point, dir) ||
+        curr_.restore->hasEntriesAbove(curr_.point, dir)) return false;
+    debug(DIFF, "same index %s for \"%s\"\n", old_gz->c_str(), dir->c_str());
+    return true;
+}
 
-    return rc;
+void DiffImplementation::diffDirs(vector<DiffEntry> &olds, vector<DiffEntry> &currs)
+{
+    // Merge the two sorted dirs. Subdirs are diffed before the next entry,
+    // thus the entries are visited in tar order, ie the order of TarSort.
+    auto o = olds.begin();
+    auto c = currs.begin();
+    while (o != olds.end() || c != currs.end())
+    {
+        DiffEntry *oe = NULL, *ce = NULL;
+        if (c == currs.end() || (o != olds.end() && TarSort::lessthan(o->path, c->path)))
+        {
+            oe = &*o++;
+            debug(DIFF, "removed entry found %s\n", oe->path->c_str());
+            addToDirSummary(Action::Removed, oe->path, &oe->stat);
+        }
+        else if (o == olds.end() || TarSort::lessthan(c->path, o->path))
+        {
+            ce = &*c++;
+            debug(DIFF, "new entry found %s\n", ce->path->c_str());
+            addToDirSummary(Action::Added, ce->path, &ce->stat);
+        }
+        else
+        {
+            oe = &*o++;
+            ce = &*c++;
+            if (ce->stat.isRegularFile())
+            {
+                compareFiles(ce->path, &oe->stat, &ce->stat);
+            }
+            if (oe->stat.isDirectory() && ce->stat.isDirectory() && sameIndex(ce->path))
+            {
+                num_skipped_dirs_++;
+                continue;
+            }
+        }
+        // Only the contents of the current subdir are kept while it is diffed.
+        vector<DiffEntry> old_contents, curr_contents;
+        if (oe && oe->stat.isDirectory()) sortedDirContents(&old_, oe->path, &old_contents);
+        if (ce && ce->stat.isDirectory()) sortedDirContents(&curr_, ce->path, &curr_contents);
+        if (old_contents.size() > 0 || curr_contents.size() > 0)
+        {
+            diffDirs(old_contents, curr_contents);
+        }
+    }
 }
 
 void DiffImplementation::report()
@@ -22,11 +22,20 @@
 #include"beak.h"
 #include"configuration.h"
 
+struct Restore;
+
+// The two file systems are walked side by side, one directory at a time,
+// thus only the contents of the directories being diffed are kept in memory.
 struct Diff
 {
     virtual RC diff(FileSystem *old_fs, Path *old_path,
                     FileSystem *new_fs, Path *new_path,
                     ProgressStatistics *progress) = 0;
+    // Diff the single points in time of two restores. A subtree whose index file
+    // is the same in both points is skipped, since the index file name contains
+    // the hash of the subtree, thus only the changed directories are loaded.
+    virtual RC diffPoints(Restore *old_restore, Restore *curr_restore,
+                          ProgressStatistics *progress) = 0;
     virtual void report() = 0;
 
     virtual ~Diff() = default;
@@ -22,6 +22,7 @@
 
 #include <assert.h>
 #include <map>
+#include <pthread.h>
 
 using namespace std;
 
@@ -54,7 +55,7 @@ struct FileSystemFuseAPIImplementation : FileSystem
     RC mountDaemon(Path *dir, FuseAPI *fuseapi, bool foreground=false, bool debug=false);
     unique_ptr<FuseMount> mount(Path *dir, FuseAPI *fuseapi, bool debug=false);
     RC umount(ptr<FuseMount> fuse_mount);
-    RC enableWatch()
+    RC enableWatch(Path *root)
     {
         return RC::ERR;
     }
@@ -64,9 +65,9 @@ struct FileSystemFuseAPIImplementation : FileSystem
         return RC::ERR;
     }
 
-    int endWatch()
+    RC endWatch(std::vector<Path*> *changed)
     {
-        return 0;
+        return RC::ERR;
     }
     FILE *openAsFILE(Path *f, const char *mode)
     {
@@ -386,19 +387,28 @@ uint32_t hashString(string a)
     return djb_hash(a.c_str(), a.length());
 }
 
+// The atoms and paths are interned from several threads, for example
+// when copying to multiple storages at the same time.
+static pthread_mutex_t interned_atoms_lock = PTHREAD_MUTEX_INITIALIZER;
 static map<string, unique_ptr<Atom>> interned_atoms;
 
 Atom *Atom::lookup(string n)
 {
     assert(n.find('/') == string::npos);
+    pthread_mutex_lock(&interned_atoms_lock);
+    Atom *a;
     auto l = interned_atoms.find(n);
     if (l != interned_atoms.end())
     {
-        return l->second.get();
+        a = l->second.get();
+    }
+    else
+    {
+        a = new Atom(n);
+        interned_atoms[n] = unique_ptr<Atom>(a);
     }
-    Atom *na = new Atom(n);
-    interned_atoms[n] = unique_ptr<Atom>(na);
-    return na;
+    pthread_mutex_unlock(&interned_atoms_lock);
+    return a;
 }
 
 bool Atom::lessthan(Atom *a, Atom *b)
@@ -413,10 +423,19 @@ bool Atom::lessthan(Atom *a, Atom *b)
     return rc < 0;
 }
 
+static pthread_mutex_t interned_paths_lock = PTHREAD_MUTEX_INITIALIZER;
 static map<string, unique_ptr<Path>> interned_paths;
 static Path *interned_root;
 
 Path *Path::lookup(string p)
+{
+    pthread_mutex_lock(&interned_paths_lock);
+    Path *pa = lookup_(p);
+    pthread_mutex_unlock(&interned_paths_lock);
+    return pa;
+}
+
+Path *Path::lookup_(string &p)
 {
     assert(p.back() != '\n' && (p.back() != 0 || p.length() == 0));
 /* #ifdef PLATFORM_WINAPI
@@ -441,7 +460,7 @@ Path *Path::lookup(string p)
     auto s = dirname_(p);
     if (s.second)
     {
-        Path *parent = lookup(s.first);
+        Path *parent = lookup_(s.first);
         Path *np = new Path(parent, Atom::lookup(basename_(p)), p);
         interned_paths[p] = unique_ptr<Path>(np);
         return np;
@@ -622,10 +641,12 @@ bool Path::splitInto(size_t name_len, Path **name, size_t prefix_len, Path **pre
 }
 */
 
+#ifdef PLATFORM_WINAPI
 ssize_t readlink(const char *path, char *dest, size_t len)
 {
     return -1;
 }
+#endif
 
 string permissionString(FileStat *fs)
 {
@@ -854,6 +875,39 @@ bool FileSystem::mkDirpWriteable(Path* path)
     return makeDirHelper(path->c_str());
 }
 
+bool FileSystem::continueFile(Path *file,
+                              FileStat *stat,
+                              off_t offset,
+                              std::function<size_t(off_t offset, char *buffer, size_t len)> cb)
+{
+    return false;
+}
+
+RC FileSystem::rename(Path *from, Path *to)
+{
+    return RC::ERR;
+}
+
+RC FileSystem::syncFileSystem(Path *dir)
+{
+    return RC::ERR;
+}
+
+RC FileSystem::syncDir(Path *dir)
+{
+    return RC::ERR;
+}
+
+RC FileSystem::pollWatch(std::vector<Path*> *changed)
+{
+    return RC::ERR;
+}
+
+RC FileSystem::prefetch(std::vector<Path*> *files)
+{
+    return RC::OK;
+}
+
 RC FileSystem::listFilesBelow(Path *p, std::vector<pair<Path*,FileStat>> *files, SortOrder so)
 {
     int depth = p->depth();
@@ -252,6 +252,7 @@ struct Path
 
     std::deque<Path*> nodes();
     Path *reparent(Path *p);
+    static Path *lookup_(std::string &p);
 };
 
 struct depthFirstSortPath
@@ -324,6 +325,10 @@ struct FileSystem
 {
     virtual bool readdir(Path *p, std::vector<Path*> *vec) = 0;
     virtual ssize_t pread(Path *p, char *buf, size_t size, off_t offset) = 0;
+    // The files will be read soon, a file system caching a remote storage fetches
+    // them all in one go, instead of one at a time when read. Then they can be read
+    // from several threads. Returns ERR if some file could not be fetched.
+    virtual RC prefetch(std::vector<Path*> *files);
     virtual RC recurse(Path *p, std::function<RecurseOption(Path *path, FileStat *stat)> cb) = 0;
     virtual RC recurse(Path *p, std::function<RecurseOption(const char *path, const struct stat *sb)> cb) = 0;
     // List all files below p, sort on CTimeDesc
@@ -351,6 +356,14 @@ struct FileSystem
                             FileStat *stat,
                             std::function<size_t(off_t offset, char *buffer, size_t len)> cb) = 0;
 
+    // Continue writing a partially written file, keep its first offset bytes
+    // and fetch the rest from the callback. Returns false if the file could not be continued,
+    // then it has to be created from the start.
+    virtual bool continueFile(Path *file,
+                              FileStat *stat,
+                              off_t offset,
+                              std::function<size_t(off_t offset, char *buffer, size_t len)> cb);
+
     virtual bool createSymbolicLink(Path *file, FileStat *stat, std::string target) = 0;
     virtual bool createHardLink(Path *file, FileStat *stat, Path *target) = 0;
     virtual bool createFIFO(Path *file, FileStat *stat) = 0;
@@ -358,13 +371,27 @@ struct FileSystem
 
     virtual bool deleteFile(Path *file) = 0;
 
-    // Enable watching of filesystem changes. Used to warn the user
-    // that the filesystem was changed during backup...
-    virtual RC enableWatch() = 0;
-    // Start watching a directory.
+    // Give the file a new name, atomically replacing any file with that name.
+    virtual RC rename(Path *from, Path *to);
+    // Make the contents of all files written into the file system holding dir durable.
+    // One sync of the file system is much cheaper than syncing many files one by one.
+    virtual RC syncFileSystem(Path *dir);
+    // Make the files created, renamed or deleted in the dir durable.
+    virtual RC syncDir(Path *dir);
+
+    // Enable watching of filesystem changes below root. Used to warn the user
+    // that the filesystem was changed during backup, without restating every file.
+    virtual RC enableWatch(Path *root) = 0;
+    // Start watching a directory, call it for every directory below the root.
     virtual RC addWatch(Path *dir) = 0;
-    // Return number of modifications made during watch. Hopefully zero.
-    virtual int endWatch() = 0;
+    // Stop watching and add the changed files and directories to changed.
+    // Returns ERR if changes might have been missed, for example when the event
+    // queue overflowed or a directory could not be watched.
+    virtual RC endWatch(std::vector<Path*> *changed) = 0;
+    // Add the changes since the watch was enabled, or since the previous poll,
+    // to changed and keep watching. Returns ERR if changes might have been missed
+    // since the previous poll.
+    virtual RC pollWatch(std::vector<Path*> *changed);
     // Return a FILE for interaction with librsync.
     virtual FILE *openAsFILE(Path *f, const char *mode) = 0;
 
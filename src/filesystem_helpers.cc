@@ -21,11 +21,13 @@
 
 #include <vector>
 #include <map>
+#include <set>
 
 using namespace std;
 
 static ComponentId CACHE = registerLogComponent("cache");
 static ComponentId MAPFS = registerLogComponent("mapfs");
+static ComponentId STAGING = registerLogComponent("staging");
 
 RC ReadOnlyFileSystem::chmod(Path *p, FileStat *fs)
 {
@@ -93,7 +95,7 @@ bool ReadOnlyFileSystem::deleteFile(Path *path)
     return false;
 }
 
-RC ReadOnlyFileSystem::enableWatch()
+RC ReadOnlyFileSystem::enableWatch(Path *root)
 {
     return RC::ERR;
 }
@@ -103,9 +105,9 @@ RC ReadOnlyFileSystem::addWatch(Path *dir)
     return RC::ERR;
 }
 
-int ReadOnlyFileSystem::endWatch()
+RC ReadOnlyFileSystem::endWatch(std::vector<Path*> *changed)
 {
-    return 0;
+    return RC::ERR;
 }
 
 RC ReadOnlyFileSystem::mountDaemon(Path *dir, FuseAPI *fuseapi, bool foreground, bool debug)
@@ -384,6 +386,38 @@ ssize_t ReadOnlyCacheFileSystemBaseImplementation::pread(Path *p, char *buf, siz
     return cache_fs_->pread(pp, buf, size, offset);
 }
 
+RC ReadOnlyCacheFileSystemBaseImplementation::prefetch(vector<Path*> *files)
+{
+    vector<Path*> missing;
+    for (Path *p : *files)
+    {
+        if (entries_.count(p) == 0)
+        {
+            debug(CACHE, "no such file found in cache index: %s\n", p->c_str());
+            return RC::ERR;
+        }
+        CacheEntry *e = &entries_[p];
+        if (!e->cached) e->cached = e->isCached(cache_fs_, cache_dir_, p);
+        if (!e->cached) missing.push_back(p);
+    }
+    if (missing.size() == 0) return RC::OK;
+
+    debug(CACHE, "prefetching %zu of %zu files\n", missing.size(), files->size());
+    RC rc = fetchFiles(&missing);
+    if (rc.isErr()) return rc;
+    for (Path *p : missing)
+    {
+        CacheEntry *e = &entries_[p];
+        e->cached = e->isCached(cache_fs_, cache_dir_, p);
+        if (!e->cached)
+        {
+            failure(CACHE, "Failed to fetch file: %s\n", p->c_str());
+            rc = RC::ERR;
+        }
+    }
+    return rc;
+}
+
 RecurseOption ReadOnlyCacheFileSystemBaseImplementation::recurse_helper_(Path *p,
                                                                          std::function<RecurseOption(Path *path, FileStat *stat)> cb)
 {
@@ -486,3 +520,133 @@ bool CacheEntry::isCached(FileSystem *cache_fs, Path *cache_dir, Path *f)
           p->c_str());
     return false;
 }
+
+// Staged files are hidden and cannot be mistaken for beak files.
+static const char *staging_prefix = ".";
+static const char *staging_suffix = ".staged";
+
+struct StagedFilesImplementation : public StagedFiles
+{
+    StagedFilesImplementation(FileSystem *fs) : fs_(fs) {}
+    ~StagedFilesImplementation();
+
+    Path *stagingName(Path *file);
+    RC written(Path *file, function<void()> committed);
+    RC commit();
+    void abandon();
+
+private:
+
+    // Commit the files written into dir_.
+    RC commitDir_();
+    // Remove the staged files in dir_ left behind by a crash, but not those in keep.
+    void removeLeftovers_(set<Path*> &keep);
+
+    FileSystem *fs_ {};
+    // The dir of the files waiting to be committed.
+    Path *dir_ {};
+    vector<pair<Path*,function<void()>>> pending_;
+    // A dir was committed with errors since the last call to commit.
+    bool failed_ {};
+};
+
+unique_ptr<StagedFiles> newStagedFiles(FileSystem *fs)
+{
+    return unique_ptr<StagedFiles>(new StagedFilesImplementation(fs));
+}
+
+StagedFilesImplementation::~StagedFilesImplementation()
+{
+    if (commit().isErr())
+    {
+        failure(STAGING, "Could not commit the files written into %s\n", dir_->c_str());
+    }
+}
+
+bool StagedFiles::isStagingName(Path *file)
+{
+    return file->name()->c_str()[0] == staging_prefix[0] && file->endsWith(staging_suffix);
+}
+
+Path *StagedFilesImplementation::stagingName(Path *file)
+{
+    return file->parent()->append(string(staging_prefix)+file->name()->str()+staging_suffix);
+}
+
+RC StagedFilesImplementation::written(Path *file, function<void()> committed)
+{
+    RC rc = RC::OK;
+    if (file->parent() != dir_) rc = commitDir_();
+    dir_ = file->parent();
+    pending_.push_back({file, committed});
+    return rc;
+}
+
+RC StagedFilesImplementation::commit()
+{
+    RC rc = commitDir_();
+    if (failed_) rc = RC::ERR;
+    failed_ = false;
+    return rc;
+}
+
+void StagedFilesImplementation::abandon()
+{
+    if (pending_.size() > 0)
+    {
+        debug(STAGING, "abandoned %zu files in %s\n", pending_.size(), dir_->c_str());
+    }
+    pending_.clear();
+}
+
+RC StagedFilesImplementation::commitDir_()
+{
+    if (pending_.size() == 0) return RC::OK;
+    RC rc = RC::OK;
+    // The contents must be durable before the renames, otherwise a crash
+    // could leave a renamed file without its contents.
+    set<Path*> keep;
+    if (fs_->syncFileSystem(dir_).isErr())
+    {
+        // The staged files are left behind and written again by the next store.
+        failure(STAGING, "Could not sync the file system of %s, the files written there are not committed.\n",
+                dir_->c_str());
+        for (auto &p : pending_) keep.insert(stagingName(p.first));
+        pending_.clear();
+        removeLeftovers_(keep);
+        failed_ = true;
+        return RC::ERR;
+    }
+    for (auto &p : pending_)
+    {
+        if (fs_->rename(stagingName(p.first), p.first).isErr())
+        {
+            // The staged file is left behind and written again by the next store.
+            keep.insert(stagingName(p.first));
+            rc = RC::ERR;
+            continue;
+        }
+        p.second();
+    }
+    fs_->syncDir(dir_);
+    debug(STAGING, "committed %zu files in %s\n", pending_.size(), dir_->c_str());
+    pending_.clear();
+    removeLeftovers_(keep);
+    if (rc.isErr()) failed_ = true;
+    return rc;
+}
+
+void StagedFilesImplementation::removeLeftovers_(set<Path*> &keep)
+{
+    vector<Path*> names;
+    if (!fs_->readdir(dir_, &names)) return;
+    for (Path *n : names)
+    {
+        Path *p = dir_->append(n->str());
+        if (!isStagingName(p) || keep.count(p) > 0) continue;
+        if (fs_->deleteFile(p))
+        {
+            verbose(STAGING, "removed %s left behind by an interrupted job\n", p->c_str());
+        }
+    }
+}
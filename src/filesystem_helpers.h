@@ -45,9 +45,9 @@ struct ReadOnlyFileSystem : FileSystem
     bool createHardLink(Path *path, FileStat *stat, Path *target);
     bool createFIFO(Path *path, FileStat *stat);
     bool deleteFile(Path *file);
-    RC enableWatch();
+    RC enableWatch(Path *root);
     RC addWatch(Path *dir);
-    int endWatch();
+    RC endWatch(std::vector<Path*> *changed);
 
     RC mountDaemon(Path *dir, FuseAPI *fuseapi, bool foreground=false, bool debug=false);
     std::unique_ptr<FuseMount> mount(Path *dir, FuseAPI *fuseapi, bool debug=false);
@@ -121,6 +121,7 @@ struct ReadOnlyCacheFileSystemBaseImplementation : ReadOnlyFileSystem
     // The base provides implementations for the file system api below.
     bool readdir(Path *p, std::vector<Path*> *vec);
     ssize_t pread(Path *p, char *buf, size_t count, off_t offset);
+    RC prefetch(std::vector<Path*> *files);
     RC recurse(Path *root, std::function<RecurseOption(Path *path, FileStat *stat)> cb);
     RC recurse(Path *root, std::function<RecurseOption(const char *path, const struct stat *sb)> cb);
     RC ctimeTouch(Path *p);
@@ -192,5 +193,35 @@ MapFileSystem(FileSystem *origin_fs) :
 // Add filemappings mapfs->addFile(from, to, filestat);
 std::unique_ptr<MapFileSystem> newMapFileSystem(FileSystem *fs);
 
+// Files are written under a staging name and renamed to their proper names
+// when their contents are durable. A crash can leave staged files behind,
+// but never a truncated file under its proper name. The staged files left
+// behind in a dir are removed when the files written into it are committed.
+// Syncing each file is slow, instead the files written into the same dir
+// are committed together, with one sync of the file system and one of the dir,
+// when a file is written into another dir or when commit is called.
+struct StagedFiles
+{
+    // Write the file contents into this name.
+    virtual Path *stagingName(Path *file) = 0;
+    // The file has been written into its staging name. The committed
+    // callback is called when the file has its proper name.
+    // Fails if the files written into the previous dir could not be committed.
+    virtual RC written(Path *file, std::function<void()> committed) = 0;
+    // Commit the files written so far. Fails if any file written since
+    // the last call to commit could not be committed.
+    virtual RC commit() = 0;
+    // Never commit the files written since the dir was last committed, since a
+    // later file failed. They are left behind under their staging names.
+    virtual void abandon() = 0;
+
+    // A staged file is not yet committed, or left behind by a crash.
+    static bool isStagingName(Path *file);
+
+    virtual ~StagedFiles() = default;
+};
+
+std::unique_ptr<StagedFiles> newStagedFiles(FileSystem *fs);
+
 
 #endif
@@ -17,19 +17,24 @@
 
 #include "filesystem.h"
 
+#include "lock.h"
 #include "log.h"
 #include "system.h"
 #include "util.h"
 
 #include <assert.h>
+#include <atomic>
 #include <dirent.h>
 #include <fcntl.h>
 #include <ftw.h>
 #include <grp.h>
 #include <sys/stat.h>
+#include <map>
+#include <pthread.h>
 #include <pwd.h>
+#include <set>
+#include <string.h>
 #include <sys/errno.h>
-//include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -52,6 +57,10 @@
 
 #else
 #include<linux/kdev_t.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/statfs.h>
 
 #define BEAK_SHARED_DIR "/dev/shm"
 #endif
@@ -59,7 +68,7 @@
 using namespace std;
 
 static ComponentId FILESYSTEM = registerLogComponent("filesystem");
-//static ComponentId WATCH = registerLogComponent("watch");
+static ComponentId WATCH = registerLogComponent("watch");
 
 bool FileStat::isRegularFile() { return S_ISREG(st_mode); }
 bool FileStat::isDirectory() { return S_ISDIR(st_mode); }
@@ -131,17 +140,25 @@ struct FileSystemImplementationPosix : FileSystem
     RC createFile(Path *file, std::vector<char> *buf);
     bool createFile(Path *path, FileStat *stat,
                      std::function<size_t(off_t offset, char *buffer, size_t len)> cb);
+    bool continueFile(Path *path, FileStat *stat, off_t offset,
+                      std::function<size_t(off_t offset, char *buffer, size_t len)> cb);
     bool createSymbolicLink(Path *path, FileStat *stat, string target);
     bool createHardLink(Path *path, FileStat *stat, Path *target);
     bool createFIFO(Path *path, FileStat *stat);
     bool readLink(Path *path, string *target);
     bool deleteFile(Path *file);
+    RC rename(Path *from, Path *to);
+    RC syncFileSystem(Path *dir);
+    RC syncDir(Path *dir);
 
-    RC enableWatch();
+    RC enableWatch(Path *root);
     RC addWatch(Path *dir);
-    int endWatch();
+    RC endWatch(vector<Path*> *changed);
+    RC pollWatch(vector<Path*> *changed);
     FILE *openAsFILE(Path *f, const char *mode);
 
+    void readWatchEvents();
+
     FileSystemImplementationPosix(System *sys) : FileSystem("FileSystemImplementationPosix"), sys_(sys)
     {
     }
@@ -152,7 +169,33 @@ private:
 
     System *sys_ {};
     Path *temp_dir_;
-    //int inotify_fd_ {};
+
+    // The inotify or fanotify fd, when watching for changes.
+    int watch_fd_ = -1;
+    bool fanotify_ {};
+    Path *watch_root_ {};
+    // Written to stop the thread reading the events.
+    int watch_stop_[2] = { -1, -1 };
+    pthread_t watch_thread_ {};
+    pthread_mutex_t watch_lock_ = PTHREAD_MUTEX_INITIALIZER;
+    // The inotify watch descriptors of the watched directories.
+    map<int,Path*> watched_dirs_;
+    // The marked file systems, fsid to a directory fd for resolving their file handles.
+    map<uint64_t,int> watch_mounts_;
+    // The resolved fanotify directory handles of the directories in the watched root.
+    map<string,Path*> watch_handles_;
+    // The fanotify directory handles outside of the watched root, the whole file system
+    // is marked. Forgotten when there are too many, they are resolved again when needed.
+    set<string> watch_outside_;
+    set<Path*> watch_changed_;
+    // Changes might have been missed, the queue overflowed or a directory could not be watched.
+    // Set by the thread reading the events as well.
+    std::atomic<bool> watch_missed_ {};
+
+#ifndef OSX64
+    Path *resolveHandle(struct fanotify_event_info_fid *fid);
+    void addWatchEvents(char *buf, ssize_t n, set<Path*> *changed);
+#endif
 };
 
 FileSystem *default_file_system_ {};
@@ -497,6 +540,11 @@ bool FileSystemImplementationPosix::createFile(Path *file,
     while (remaining > 0) {
         size_t read = (remaining > sizeof(buf)) ? sizeof(buf) : remaining;
         size_t len = acquire_bytes(offset, buf, read);
+        if (len == 0) {
+            failure(FILESYSTEM,"Could not get the contents of file %s at %ju\n", file->c_str(), (uintmax_t)offset);
+            close(fd);
+            return false;
+        }
         ssize_t n = write(fd, buf, len);
         if (n == -1) {
             if (errno == EINTR) {
@@ -509,7 +557,59 @@ bool FileSystemImplementationPosix::createFile(Path *file,
 	offset += n;
 	remaining -= n;
     }
-    close(fd);
+    // A failed write can be reported first when the file is closed.
+    if (close(fd) == -1) {
+        failure(FILESYSTEM,"Could not write to file %s errno=%d\n", file->c_str(), errno);
+        return false;
+    }
+    return true;
+}
+
+bool FileSystemImplementationPosix::continueFile(Path *file,
+                                                 FileStat *stat,
+                                                 off_t offset,
+                                                 std::function<size_t(off_t offset, char *buffer, size_t len)>
+                                                 acquire_bytes)
+{
+    char buf[65536];
+    if (offset > stat->st_size) return false;
+    size_t remaining = stat->st_size - offset;
+
+    int fd = open(file->c_str(), O_WRONLY);
+    if (fd == -1) return false;
+    // Drop anything written after the offset, it might be incomplete.
+    if (ftruncate(fd, offset) == -1 || lseek(fd, offset, SEEK_SET) == -1) {
+        close(fd);
+        return false;
+    }
+
+    debug(FILESYSTEM,"continue writing %ju bytes to file %s from %ju\n", remaining, file->c_str(), offset);
+
+    while (remaining > 0) {
+        size_t read = (remaining > sizeof(buf)) ? sizeof(buf) : remaining;
+        size_t len = acquire_bytes(offset, buf, read);
+        if (len == 0) {
+            failure(FILESYSTEM,"Could not get the contents of file %s at %ju\n", file->c_str(), (uintmax_t)offset);
+            close(fd);
+            return false;
+        }
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failure(FILESYSTEM,"Could not write to file %s errno=%d\n", file->c_str(), errno);
+            close(fd);
+            return false;
+        }
+        offset += n;
+        remaining -= n;
+    }
+    // A failed write can be reported first when the file is closed.
+    if (close(fd) == -1) {
+        failure(FILESYSTEM,"Could not write to file %s errno=%d\n", file->c_str(), errno);
+        return false;
+    }
     return true;
 }
 
@@ -560,6 +660,40 @@ bool FileSystemImplementationPosix::deleteFile(Path *file)
     return true;
 }
 
+RC FileSystemImplementationPosix::rename(Path *from, Path *to)
+{
+    int rc = ::rename(from->c_str(), to->c_str());
+    if (rc) {
+        failure(FILESYSTEM, "Could not rename \"%s\" to \"%s\" errno=%d\n", from->c_str(), to->c_str(), errno);
+        return RC::ERR;
+    }
+    return RC::OK;
+}
+
+RC FileSystemImplementationPosix::syncFileSystem(Path *dir)
+{
+#ifdef OSX64
+    // There is no syncfs, sync all file systems.
+    sync();
+    return RC::OK;
+#else
+    int fd = open(dir->c_str(), O_RDONLY);
+    if (fd == -1) return RC::ERR;
+    int rc = syncfs(fd);
+    close(fd);
+    return rc == 0 ? RC::OK : RC::ERR;
+#endif
+}
+
+RC FileSystemImplementationPosix::syncDir(Path *dir)
+{
+    int fd = open(dir->c_str(), O_RDONLY);
+    if (fd == -1) return RC::ERR;
+    int rc = fsync(fd);
+    close(fd);
+    return rc == 0 ? RC::OK : RC::ERR;
+}
+
 void FileSystemImplementationPosix::initTempDir()
 {
     Path *tmp = Path::lookup(BEAK_SHARED_DIR);
@@ -680,23 +814,90 @@ Path *cacheDir()
     return cache_dir_;
 }
 
-RC FileSystemImplementationPosix::enableWatch()
+#ifndef OSX64
+
+static void *watchThread(void *data)
 {
-    /*
-    //inotify_fd_ = inotify_init1(IN_NONBLOCK);
+    ((FileSystemImplementationPosix*)data)->readWatchEvents();
+    return NULL;
+}
 
-    if (inotify_fd_ == -1) {
-        error(FILESYSTEM, "Could not enable inotify watch. errno=%d\n", errno);
+RC FileSystemImplementationPosix::enableWatch(Path *root)
+{
+    watch_root_ = root;
+    watch_changed_.clear();
+    watch_missed_ = false;
+
+    // A filesystem wide fanotify mark sees every change below the root at once,
+    // but it requires privileges. Otherwise every directory gets an inotify watch.
+    watch_fd_ = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+    if (watch_fd_ != -1)
+    {
+        fanotify_ = true;
+        if (addWatch(root).isErr())
+        {
+            close(watch_fd_);
+            watch_fd_ = -1;
+            fanotify_ = false;
+        }
+    }
+    if (watch_fd_ == -1)
+    {
+        watch_fd_ = inotify_init1(IN_NONBLOCK);
+        if (watch_fd_ == -1)
+        {
+            verbose(WATCH, "Could not watch %s for changes. (errno=%d %s)\n", root->c_str(), errno, strerror(errno));
+            return RC::ERR;
+        }
     }
-    */
+    if (pipe(watch_stop_) != 0 || pthread_create(&watch_thread_, NULL, watchThread, this) != 0)
+    {
+        close(watch_fd_);
+        watch_fd_ = -1;
+        return RC::ERR;
+    }
+    debug(WATCH, "watching %s using %s\n", root->c_str(), fanotify_ ? "fanotify" : "inotify");
     return RC::OK;
 }
 
-RC FileSystemImplementationPosix::addWatch(Path *p)
+RC FileSystemImplementationPosix::addWatch(Path *dir)
 {
-    /*
-    if (!inotify_fd_) return RC::OK;
-    int wd = inotify_add_watch(inotify_fd_, p->c_str(),
+    if (watch_fd_ == -1) return RC::ERR;
+
+    if (fanotify_)
+    {
+        // A mark covers the whole file system of the directory, but a subdirectory
+        // can be a mount point of another file system.
+        struct statfs sfs;
+        if (statfs(dir->c_str(), &sfs) != 0) return RC::ERR;
+        uint64_t fsid;
+        memcpy(&fsid, &sfs.f_fsid, sizeof(fsid));
+        LOCK(&watch_lock_);
+        bool marked = watch_mounts_.count(fsid) > 0;
+        UNLOCK(&watch_lock_);
+        if (marked) return RC::OK;
+
+        int rc = fanotify_mark(watch_fd_, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                               FAN_MODIFY | FAN_ATTRIB | FAN_CREATE | FAN_DELETE | FAN_DELETE_SELF |
+                               FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR,
+                               AT_FDCWD, dir->c_str());
+        // The file handles of the events are resolved relative to this directory.
+        int mount_fd = rc == 0 ? open(dir->c_str(), O_RDONLY | O_DIRECTORY) : -1;
+        if (mount_fd == -1)
+        {
+            debug(WATCH, "could not mark file system of %s (errno=%d %s)\n", dir->c_str(), errno, strerror(errno));
+            // Not permitted to mark or resolve, the already watching thread must give up.
+            if (dir != watch_root_) watch_missed_ = true;
+            return RC::ERR;
+        }
+        LOCK(&watch_lock_);
+        watch_mounts_[fsid] = mount_fd;
+        UNLOCK(&watch_lock_);
+        debug(WATCH, "marked file system of %s\n", dir->c_str());
+        return RC::OK;
+    }
+
+    int wd = inotify_add_watch(watch_fd_, dir->c_str(),
                                IN_ATTRIB |
                                IN_CREATE |
                                IN_DELETE |
@@ -704,85 +905,210 @@ RC FileSystemImplementationPosix::addWatch(Path *p)
                                IN_MODIFY |
                                IN_MOVE_SELF |
                                IN_MOVED_FROM |
-                               IN_MOVED_TO);
-
-    debug(WATCH,"added \"%s\"\n", p->c_str());
-    if (wd == -1) {
-        warning(FILESYSTEM, "Could not add watch to \"%s\". (errno=%d %s)\n", p->c_str(), errno, strerror(errno));
-        }*/
+                               IN_MOVED_TO |
+                               IN_ONLYDIR);
+    if (wd == -1)
+    {
+        // Usually the watch limit fs.inotify.max_user_watches is reached.
+        verbose(WATCH, "Could not add watch to \"%s\". (errno=%d %s)\n", dir->c_str(), errno, strerror(errno));
+        watch_missed_ = true;
+        return RC::ERR;
+    }
+    LOCK(&watch_lock_);
+    watched_dirs_[wd] = dir;
+    UNLOCK(&watch_lock_);
     return RC::OK;
 }
 
-//#define LEN_NAME    256
-//#define EVENT_SIZE  sizeof(struct inotify_event)
-//#define BUF_LEN     (EVENT_SIZE + LEN_NAME + 1)
+// The number of directory handles outside of the watched root that are remembered.
+static const size_t max_watch_outside_handles = 65536;
 
-int FileSystemImplementationPosix::endWatch()
+Path *FileSystemImplementationPosix::resolveHandle(struct fanotify_event_info_fid *fid)
 {
-    /*
-    ssize_t n = 0;
-    int rc = ioctl(inotify_fd_, FIONREAD, &n);
-    if (rc) {
-        error(WATCH, "Could not read from inotify fd.\n");
+    struct file_handle *fh = (struct file_handle*)fid->handle;
+    uint64_t fsid;
+    memcpy(&fsid, &fid->fsid, sizeof(fsid));
+    string key((char*)&fsid, sizeof(fsid));
+    key.append((char*)fh, sizeof(*fh)+fh->handle_bytes);
+
+    LOCK(&watch_lock_);
+    auto i = watch_handles_.find(key);
+    Path *dir = i != watch_handles_.end() ? i->second : NULL;
+    bool found = i != watch_handles_.end() || watch_outside_.count(key) > 0;
+    auto m = watch_mounts_.find(fsid);
+    int mount_fd = m != watch_mounts_.end() ? m->second : -1;
+    UNLOCK(&watch_lock_);
+    if (found || mount_fd == -1) return dir;
+
+    // The directory can be gone already, then a change is reported in its parent.
+    int fd = open_by_handle_at(mount_fd, fh, O_PATH);
+    if (fd != -1)
+    {
+        char proc[64];
+        char buf[PATH_MAX+1];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        ssize_t n = readlink(proc, buf, PATH_MAX);
+        if (n > 0)
+        {
+            buf[n] = 0;
+            dir = Path::lookup(buf);
+        }
+        close(fd);
     }
-    if (n == 0) return 0;
-
-    ssize_t i = 0;
-    char buffer[BUF_LEN];
-    n = read(inotify_fd_, buffer, BUF_LEN);
-
-    if (n == -1 && errno != EAGAIN) {
-        perror("read");
-        exit(EXIT_FAILURE);
+    // A directory that is gone is not remembered, its handle is not reused.
+    if (dir == NULL) return NULL;
+    LOCK(&watch_lock_);
+    if (dir->isBelowOrEqual(watch_root_))
+    {
+        watch_handles_[key] = dir;
     }
-    int count = 0;
-
-    if (n<0) {
-        error(WATCH, "Could not read from inotify fd!\n");
+    else
+    {
+        if (watch_outside_.size() >= max_watch_outside_handles) watch_outside_.clear();
+        watch_outside_.insert(key);
+        dir = NULL;
     }
+    UNLOCK(&watch_lock_);
+    return dir;
+}
 
-    while (i<n)
+void FileSystemImplementationPosix::addWatchEvents(char *buf, ssize_t n, set<Path*> *changed)
+{
+    if (fanotify_)
     {
-        struct inotify_event *event = (struct inotify_event*)&buffer[i];
-        if (event->len)
+        struct fanotify_event_metadata *meta = (struct fanotify_event_metadata*)buf;
+        for (; FAN_EVENT_OK(meta, n); meta = FAN_EVENT_NEXT(meta, n))
         {
-            count ++;
-            if (event->mask & IN_CREATE)
+            if (meta->vers != FANOTIFY_METADATA_VERSION || (meta->mask & FAN_Q_OVERFLOW))
             {
-                debug(WATCH, "created %s\n", event->name);
+                watch_missed_ = true;
+                break;
             }
-            if (event->mask & IN_MODIFY)
+            struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid*)(meta+1);
+            if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) continue;
+            struct file_handle *fh = (struct file_handle*)fid->handle;
+            const char *name = (const char*)fh->f_handle + fh->handle_bytes;
+
+            Path *dir = resolveHandle(fid);
+            // Most events belong to other parts of the file system.
+            if (dir == NULL || !dir->isBelowOrEqual(watch_root_)) continue;
+            if (strcmp(name, ".") != 0) changed->insert(dir->append(name));
+            if (meta->mask & (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE_SELF) ||
+                strcmp(name, ".") == 0)
             {
-                debug(WATCH, "modified %s\n", event->name);
-            }
-            if (event->mask & IN_DELETE ||
-                event->mask & IN_DELETE_SELF) {
-                debug(WATCH, "deleted %s\n", event->name);
-            }
-            if (event->mask & IN_ATTRIB) {
-                debug(WATCH, "attributes changed %s\n", event->name);
-            }
-            if (event->mask & IN_MOVE_SELF) {
-                debug(WATCH, "move %s\n", event->name);
+                changed->insert(dir);
             }
-            if (event->mask & IN_MOVED_FROM) {
-                debug(WATCH, "move from %s\n", event->name);
-            }
-            if (event->mask & IN_MOVED_TO) {
-                debug(WATCH, "move to %s\n", event->name);
-            }
-            i += EVENT_SIZE + event->len;
         }
+        return;
     }
 
-    // This happens implicitly below, inotify_rm_watch(...);
-    close(inotify_fd_);
+    for (char *p = buf; p < buf+n; )
+    {
+        struct inotify_event *event = (struct inotify_event*)p;
+        p += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+            watch_missed_ = true;
+            continue;
+        }
+        LOCK(&watch_lock_);
+        auto i = watched_dirs_.find(event->wd);
+        Path *dir = i != watched_dirs_.end() ? i->second : NULL;
+        UNLOCK(&watch_lock_);
+        if (dir == NULL) continue;
+        if (event->len > 0) changed->insert(dir->append(event->name));
+        // Adding or removing an entry changes the directory as well.
+        if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) || event->len == 0)
+        {
+            changed->insert(dir);
+        }
+    }
+}
+
+void FileSystemImplementationPosix::readWatchEvents()
+{
+    // Read the events as they come, to keep the event queue from overflowing.
+    vector<char> buf(65536);
+    for (;;)
+    {
+        struct pollfd fds[2] = { { watch_fd_, POLLIN, 0 }, { watch_stop_[0], POLLIN, 0 } };
+        int rc = poll(fds, 2, -1);
+        if (rc == -1 && errno != EINTR) break;
+        bool stop = fds[1].revents != 0;
+        set<Path*> changed;
+        ssize_t n;
+        while ((n = read(watch_fd_, &buf[0], buf.size())) > 0)
+        {
+            addWatchEvents(&buf[0], n, &changed);
+        }
+        LOCK(&watch_lock_);
+        watch_changed_.insert(changed.begin(), changed.end());
+        UNLOCK(&watch_lock_);
+        if (stop) break;
+    }
+}
+
+RC FileSystemImplementationPosix::pollWatch(vector<Path*> *changed)
+{
+    if (watch_fd_ == -1) return RC::ERR;
+
+    LOCK(&watch_lock_);
+    changed->insert(changed->end(), watch_changed_.begin(), watch_changed_.end());
+    watch_changed_.clear();
+    UNLOCK(&watch_lock_);
+    bool missed = watch_missed_.exchange(false);
+    return missed ? RC::ERR : RC::OK;
+}
+
+RC FileSystemImplementationPosix::endWatch(vector<Path*> *changed)
+{
+    if (watch_fd_ == -1) return RC::ERR;
+
+    // Wake up the thread for a last read of the events.
+    if (write(watch_stop_[1], "", 1) != 1) watch_missed_ = true;
+    pthread_join(watch_thread_, NULL);
+    close(watch_stop_[0]);
+    close(watch_stop_[1]);
+    // This removes the inotify watches and fanotify marks as well.
+    close(watch_fd_);
+    watch_fd_ = -1;
+    for (auto &m : watch_mounts_) close(m.second);
+    watch_mounts_.clear();
+    watch_handles_.clear();
+    watch_outside_.clear();
+    watched_dirs_.clear();
+
+    changed->insert(changed->end(), watch_changed_.begin(), watch_changed_.end());
+    debug(WATCH, "%zu changes below %s%s\n", watch_changed_.size(), watch_root_->c_str(),
+          watch_missed_ ? ", but changes were missed" : "");
+    watch_changed_.clear();
+    return watch_missed_ ? RC::ERR : RC::OK;
+}
+
+#else
+
+RC FileSystemImplementationPosix::enableWatch(Path *root)
+{
+    return RC::ERR;
+}
+
+RC FileSystemImplementationPosix::addWatch(Path *dir)
+{
+    return RC::ERR;
+}
+
+RC FileSystemImplementationPosix::pollWatch(vector<Path*> *changed)
+{
+    return RC::ERR;
+}
 
-    return count;
-    */
-    return 0;
+RC FileSystemImplementationPosix::endWatch(vector<Path*> *changed)
+{
+    return RC::ERR;
 }
 
+#endif
+
 FILE *FileSystemImplementationPosix::openAsFILE(Path *p, const char *mode)
 {
     return fopen(p->c_str(), mode);
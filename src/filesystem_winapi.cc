@@ -115,10 +115,11 @@ struct FileSystemImplementationWinapi : FileSystem
     bool createFIFO(Path *file, FileStat *stat);
     bool readLink(Path *file, string *target);
     bool deleteFile(Path *file);
+    RC rename(Path *from, Path *to);
 
-    RC enableWatch();
+    RC enableWatch(Path *root);
     RC addWatch(Path *dir);
-    int endWatch();
+    RC endWatch(std::vector<Path*> *changed);
     FILE *openAsFILE(Path *p, const char *mode);
 
     FileSystemImplementationWinapi() : FileSystem("FileSystemImplementationWinapi") {}
@@ -429,6 +430,12 @@ bool FileSystemImplementationWinapi::deleteFile(Path *file)
     return false;
 }
 
+RC FileSystemImplementationWinapi::rename(Path *from, Path *to)
+{
+    if (!MoveFileExA(from->c_str(), to->c_str(), MOVEFILE_REPLACE_EXISTING)) return RC::ERR;
+    return RC::OK;
+}
+
 uid_t geteuid()
 {
     return 0;
@@ -477,7 +484,7 @@ Path *cacheDir()
     return cache_dir_;
 }
 
-RC  FileSystemImplementationWinapi::enableWatch()
+RC  FileSystemImplementationWinapi::enableWatch(Path *root)
 {
     return RC::ERR;
 }
@@ -487,9 +494,9 @@ RC  FileSystemImplementationWinapi::addWatch(Path *dir)
     return RC::ERR;
 }
 
-int  FileSystemImplementationWinapi::endWatch()
+RC  FileSystemImplementationWinapi::endWatch(std::vector<Path*> *changed)
 {
-    return 0;
+    return RC::ERR;
 }
 
 FILE *FileSystemImplementationWinapi::openAsFILE(Path *p, const char *mode)
@@ -21,6 +21,7 @@
 #include "index.h"
 #include "filesystem.h"
 #include "log.h"
+#include "sha256.h"
 #include "tarentry.h"
 #include "util.h"
 
@@ -35,7 +36,8 @@ RC Index::loadIndex(vector<char> &v,
                     Path *safedir_to_prepend,
                     size_t *size,
                     function<void(IndexEntry*)> on_entry,
-                    function<void(IndexTar*)> on_tar)
+                    function<void(IndexTar*)> on_tar,
+                    string *config_out)
 {
     vector<char>::iterator ii = i;
 
@@ -110,6 +112,8 @@ RC Index::loadIndex(vector<char> &v,
         }
     }
 
+    if (config_out) *config_out = config;
+
     const char *dtp = "";
     if (dir_to_prepend) dtp = dir_to_prepend->c_str();
     debug(INDEX, "loading gz for %s with %s and %d files prepend \"%s\".\n", dtp, config.c_str(), num_files, dtp);
@@ -123,6 +127,7 @@ RC Index::loadIndex(vector<char> &v,
                                   &ie->num_parts, &ie->part_offset,
                                   &ie->part_size, &ie->last_part_size,
                                   &ie->ondisk_part_size, &ie->ondisk_last_part_size,
+                                  &ie->content_hash,
                                   &eof, &err);
         debug(INDEX, "eatEntry \"%s\" \"%s\"\n", ie->tarr.c_str(), ie->path->c_str());
         if (err) {
@@ -280,13 +285,7 @@ RC Index::loadIndex(vector<char> &v,
 
         string read_hexs = string(hex);
         vector<char> sha256_hash;
-        sha256_hash.resize(SHA256_DIGEST_LENGTH);
-        {
-            SHA256_CTX sha256ctx;
-            SHA256_Init(&sha256ctx);
-            SHA256_Update(&sha256ctx, (unsigned char*)&v[0], endofcontent-v.begin());
-            SHA256_Final((unsigned char*)&sha256_hash[0], &sha256ctx);
-        }
+        sha256(&v[0], endofcontent-v.begin(), &sha256_hash);
         string calc_hexs = toHex(sha256_hash);
         debug(INDEX, "index checksum: %s calculated: %s\n",
               read_hexs.c_str(), calc_hexs.c_str());
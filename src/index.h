@@ -39,6 +39,8 @@ struct IndexEntry {
     size_t last_part_size;
     size_t ondisk_part_size;
     size_t ondisk_last_part_size;
+    // Hex sha256 of the file contents, empty unless the backup was made with --contenthash.
+    std::string content_hash;
 
     size_t contentSize(size_t partnr)
     {
@@ -67,7 +69,8 @@ struct Index {
                          Path *safedir_to_prepend,
                          size_t *size,
                          std::function<void(IndexEntry*)> on_entry,
-                         std::function<void(IndexTar*)> on_tar);
+                         std::function<void(IndexTar*)> on_tar,
+                         std::string *config_out = NULL);
 };
 
 #endif
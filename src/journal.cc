@@ -0,0 +1,304 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "journal.h"
+
+#include "lock.h"
+#include "log.h"
+#include "monitor.h"
+#include "sha256.h"
+#include "util.h"
+
+#include <map>
+#include <memory>
+#include <pthread.h>
+
+static ComponentId JOURNAL = registerLogComponent("journal");
+
+using namespace std;
+
+// The progress of a file being written is journaled every this many bytes.
+static const size_t journal_interval = 16*1024*1024;
+// The prefix of a partially written file is read back in chunks of this size.
+static const size_t verify_chunk = 1024*1024;
+
+struct Written
+{
+    size_t offset {};
+    size_t size {};
+    struct timespec mtim {};
+    // The sha256 in hex of the first offset bytes.
+    string hash;
+};
+
+// A file being written now, hashed as it is written.
+struct Progress
+{
+    size_t hashed {};
+    size_t journaled {};
+    unique_ptr<SHA256Hasher> hasher;
+};
+
+struct JournalImplementation : public Journal
+{
+    JournalImplementation(ptr<System> sys, ptr<FileSystem> fs, Path *destination);
+    ~JournalImplementation();
+
+    RC load();
+
+    void written(Path *file, FileStat *target, size_t offset, const char *data, size_t len);
+    void stored(Path *file, size_t size);
+
+    size_t resumeOffset(Path *file, FileStat *target, FileSystem *fs, Path *partial);
+    void forEachStored(function<void(Path *file, size_t size)> cb);
+
+    void remove();
+
+private:
+
+    void append(string &entry);
+
+    FileSystem *fs_ {};
+    Path *file_ {};
+    FILE *out_ {};
+    // The journal file exists, it is loaded or written.
+    bool exists_ {};
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    // How far the interrupted job got with its files.
+    map<Path*,Written> written_;
+    // The files stored by the interrupted job and this one.
+    map<Path*,size_t> stored_;
+    // How far the files being written now have been hashed and journaled.
+    map<Path*,Progress> progress_;
+};
+
+unique_ptr<Journal> newJournal(ptr<System> sys, ptr<FileSystem> fs, Path *destination)
+{
+    return unique_ptr<Journal>(new JournalImplementation(sys, fs, destination));
+}
+
+JournalImplementation::JournalImplementation(ptr<System> sys, ptr<FileSystem> fs, Path *destination)
+    : fs_(fs)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "journal_%08x", hashString(destination->str()));
+    file_ = beakSharedDir(sys, fs)->append(name);
+}
+
+JournalImplementation::~JournalImplementation()
+{
+    if (out_) fclose(out_);
+}
+
+RC JournalImplementation::load()
+{
+    vector<char> buf;
+    FileStat st;
+    if (fs_->stat(file_, &st).isErr()) return RC::ERR;
+    RC rc = fs_->loadVector(file_, 65536, &buf);
+    if (rc.isErr()) return rc;
+    exists_ = true;
+
+    auto i = buf.begin();
+    bool eof = false, err = false;
+    string type = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (type != "#beak journal 2")
+    {
+        warning(JOURNAL, "Not a proper journal %s\n", file_->c_str());
+        return RC::ERR;
+    }
+    while (!eof)
+    {
+        string entry = eatTo(buf, i, separator, 4096, &eof, &err);
+        // The last entry might have been cut short when the job was interrupted.
+        if (err || (eof && entry.length() == 0)) break;
+        unsigned long long offset, size;
+        long long sec;
+        long nsec;
+        char hash[65];
+        int n = 0;
+        if (sscanf(entry.c_str(), "at %llu %llu %lld.%ld %64s %n", &offset, &size, &sec, &nsec, hash, &n) == 5 &&
+            n > 0)
+        {
+            Written &w = written_[Path::lookup(entry.substr(n))];
+            w.offset = offset;
+            w.size = size;
+            w.mtim.tv_sec = sec;
+            w.mtim.tv_nsec = nsec;
+            w.hash = hash;
+        }
+        else if (sscanf(entry.c_str(), "stored %llu %n", &size, &n) == 1 && n > 0)
+        {
+            Path *p = Path::lookup(entry.substr(n));
+            stored_[p] = size;
+            written_.erase(p);
+        }
+    }
+    debug(JOURNAL, "loaded %zu stored and %zu partially written files from %s\n",
+          stored_.size(), written_.size(), file_->c_str());
+    return RC::OK;
+}
+
+void JournalImplementation::append(string &entry)
+{
+    if (!out_)
+    {
+        FileStat st;
+        bool exists = fs_->stat(file_, &st).isOk();
+        out_ = fs_->openAsFILE(file_, "a");
+        if (!out_)
+        {
+            warning(JOURNAL, "Could not write journal %s\n", file_->c_str());
+            return;
+        }
+        if (!exists) fputs("#beak journal 2\n", out_);
+        exists_ = true;
+    }
+    fwrite(entry.c_str(), 1, entry.length(), out_);
+    // Flush every entry, the journal is read after the process was interrupted.
+    fflush(out_);
+}
+
+void JournalImplementation::written(Path *file, FileStat *target, size_t offset, const char *data, size_t len)
+{
+    // A small file is simply written again.
+    if ((size_t)target->st_size <= journal_interval) return;
+    LOCK(&lock_);
+    Progress &p = progress_[file];
+    if (offset == len)
+    {
+        // The file is written from the start.
+        p.hasher.reset(new SHA256Hasher);
+        p.hashed = 0;
+        p.journaled = 0;
+    }
+    if (!p.hasher || p.hashed != offset-len)
+    {
+        // The bytes did not follow each other, the file cannot be continued from here.
+        p.hasher.reset();
+        UNLOCK(&lock_);
+        return;
+    }
+    p.hasher->update(data, len);
+    p.hashed = offset;
+    if (offset >= (size_t)target->st_size)
+    {
+        // Completely written, nothing more to journal.
+        progress_.erase(file);
+    }
+    else if (offset >= p.journaled + journal_interval)
+    {
+        p.journaled = offset;
+        vector<char> hash;
+        p.hasher->peek(&hash);
+        string entry;
+        strprintf(entry, "at %zu %zu %jd.%09ld %s %s", offset, (size_t)target->st_size,
+                  (intmax_t)target->st_mtim.tv_sec, target->st_mtim.tv_nsec, toHex(hash).c_str(), file->c_str());
+        entry += separator_string;
+        append(entry);
+    }
+    UNLOCK(&lock_);
+}
+
+void JournalImplementation::stored(Path *file, size_t size)
+{
+    string entry;
+    strprintf(entry, "stored %zu %s", size, file->c_str());
+    entry += separator_string;
+    LOCK(&lock_);
+    stored_[file] = size;
+    append(entry);
+    UNLOCK(&lock_);
+}
+
+size_t JournalImplementation::resumeOffset(Path *file, FileStat *target, FileSystem *fs, Path *partial)
+{
+    LOCK(&lock_);
+    Written w;
+    auto i = written_.find(file);
+    if (i != written_.end() &&
+        i->second.size == (size_t)target->st_size &&
+        i->second.mtim.tv_sec == target->st_mtim.tv_sec &&
+        i->second.mtim.tv_nsec == target->st_mtim.tv_nsec)
+    {
+        w = i->second;
+    }
+    UNLOCK(&lock_);
+    FileStat st;
+    if (w.offset == 0 || fs->stat(partial, &st).isErr() || (size_t)st.st_size < w.offset) return 0;
+
+    // Read back what the interrupted job wrote, it must not have been changed since.
+    unique_ptr<SHA256Hasher> hasher(new SHA256Hasher);
+    vector<char> buf(verify_chunk);
+    size_t offset = 0;
+    while (offset < w.offset)
+    {
+        size_t len = w.offset-offset;
+        if (len > verify_chunk) len = verify_chunk;
+        ssize_t n = fs->pread(partial, &buf[0], len, offset);
+        if (n <= 0) return 0;
+        hasher->update(&buf[0], n);
+        offset += n;
+    }
+    vector<char> hash;
+    hasher->peek(&hash);
+    if (toHex(hash) != w.hash)
+    {
+        verbose(JOURNAL, "The partially written %s has changed, it is written from the start.\n", partial->c_str());
+        return 0;
+    }
+
+    // Continue hashing when the rest of the file is written.
+    LOCK(&lock_);
+    Progress &p = progress_[file];
+    p.hasher = std::move(hasher);
+    p.hashed = w.offset;
+    p.journaled = w.offset;
+    UNLOCK(&lock_);
+    return w.offset;
+}
+
+void JournalImplementation::forEachStored(function<void(Path *file, size_t size)> cb)
+{
+    LOCK(&lock_);
+    map<Path*,size_t> stored = stored_;
+    UNLOCK(&lock_);
+    for (auto &p : stored)
+    {
+        cb(p.first, p.second);
+    }
+}
+
+void JournalImplementation::remove()
+{
+    LOCK(&lock_);
+    if (out_)
+    {
+        fclose(out_);
+        out_ = NULL;
+    }
+    written_.clear();
+    stored_.clear();
+    progress_.clear();
+    if (exists_)
+    {
+        fs_->deleteFile(file_);
+        exists_ = false;
+        debug(JOURNAL, "removed %s\n", file_->c_str());
+    }
+    UNLOCK(&lock_);
+}
@@ -0,0 +1,64 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "always.h"
+#include "filesystem.h"
+#include "system.h"
+
+#include <functional>
+#include <memory>
+
+// The journal of a store, copy or restore job into a destination, kept in the
+// shared dir of the beak processes. It records the files completely written
+// and how far the large files got, so that an interrupted job can continue
+// where it stopped. The journal is removed when the job completes.
+//
+// A partially written file is identified by its final size and mtime,
+// if the file to be written is another version it is written from the start.
+// The sha256 of the bytes written so far is journaled as well, a partially
+// written file that was changed afterwards is also written from the start.
+// The journal is appended to while the job runs and is thread safe.
+struct Journal
+{
+    // Load the journal of an earlier interrupted job. Fails if there is none.
+    virtual RC load() = 0;
+
+    // The first offset bytes of the file, that will have the target size and mtime, are written.
+    // The data is the len bytes just before offset, the bytes of a file must be passed in order.
+    virtual void written(Path *file, FileStat *target, size_t offset, const char *data, size_t len) = 0;
+    // The file has been completely written, with this size. Only needed for storages
+    // where it is expensive to find out, a local file is complete when its mtime is set.
+    virtual void stored(Path *file, size_t size) = 0;
+
+    // How many bytes of the file the interrupted job wrote into partial, found in fs.
+    // Zero if none or if partial no longer starts with the bytes that were written.
+    virtual size_t resumeOffset(Path *file, FileStat *target, FileSystem *fs, Path *partial) = 0;
+    // The files the interrupted job, and this job, completely wrote.
+    virtual void forEachStored(std::function<void(Path *file, size_t size)> cb) = 0;
+
+    // The job has completed, forget the journal.
+    virtual void remove() = 0;
+
+    virtual ~Journal() = default;
+};
+
+std::unique_ptr<Journal> newJournal(ptr<System> sys, ptr<FileSystem> fs, Path *destination);
+
+#endif
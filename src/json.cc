@@ -0,0 +1,310 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "json.h"
+
+#include "log.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static ComponentId JSON = registerLogComponent("json");
+
+using namespace std;
+
+Json &Json::operator[](string key)
+{
+    if (type == JsonType::Null) type = JsonType::Object;
+    assert(type == JsonType::Object);
+    return members[key];
+}
+
+string Json::getString(string key, string def)
+{
+    auto i = members.find(key);
+    if (i == members.end() || i->second.type != JsonType::String) return def;
+    return i->second.text;
+}
+
+double Json::getNumber(string key, double def)
+{
+    auto i = members.find(key);
+    if (i == members.end() || i->second.type != JsonType::Number) return def;
+    return i->second.number;
+}
+
+bool Json::getBool(string key, bool def)
+{
+    auto i = members.find(key);
+    if (i == members.end() || i->second.type != JsonType::Bool) return def;
+    return i->second.boolean;
+}
+
+static void quote(const string &s, string *out)
+{
+    out->push_back('"');
+    for (unsigned char c : s)
+    {
+        switch (c) {
+        case '"': out->append("\\\""); break;
+        case '\\': out->append("\\\\"); break;
+        case '\n': out->append("\\n"); break;
+        case '\r': out->append("\\r"); break;
+        case '\t': out->append("\\t"); break;
+        default:
+            if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out->append(buf);
+            } else {
+                out->push_back(c);
+            }
+        }
+    }
+    out->push_back('"');
+}
+
+static void serialize(Json &j, string *out)
+{
+    switch (j.type) {
+    case JsonType::Null: out->append("null"); break;
+    case JsonType::Bool: out->append(j.boolean ? "true" : "false"); break;
+    case JsonType::Number:
+    {
+        char buf[64];
+        if (j.number == floor(j.number) && fabs(j.number) < 1e18) {
+            snprintf(buf, sizeof(buf), "%lld", (long long)j.number);
+        } else {
+            snprintf(buf, sizeof(buf), "%.17g", j.number);
+        }
+        out->append(buf);
+        break;
+    }
+    case JsonType::String: quote(j.text, out); break;
+    case JsonType::Array:
+    {
+        out->push_back('[');
+        bool first = true;
+        for (auto &i : j.items) {
+            if (!first) out->push_back(',');
+            serialize(i, out);
+            first = false;
+        }
+        out->push_back(']');
+        break;
+    }
+    case JsonType::Object:
+    {
+        out->push_back('{');
+        bool first = true;
+        for (auto &m : j.members) {
+            if (!first) out->push_back(',');
+            quote(m.first, out);
+            out->push_back(':');
+            serialize(m.second, out);
+            first = false;
+        }
+        out->push_back('}');
+        break;
+    }
+    }
+}
+
+string Json::serialize()
+{
+    string s;
+    ::serialize(*this, &s);
+    return s;
+}
+
+struct JsonParser
+{
+    const char *p, *end;
+
+    void skipWhitespace()
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    }
+
+    bool literal(const char *lit)
+    {
+        size_t n = strlen(lit);
+        if ((size_t)(end-p) < n || strncmp(p, lit, n)) return false;
+        p += n;
+        return true;
+    }
+
+    static void appendUtf8(unsigned int cp, string *out)
+    {
+        if (cp < 0x80) {
+            out->push_back(cp);
+        } else if (cp < 0x800) {
+            out->push_back(0xc0 | (cp >> 6));
+            out->push_back(0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            out->push_back(0xe0 | (cp >> 12));
+            out->push_back(0x80 | ((cp >> 6) & 0x3f));
+            out->push_back(0x80 | (cp & 0x3f));
+        } else {
+            out->push_back(0xf0 | (cp >> 18));
+            out->push_back(0x80 | ((cp >> 12) & 0x3f));
+            out->push_back(0x80 | ((cp >> 6) & 0x3f));
+            out->push_back(0x80 | (cp & 0x3f));
+        }
+    }
+
+    bool hex4(unsigned int *cp)
+    {
+        if (end-p < 4) return false;
+        char buf[5];
+        memcpy(buf, p, 4);
+        buf[4] = 0;
+        char *e;
+        *cp = strtoul(buf, &e, 16);
+        if (e != buf+4) return false;
+        p += 4;
+        return true;
+    }
+
+    bool parseString(string *out)
+    {
+        if (p >= end || *p != '"') return false;
+        p++;
+        while (p < end && *p != '"')
+        {
+            if (*p != '\\') {
+                out->push_back(*p++);
+                continue;
+            }
+            p++;
+            if (p >= end) return false;
+            char c = *p++;
+            switch (c) {
+            case '"': out->push_back('"'); break;
+            case '\\': out->push_back('\\'); break;
+            case '/': out->push_back('/'); break;
+            case 'b': out->push_back('\b'); break;
+            case 'f': out->push_back('\f'); break;
+            case 'n': out->push_back('\n'); break;
+            case 'r': out->push_back('\r'); break;
+            case 't': out->push_back('\t'); break;
+            case 'u':
+            {
+                unsigned int cp;
+                if (!hex4(&cp)) return false;
+                if (cp >= 0xd800 && cp < 0xdc00 && literal("\\u")) {
+                    // A surrogate pair.
+                    unsigned int low;
+                    if (!hex4(&low)) return false;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                }
+                appendUtf8(cp, out);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        if (p >= end) return false;
+        p++;
+        return true;
+    }
+
+    bool parseValue(Json *out)
+    {
+        skipWhitespace();
+        if (p >= end) return false;
+        switch (*p) {
+        case '{':
+        {
+            *out = Json::object();
+            p++;
+            skipWhitespace();
+            if (p < end && *p == '}') { p++; return true; }
+            for (;;) {
+                skipWhitespace();
+                string key;
+                if (!parseString(&key)) return false;
+                skipWhitespace();
+                if (p >= end || *p != ':') return false;
+                p++;
+                if (!parseValue(&out->members[key])) return false;
+                skipWhitespace();
+                if (p < end && *p == ',') { p++; continue; }
+                if (p < end && *p == '}') { p++; return true; }
+                return false;
+            }
+        }
+        case '[':
+        {
+            *out = Json::array();
+            p++;
+            skipWhitespace();
+            if (p < end && *p == ']') { p++; return true; }
+            for (;;) {
+                out->items.push_back(Json());
+                if (!parseValue(&out->items.back())) return false;
+                skipWhitespace();
+                if (p < end && *p == ',') { p++; continue; }
+                if (p < end && *p == ']') { p++; return true; }
+                return false;
+            }
+        }
+        case '"':
+            *out = Json("");
+            return parseString(&out->text);
+        case 't':
+            *out = Json(true);
+            return literal("true");
+        case 'f':
+            *out = Json(false);
+            return literal("false");
+        case 'n':
+            *out = Json();
+            return literal("null");
+        default:
+        {
+            // Numbers are not null terminated in the buffer, copy them out.
+            const char *s = p;
+            while (p < end && strchr("+-0123456789.eE", *p)) p++;
+            if (s == p) return false;
+            string num(s, p);
+            char *e;
+            double d = strtod(num.c_str(), &e);
+            if (*e != 0) return false;
+            *out = Json(d);
+            return true;
+        }
+        }
+    }
+};
+
+RC parseJson(const char *data, size_t len, Json *out)
+{
+    JsonParser parser { data, data+len };
+    if (!parser.parseValue(out)) {
+        debug(JSON, "parse error at offset %zu\n", (size_t)(parser.p-data));
+        return RC::ERR;
+    }
+    parser.skipWhitespace();
+    if (parser.p != parser.end) {
+        debug(JSON, "trailing data at offset %zu\n", (size_t)(parser.p-data));
+        return RC::ERR;
+    }
+    return RC::OK;
+}
@@ -0,0 +1,65 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JSON_H
+#define JSON_H
+
+#include "always.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+enum class JsonType { Null, Bool, Number, String, Array, Object };
+
+// A minimal json value, enough to talk to services like the rclone remote control api.
+struct Json
+{
+    JsonType type = JsonType::Null;
+    bool boolean {};
+    double number {};
+    std::string text;
+    std::vector<Json> items;
+    std::map<std::string,Json> members;
+
+    Json() = default;
+    Json(bool b) : type(JsonType::Bool), boolean(b) {}
+    Json(int n) : type(JsonType::Number), number(n) {}
+    Json(size_t n) : type(JsonType::Number), number(n) {}
+    Json(double n) : type(JsonType::Number), number(n) {}
+    Json(const char *s) : type(JsonType::String), text(s) {}
+    Json(std::string s) : type(JsonType::String), text(s) {}
+
+    static Json object() { Json j; j.type = JsonType::Object; return j; }
+    static Json array() { Json j; j.type = JsonType::Array; return j; }
+
+    bool isNull() { return type == JsonType::Null; }
+    // Access a member, it is added as null if missing. A null value becomes an object.
+    Json &operator[](std::string key);
+    bool has(std::string key) { return members.count(key) > 0; }
+
+    // Convenience accessors that return the default when the member is missing or of the wrong type.
+    std::string getString(std::string key, std::string def = "");
+    double getNumber(std::string key, double def = 0);
+    bool getBool(std::string key, bool def = false);
+
+    std::string serialize();
+};
+
+RC parseJson(const char *data, size_t len, Json *out);
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "listingcache.h"
+
+#include "log.h"
+#include "tarfile.h"
+#include "util.h"
+
+#include <map>
+
+static ComponentId LISTINGCACHE = registerLogComponent("listingcache");
+
+using namespace std;
+
+struct ListingCacheImplementation : public ListingCache
+{
+    ListingCacheImplementation(ptr<FileSystem> fs, Path *storage_location);
+
+    RC load();
+    RC save();
+    RC loadPointsInTime(vector<string> *index_files);
+    void invalidate();
+
+    uint64_t age();
+    void clear();
+    void add(string file, size_t size);
+    void remove(string file);
+    size_t size() { return files_.size(); }
+    void forEach(function<void(string &file, size_t size)> cb);
+    size_t numDifferences(ListingCache *other);
+
+private:
+
+    FileSystem *fs_ {};
+    Path *file_ {};
+    // The manifest with the points in time.
+    Path *points_file_ {};
+    // The unix time in seconds of the last full listing.
+    uint64_t listed_ {};
+    map<string,size_t> files_;
+};
+
+unique_ptr<ListingCache> newListingCache(ptr<FileSystem> fs, Path *storage_location)
+{
+    return unique_ptr<ListingCache>(new ListingCacheImplementation(fs, storage_location));
+}
+
+ListingCacheImplementation::ListingCacheImplementation(ptr<FileSystem> fs, Path *storage_location)
+    : fs_(fs)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "listing_%08x", hashString(storage_location->str()));
+    file_ = cacheDir()->append(name);
+    snprintf(name, sizeof(name), "points_%08x", hashString(storage_location->str()));
+    points_file_ = cacheDir()->append(name);
+}
+
+static string normalize(string file)
+{
+    // Rclone and rsync list the files without a leading slash.
+    size_t i = file.find_first_not_of('/');
+    if (i == string::npos) return "";
+    return file.substr(i);
+}
+
+RC ListingCacheImplementation::load()
+{
+    vector<char> buf;
+    FileStat st;
+    if (fs_->stat(file_, &st).isErr()) return RC::ERR;
+    RC rc = fs_->loadVector(file_, 65536, &buf);
+    if (rc.isErr()) return rc;
+
+    auto i = buf.begin();
+    bool eof = false, err = false;
+    string type = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (type != "#beak listing 1")
+    {
+        warning(LISTINGCACHE, "Not a proper listing cache %s\n", file_->c_str());
+        return RC::ERR;
+    }
+    unsigned long long listed = 0;
+    size_t num_files = 0;
+    string line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (err || sscanf(line.c_str(), "#listed %llu", &listed) != 1) return RC::ERR;
+    line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (err || sscanf(line.c_str(), "#files %zu", &num_files) != 1) return RC::ERR;
+
+    files_.clear();
+    listed_ = listed;
+    for (size_t f = 0; f < num_files; ++f)
+    {
+        line = eatTo(buf, i, separator, 4096, &eof, &err);
+        size_t sp = line.find(' ');
+        if (err || sp == string::npos) return RC::ERR;
+        files_[line.substr(sp+1)] = atol(line.substr(0, sp).c_str());
+    }
+    debug(LISTINGCACHE, "loaded %zu files listed %llu from %s\n", files_.size(), listed, file_->c_str());
+    return RC::OK;
+}
+
+RC ListingCacheImplementation::save()
+{
+    string s = "#beak listing 1\n";
+    s += "#listed "+to_string(listed_)+"\n";
+    s += "#files "+to_string(files_.size())+"\n";
+    for (auto &f : files_)
+    {
+        s += to_string(f.second)+" "+f.first+separator_string;
+    }
+    vector<char> buf(s.begin(), s.end());
+    fs_->mkDirpWriteable(file_->parent());
+    RC rc = fs_->createFile(file_, &buf);
+    if (rc.isErr()) return rc;
+
+    vector<string> index_files;
+    for (auto &f : files_)
+    {
+        // The index files of the points in time are not inside a directory.
+        if (f.first.find('/') != string::npos) continue;
+        if (!TarFileName::isIndexFile(Path::lookup(f.first))) continue;
+        index_files.push_back(f.first);
+    }
+    s = "#beak points 1\n";
+    s += "#listed "+to_string(listed_)+"\n";
+    s += "#points "+to_string(index_files.size())+"\n";
+    for (auto &f : index_files)
+    {
+        s += f+"\n";
+    }
+    buf.assign(s.begin(), s.end());
+    return fs_->createFile(points_file_, &buf);
+}
+
+RC ListingCacheImplementation::loadPointsInTime(vector<string> *index_files)
+{
+    vector<char> buf;
+    FileStat st;
+    if (fs_->stat(points_file_, &st).isErr()) return RC::ERR;
+    RC rc = fs_->loadVector(points_file_, 65536, &buf);
+    if (rc.isErr()) return rc;
+
+    auto i = buf.begin();
+    bool eof = false, err = false;
+    string type = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (type != "#beak points 1")
+    {
+        warning(LISTINGCACHE, "Not a proper points in time manifest %s\n", points_file_->c_str());
+        return RC::ERR;
+    }
+    unsigned long long listed = 0;
+    size_t num_points = 0;
+    string line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (err || sscanf(line.c_str(), "#listed %llu", &listed) != 1) return RC::ERR;
+    line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (err || sscanf(line.c_str(), "#points %zu", &num_points) != 1) return RC::ERR;
+
+    for (size_t p = 0; p < num_points; ++p)
+    {
+        line = eatTo(buf, i, '\n', 4096, &eof, &err);
+        if (err || line.length() == 0) return RC::ERR;
+        index_files->push_back(line);
+    }
+    listed_ = listed;
+    debug(LISTINGCACHE, "loaded %zu points in time listed %llu from %s\n", num_points, listed, points_file_->c_str());
+    return RC::OK;
+}
+
+void ListingCacheImplementation::invalidate()
+{
+    debug(LISTINGCACHE, "invalidated %s\n", file_->c_str());
+    files_.clear();
+    FileStat st;
+    if (fs_->stat(file_, &st).isOk()) fs_->deleteFile(file_);
+    if (fs_->stat(points_file_, &st).isOk()) fs_->deleteFile(points_file_);
+}
+
+uint64_t ListingCacheImplementation::age()
+{
+    uint64_t now = clockGetUnixTimeNanoSeconds()/1000000000;
+    return now > listed_ ? now - listed_ : 0;
+}
+
+void ListingCacheImplementation::clear()
+{
+    files_.clear();
+    listed_ = clockGetUnixTimeNanoSeconds()/1000000000;
+}
+
+void ListingCacheImplementation::add(string file, size_t size)
+{
+    files_[normalize(file)] = size;
+}
+
+void ListingCacheImplementation::remove(string file)
+{
+    files_.erase(normalize(file));
+}
+
+void ListingCacheImplementation::forEach(function<void(string &file, size_t size)> cb)
+{
+    for (auto &f : files_)
+    {
+        string file = f.first;
+        cb(file, f.second);
+    }
+}
+
+size_t ListingCacheImplementation::numDifferences(ListingCache *other)
+{
+    map<string,size_t> others;
+    other->forEach([&](string &file, size_t size) { others[file] = size; });
+    size_t n = 0;
+    for (auto &f : files_)
+    {
+        auto o = others.find(f.first);
+        if (o == others.end() || o->second != f.second) n++;
+        if (o != others.end()) others.erase(o);
+    }
+    return n + others.size();
+}
@@ -0,0 +1,64 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LISTINGCACHE_H
+#define LISTINGCACHE_H
+
+#include "always.h"
+#include "filesystem.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// A listing of a remote storage (rclone or rsync) persisted in the cache dir.
+// Beak updates the listing with its own uploads and deletes, so the storage only
+// has to be fully listed again when the listing gets too old, when the points in time
+// in the storage are no longer the ones listed, or when fsck relists it.
+// The file names are relative to the storage location, as listed by rclone/rsync.
+//
+// Saving the listing also saves the names of the index files in the root of
+// the storage, ie the points in time, in a small manifest next to the listing.
+// Listing the points in time then does not have to load a listing of millions of files.
+struct ListingCache
+{
+    // Load the cached listing. Fails if there is none.
+    virtual RC load() = 0;
+    virtual RC save() = 0;
+    // Load only the index files in the root of the storage from the manifest.
+    // Fails if there is none. The age is that of the listing it was saved with.
+    virtual RC loadPointsInTime(std::vector<std::string> *index_files) = 0;
+    // Remove the cached listing, the next command will list the storage.
+    virtual void invalidate() = 0;
+
+    // Seconds since the storage was fully listed.
+    virtual uint64_t age() = 0;
+    // Start over with an empty listing from a full listing made now.
+    virtual void clear() = 0;
+    virtual void add(std::string file, size_t size) = 0;
+    virtual void remove(std::string file) = 0;
+    virtual size_t size() = 0;
+    virtual void forEach(std::function<void(std::string &file, size_t size)> cb) = 0;
+    // Count the files that differ (missing, superfluous or with another size) from the other listing.
+    virtual size_t numDifferences(ListingCache *other) = 0;
+
+    virtual ~ListingCache() = default;
+};
+
+std::unique_ptr<ListingCache> newListingCache(ptr<FileSystem> fs, Path *storage_location);
+
+#endif
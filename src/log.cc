@@ -43,7 +43,7 @@ static set<int> log_components_;
 static set<int> trace_components_;
 
 static int num_components_ = 0;
-#define MAX_NUM_COMPONENTS 64
+#define MAX_NUM_COMPONENTS 128
 static const char *all_components_[MAX_NUM_COMPONENTS];
 
 bool verbose_logging_ = false;
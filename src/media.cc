@@ -24,6 +24,7 @@
 #include "log.h"
 #include "storagetool.h"
 #include "media.h"
+#include "sha256.h"
 #include "system.h"
 
 extern "C" {
@@ -45,11 +46,11 @@ struct MediaHelper
     MediaHelper();
     bool exifEntry(Exiv2::ExifData::const_iterator i,
                    struct timespec *ts, struct tm *tm,
-                   Orientation *o, SHA256_CTX *sha256ctx);
+                   Orientation *o, SHA256Hasher *hasher);
     bool iptcEntry(Exiv2::IptcData::const_iterator i,
-                   struct timespec *ts, struct tm *tm, SHA256_CTX *sha256ctx);
+                   struct timespec *ts, struct tm *tm, SHA256Hasher *hasher);
     bool xmpEntry(Exiv2::XmpData::const_iterator i,
-                  struct timespec *ts, struct tm *tm, SHA256_CTX *sha256ctx);
+                  struct timespec *ts, struct tm *tm, SHA256Hasher *hasher);
     bool getExiv2MetaData(Path *p,
                           struct timespec *ts, struct tm *tm,
                           int *width, int *height,
@@ -123,17 +124,17 @@ const char *toString(MediaType mt)
 }
 
 bool MediaHelper::exifEntry(Exiv2::ExifData::const_iterator i,
-                            struct timespec *ts, struct tm *tm, Orientation *o, SHA256_CTX *sha256ctx)
+                            struct timespec *ts, struct tm *tm, Orientation *o, SHA256Hasher *hasher)
 {
     debug(MEDIA,"    %s = %s\n", i->key().c_str(), i->value().toString().c_str());
     // Add the key to the hash.
-    SHA256_Update(sha256ctx, i->key().c_str(), i->key().length());
+    hasher->update(i->key().c_str(), i->key().length());
 
     unsigned char buf[i->value().size()];
     i->value().copy(buf, Exiv2::littleEndian);
 
     // Add the value content to the hash.
-    SHA256_Update(sha256ctx, buf, i->value().size());
+    hasher->update(buf, i->value().size());
 
     // Match both DateTime and DateTimeOriginal
     if (i->key().find("Exif.Image.DateTime") == 0)
@@ -183,17 +184,17 @@ bool MediaHelper::exifEntry(Exiv2::ExifData::const_iterator i,
 }
 
 bool MediaHelper::iptcEntry(Exiv2::IptcData::const_iterator i,
-                            struct timespec *ts, struct tm *tm, SHA256_CTX *sha256ctx)
+                            struct timespec *ts, struct tm *tm, SHA256Hasher *hasher)
 {
     debug(MEDIA,"    %s = %s\n", i->key().c_str(), i->value().toString().c_str());
     // Add the key to the hash.
-    SHA256_Update(sha256ctx, i->key().c_str(), i->key().length());
+    hasher->update(i->key().c_str(), i->key().length());
 
     unsigned char buf[i->value().size()];
     i->value().copy(buf, Exiv2::littleEndian);
 
     // Add the value content to the hash.
-    SHA256_Update(sha256ctx, buf, i->value().size());
+    hasher->update(buf, i->value().size());
 
     // Iptc.Application2.DateCreated = 2017-05-29
     // Iptc.Application2.TimeCreated = 17:19:21-04:00
@@ -229,17 +230,17 @@ bool MediaHelper::iptcEntry(Exiv2::IptcData::const_iterator i,
 }
 
 bool MediaHelper::xmpEntry(Exiv2::XmpData::const_iterator i,
-                           struct timespec *ts, struct tm *tm, SHA256_CTX *sha256ctx)
+                           struct timespec *ts, struct tm *tm, SHA256Hasher *hasher)
 {
     debug(MEDIA,"    %s = %s\n", i->key().c_str(), i->value().toString().c_str());
     // Add the key to the hash.
-    SHA256_Update(sha256ctx, i->key().c_str(), i->key().length());
+    hasher->update(i->key().c_str(), i->key().length());
 
     unsigned char buf[i->value().size()];
     i->value().copy(buf, Exiv2::littleEndian);
 
     // Add the value content to the hash.
-    SHA256_Update(sha256ctx, buf, i->value().size());
+    hasher->update(buf, i->value().size());
 
     // Xmp.xmp.CreateDate = 2017-05-29T17:19:21-04:00
     if (i->key().find("Xmp.xmp.CreateDate") != 0) return false;
@@ -304,14 +305,13 @@ bool MediaHelper::getExiv2MetaData(Path *p,
         Exiv2::XmpData &xmpData = image->xmpData();
         bool xd_found = false;
 
-        SHA256_CTX sha256ctx;
-        SHA256_Init(&sha256ctx);
+        SHA256Hasher hasher;
 
 
         auto end = exifData.end();
         for (auto i = exifData.begin(); i != end; ++i)
         {
-            found_datetime |= exifEntry(i, ts, tm, o, &sha256ctx);
+            found_datetime |= exifEntry(i, ts, tm, o, &hasher);
             if (ed_found == false)
             {
                 meta_data_found = true;
@@ -334,7 +334,7 @@ bool MediaHelper::getExiv2MetaData(Path *p,
         auto iend = iptcData.end();
         for (auto i = iptcData.begin(); i != iend; ++i)
         {
-            found_datetime |= iptcEntry(i, ts, tm, &sha256ctx);
+            found_datetime |= iptcEntry(i, ts, tm, &hasher);
             if (id_found == false)
             {
                 meta_data_found = true;
@@ -346,7 +346,7 @@ bool MediaHelper::getExiv2MetaData(Path *p,
         auto xend = xmpData.end();
         for (auto i = xmpData.begin(); i != xend; ++i)
         {
-            found_datetime |= xmpEntry(i, ts, tm, &sha256ctx);
+            found_datetime |= xmpEntry(i, ts, tm, &hasher);
             if (xd_found == false)
             {
                 meta_data_found = true;
@@ -357,8 +357,7 @@ bool MediaHelper::getExiv2MetaData(Path *p,
 
         if (meta_data_found)
         {
-            hash->resize(SHA256_DIGEST_LENGTH);
-            SHA256_Final((unsigned char*)&(*hash)[0], &sha256ctx);
+            hasher.final(hash);
         }
     }
     catch (std::exception &e)
@@ -444,8 +443,7 @@ bool MediaHelper::getFFMPEGMetaData(Path *p,
     bool found_creation_time = false;
     AVDictionaryEntry *t = NULL;
 
-    SHA256_CTX sha256ctx;
-    SHA256_Init(&sha256ctx);
+    SHA256Hasher hasher;
 
     while ((t = av_dict_get(d, "", t, AV_DICT_IGNORE_SUFFIX)))
     {
@@ -456,8 +454,8 @@ bool MediaHelper::getFFMPEGMetaData(Path *p,
         }
         debug(MEDIA, "    %s = %s\n", t->key, t->value);
         // Add the key value to the hash.
-        SHA256_Update(&sha256ctx, t->key, strlen(t->key));
-        SHA256_Update(&sha256ctx, t->value, strlen(t->value));
+        hasher.update(t->key, strlen(t->key));
+        hasher.update(t->value, strlen(t->value));
 
         if (!strcmp(t->key, "creation_time"))
         {
@@ -524,8 +522,7 @@ bool MediaHelper::getFFMPEGMetaData(Path *p,
         debug(MEDIA, "no creation_time found!\n");
     }
 
-    hash->resize(SHA256_DIGEST_LENGTH);
-    SHA256_Final((unsigned char*)&(*hash)[0], &sha256ctx);
+    hasher.final(hash);
 
     return found_creation_time;
 }
@@ -65,8 +65,10 @@ private:
     FileSystem *fs_ {};
     Path *shared_dir_ {};
     map<int,string> jobs_;
-    // A list of functions to call before redrawing the monitor.
-    vector<function<bool()>> redraws_;
+    // The functions to call before redrawing the monitor, indexed by display id.
+    // Several displays can be active when copying to multiple storages at the same time.
+    map<int,function<bool()>> redraws_;
+    int next_display_id_ {};
     map<pid_t,string> updates_;
     ProgressDisplayType pdt_;
 
@@ -88,36 +90,42 @@ MonitorImplementation::newProgressStatistics(string job)
     return newwProgressStatistics(pdt_, this, job);
 }
 
-void MonitorImplementation::checkSharedDir()
+Path *beakSharedDir(System *sys, FileSystem *fs)
 {
     Path *tmp = Path::lookup(BEAK_SHARED_DIR);
     string shd;
-    strprintf(shd, "beak-%s", sys_->userName().c_str());
-    shared_dir_ = tmp->append(shd);
+    strprintf(shd, "beak-%s", sys->userName().c_str());
+    Path *shared_dir = tmp->append(shd);
     FileStat stat;
-    RC rc = fs_->stat(shared_dir_, &stat);
+    RC rc = fs->stat(shared_dir, &stat);
     if (rc.isErr())
     {
         // Directory does not exist, lets create it.
-        fs_->mkDir(shared_dir_, "", 0700);
+        fs->mkDir(shared_dir, "", 0700);
     }
     else
     {
         // Something is there...
         if (!stat.isDirectory())
         {
-            error(MONITOR, "Expected \"%s\" to be a directory or not exist!\n", shared_dir_->c_str());
+            error(MONITOR, "Expected \"%s\" to be a directory or not exist!\n", shared_dir->c_str());
         }
         if ((stat.st_mode & 0777) != 0700)
         {
-            error(MONITOR, "Expected \"%s\" to be accessible only by you!\n", shared_dir_->c_str());
+            error(MONITOR, "Expected \"%s\" to be accessible only by you!\n", shared_dir->c_str());
         }
         // We ignore group sharing for the moment.
         if (stat.st_uid != geteuid())
         {
-            error(MONITOR, "Expected \"%s\" to owned by you!\n", shared_dir_->c_str());
+            error(MONITOR, "Expected \"%s\" to owned by you!\n", shared_dir->c_str());
         }
     }
+    return shared_dir;
+}
+
+void MonitorImplementation::checkSharedDir()
+{
+    shared_dir_ = beakSharedDir(sys_, fs_);
 }
 
 void MonitorImplementation::updateJob(pid_t pid, string info)
@@ -147,25 +155,31 @@ int MonitorImplementation::startDisplay(function<bool()> progress_cb)
 {
     setbuf(stdout, NULL);
     checkSharedDir();
-    redraws_.push_back(progress_cb);
+    int id;
+    doWhileCallbackBlocked([&]() {
+            id = next_display_id_++;
+            redraws_[id] = progress_cb;
+        });
     if (!regular_)
     {
         regular_ = newRegularThreadCallback(1000, [this](){ return regularDisplay();});
     }
-    return 0;
+    return id;
 }
 
 void MonitorImplementation::stopDisplay(int id)
 {
-    assert(redraws_.size() > 0);
-    redraws_.pop_back();
+    doWhileCallbackBlocked([&]() {
+            assert(redraws_.count(id) == 1);
+            redraws_.erase(id);
+        });
 }
 
 bool MonitorImplementation::regularDisplay()
 {
     for (auto &cb : redraws_)
     {
-        cb();
+        cb.second();
     }
     /*
     RC rc = RC::OK;
@@ -231,7 +245,7 @@ using namespace std;
 struct ProgressStatisticsImplementation : ProgressStatistics
 {
     ProgressStatisticsImplementation(ProgressDisplayType t, MonitorImplementation *m, string job) : pdt_(t), monitor_(m), job_(job), mid_(-1) {}
-    ~ProgressStatisticsImplementation() = default;
+    ~ProgressStatisticsImplementation() { if (mid_ != -1) monitor_->stopDisplay(mid_); }
     void setProgress(string msg);
 
 private:
@@ -395,7 +409,7 @@ void ProgressStatisticsImplementation::finishProgress()
     assert(start_time != 0);
     if (stats.num_files == 0 || stats.num_files_to_store == 0) return;
     updateProgress();
-    redrawLine();
+    monitor_->doWhileCallbackBlocked([this]() { redrawLine(); });
 
     switch (pdt_) {
     case ProgressDisplayType::None:
@@ -406,6 +420,7 @@ void ProgressStatisticsImplementation::finishProgress()
         UI::output(" done.\n");
     }
     monitor_->stopDisplay(mid_);
+    mid_ = -1;
 }
 
 unique_ptr<ProgressStatistics> newwProgressStatistics(ProgressDisplayType t, MonitorImplementation *monitor, std::string job)
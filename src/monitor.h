@@ -91,4 +91,8 @@ struct Monitor
 
 std::unique_ptr<Monitor> newMonitor(System *sys, FileSystem *fs, ProgressDisplayType pdt);
 
+// The directory shared by the beak processes of the user, created if missing.
+// It holds the job updates and the journals of interrupted jobs.
+Path *beakSharedDir(System *sys, FileSystem *fs);
+
 #endif
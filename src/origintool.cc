@@ -17,8 +17,13 @@
 
 #include "origintool.h"
 
+#include "journal.h"
+#include "lock.h"
 #include "log.h"
 #include "system.h"
+#include "threads.h"
+
+#include <set>
 
 static ComponentId ORIGINTOOL = registerLogComponent("origintool");
 
@@ -42,8 +47,20 @@ struct OriginToolImplementation : public OriginTool
                            Settings *settings,
                            ProgressStatistics *st);
 
+    void findTarsToFetch(FileSystem *backup_contents_fs,
+                         Restore *restore,
+                         PointInTime *point,
+                         Settings *settings,
+                         vector<Path*> *tars);
+
     ptr<FileSystem> fs() { return origin_fs_; }
 
+    // The regular files to store, or to update the permissions of.
+    void findFilesToStore(FileSystem *backup_contents_fs,
+                          Restore *restore,
+                          PointInTime *point,
+                          vector<pair<Path*,FileStat*>> *files);
+
     bool extractHardLink(Path *target,
                          Path *dst_root, Path *file_to_extract, FileStat *stat,
                          ptr<ProgressStatistics> statistics);
@@ -83,6 +100,10 @@ struct OriginToolImplementation : public OriginTool
 
     ptr<System> sys_;
     ptr<FileSystem> origin_fs_;
+    // How far the files of an interrupted restore got.
+    unique_ptr<Journal> journal_;
+    // The regular files are written concurrently, they share the statistics.
+    pthread_mutex_t stats_lock_ = PTHREAD_MUTEX_INITIALIZER;
 };
 
 unique_ptr<OriginTool> newOriginTool(ptr<System> sys,
@@ -162,6 +183,18 @@ bool OriginToolImplementation::extractHardLink(Path *target,
     return true;
 }
 
+// The path of a part of the multipart tar holding the entry.
+static Path *tarPart(RestoreEntry *entry, TarFileName &tfn, Path *tar_inside_dir, uint partnr)
+{
+    char name[4096];
+    tfn.part_nr = partnr;
+    tfn.num_parts = entry->num_parts;
+    tfn.size = entry->contentSize(partnr);
+    tfn.ondisk_size = entry->diskSize(partnr);
+    tfn.writeTarFileNameIntoBuffer(name, sizeof(name), tar_inside_dir);
+    return Path::lookup(name);
+}
+
 bool OriginToolImplementation::extractFileFromBackup(RestoreEntry *entry,
                                                      FileSystem *backup_fs, Path *tar_file, off_t tar_file_offset,
                                                      Path *file_to_extract, FileStat *stat,
@@ -189,8 +222,7 @@ bool OriginToolImplementation::extractFileFromBackup(RestoreEntry *entry,
     Path *tar_inside_dir = Path::lookup(d);
 
     origin_fs_->mkDirpWriteable(file_to_extract->parent());
-    origin_fs_->createFile(file_to_extract, stat,
-        [&] (off_t offset, char *buffer, size_t len)
+    auto extract = [&] (off_t offset, char *buffer, size_t len) -> size_t
         {
             if (entry->num_parts == 1) {
                 debug(ORIGINTOOL,"Extracting %ju bytes to file %s\n", len, file_to_extract->c_str());
@@ -204,14 +236,7 @@ bool OriginToolImplementation::extractFileFromBackup(RestoreEntry *entry,
                 ssize_t n =  entry->readParts(offset, buffer, len,
                       [&](uint partnr, off_t offset_inside_part, char *buffer, size_t length_to_read)
                       {
-                          char name[4096];
-                          tfn.size = entry->part_size;
-                          tfn.part_nr = partnr;
-                          tfn.num_parts = entry->num_parts;
-                          tfn.size = entry->contentSize(partnr);
-                          tfn.ondisk_size = entry->diskSize(partnr);
-                          tfn.writeTarFileNameIntoBuffer(name, sizeof(name), tar_inside_dir);
-                          Path *tarf = Path::lookup(name);
+                          Path *tarf = tarPart(entry, tfn, tar_inside_dir, partnr);
                           assert(length_to_read > 0);
                           debug(ORIGINTOOL, "reading %ju bytes from offset %ju in tar part %s\n",
                                 length_to_read, offset_inside_part, tarf->c_str());
@@ -228,14 +253,38 @@ bool OriginToolImplementation::extractFileFromBackup(RestoreEntry *entry,
                 assert(n > 0);
                 return n;
             }
-        });
+        };
+    auto extract_and_journal = [&] (off_t offset, char *buffer, size_t len)
+        {
+            size_t n = extract(offset, buffer, len);
+            journal_->written(file_to_extract, stat, offset+n, buffer, n);
+            return n;
+        };
+
+    bool continued = false;
+    size_t offset = journal_->resumeOffset(file_to_extract, stat, origin_fs_, file_to_extract);
+    if (offset > 0)
+    {
+        // Continue the file where the interrupted restore stopped.
+        continued = origin_fs_->continueFile(file_to_extract, stat, offset, extract_and_journal);
+        if (continued)
+        {
+            verbose(ORIGINTOOL, "Continued %s from %zu\n", file_to_extract->c_str(), offset);
+        }
+    }
+    if (!continued)
+    {
+        origin_fs_->createFile(file_to_extract, stat, extract_and_journal);
+    }
 
     origin_fs_->utime(file_to_extract, stat);
+    LOCK(&stats_lock_);
     statistics->stats.num_files_stored++;
     statistics->stats.size_files_stored+=stat->st_size;
+    statistics->updateProgress();
+    UNLOCK(&stats_lock_);
     verbose(ORIGINTOOL, "Stored %s (%ju %s %06o)\n",
             file_to_extract->c_str(), stat->st_size, permissionString(stat).c_str(), stat->st_mode);
-    statistics->updateProgress();
     return true;
 }
 
@@ -406,12 +455,39 @@ void OriginToolImplementation::restoreFileSystem(FileSystem *backup_fs,
                                                  Settings *settings,
                                                  ProgressStatistics *st)
 {
+    // Continue an interrupted restore into the same origin.
+    journal_ = newJournal(sys_, origin_fs_, settings->to.origin);
+    journal_->load();
+
     // First restore the files,nodes and symlinks and their contents, set the utimes properly for the files.
     Path *r = Path::lookupRoot();
     // The backup fs is only needed when extracting the regular files, since the file content needs to be fetched
     // from the beak tar files in the backup fs.
-    backup_contents_fs->recurse(r, [=](Path *path, FileStat *stat) {
-            return handleRegularFiles(path,stat,restore,point,settings,st,backup_fs);
+    vector<pair<Path*,FileStat*>> files;
+    findFilesToStore(backup_contents_fs, restore, point, &files);
+
+    int num_threads = settings->threads_supplied ? settings->threads : numCores();
+    vector<Path*> tars;
+    findTarsToFetch(backup_contents_fs, restore, point, settings, &tars);
+    if (backup_fs->prefetch(&tars).isErr())
+    {
+        // The tars are then fetched one at a time, which cannot be done concurrently.
+        warning(ORIGINTOOL, "Could not fetch all tars in one go, restoring one file at a time.\n");
+        num_threads = 1;
+    }
+    // The dirs are created before the files are written concurrently.
+    set<Path*> dirs;
+    for (auto &f : files)
+    {
+        dirs.insert(f.first->prepend(settings->to.origin)->parent());
+    }
+    for (Path *d : dirs)
+    {
+        origin_fs_->mkDirpWriteable(d);
+    }
+    debug(ORIGINTOOL, "storing %zu files from %zu tars using %d threads\n", files.size(), tars.size(), num_threads);
+    parallelFor(files.size(), num_threads, [&](size_t i) {
+            handleRegularFiles(files[i].first, files[i].second, restore, point, settings, st, backup_fs);
         });
     // Restore unix nodes.
     backup_contents_fs->recurse(r, [=](Path *path, FileStat *stat) {
@@ -429,4 +505,53 @@ void OriginToolImplementation::restoreFileSystem(FileSystem *backup_fs,
     backup_contents_fs->recurse(r, [=](Path *path, FileStat *stat) {
             return handleDirs(path,stat,restore,point,settings,st);
         });
+    // The restore has completed, there is nothing left to continue.
+    journal_->remove();
+}
+
+void OriginToolImplementation::findFilesToStore(FileSystem *backup_contents_fs,
+                                                Restore *restore,
+                                                PointInTime *point,
+                                                vector<pair<Path*,FileStat*>> *files)
+{
+    backup_contents_fs->recurse(Path::lookupRoot(), [=](Path *path, FileStat *stat) {
+            auto entry = restore->findEntry(point, path);
+            if (!entry->fs.hard_link && stat->isRegularFile() && stat->disk_update != NoUpdate) {
+                files->push_back({ path, stat });
+            }
+            return RecurseContinue;
+        });
+}
+
+void OriginToolImplementation::findTarsToFetch(FileSystem *backup_contents_fs,
+                                               Restore *restore,
+                                               PointInTime *point,
+                                               Settings *settings,
+                                               vector<Path*> *tars)
+{
+    vector<pair<Path*,FileStat*>> files;
+    findFilesToStore(backup_contents_fs, restore, point, &files);
+
+    set<Path*> found;
+    for (auto &f : files)
+    {
+        // Only the permissions are updated, the contents are not needed.
+        if (f.second->disk_update != Store) continue;
+        auto entry = restore->findEntry(point, f.first);
+        Path *tar_file = entry->tarr->prepend(settings->from.storage->storage_location);
+        if (entry->num_parts == 1)
+        {
+            found.insert(tar_file);
+            continue;
+        }
+        TarFileName tfn;
+        string d;
+        if (!tfn.parseFileName(tar_file->str(), &d)) continue;
+        Path *tar_inside_dir = Path::lookup(d);
+        for (uint partnr = 0; partnr < entry->num_parts; ++partnr)
+        {
+            found.insert(tarPart(entry, tfn, tar_inside_dir, partnr));
+        }
+    }
+    tars->insert(tars->end(), found.begin(), found.end());
 }
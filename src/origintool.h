@@ -36,6 +36,8 @@
 
 struct OriginTool
 {
+    // The tars holding the regular files are fetched in one go, then the files
+    // are written concurrently. The other entries are restored after the files.
     virtual void restoreFileSystem(FileSystem *backup_fs, // Gives access to the backups .tar and .gz files.
                                    FileSystem *backup_contents_fs, // Lists all backed up files stored in the backup.
                                    Restore *restore,
@@ -50,6 +52,13 @@ struct OriginTool
                                 Restore *restore,
                                 PointInTime *point) = 0;
 
+    // The tars, or tar parts, that hold the regular files addRestoreWork found to need storing.
+    virtual void findTarsToFetch(FileSystem *backup_contents_fs,
+                                 Restore *restore,
+                                 PointInTime *point,
+                                 Settings *settings,
+                                 std::vector<Path*> *tars) = 0;
+
     virtual ptr<FileSystem> fs() = 0;
 
     virtual ~OriginTool() = default;
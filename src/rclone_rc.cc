@@ -0,0 +1,485 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rclone_rc.h"
+
+#include "lock.h"
+#include "log.h"
+#include "util.h"
+
+#include <algorithm>
+#include <map>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef PLATFORM_WINAPI
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+
+static ComponentId RCLONE_RC = registerLogComponent("rclone_rc");
+
+using namespace std;
+
+// The jobs are started asynchronously, every request except a listing should be
+// answered at once. A daemon that does not answer in time is considered wedged.
+static const int request_timeout_ms = 60*1000;
+// A listing is answered when the whole remote has been listed.
+static const int list_timeout_ms = 60*60*1000;
+
+struct RCloneDaemonImplementation : public RCloneRC
+{
+    RCloneDaemonImplementation(ptr<System> sys) : sys_(sys) {}
+    ~RCloneDaemonImplementation();
+
+    RC start();
+    RC request(string method, Json &params, Json *result);
+
+private:
+
+    System *sys_ {};
+    pid_t pid_ {};
+    // The process that started the daemon, forked children must not clean up after it.
+    pid_t owner_ {};
+    string dir_;
+    Path *socket_ {};
+};
+
+unique_ptr<RCloneRC> newRCloneDaemon(ptr<System> sys)
+{
+    unique_ptr<RCloneDaemonImplementation> d(new RCloneDaemonImplementation(sys));
+    if (d->start().isErr()) return NULL;
+    return unique_ptr<RCloneRC>(d.release());
+}
+
+RC RCloneDaemonImplementation::start()
+{
+    char name[] = "/tmp/beak_rcd_XXXXXX";
+    if (!mkdtemp(name)) return RC::ERR;
+    dir_ = name;
+    socket_ = Path::lookup(dir_+"/rc.sock");
+
+    vector<string> args;
+    args.push_back("rcd");
+    args.push_back("--rc-addr");
+    args.push_back("unix://"+socket_->str());
+    args.push_back("--rc-no-auth");
+    RC rc = sys_->startDaemon("rclone", args, &pid_);
+    if (rc.isErr()) return rc;
+    owner_ = getpid();
+
+    // Wait for the daemon to accept connections.
+    for (int i = 0; i < 200; ++i)
+    {
+        Json params = Json::object();
+        Json result;
+        if (request("rc/noop", params, &result).isOk())
+        {
+            debug(RCLONE_RC, "rclone rcd %d is listening on %s\n", pid_, socket_->c_str());
+            return RC::OK;
+        }
+        if (!sys_->processExists(pid_))
+        {
+            debug(RCLONE_RC, "rclone rcd exited before accepting connections\n");
+            sys_->stopDaemon(pid_);
+            return RC::ERR;
+        }
+        usleep(25*1000);
+    }
+    debug(RCLONE_RC, "rclone rcd never started listening on %s\n", socket_->c_str());
+    sys_->stopDaemon(pid_);
+    return RC::ERR;
+}
+
+RCloneDaemonImplementation::~RCloneDaemonImplementation()
+{
+    if (owner_ != getpid()) return;
+    // The shared session can outlive the System, which then has already stopped and reaped
+    // the daemon. Otherwise, for example when error() exits, the daemon is stopped here.
+    // Only our own child can be waited for, thus a reused pid is never killed.
+#ifndef PLATFORM_WINAPI
+    int status;
+    if (pid_ > 0 && waitpid(pid_, &status, WNOHANG) == 0)
+    {
+        debug(RCLONE_RC, "stopping rclone rcd %d\n", pid_);
+        kill(pid_, SIGTERM);
+        waitpid(pid_, &status, 0);
+    }
+#endif
+    if (socket_) remove(socket_->c_str());
+    if (dir_.length() > 0) remove(dir_.c_str());
+}
+
+RC RCloneDaemonImplementation::request(string method, Json &params, Json *result)
+{
+    string body = params.serialize();
+    string request = "POST /"+method+" HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: "+to_string(body.size())+"\r\n"
+        "Connection: close\r\n"
+        "\r\n"+body;
+    debug(RCLONE_RC, "call %s %s\n", method.c_str(), body.c_str());
+
+    *result = Json::object();
+    vector<char> reply;
+    int timeout_ms = method == "operations/list" ? list_timeout_ms : request_timeout_ms;
+    RC rc = sys_->exchangeUnixSocket(socket_, request, &reply, timeout_ms);
+    if (rc.isErr())
+    {
+        (*result)["error"] = "could not exchange with rclone rcd";
+        return RC::ERR;
+    }
+    int status = 0;
+    string json;
+    if (parseHttpReply(reply, &status, &json).isErr() ||
+        parseJson(json.c_str(), json.size(), result).isErr() ||
+        result->type != JsonType::Object)
+    {
+        *result = Json::object();
+        (*result)["error"] = "bad reply from rclone rcd";
+        return RC::ERR;
+    }
+    if (status != 200)
+    {
+        if (!result->has("error")) (*result)["error"] = "http status "+to_string(status);
+        debug(RCLONE_RC, "%s failed: %s\n", method.c_str(), result->getString("error").c_str());
+        return RC::ERR;
+    }
+    return RC::OK;
+}
+
+RC parseHttpReply(vector<char> &reply, int *status, string *body)
+{
+    string s(reply.begin(), reply.end());
+    size_t sp = s.find(' ');
+    size_t end_of_headers = s.find("\r\n\r\n");
+    if (s.compare(0, 5, "HTTP/") != 0 || sp == string::npos || end_of_headers == string::npos)
+    {
+        return RC::ERR;
+    }
+    *status = atoi(s.c_str()+sp+1);
+
+    string headers = s.substr(0, end_of_headers+2);
+    transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+    size_t pos = end_of_headers+4;
+
+    if (headers.find("\r\ntransfer-encoding: chunked\r\n") == string::npos)
+    {
+        *body = s.substr(pos);
+        size_t cl = headers.find("\r\ncontent-length:");
+        if (cl != string::npos)
+        {
+            size_t len = strtoul(headers.c_str()+cl+17, NULL, 10);
+            if (len > body->size()) return RC::ERR;
+            body->resize(len);
+        }
+        return RC::OK;
+    }
+
+    // Each chunk is: hexsize\r\n data \r\n, ending with a zero sized chunk.
+    body->clear();
+    for (;;)
+    {
+        size_t eol = s.find("\r\n", pos);
+        if (eol == string::npos) return RC::ERR;
+        size_t len = strtoul(s.c_str()+pos, NULL, 16);
+        if (len == 0) break;
+        if (eol+2+len > s.size()) return RC::ERR;
+        body->append(s, eol+2, len);
+        pos = eol+2+len+2;
+    }
+    return RC::OK;
+}
+
+struct FakeRCloneDaemonImplementation : public RCloneRC
+{
+    FakeRCloneDaemonImplementation(ptr<FileSystem> fs, Path *root) : fs_(fs), root_(root) {}
+
+    RC request(string method, Json &params, Json *result);
+
+private:
+
+    Path *resolve_(string fs, string remote);
+    RC list_(Json &params, Json *result);
+    RC copyFile_(Json &params, Json *result);
+    RC deleteFile_(Json &params, Json *result);
+
+    FileSystem *fs_ {};
+    Path *root_ {};
+    map<size_t,Json> jobs_;
+    size_t next_jobid_ = 1;
+};
+
+unique_ptr<RCloneRC> newFakeRCloneDaemon(ptr<FileSystem> fs, Path *root)
+{
+    return unique_ptr<RCloneRC>(new FakeRCloneDaemonImplementation(fs, root));
+}
+
+static string dropSlashes(string s)
+{
+    size_t i = s.find_first_not_of('/');
+    if (i == string::npos) return "";
+    return s.substr(i);
+}
+
+Path *FakeRCloneDaemonImplementation::resolve_(string fs, string remote)
+{
+    string p;
+    if (fs.length() > 0 && fs[0] == '/')
+    {
+        p = fs;
+    }
+    else
+    {
+        size_t colon = fs.find(':');
+        if (colon == string::npos) return NULL;
+        p = root_->str()+"/"+fs.substr(0, colon);
+        string dir = dropSlashes(fs.substr(colon+1));
+        if (dir.length() > 0) p += "/"+dir;
+    }
+    remote = dropSlashes(remote);
+    if (remote.length() > 0) p += "/"+remote;
+    return Path::lookup(p);
+}
+
+RC FakeRCloneDaemonImplementation::request(string method, Json &params, Json *result)
+{
+    debug(RCLONE_RC, "fake call %s %s\n", method.c_str(), params.serialize().c_str());
+    *result = Json::object();
+
+    if (params.getBool("_async"))
+    {
+        // The fake runs the job immediately and remembers the outcome.
+        Json p = params;
+        p.members.erase("_async");
+        Json r;
+        RC rc = request(method, p, &r);
+        size_t jobid = next_jobid_++;
+        Json &status = jobs_[jobid];
+        status["id"] = jobid;
+        status["finished"] = true;
+        status["success"] = rc.isOk();
+        status["error"] = r.getString("error");
+        *result = Json::object();
+        (*result)["jobid"] = jobid;
+        return RC::OK;
+    }
+
+    if (method == "rc/noop")
+    {
+        *result = params;
+        return RC::OK;
+    }
+    if (method == "core/quit") return RC::OK;
+    if (method == "job/status")
+    {
+        auto j = jobs_.find((size_t)params.getNumber("jobid"));
+        if (j == jobs_.end())
+        {
+            (*result)["error"] = "job not found";
+            return RC::ERR;
+        }
+        *result = j->second;
+        return RC::OK;
+    }
+    if (method == "operations/list") return list_(params, result);
+    if (method == "operations/copyfile") return copyFile_(params, result);
+    if (method == "operations/deletefile") return deleteFile_(params, result);
+
+    (*result)["error"] = "couldn't find method \""+method+"\"";
+    return RC::ERR;
+}
+
+RC FakeRCloneDaemonImplementation::list_(Json &params, Json *result)
+{
+    Path *dir = resolve_(params.getString("fs"), params.getString("remote"));
+    FileStat st;
+    if (dir == NULL || fs_->stat(dir, &st).isErr() || !st.isDirectory())
+    {
+        (*result)["error"] = "directory not found";
+        return RC::ERR;
+    }
+    Json list = Json::array();
+    fs_->recurse(dir, [&](Path *p, FileStat *st) {
+            if (st->isRegularFile())
+            {
+                Json e = Json::object();
+                e["Path"] = p->subpath(dir->depth())->str();
+                e["Name"] = p->name()->str();
+                e["Size"] = (size_t)st->st_size;
+                e["IsDir"] = false;
+                list.items.push_back(e);
+            }
+            return RecurseContinue;
+        });
+    (*result)["list"] = list;
+    return RC::OK;
+}
+
+RC FakeRCloneDaemonImplementation::copyFile_(Json &params, Json *result)
+{
+    Path *src = resolve_(params.getString("srcFs"), params.getString("srcRemote"));
+    Path *dst = resolve_(params.getString("dstFs"), params.getString("dstRemote"));
+    vector<char> buf;
+    if (src == NULL || dst == NULL || fs_->loadVector(src, 65536, &buf).isErr())
+    {
+        (*result)["error"] = "object not found";
+        return RC::ERR;
+    }
+    fs_->mkDirpWriteable(dst->parent());
+    if (fs_->createFile(dst, &buf).isErr())
+    {
+        (*result)["error"] = "could not write "+dst->str();
+        return RC::ERR;
+    }
+    return RC::OK;
+}
+
+RC FakeRCloneDaemonImplementation::deleteFile_(Json &params, Json *result)
+{
+    Path *file = resolve_(params.getString("fs"), params.getString("remote"));
+    if (file == NULL || !fs_->deleteFile(file))
+    {
+        (*result)["error"] = "object not found";
+        return RC::ERR;
+    }
+    return RC::OK;
+}
+
+static unique_ptr<RCloneRC> session_;
+static bool session_started_ = false;
+// Several storages can be copied to at the same time, but only one rcd should be started.
+static pthread_mutex_t session_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+RCloneRC *rcloneSession(ptr<System> sys)
+{
+    LOCK(&session_lock_);
+    if (!session_started_)
+    {
+        session_started_ = true;
+        session_ = newRCloneDaemon(sys);
+        if (!session_)
+        {
+            verbose(RCLONE_RC, "Could not start rclone rcd, invoking rclone for each operation instead.\n");
+        }
+    }
+    UNLOCK(&session_lock_);
+    return session_.get();
+}
+
+void setRCloneSession(unique_ptr<RCloneRC> session)
+{
+    session_ = std::move(session);
+    session_started_ = true;
+}
+
+RC rcloneList(RCloneRC *rc, string fs, vector<RCloneEntry> *entries, bool recurse)
+{
+    Json params = Json::object();
+    params["fs"] = fs;
+    params["remote"] = "";
+    params["opt"]["recurse"] = recurse;
+    params["opt"]["filesOnly"] = true;
+    Json result;
+    if (rc->request("operations/list", params, &result).isErr())
+    {
+        debug(RCLONE_RC, "could not list %s: %s\n", fs.c_str(), result.getString("error").c_str());
+        return RC::ERR;
+    }
+    for (auto &e : result["list"].items)
+    {
+        if (e.type != JsonType::Object || e.getBool("IsDir")) continue;
+        entries->push_back({ e.getString("Path"), (size_t)e.getNumber("Size") });
+    }
+    return RC::OK;
+}
+
+RC rcloneRunJobs(RCloneRC *rc, vector<RCloneJob> *jobs, int max_jobs,
+                 function<void(RCloneJob *job)> done)
+{
+    size_t next = 0;
+    size_t num_failed = 0;
+    vector<size_t> running;
+    useconds_t wait = 1000;
+
+    while (next < jobs->size() || running.size() > 0)
+    {
+        // Hand out new jobs until max_jobs are running.
+        while (next < jobs->size() && (int)running.size() < max_jobs)
+        {
+            RCloneJob *job = &(*jobs)[next];
+            Json params = job->params;
+            params["_async"] = true;
+            Json result;
+            if (rc->request(job->method, params, &result).isErr() || !result.has("jobid"))
+            {
+                job->result = RC::ERR;
+                job->error = result.getString("error");
+                num_failed++;
+                done(job);
+            }
+            else
+            {
+                job->jobid = (size_t)result.getNumber("jobid");
+                job->started = clockGetTimeMicroSeconds();
+                running.push_back(next);
+            }
+            next++;
+        }
+
+        bool finished_any = false;
+        for (size_t i = 0; i < running.size(); )
+        {
+            RCloneJob *job = &(*jobs)[running[i]];
+            Json params = Json::object();
+            params["jobid"] = job->jobid;
+            Json status;
+            RC r = rc->request("job/status", params, &status);
+            if (r.isOk() && !status.getBool("finished"))
+            {
+                i++;
+                continue;
+            }
+            if (r.isErr() || !status.getBool("success"))
+            {
+                job->result = RC::ERR;
+                job->error = status.getString("error");
+                num_failed++;
+            }
+            // Prefer the duration measured by rclone, the polling adds to our own measurement.
+            double measured = (clockGetTimeMicroSeconds() - job->started) / 1000000.0;
+            job->secs = status.getNumber("duration", measured);
+            done(job);
+            running.erase(running.begin()+i);
+            finished_any = true;
+        }
+
+        // Back off while the running jobs are busy.
+        if (finished_any || running.size() == 0)
+        {
+            wait = 1000;
+        }
+        else
+        {
+            usleep(wait);
+            if (wait < 100*1000) wait *= 2;
+        }
+    }
+    return num_failed > 0 ? RC::ERR : RC::OK;
+}
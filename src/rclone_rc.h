@@ -0,0 +1,89 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RCLONE_RC_H
+#define RCLONE_RC_H
+
+#include "always.h"
+#include "filesystem.h"
+#include "json.h"
+#include "system.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A session with an rclone remote control server, normally a long running
+// "rclone rcd" that is started once instead of invoking rclone for every operation.
+struct RCloneRC
+{
+    // Call a method, e.g. "operations/list", with a json object as parameters.
+    // If the call fails, RC::ERR is returned and result["error"] holds the reason.
+    virtual RC request(std::string method, Json &params, Json *result) = 0;
+
+    virtual ~RCloneRC() = default;
+};
+
+// Start "rclone rcd" listening on a unix socket. Returns NULL if it could
+// not be started, for example if rclone is missing or too old.
+std::unique_ptr<RCloneRC> newRCloneDaemon(ptr<System> sys);
+
+// A fake rcd for tests that serves the methods used by beak from a local file system.
+// The remote "name:dir" is stored in root/name/dir, absolute paths are local directories.
+std::unique_ptr<RCloneRC> newFakeRCloneDaemon(ptr<FileSystem> fs, Path *root);
+
+// The rcd session shared by all rclone storages, started on first use.
+// Returns NULL if no rcd could be started, then rclone is invoked per operation instead.
+RCloneRC *rcloneSession(ptr<System> sys);
+// Replace the shared session, for example with a fake rcd.
+void setRCloneSession(std::unique_ptr<RCloneRC> session);
+
+struct RCloneEntry
+{
+    std::string path; // Relative to the listed fs.
+    size_t size;
+};
+
+// List all files below fs recursively, or only the files directly in fs.
+RC rcloneList(RCloneRC *rc, std::string fs, std::vector<RCloneEntry> *entries, bool recurse = true);
+
+// A call that is run as an asynchronous job by the rcd.
+struct RCloneJob
+{
+    std::string method;
+    Json params;
+    // The outcome of the job, error holds the message from rclone if it failed.
+    RC result = RC::OK;
+    std::string error;
+    // Used to track the running job.
+    size_t jobid {};
+    uint64_t started {};
+    // How long the job ran, in seconds.
+    double secs {};
+};
+
+// Start all jobs without waiting for the previous to finish, but keep at most
+// max_jobs running at the same time. Done is invoked as each job finishes.
+// Returns RC::ERR if any job failed.
+RC rcloneRunJobs(RCloneRC *rc, std::vector<RCloneJob> *jobs, int max_jobs,
+                 std::function<void(RCloneJob *job)> done);
+
+// Split an http reply into status code and body, handling chunked transfer encoding.
+RC parseHttpReply(std::vector<char> &reply, int *status, std::string *body);
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "refindex.h"
+
+#include "log.h"
+#include "tar.h"
+#include "util.h"
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+static ComponentId REFINDEX = registerLogComponent("refindex");
+
+using namespace std;
+
+// An inclusive range of point numbers.
+struct PointRange
+{
+    uint32_t from, to;
+};
+
+struct RefIndexImplementation : public RefIndex
+{
+    void addPointInTime(string filename, size_t size, vector<Path*> &beak_files);
+    RC updatePointsInTime(vector<string> &filenames,
+                          function<RC(string &filename, size_t *size, vector<Path*> *beak_files)> load,
+                          size_t *num_loaded,
+                          vector<string> *failed);
+
+    size_t numPointsInTime() { return points_.size(); }
+    string &pointFileName(size_t point) { return points_[point]; }
+    size_t pointSize(size_t point) { return sizes_[point]; }
+
+    void referencedFiles(vector<Path*> *files);
+    size_t numReferences(Path *file);
+    void pointsReferencing(Path *file, vector<size_t> *points);
+    void filesFreedByRemoving(vector<bool> &remove, vector<Path*> *freed);
+
+    RC load(FileSystem *fs, Path *file);
+    RC save(FileSystem *fs, Path *file);
+
+private:
+
+    void addReference_(Path *file, uint32_t point);
+    void sortReferences_(Path *file);
+
+    vector<string> points_;
+    vector<size_t> sizes_;
+    unordered_map<Path*,vector<PointRange>> refs_;
+};
+
+unique_ptr<RefIndex> newRefIndex()
+{
+    return unique_ptr<RefIndex>(new RefIndexImplementation());
+}
+
+void RefIndexImplementation::addReference_(Path *file, uint32_t point)
+{
+    vector<PointRange> &r = refs_[file];
+    if (r.size() > 0 && r.back().to+1 == point)
+    {
+        r.back().to = point;
+    }
+    else if (r.size() == 0 || r.back().to < point)
+    {
+        r.push_back({ point, point });
+    }
+    else if (point < r.back().from)
+    {
+        // Out of order, can only happen when an older point in time appeared later.
+        r.push_back({ point, point });
+        sortReferences_(file);
+    }
+}
+
+void RefIndexImplementation::sortReferences_(Path *file)
+{
+    vector<PointRange> &r = refs_[file];
+    vector<uint32_t> all;
+    for (auto &pr : r)
+    {
+        for (uint32_t p = pr.from; p <= pr.to; ++p) all.push_back(p);
+    }
+    sort(all.begin(), all.end());
+    all.erase(unique(all.begin(), all.end()), all.end());
+    r.clear();
+    for (auto p : all)
+    {
+        if (r.size() > 0 && r.back().to+1 == p) r.back().to = p;
+        else r.push_back({ p, p });
+    }
+}
+
+void RefIndexImplementation::addPointInTime(string filename, size_t size, vector<Path*> &beak_files)
+{
+    uint32_t point = points_.size();
+    points_.push_back(filename);
+    sizes_.push_back(size);
+    for (auto f : beak_files)
+    {
+        addReference_(f, point);
+    }
+}
+
+RC RefIndexImplementation::updatePointsInTime(vector<string> &filenames,
+                                              function<RC(string &filename,
+                                                          size_t *size,
+                                                          vector<Path*> *beak_files)> load,
+                                              size_t *num_loaded,
+                                              vector<string> *failed)
+{
+    map<string,uint32_t> old_numbers;
+    for (uint32_t i = 0; i < points_.size(); ++i) old_numbers[points_[i]] = i;
+
+    // Map the old point numbers to the new numbers, points no longer present are dropped.
+    const uint32_t dropped = 0xffffffff;
+    vector<uint32_t> renumber(points_.size(), dropped);
+    vector<size_t> sizes(filenames.size());
+    vector<bool> known(filenames.size());
+    for (uint32_t i = 0; i < filenames.size(); ++i)
+    {
+        auto o = old_numbers.find(filenames[i]);
+        if (o != old_numbers.end())
+        {
+            renumber[o->second] = i;
+            sizes[i] = sizes_[o->second];
+            known[i] = true;
+        }
+    }
+
+    // Load the new points before touching the index, a point without
+    // its references would make its files look unused.
+    map<uint32_t,vector<Path*>> loaded;
+    *num_loaded = 0;
+    for (uint32_t i = 0; i < filenames.size(); ++i)
+    {
+        if (known[i]) continue;
+        RC rc = load(filenames[i], &sizes[i], &loaded[i]);
+        if (rc.isErr())
+        {
+            warning(REFINDEX, "Could not load references of %s\n", filenames[i].c_str());
+            failed->push_back(filenames[i]);
+        }
+        (*num_loaded)++;
+    }
+    if (failed->size() > 0) return RC::ERR;
+
+    unordered_map<Path*,vector<PointRange>> old_refs;
+    old_refs.swap(refs_);
+    points_ = filenames;
+    sizes_ = sizes;
+
+    for (auto &f : old_refs)
+    {
+        for (auto &pr : f.second)
+        {
+            for (uint32_t p = pr.from; p <= pr.to; ++p)
+            {
+                if (renumber[p] != dropped) addReference_(f.first, renumber[p]);
+            }
+        }
+    }
+
+    for (auto &l : loaded)
+    {
+        for (auto f : l.second) addReference_(f, l.first);
+    }
+    debug(REFINDEX, "updated %zu points in time, loaded %zu\n", points_.size(), *num_loaded);
+    return RC::OK;
+}
+
+void RefIndexImplementation::referencedFiles(vector<Path*> *files)
+{
+    for (auto &f : refs_)
+    {
+        if (f.second.size() > 0) files->push_back(f.first);
+    }
+}
+
+size_t RefIndexImplementation::numReferences(Path *file)
+{
+    auto f = refs_.find(file);
+    if (f == refs_.end()) return 0;
+    size_t n = 0;
+    for (auto &pr : f->second) n += pr.to - pr.from + 1;
+    return n;
+}
+
+void RefIndexImplementation::pointsReferencing(Path *file, vector<size_t> *points)
+{
+    auto f = refs_.find(file);
+    if (f == refs_.end()) return;
+    for (auto &pr : f->second)
+    {
+        for (uint32_t p = pr.from; p <= pr.to; ++p) points->push_back(p);
+    }
+}
+
+void RefIndexImplementation::filesFreedByRemoving(vector<bool> &remove, vector<Path*> *freed)
+{
+    // kept[i] is the number of kept points before point i, which makes it
+    // possible to check a whole range of references at once.
+    vector<uint32_t> kept(points_.size()+1);
+    for (size_t i = 0; i < points_.size(); ++i)
+    {
+        bool removed = i < remove.size() && remove[i];
+        kept[i+1] = kept[i] + (removed ? 0 : 1);
+    }
+    for (auto &f : refs_)
+    {
+        bool needed = false;
+        for (auto &pr : f.second)
+        {
+            if (kept[pr.to+1] != kept[pr.from])
+            {
+                needed = true;
+                break;
+            }
+        }
+        if (!needed && f.second.size() > 0) freed->push_back(f.first);
+    }
+}
+
+RC RefIndexImplementation::load(FileSystem *fs, Path *file)
+{
+    vector<char> buf;
+    RC rc = fs->loadVector(file, T_BLOCKSIZE, &buf);
+    if (rc.isErr()) return rc;
+
+    auto i = buf.begin();
+    bool eof = false, err = false;
+    string type = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (type != "#beak refindex 1")
+    {
+        warning(REFINDEX, "Not a proper reference index %s\n", file->c_str());
+        return RC::ERR;
+    }
+    int num_points = 0, num_files = 0;
+    string line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (err || sscanf(line.c_str(), "#points %d", &num_points) != 1) return RC::ERR;
+
+    points_.clear();
+    sizes_.clear();
+    refs_.clear();
+    for (int p = 0; p < num_points; ++p)
+    {
+        line = eatTo(buf, i, separator, 4096, &eof, &err);
+        size_t sp = line.find(' ');
+        if (err || sp == string::npos) return RC::ERR;
+        sizes_.push_back(atol(line.substr(0, sp).c_str()));
+        points_.push_back(line.substr(sp+1));
+    }
+
+    line = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (err || sscanf(line.c_str(), "#files %d", &num_files) != 1) return RC::ERR;
+    for (int f = 0; f < num_files; ++f)
+    {
+        // Each file is stored as: 0-12,15 path/to/beak_s_....tar
+        line = eatTo(buf, i, separator, 1024*1024, &eof, &err);
+        size_t sp = line.find(' ');
+        if (err || sp == string::npos) return RC::ERR;
+        Path *p = Path::lookup(line.substr(sp+1));
+        vector<PointRange> &r = refs_[p];
+        const char *s = line.c_str();
+        while (s < line.c_str()+sp)
+        {
+            char *e;
+            uint32_t from = strtoul(s, &e, 10);
+            uint32_t to = from;
+            if (*e == '-') to = strtoul(e+1, &e, 10);
+            if (to < from || to >= points_.size()) return RC::ERR;
+            r.push_back({ from, to });
+            s = e+1;
+        }
+    }
+    debug(REFINDEX, "loaded %zu points and %zu files from %s\n", points_.size(), refs_.size(), file->c_str());
+    return RC::OK;
+}
+
+RC RefIndexImplementation::save(FileSystem *fs, Path *file)
+{
+    string s = "#beak refindex 1\n";
+    s += "#points "+to_string(points_.size())+"\n";
+    for (size_t p = 0; p < points_.size(); ++p)
+    {
+        s += to_string(sizes_[p])+" "+points_[p]+separator_string;
+    }
+    // Sort the files to make the saved index independent of the hash order.
+    map<string,vector<PointRange>*> files;
+    for (auto &f : refs_) if (f.second.size() > 0) files[f.first->str()] = &f.second;
+    s += "#files "+to_string(files.size())+"\n";
+    for (auto &f : files)
+    {
+        string ranges;
+        for (auto &pr : *f.second)
+        {
+            if (ranges.length() > 0) ranges += ",";
+            ranges += to_string(pr.from);
+            if (pr.to != pr.from) ranges += "-"+to_string(pr.to);
+        }
+        s += ranges+" "+f.first+separator_string;
+    }
+    vector<char> buf(s.begin(), s.end());
+    return fs->createFile(file, &buf);
+}
@@ -0,0 +1,70 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REFINDEX_H
+#define REFINDEX_H
+
+#include "always.h"
+#include "filesystem.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// The reference index records, for every beak file in a storage, which
+// points in time refer to it. Consecutive points in time mostly share
+// their tars, so the references are stored as ranges of points.
+// Points are numbered in the order they were added, oldest first,
+// which is the same order as Restore::historyOldToNew.
+struct RefIndex
+{
+    // Add the next point in time, with the beak files (index and tar files) it needs.
+    virtual void addPointInTime(std::string filename, size_t size, std::vector<Path*> &beak_files) = 0;
+
+    // Renumber the index to exactly the points in time listed in filenames.
+    // Points already known keep their references, the others are fetched using load,
+    // num_loaded is the number of points that had to be loaded. If any point could not
+    // be loaded, it is added to failed and the index is left unchanged.
+    virtual RC updatePointsInTime(std::vector<std::string> &filenames,
+                                  std::function<RC(std::string &filename,
+                                                   size_t *size,
+                                                   std::vector<Path*> *beak_files)> load,
+                                  size_t *num_loaded,
+                                  std::vector<std::string> *failed) = 0;
+
+    virtual size_t numPointsInTime() = 0;
+    virtual std::string &pointFileName(size_t point) = 0;
+    // The size of the backup as recorded in the point's index file.
+    virtual size_t pointSize(size_t point) = 0;
+
+    // All beak files referenced by at least one point in time.
+    virtual void referencedFiles(std::vector<Path*> *files) = 0;
+    virtual size_t numReferences(Path *file) = 0;
+    // The points in time that break if this file is lost.
+    virtual void pointsReferencing(Path *file, std::vector<size_t> *points) = 0;
+    // The beak files that are no longer needed when the points marked in remove are removed.
+    virtual void filesFreedByRemoving(std::vector<bool> &remove, std::vector<Path*> *freed) = 0;
+
+    virtual RC load(FileSystem *fs, Path *file) = 0;
+    virtual RC save(FileSystem *fs, Path *file) = 0;
+
+    virtual ~RefIndex() = default;
+};
+
+std::unique_ptr<RefIndex> newRefIndex();
+
+#endif
@@ -42,6 +42,12 @@ using namespace std;
 
 ComponentId RESTORE = registerLogComponent("restore");
 
+// The tars are read in blocks of 256KiB, 64MiB of them are cached.
+static const size_t block_size = 256*1024;
+static const size_t max_cached_blocks = 256;
+// A sequential read is followed by reading the next 2MiB in the background.
+static const size_t readahead_blocks = 8;
+
 struct RestoreFileSystem : FileSystem
 {
     Restore *rev_;
@@ -49,7 +55,15 @@ struct RestoreFileSystem : FileSystem
 
     bool readdir(Path *p, std::vector<Path*> *vec)
     {
-        return false;
+        point_ = rev_->singlePointInTime();
+        assert(point_);
+
+        RestoreEntry *d = rev_->findEntry(point_, p);
+        if (!d) return false;
+        for (auto e : *rev_->dirContents(point_, d)) {
+            vec->push_back(Path::lookup(e->path->name()->str()));
+        }
+        return true;
     }
 
     ssize_t pread(Path *p, char *buf, size_t size, off_t offset)
@@ -59,16 +73,16 @@ struct RestoreFileSystem : FileSystem
 
     void recurseInto(RestoreEntry *d, std::function<void(Path*,FileStat*)> cb)
     {
-        rev_->loadDirContents(point_, d->path);
+        vector<RestoreEntry*> *contents = rev_->dirContents(point_, d);
 
         // Recurse depth first.
-        for (auto e : d->dir()) {
+        for (auto e : *contents) {
             if (e->fs.isDirectory()) {
                 recurseInto(e, cb);
                 cb(e->path, &e->fs);
             }
         }
-        for (auto e : d->dir()) {
+        for (auto e : *contents) {
             if (!e->fs.isDirectory()) {
                 cb(e->path, &e->fs);
             }
@@ -102,7 +116,13 @@ struct RestoreFileSystem : FileSystem
 
     RC stat(Path *p, FileStat *fs)
     {
-        return RC::ERR;
+        point_ = rev_->singlePointInTime();
+        assert(point_);
+
+        RestoreEntry *e = rev_->findEntry(point_, p);
+        if (!e) return RC::ERR;
+        *fs = e->fs;
+        return RC::OK;
     }
 
     RC chmod(Path *p, FileStat *fs)
@@ -195,7 +215,7 @@ struct RestoreFileSystem : FileSystem
         return RC::ERR;
     }
 
-    RC enableWatch()
+    RC enableWatch(Path *root)
     {
         return RC::ERR;
     }
@@ -205,9 +225,9 @@ struct RestoreFileSystem : FileSystem
         return RC::ERR;
     }
 
-    int endWatch()
+    RC endWatch(std::vector<Path*> *changed)
     {
-        return 0;
+        return RC::ERR;
     }
 
     FILE *openAsFILE(Path *f, const char *mode)
@@ -225,26 +245,54 @@ Restore::Restore(FileSystem *backup_fs)
     pthread_mutex_init(&global, &global_attr);
     backup_fs_ = backup_fs;
     contents_fs_ = unique_ptr<FileSystem>(new RestoreFileSystem(this));
+    // The backup fs is only called with the global lock held.
+    block_cache_ = newBlockCache(backup_fs_, &global, block_size, max_cached_blocks, readahead_blocks);
 }
 
 Restore::~Restore() {
+    // Stop the read aheads before the backup fs goes away.
+    block_cache_.reset();
     delete fuse_api_;
     fuse_api_ = 0;
 }
 
+RestoreEntry *RestoreIndex::find(Path *p)
+{
+    auto i = lower_bound(sorted.begin(), sorted.end(), p,
+                         [](RestoreEntry *e, Path *p) { return e->path < p; });
+    if (i == sorted.end() || (*i)->path != p) return NULL;
+    return *i;
+}
+
+void RestoreIndex::forEachBelow(Path *dir, function<void(RestoreEntry*)> cb)
+{
+    string prefix = dir->str()+"/";
+    auto i = lower_bound(by_name.begin(), by_name.end(), prefix,
+                         [](RestoreEntry *e, const string &s) { return e->path->str() < s; });
+    for (; i != by_name.end() && (*i)->path->str().compare(0, prefix.length(), prefix) == 0; ++i)
+    {
+        cb(*i);
+    }
+}
+
 // The gz file to load, and the dir to populate with its contents.
 bool Restore::loadGz(PointInTime *point, Path *gz, Path *dir_to_prepend)
 {
     debug(RESTORE, "loadGz gzfile=%s backup_location=%s\n", gz?gz->c_str():"NULL", dir_to_prepend?dir_to_prepend->c_str():"NULL");
-    Path *safedir_to_prepend = gz->parent()->subpath(rootDir()->depth());;
 
-    RC rc = RC::OK;
-    if (point->hasLoadedGzFile(gz))
+    bool root_index = dir_to_prepend == NULL;
+    auto f = indexes_.find(gz);
+    if (f != indexes_.end())
     {
-        return true;
+        // Already loaded, perhaps by another point in time.
+        if (f->second.ok && root_index) point->setRootIndex(&f->second);
+        return f->second.ok;
     }
-    point->addLoadedGzFile(gz);
+    RestoreIndex *index = &indexes_[gz];
 
+    Path *safedir_to_prepend = gz->parent()->subpath(rootDir()->depth());;
+
+    RC rc = RC::OK;
     vector<char> buf;
     rc = backup_fs_->loadVector(gz, T_BLOCKSIZE, &buf);
     if (rc.isErr()) return false;
@@ -261,20 +309,11 @@ bool Restore::loadGz(PointInTime *point, Path *gz, Path *dir_to_prepend)
     struct IndexEntry index_entry;
     struct IndexTar index_tar;
 
-    vector<RestoreEntry*> es;
-    bool parsed_tars_already = point->hasGzFiles();
-
-    rc = Index::loadIndex(contents, i, &index_entry, &index_tar, dir_to_prepend, safedir_to_prepend, &point->size,
-             [point,&es,dir_to_prepend](IndexEntry *ie) {
-                         if (!point->hasPath(ie->path)) {
-                             debug(RESTORE, "adding entry for >%s<\n", ie->path->c_str());
-                             // Trigger storage of entry.
-                             point->addPath(ie->path);
-                         } else {
-                             debug(RESTORE, "using existing entry for >%s< %p\n", ie->path->c_str());
-                         }
-                         RestoreEntry *e = point->getPath(ie->path);
-                         assert(e->path = ie->path);
+    rc = Index::loadIndex(contents, i, &index_entry, &index_tar, dir_to_prepend, safedir_to_prepend, &index->size,
+             [index,dir_to_prepend](IndexEntry *ie) {
+                         debug(RESTORE, "adding entry for >%s<\n", ie->path->c_str());
+                         index->entries.push_back(RestoreEntry());
+                         RestoreEntry *e = &index->entries.back();
                          e->loadFromIndex(ie);
                          if (ie->is_hard_link)
                          {
@@ -286,17 +325,16 @@ bool Restore::loadGz(PointInTime *point, Path *gz, Path *dir_to_prepend)
                                  e->fs.hard_link = Path::lookup(ie->link);
                              }
                          }
-                         es.push_back(e);
                      },
-                     [point,parsed_tars_already](IndexTar *it)
+                     [index,root_index](IndexTar *it)
                           {
-                              if (!parsed_tars_already)
+                              if (root_index)
                               {
                                   if (TarFileName::isIndexFile(it->tarfile_location))
                                   {
-                                      point->addGzFile(it->backup_location, it->tarfile_location);
+                                      index->gz_files[it->backup_location] = it->tarfile_location;
                                   }
-                                  point->addTar(it->tarfile_location);
+                                  index->tars.push_back(it->tarfile_location);
                               }
                           });
 
@@ -306,117 +344,162 @@ bool Restore::loadGz(PointInTime *point, Path *gz, Path *dir_to_prepend)
         return false;
     }
 
-    for (auto i : es)
+    // The entries are not moved anymore, now they can be pointed to.
+    for (auto &e : index->entries) index->sorted.push_back(&e);
+    sort(index->sorted.begin(), index->sorted.end(),
+         [](RestoreEntry *a, RestoreEntry *b) { return a->path < b->path; });
+    index->by_name = index->sorted;
+    sort(index->by_name.begin(), index->by_name.end(),
+         [](RestoreEntry *a, RestoreEntry *b) { return a->path->str() < b->path->str(); });
+
+    Path *dir = dir_to_prepend ? dir_to_prepend : Path::lookupRoot();
+    for (auto &e : index->entries)
     {
         // Now iterate over the files found.
         // Some of them might be in subdirectories.
-        Path *p = i->path;
-        Path *pp = p->parent();
+        Path *pp = e.path->parent();
         if (!pp) pp = Path::lookupRoot();
-        RestoreEntry *d = point->getPath(pp);
+        if (pp == dir)
+        {
+            index->top.push_back(&e);
+            continue;
+        }
+        RestoreEntry *d = index->find(pp);
         if (d == NULL)
         {
-            d = point->addPath(pp);
-            d->path = pp;
+            // A hard link stored here, the common ancestor of the link and its target,
+            // inside a dir that is stored in another index. Found by dirContents.
+            debug(RESTORE, "no dir %s for %s in index %s\n", pp->c_str(), e.path->c_str(), gz->c_str());
+            continue;
         }
-        debug(RESTORE, "added %s %p to dir >%s< %p\n", i->path->c_str(), i, pp->c_str(), d);
-        d->addEntryToDir(i);
-        d->loaded = true;
+        debug(RESTORE, "added %s to dir >%s<\n", e.path->c_str(), pp->c_str());
+        d->addEntryToDir(&e);
     }
+    if (root_index)
+    {
+        index->gz_files[Path::lookupRoot()] = Path::lookup(gz->name()->str());
+        point->setRootIndex(index);
+    }
+    index->ok = true;
 
     debug(RESTORE, "found proper index file! %s\n", gz->c_str());
 
     return true;
 }
 
-Path *Restore::loadDirContents(PointInTime *point, Path *path)
+RestoreIndex *Restore::loadIndex_(PointInTime *point, Path *dir)
 {
-    FileStat stat;
-    Path *gz = point->getGzFile(path);
-    debug(RESTORE, "looking for index file in dir >%s< (found %p)\n", path->c_str(), gz);
-    if (gz != NULL)
+    Path *gz = point->getGzFile(dir);
+    if (gz == NULL) return NULL;
+    gz = gz->prepend(rootDir());
+
+    auto i = indexes_.find(gz);
+    if (i == indexes_.end())
     {
-        gz = gz->prepend(rootDir());
+        FileStat stat;
         RC rc = backup_fs_->stat(gz, &stat);
         debug(RESTORE, "%s --- rc=%d %d\n", gz->c_str(), rc.toInteger(), stat.isRegularFile());
-        if (rc.isOk() && stat.isRegularFile()) {
-            // Found a gz file!
-            debug(RESTORE, "found a gz file %s for \"%s\"\n", gz->c_str(), path->c_str());
-            loadGz(point, gz, path);
-        }
-    }
-    else
-    {
-        debug(RESTORE, "no gz file found %s\n", path->c_str());
+        if (rc.isErr() || !stat.isRegularFile()) return NULL;
+        debug(RESTORE, "found a gz file %s for \"%s\"\n", gz->c_str(), dir->c_str());
+        loadGz(point, gz, dir == Path::lookupRoot() ? NULL : dir);
+        i = indexes_.find(gz);
     }
-
-    return gz;
+    if (!i->second.ok) return NULL;
+    return &i->second;
 }
 
-void Restore::loadCache(PointInTime *point, Path *path)
+vector<RestoreEntry*> *Restore::dirContents(PointInTime *point, RestoreEntry *dir)
 {
-//    Path *opath = path;
+    auto m = point->merged_dirs.find(dir->path);
+    if (m != point->merged_dirs.end()) return &m->second;
+
+    RestoreIndex *index = loadIndex_(point, dir->path);
+    vector<RestoreEntry*> *contents = index ? &index->top : &dir->dir();
+    Path *root = Path::lookupRoot();
+    if (dir->path == root) return contents;
+
+    // Hard links between dirs are stored in the index of their nearest common ancestor,
+    // look for entries inside this dir in the indexes above the one that stores the dir.
+    // The index that stores the dir has them in the dir entry already.
+    vector<RestoreEntry*> found;
+    bool skip_holder = index == NULL;
+    Path *above = dir->path->parent();
+    for (;;)
+    {
+        if (above == NULL) above = root;
+        RestoreIndex *ai = point->getGzFile(above) ? loadIndex_(point, above) : NULL;
+        if (ai && skip_holder) skip_holder = false;
+        else if (ai)
+        {
+            ai->forEachBelow(dir->path, [&](RestoreEntry *e) {
+                    if (e->path->parent() == dir->path) found.push_back(e);
+                });
+        }
+        if (above == root) break;
+        above = above->parent();
+    }
+    if (found.size() == 0) return contents;
 
-    RestoreEntry *e = point->getPath(path);
-    if (e != NULL && e->loaded)
+    vector<RestoreEntry*> &merged = point->merged_dirs[dir->path];
+    set<Path*> paths;
+    for (auto e : *contents)
     {
-        return;
+        merged.push_back(e);
+        paths.insert(e->path);
     }
+    for (auto e : found)
+    {
+        if (paths.insert(e->path).second) merged.push_back(e);
+    }
+    return &merged;
+}
 
-    debug(RESTORE, "load cache for '%s'\n", path->c_str());
-    // Walk up in the directory structure until a gz file is found.
-    for (;;)
+bool Restore::hasEntriesAbove(PointInTime *point, Path *dir)
+{
+    Path *root = Path::lookupRoot();
+    if (dir == root) return false;
+    bool found = false;
+    for (Path *above = dir->parent(); !found; above = above->parent())
     {
-        if (path == NULL) {
-            // No gz file found anywhere! This filesystem should not have been mounted!
-            debug(RESTORE, "no index file found anywhere!\n");
-            return;
-        }
-        Path *gz = loadDirContents(point, path);
-        if (gz != NULL)
-        {
-            if (point->hasPath(path))
-            {
-                if (path == NULL)
-                {
-                    debug(RESTORE, "reached root\n");
-                    return;
-                }
-                // Success
-                debug(RESTORE, "found '%s' in index '%s'\n", path->c_str(), gz->c_str());
-                return;
-            }
-            // Can we terminate this search early?
-        }
-        // Move up in the directory tree.
-        path = path->parent();
-        if (path != NULL)
-        {
-            debug(RESTORE, "moving up to %s\n", path->c_str());
-        }
-        else
-        {
-            debug(RESTORE, "cannot move up!\n");
-        }
+        if (above == NULL) above = root;
+        RestoreIndex *index = point->getGzFile(above) ? loadIndex_(point, above) : NULL;
+        if (index) index->forEachBelow(dir, [&](RestoreEntry *e) { found = true; });
+        if (above == root) break;
     }
-    assert(0);
+    return found;
 }
 
 RestoreEntry *Restore::findEntry(PointInTime *point, Path *path)
 {
-    if (!point->hasPath(path))
+    Path *root = Path::lookupRoot();
+    if (path == root) return point->root();
+
+    // The entry is stored in the index of the nearest dir above it that has an index file,
+    // unless it is a hard link to another dir, then it is in the index of a dir further up.
+    Path *dir = path->parent();
+    bool has_index = false;
+    for (;;)
     {
-        // No cache index loaded for this path, try to load.
-        loadCache(point, path);
-        if (!point->hasPath(path))
+        if (dir == NULL) dir = root;
+        if (point->getGzFile(dir) != NULL)
         {
-            // Still no index loaded for the path, ie it does not exist.
-            debug(RESTORE, "not found '%s'\n", path->c_str());
-            return NULL;
+            has_index = true;
+            RestoreIndex *index = loadIndex_(point, dir);
+            RestoreEntry *e = index ? index->find(path) : NULL;
+            if (e) return e;
         }
+        if (dir == root) break;
+        dir = dir->parent();
     }
-
-    return point->getPath(path);
+    if (has_index)
+    {
+        debug(RESTORE, "not found '%s'\n", path->c_str());
+    }
+    else
+    {
+        debug(RESTORE, "no index file found for '%s'\n", path->c_str());
+    }
+    return NULL;
 }
 
 struct RestoreFuseAPI : FuseAPI
@@ -599,14 +682,10 @@ struct RestoreFuseAPI : FuseAPI
 
         if (!e->fs.isDirectory()) goto err;
 
-        if (!e->loaded) {
-            debug(RESTORE,"not loaded %s\n", e->path->c_str());
-            restore_->loadCache(point, e->path);
-        }
         filler(buf, ".", NULL, 0);
         filler(buf, "..", NULL, 0);
 
-        for (auto i : e->dir())
+        for (auto i : *restore_->dirContents(point, e))
         {
             char filename[256];
             memset(filename, 0, 256);
@@ -719,7 +798,7 @@ struct RestoreFuseAPI : FuseAPI
             // Offset into a single tar file.
             file_offset += e->offset_;
             debug(RESTORE, "reading %ju bytes from offset %ju in file %s\n", size, file_offset, tar->c_str());
-            n = restore_->backupFileSystem()->pread(tar, buf, size, file_offset);
+            n = restore_->blockCache()->pread(tar, buf, size, file_offset);
             if (n == -1)
             {
                 failure(RESTORE,
@@ -731,21 +810,25 @@ struct RestoreFuseAPI : FuseAPI
         else
         {
             // There is more than one part
+            auto part_name = [&](uint partnr)
+                {
+                    char name[4096];
+                    tfn.part_nr = partnr;
+                    tfn.size = e->contentSize(partnr);
+                    tfn.ondisk_size = e->diskSize(partnr);
+                    tfn.num_parts = e->num_parts;
+                    Path *dir = e->path->parent()->prepend(restore_->rootDir());
+                    tfn.writeTarFileNameIntoBuffer(name, sizeof(name), dir);
+                    return Path::lookup(name);
+                };
             n =  e->readParts(file_offset, buf, size,
                       [&](uint partnr, off_t offset_inside_part, char *buffer, size_t length_to_read)
                       {
-                          char name[4096];
-                          tfn.part_nr = partnr;
-                          tfn.size = e->contentSize(partnr);
-                          tfn.ondisk_size = e->diskSize(partnr);
-                          tfn.num_parts = e->num_parts;
-                          Path *dir = e->path->parent()->prepend(restore_->rootDir());
-                          tfn.writeTarFileNameIntoBuffer(name, sizeof(name), dir);
-                          Path *tarf = Path::lookup(name);
+                          Path *tarf = part_name(partnr);
                           assert(length_to_read > 0);
                           debug(RESTORE, "reading %ju bytes from offset %ju in tar part %s\n",
                                 length_to_read, offset_inside_part, tarf->c_str());
-                          int nn = restore_->backupFileSystem()->pread(tarf, buffer, length_to_read, offset_inside_part);
+                          int nn = restore_->blockCache()->pread(tarf, buffer, length_to_read, offset_inside_part);
                           if (nn <= 0)
                           {
                               failure(RESTORE,
@@ -753,6 +836,15 @@ struct RestoreFuseAPI : FuseAPI
                                       tarf->c_str(), errno);
                               return 0;
                           }
+                          // A sequential read approaching the end of the part starts reading
+                          // the next part, which fetches it from a remote storage ahead of time.
+                          size_t window = readahead_blocks*block_size;
+                          if (partnr+1 < e->num_parts &&
+                              offset_inside_part+length_to_read+window >= e->lengthOfPart(partnr) &&
+                              restore_->blockCache()->isSequential(tarf))
+                          {
+                              restore_->blockCache()->readAhead(part_name(partnr+1), 0, window);
+                          }
                           return nn;
                       });
         }
@@ -770,17 +862,27 @@ struct RestoreFuseAPI : FuseAPI
 
 RC Restore::lookForPointsInTime(PointInTimeFormat f, Path *path)
 {
-    bool ok;
     if (path == NULL) return RC::ERR;
 
     vector<Path*> contents;
     if (!backup_fs_->readdir(path, &contents)) {
         return RC::ERR;
     }
+    vector<string> index_files;
     for (auto f : contents)
+    {
+        index_files.push_back(f->str());
+    }
+    return lookForPointsInTime(f, index_files);
+}
+
+RC Restore::lookForPointsInTime(PointInTimeFormat f, vector<string> &index_files)
+{
+    bool ok;
+    for (auto &f : index_files)
     {
         TarFileName tfn;
-        ok = tfn.parseFileName(f->str());
+        ok = tfn.parseFileName(f);
 
         if (ok && tfn.type == TarContents::INDEX_FILE)
         {
@@ -791,9 +893,9 @@ RC Restore::lookForPointsInTime(PointInTimeFormat f, Path *path)
 
             p.ago = timeAgo(p.ts());
             p.datetime = datetime;
-            p.filename = f->str();
+            p.filename = f;
             history_old_to_new_.push_back(p);
-            debug(RESTORE, "found index file %s\n", f->c_str());
+            debug(RESTORE, "found index file %s\n", f.c_str());
         }
     }
 
@@ -836,9 +938,7 @@ RC Restore::lookForPointsInTime(PointInTimeFormat f, Path *path)
         points_in_time_[point.direntry] = &point;
         FileStat fs;
         fs.st_mode = S_IFDIR | S_IRUSR | S_IXUSR;
-        point.addPath(Path::lookupRoot());
-        RestoreEntry *re = point.getPath(Path::lookupRoot());
-        *re = RestoreEntry(fs, 0, Path::lookupRoot());
+        *point.root() = RestoreEntry(fs, 0, Path::lookupRoot());
     }
     if (i > 0) {
         return RC::OK;
@@ -904,23 +1004,19 @@ RC Restore::loadBeakFileSystem(Storage *storage)
 
         // Populate the list of all tars from the root index file.
         bool ok = loadGz(&point, gz, NULL);
-        point.addGzFile(Path::lookupRoot(), Path::lookup(name));
 
         if (!ok) {
             failure(RESTORE, "Could not load index file for backup %s!\n", point.ago.c_str());
+            continue;
         }
 
-        // Populate the root directory with its contents.
-        loadCache(&point, Path::lookupRoot());
-
-        RestoreEntry *e = findEntry(&point, Path::lookupRoot());
-        assert(e != NULL);
+        RestoreEntry *e = point.root();
 
         // Look for the youngest timestamp inside root to
         // be used as the timestamp for the root directory.
         // The root directory is by definition not defined inside gz file.
         time_t youngest_secs = 0, youngest_nanos = 0;
-        for (auto i : e->dir())
+        for (auto i : *dirContents(&point, e))
         {
             if (i->fs.st_mtim.tv_sec > youngest_secs ||
                 (i->fs.st_mtim.tv_sec == youngest_secs &&
@@ -961,6 +1057,7 @@ void RestoreEntry::loadFromIndex(IndexEntry *ie)
     last_part_size = ie->last_part_size;
     ondisk_part_size = ie->ondisk_part_size;
     ondisk_last_part_size = ie->ondisk_last_part_size;
+    content_hash = ie->content_hash;
 }
 
 bool RestoreEntry::findPartContainingOffset(size_t file_offset, uint *partnr, size_t *offset_inside_part)
@@ -31,12 +31,14 @@
 #include <stddef.h>
 #include <sys/stat.h>
 #include <ctime>
+#include <functional>
 #include <map>
 #include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "blockcache.h"
 #include "index.h"
 #include "tar.h"
 #include "tarfile.h"
@@ -59,8 +61,9 @@ struct RestoreEntry
     size_t last_part_size {};
     size_t ondisk_part_size {};
     size_t ondisk_last_part_size {};
-    bool loaded {};
     UpdateDisk disk_update {};
+    // The hex sha256 of the contents, empty unless stored with --contenthash.
+    std::string content_hash;
 
     RestoreEntry() {}
     RestoreEntry(FileStat s, size_t o, Path *p) : fs(s), path(p), offset_(o) { }
@@ -97,6 +100,32 @@ enum PointInTimeFormat : short {
     both_point
 };
 
+// The entries of an index file. The name of an index file contains the hash of
+// its contents, thus the points in time that have the same index file share its
+// entries, they are loaded once and kept in flat arrays. Memory then scales with
+// the distinct indexes that are viewed, not with the number of points in time.
+struct RestoreIndex
+{
+    bool ok {};
+    // The size of the backup, as recorded in the index.
+    size_t size {};
+    // The entries in the order of the index file.
+    std::vector<RestoreEntry> entries;
+    // The entries sorted on their paths, to find them.
+    std::vector<RestoreEntry*> sorted;
+    // The entries sorted on their path names, thus the entries below a dir follow each other.
+    std::vector<RestoreEntry*> by_name;
+    // The entries directly inside the dir of the index.
+    std::vector<RestoreEntry*> top;
+    // Only the root index of a point in time lists all its tars and index files.
+    std::vector<Path*> tars;
+    std::map<Path*,Path*> gz_files;
+
+    RestoreEntry *find(Path *p);
+    // The entries below the dir, the dir must not be the root.
+    void forEachBelow(Path *dir, std::function<void(RestoreEntry*)> cb);
+};
+
 struct PointInTime {
     int key;
     size_t size;
@@ -104,27 +133,21 @@ struct PointInTime {
     std::string datetime;
     std::string direntry;
     std::string filename;
-
-    bool hasPath(Path *p) { return entries_.count(p) == 1; }
-    RestoreEntry *getPath(Path *p) { if (hasPath(p)) { return &entries_[p]; } else { return NULL; } }
-    RestoreEntry *addPath(Path *p) {
-        assert(entries_.count(p) == 0);
-        entries_[p] = RestoreEntry();
-        return &entries_[p];
-    }
-    void addTar(Path *p) {
-        tars_.push_back(p);
-    }
-    bool hasLoadedGzFile(Path *gz) { return loaded_gz_files_.count(gz) == 1; }
-    void addLoadedGzFile(Path *gz) { loaded_gz_files_.insert(gz); }
-    bool hasGzFiles() { return gz_files_.size() != 0; }
-    void addGzFile(Path *parent, Path *gzfile)
+    // A hard link between dirs is stored in the index of their nearest common ancestor,
+    // thus a dir can have entries in several indexes. These are the merged contents.
+    std::map<Path*,std::vector<RestoreEntry*>> merged_dirs;
+
+    RestoreEntry *root() { return &root_; }
+    void setRootIndex(RestoreIndex *index) { root_index_ = index; size = index->size; }
+    bool hasGzFiles() { return root_index_ != NULL; }
+    Path *getGzFile(Path *dir)
     {
-        //fprintf(stderr, "GURKA Add gz file %s to dir %s\n", gzfile->c_str(), parent->c_str());
-        gz_files_[parent] = gzfile;
+        if (!root_index_) return NULL;
+        auto i = root_index_->gz_files.find(dir);
+        if (i == root_index_->gz_files.end()) return NULL;
+        return i->second;
     }
-    Path *getGzFile(Path *dir) { if (gz_files_.count(dir) == 1) { return gz_files_[dir]; } else { return NULL; } }
-    std::vector<Path*> *tarfiles() { return &tars_; }
+    std::vector<Path*> *tarfiles() { assert(root_index_); return &root_index_->tars; }
 
     const struct timespec *ts() { return &ts_; }
     uint64_t point() { return point_; }
@@ -139,10 +162,9 @@ private:
 
     struct timespec ts_;
     uint64_t point_;
-    std::vector<Path*> tars_;
-    std::map<Path*,RestoreEntry,depthFirstSortPath> entries_;
-    std::map<Path*,Path*> gz_files_;
-    std::set<Path*> loaded_gz_files_;
+    // The root dir is not in any index, each point in time has its own.
+    RestoreEntry root_;
+    RestoreIndex *root_index_ {};
 };
 
 struct Restore
@@ -161,14 +183,19 @@ struct Restore
                struct fuse_file_info *fi);
     int readlinkCB(const char *path, char *buf, size_t s);
 
+    // Load the index file, the dir is NULL for the root index of the point in time.
     bool loadGz(PointInTime *point, Path *gz, Path *dir_to_prepend);
-
-    Path *loadDirContents(PointInTime *point, Path *path);
-    void loadCache(PointInTime *point, Path *path);
+    // The contents of a dir, they are in the index of the dir if it has one of its own.
+    std::vector<RestoreEntry*> *dirContents(PointInTime *point, RestoreEntry *dir);
+    // Some entries below the dir, that has an index of its own, are stored in an index further up.
+    bool hasEntriesAbove(PointInTime *point, Path *dir);
 
     PointInTime *singlePointInTime() { return single_point_in_time_; }
     PointInTime *mostRecentPointInTime() { return most_recent_point_in_time_; }
+    // Find the points in time from the index files in the root of the backup fs.
     RC lookForPointsInTime(PointInTimeFormat f, Path *src);
+    // Use these index file names, as listed by StorageTool::listPointsInTime.
+    RC lookForPointsInTime(PointInTimeFormat f, std::vector<std::string> &index_files);
     std::vector<PointInTime> &historyOldToNew() { return history_old_to_new_; }
     PointInTime *findPointInTime(std::string s);
     PointInTime *setPointInTime(std::string g);
@@ -182,6 +209,7 @@ struct Restore
     ptr<FileSystem> asFileSystem() { return contents_fs_; }
     FuseAPI *asFuseAPI();
     FileSystem *backupFileSystem() { return backup_fs_; }
+    BlockCache *blockCache() { return block_cache_.get(); }
 
     ~Restore();
 
@@ -200,6 +228,13 @@ struct Restore
     FileSystem *backup_fs_ {};
     FuseAPI *fuse_api_ {};
     std::unique_ptr<FileSystem> contents_fs_;
+    // The reads from the tars in the backup fs, read ahead when sequential.
+    std::unique_ptr<BlockCache> block_cache_;
+    // The loaded index files, shared by the points in time.
+    std::map<Path*,RestoreIndex> indexes_;
+
+    // The index of the dir, NULL if the dir has no index file of its own.
+    RestoreIndex *loadIndex_(PointInTime *point, Path *dir);
 };
 
 // Restore from a file system containing a backup full of beak files
@@ -0,0 +1,242 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "scheduler.h"
+
+#include "fit.h"
+#include "lock.h"
+#include "log.h"
+#include "util.h"
+
+#include <algorithm>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+static ComponentId SCHEDULER = registerLogComponent("scheduler");
+
+using namespace std;
+
+// Only the most recent samples are kept, the storage performance changes over time.
+static const size_t max_samples = 256;
+// An estimate needs at least this many samples.
+static const size_t min_samples = 4;
+
+struct TransferHistoryImplementation : public TransferHistory
+{
+    TransferHistoryImplementation(ptr<FileSystem> fs, Path *storage_location);
+
+    RC load();
+    RC save();
+
+    void addSample(size_t bytes, double secs);
+    size_t numSamples() { return samples_.size(); }
+    bool estimate(double *latency, double *bytes_per_second);
+
+private:
+
+    FileSystem *fs_ {};
+    Path *file_ {};
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    vector<pair<double,double>> samples_; // bytes, secs
+};
+
+unique_ptr<TransferHistory> newTransferHistory(ptr<FileSystem> fs, Path *storage_location)
+{
+    return unique_ptr<TransferHistory>(new TransferHistoryImplementation(fs, storage_location));
+}
+
+TransferHistoryImplementation::TransferHistoryImplementation(ptr<FileSystem> fs, Path *storage_location)
+    : fs_(fs)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "transfers_%08x", hashString(storage_location->str()));
+    file_ = cacheDir()->append(name);
+}
+
+RC TransferHistoryImplementation::load()
+{
+    vector<char> buf;
+    FileStat st;
+    if (fs_->stat(file_, &st).isErr()) return RC::ERR;
+    RC rc = fs_->loadVector(file_, 65536, &buf);
+    if (rc.isErr()) return rc;
+
+    auto i = buf.begin();
+    bool eof = false, err = false;
+    string type = eatTo(buf, i, '\n', 64, &eof, &err);
+    if (type != "#beak transfers 1")
+    {
+        warning(SCHEDULER, "Not a proper transfer history %s\n", file_->c_str());
+        return RC::ERR;
+    }
+    samples_.clear();
+    while (!eof)
+    {
+        string line = eatTo(buf, i, '\n', 64, &eof, &err);
+        if (err) break;
+        unsigned long long bytes;
+        double secs;
+        if (sscanf(line.c_str(), "%llu %lf", &bytes, &secs) != 2) return RC::ERR;
+        samples_.push_back({(double)bytes, secs});
+    }
+    debug(SCHEDULER, "loaded %zu samples from %s\n", samples_.size(), file_->c_str());
+    return RC::OK;
+}
+
+RC TransferHistoryImplementation::save()
+{
+    string s = "#beak transfers 1\n";
+    LOCK(&lock_);
+    for (auto &p : samples_)
+    {
+        char line[64];
+        snprintf(line, sizeof(line), "%llu %.6f\n", (unsigned long long)p.first, p.second);
+        s += line;
+    }
+    UNLOCK(&lock_);
+    vector<char> buf(s.begin(), s.end());
+    fs_->mkDirpWriteable(file_->parent());
+    return fs_->createFile(file_, &buf);
+}
+
+void TransferHistoryImplementation::addSample(size_t bytes, double secs)
+{
+    LOCK(&lock_);
+    samples_.push_back({(double)bytes, secs});
+    if (samples_.size() > max_samples)
+    {
+        samples_.erase(samples_.begin(), samples_.begin()+(samples_.size()-max_samples));
+    }
+    UNLOCK(&lock_);
+}
+
+bool TransferHistoryImplementation::estimate(double *latency, double *bytes_per_second)
+{
+    LOCK(&lock_);
+    vector<pair<double,double>> xy = samples_;
+    UNLOCK(&lock_);
+
+    if (xy.size() < min_samples) return false;
+    double min_bytes = xy[0].first, max_bytes = xy[0].first;
+    for (auto &p : xy)
+    {
+        min_bytes = min(min_bytes, p.first);
+        max_bytes = max(max_bytes, p.first);
+    }
+    // All files of the same size cannot separate the latency from the bandwidth.
+    if (max_bytes - min_bytes < 1) return false;
+
+    // secs = a*bytes + b, where a is the time per byte and b the latency.
+    double a, b;
+    fitFirstOrderCurve(xy, &a, &b);
+    if (!(a > 0)) return false;
+    *latency = max(b, 0.0);
+    *bytes_per_second = 1.0/a;
+    debug(SCHEDULER, "estimated latency %.3fs bandwidth %s/s from %zu samples\n",
+          *latency, humanReadable((size_t)*bytes_per_second).c_str(), xy.size());
+    return true;
+}
+
+struct ThrottleImplementation : public Throttle
+{
+    ThrottleImplementation(BandwidthLimit *limit) : limit_(limit) {}
+
+    void consumed(size_t len);
+
+private:
+
+    BandwidthLimit *limit_ {};
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    // The time (in micro seconds) when all bytes sent so far are within the limit.
+    uint64_t due_ {};
+};
+
+unique_ptr<Throttle> newThrottle(BandwidthLimit *limit)
+{
+    if (!limit->isSet()) return NULL;
+    return unique_ptr<Throttle>(new ThrottleImplementation(limit));
+}
+
+void ThrottleImplementation::consumed(size_t len)
+{
+    size_t bps = limit_->bytesPerSecond(time(NULL));
+    if (bps == 0) return;
+
+    LOCK(&lock_);
+    uint64_t now = clockGetTimeMicroSeconds();
+    // Unused bandwidth can be saved up for at most one second of burst.
+    if (due_ + 1000000 < now) due_ = now - 1000000;
+    due_ += (uint64_t)((double)len * 1000000.0 / (double)bps);
+    uint64_t wait = due_ > now ? due_ - now : 0;
+    UNLOCK(&lock_);
+
+    if (wait > 0) usleep(wait);
+}
+
+void planTransfers(TransferHistory *history,
+                   vector<size_t> &sizes,
+                   int default_connections,
+                   int max_connections,
+                   size_t bwlimit,
+                   TransferPlan *plan)
+{
+    plan->order.resize(sizes.size());
+    for (size_t i = 0; i < sizes.size(); ++i) plan->order[i] = i;
+    stable_sort(plan->order.begin(), plan->order.end(),
+                [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    int n = default_connections;
+    plan->secs = 0;
+
+    double latency, bps;
+    bool known = history != NULL && sizes.size() > 0 && history->estimate(&latency, &bps);
+    if (known)
+    {
+        double total = 0;
+        for (size_t s : sizes) total += s;
+        double avg = total / sizes.size();
+        // While a connection waits out the latency of one file, the other
+        // connections can transfer theirs.
+        double want = 1 + ceil(latency * bps / max(avg, 1.0));
+        if (bwlimit > 0)
+        {
+            // More connections than needed to reach the limit only wait in the throttle.
+            want = min(want, ceil((double)bwlimit / bps));
+        }
+        n = (int)min(want, (double)max_connections);
+    }
+    n = max(1, min(n, max_connections));
+    if (sizes.size() > 0) n = min(n, (int)sizes.size());
+    plan->connections = n;
+
+    if (known)
+    {
+        double rate = bps;
+        if (bwlimit > 0) rate = min(bps, (double)bwlimit / n);
+        // Simulate the connections picking the next file as they become free.
+        vector<double> free_at(n, 0.0);
+        for (size_t i : plan->order)
+        {
+            auto first = min_element(free_at.begin(), free_at.end());
+            *first += latency + sizes[i] / rate;
+        }
+        plan->secs = *max_element(free_at.begin(), free_at.end());
+    }
+    debug(SCHEDULER, "planned %zu transfers over %d connections, estimated %.1fs\n",
+          sizes.size(), plan->connections, plan->secs);
+}
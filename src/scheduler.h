@@ -0,0 +1,84 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "always.h"
+#include "configuration.h"
+#include "filesystem.h"
+
+#include <memory>
+#include <vector>
+
+// The measured transfers to a storage, persisted in the cache dir so that the
+// next command can plan its uploads. Each sample is the size and the duration of
+// a single file transfer. A first order fit of the samples gives the latency,
+// the time to transfer an empty file, and the bandwidth of a connection.
+struct TransferHistory
+{
+    // Load the samples of earlier commands. Fails if there are none.
+    virtual RC load() = 0;
+    virtual RC save() = 0;
+
+    // Thread safe, the connections to a storage add their samples concurrently.
+    virtual void addSample(size_t bytes, double secs) = 0;
+    virtual size_t numSamples() = 0;
+    // Returns false if the samples are too few or too similar for an estimate.
+    virtual bool estimate(double *latency, double *bytes_per_second) = 0;
+
+    virtual ~TransferHistory() = default;
+};
+
+std::unique_ptr<TransferHistory> newTransferHistory(ptr<FileSystem> fs, Path *storage_location);
+
+// Keeps the transfers to a storage within its bandwidth limit.
+// A single throttle is shared by all connections to the storage.
+struct Throttle
+{
+    // Sleep until sending len more bytes is within the limit.
+    virtual void consumed(size_t len) = 0;
+
+    virtual ~Throttle() = default;
+};
+
+// Returns NULL if the storage has no bandwidth limit.
+std::unique_ptr<Throttle> newThrottle(BandwidthLimit *limit);
+
+struct TransferPlan
+{
+    // The number of connections to use.
+    int connections {};
+    // The files, as indexes into the sizes, in the order they should be started.
+    std::vector<size_t> order;
+    // Estimated total time in seconds, zero if there is no history to estimate from.
+    double secs {};
+};
+
+// Plan the transfer of files with the given sizes to a storage with the measured history.
+// The largest files are started first, so that the connections finish at about the same time.
+// Enough connections are used to hide the latency, but never more than max_connections,
+// without a usable history default_connections are used. With a bandwidth limit
+// (bytes per second, zero is unlimited) fewer connections are needed to reach the limit.
+void planTransfers(TransferHistory *history,
+                   std::vector<size_t> &sizes,
+                   int default_connections,
+                   int max_connections,
+                   size_t bwlimit,
+                   TransferPlan *plan);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sha256.h"
+
+#include "log.h"
+#include "threads.h"
+
+#include <openssl/evp.h>
+
+using namespace std;
+
+static ComponentId HASH = registerLogComponent("sha256");
+
+SHA256Hasher::SHA256Hasher()
+{
+    ctx_ = EVP_MD_CTX_new();
+    if (ctx_ == NULL || EVP_DigestInit_ex(ctx_, EVP_sha256(), NULL) != 1)
+    {
+        error(HASH, "Could not initialize sha256 digest.\n");
+    }
+}
+
+SHA256Hasher::~SHA256Hasher()
+{
+    EVP_MD_CTX_free(ctx_);
+}
+
+void SHA256Hasher::update(const void *data, size_t len)
+{
+    EVP_DigestUpdate(ctx_, data, len);
+}
+
+void SHA256Hasher::final(vector<char> *hash)
+{
+    unsigned int len = SHA256_DIGEST_LENGTH;
+    hash->resize(SHA256_DIGEST_LENGTH);
+    EVP_DigestFinal_ex(ctx_, (unsigned char*)&(*hash)[0], &len);
+    assert(len == SHA256_DIGEST_LENGTH);
+    // Prepare for the next hash.
+    EVP_DigestInit_ex(ctx_, EVP_sha256(), NULL);
+}
+
+void SHA256Hasher::peek(vector<char> *hash)
+{
+    unsigned int len = SHA256_DIGEST_LENGTH;
+    hash->resize(SHA256_DIGEST_LENGTH);
+    EVP_MD_CTX *copy = EVP_MD_CTX_new();
+    if (copy == NULL || EVP_MD_CTX_copy_ex(copy, ctx_) != 1)
+    {
+        error(HASH, "Could not copy sha256 digest.\n");
+    }
+    EVP_DigestFinal_ex(copy, (unsigned char*)&(*hash)[0], &len);
+    assert(len == SHA256_DIGEST_LENGTH);
+    EVP_MD_CTX_free(copy);
+}
+
+void sha256(const void *data, size_t len, vector<char> *hash)
+{
+    // Allocating a new EVP context for every small hash is
+    // expensive, thus keep one around for each thread.
+    static thread_local SHA256Hasher hasher;
+    hasher.update(data, len);
+    hasher.final(hash);
+}
+
+void sha256Many(size_t n, int num_threads,
+                function<void(size_t,SHA256Hasher*)> fill,
+                function<void(size_t,vector<char>&)> done)
+{
+    parallelFor(n, num_threads, [&](size_t i) {
+            static thread_local SHA256Hasher hasher;
+            vector<char> hash;
+            fill(i, &hasher);
+            hasher.final(&hash);
+            done(i, hash);
+        });
+    debug(HASH, "hashed %zu entries using %d threads\n", n, num_threads);
+}
@@ -0,0 +1,62 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include "always.h"
+
+#include <functional>
+#include <openssl/sha.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Incremental sha256 using the openssl EVP api, which picks
+// the fastest implementation for the cpu (eg SHA-NI or AVX2).
+struct SHA256Hasher
+{
+    SHA256Hasher();
+    ~SHA256Hasher();
+
+    void update(const void *data, size_t len);
+    void update(std::string &s) { update(s.c_str(), s.length()); }
+    void update(std::vector<char> &v) { if (v.size() > 0) update(&v[0], v.size()); }
+    // Store the hash into hash, the hasher is then ready for new data.
+    void final(std::vector<char> *hash);
+    // Store the hash of the data so far into hash, the hasher continues with more data.
+    void peek(std::vector<char> *hash);
+
+private:
+    // This is an EVP_MD_CTX, openssl/evp.h cannot be included here since it clashes with UI.
+    struct evp_md_ctx_st *ctx_;
+
+    SHA256Hasher(const SHA256Hasher&) = delete;
+    SHA256Hasher &operator=(const SHA256Hasher&) = delete;
+};
+
+// Hash a single buffer, reusing a hasher per thread.
+void sha256(const void *data, size_t len, std::vector<char> *hash);
+
+// Calculate n hashes, where fill(i, hasher) updates the hasher with
+// the data for hash i and done(i, hash) receives the result.
+// The hashes are spread over num_threads threads.
+void sha256Many(size_t n, int num_threads,
+                std::function<void(size_t,SHA256Hasher*)> fill,
+                std::function<void(size_t,std::vector<char>&)> done);
+
+#endif
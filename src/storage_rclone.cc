@@ -17,87 +17,151 @@
 
 #include "storage_rclone.h"
 
+#include "lock.h"
 #include "log.h"
+#include "rclone_rc.h"
+#include "threads.h"
+
+#include <atomic>
 
 using namespace std;
 
 static ComponentId RCLONE = registerLogComponent("rclone");
 
-RC rcloneListBeakFiles(Storage *storage,
-                       vector<TarFileName> *files,
-                       vector<TarFileName> *bad_files,
-                       vector<string> *other_files,
-                       map<Path*,FileStat> *contents,
-                       ptr<System> sys,
-                       ProgressStatistics *st)
+// The number of transfers the rcd runs at the same time.
+static const int max_rcd_jobs = 8;
+// Deletes without an rcd are split into chunks of this many files,
+// and this many rclone processes delete chunks at the same time.
+static const size_t delete_chunk_size = 1000;
+static const int num_concurrent_deletes = 4;
+
+void rcloneAddListedFile(Storage *storage,
+                         string &file_name,
+                         size_t siz,
+                         vector<TarFileName> *files,
+                         vector<TarFileName> *bad_files,
+                         vector<string> *other_files,
+                         map<Path*,FileStat> *contents)
+{
+    TarFileName tfn;
+    string dir;
+    bool ok = tfn.parseFileName(file_name, &dir);
+    // Only files that have proper beakfs names are included.
+    if (ok) {
+        if (tfn.ondisk_size == siz)
+        {
+            files->push_back(tfn);
+            Path *p = Path::lookup(dir)->prepend(storage->storage_location);
+            char filename[1024];
+            tfn.writeTarFileNameIntoBuffer(filename, sizeof(filename), p);
+            Path *file_path = Path::lookup(filename);
+            FileStat fs;
+            fs.st_size = (off_t)siz;
+            fs.st_mtim.tv_sec = tfn.sec;
+            fs.st_mtim.tv_nsec = tfn.nsec;
+            fs.st_mode |= S_IRUSR;
+            fs.st_mode |= S_IFREG;
+            (*contents)[file_path] = fs;
+        }
+        else
+        {
+            bad_files->push_back(tfn);
+        }
+    } else {
+        other_files->push_back(file_name);
+    }
+}
+
+RC rcloneListFiles(Storage *storage,
+                   ptr<System> sys,
+                   function<void(string &file, size_t size)> cb,
+                   bool recursive)
 {
     assert(storage->type == RCloneStorage);
 
-    RC rc = RC::OK;
-    vector<char> out;
-    vector<string> args;
+    RCloneRC *session = rcloneSession(sys);
+    if (session)
+    {
+        vector<RCloneEntry> entries;
+        RC rc = rcloneList(session, storage->storage_location->str(), &entries, recursive);
+        if (rc.isErr()) return RC::ERR;
+        for (auto &e : entries) {
+            cb(e.path, e.size);
+        }
+        return RC::OK;
+    }
 
+    vector<string> args;
     args.push_back("ls");
-    args.push_back(storage->storage_location->c_str());
-    rc = sys->invoke("rclone", args, &out);
-
-    if (rc.isErr()) return RC::ERR;
-
-    auto i = out.begin();
-    bool eof = false, err = false;
-
-    for (;;) {
-        eatWhitespace(out, i, &eof);
-        if (eof) break;
-        string size = eatTo(out, i, ' ', 64, &eof, &err);
-        if (eof || err) break;
-        string file_name = eatTo(out, i, '\n', 4096, &eof, &err);
-        if (err) break;
-        TarFileName tfn;
-        string dir;
-        bool ok = tfn.parseFileName(file_name, &dir);
-        // Only files that have proper beakfs names are included.
-        if (ok) {
-            size_t siz = (size_t)atol(size.c_str());
-            if (tfn.ondisk_size == siz)
-            {
-                files->push_back(tfn);
-                Path *p = Path::lookup(dir)->prepend(storage->storage_location);
-                char filename[1024];
-                tfn.writeTarFileNameIntoBuffer(filename, sizeof(filename), p);
-                Path *file_path = Path::lookup(filename);
-                FileStat fs;
-                fs.st_size = (off_t)siz;
-                fs.st_mtim.tv_sec = tfn.sec;
-                fs.st_mtim.tv_nsec = tfn.nsec;
-                fs.st_mode |= S_IRUSR;
-                fs.st_mode |= S_IFREG;
-                (*contents)[file_path] = fs;
-            }
-            else
-            {
-                bad_files->push_back(tfn);
-            }
-        } else {
-            other_files->push_back(file_name);
-        }
+    if (!recursive)
+    {
+        args.push_back("--max-depth");
+        args.push_back("1");
     }
-    if (err) return RC::ERR;
+    args.push_back(storage->storage_location->c_str());
 
+    // Parse each line as it arrives, a listing of a large storage can be huge.
+    bool err = false;
+    LineSplitter lines([&](string &line) {
+            // Example line: "   123456 dir/beak_s_....tar"
+            vector<char> v(line.begin(), line.end());
+            v.push_back('\n');
+            auto i = v.begin();
+            bool eof = false, e = false;
+            eatWhitespace(v, i, &eof);
+            if (eof) return;
+            string size = eatTo(v, i, ' ', 64, &eof, &e);
+            if (eof || e) { err = true; return; }
+            string file_name = eatTo(v, i, '\n', 4096, &eof, &e);
+            if (e) { err = true; return; }
+            cb(file_name, (size_t)atol(size.c_str()));
+        });
+    RC rc = sys->invoke("rclone", args, NULL, CaptureStdout,
+                        [&](char *buf, size_t len) { lines.feed(buf, len); });
+    lines.flush();
+
+    if (rc.isErr() || err) return RC::ERR;
     return RC::OK;
 }
 
+// Account for a file that the rcd has finished transferring.
+static void fileTransferred(ProgressStatistics *st, Path *path)
+{
+    if (st->stats.file_sizes.count(path))
+    {
+        st->stats.size_files_stored += st->stats.file_sizes[path];
+        st->stats.num_files_stored++;
+        st->updateProgress();
+    }
+}
 
-void parse_rclone_verbose_output(ProgressStatistics *st,
-                                 Storage *storage,
-                                 char *buf,
-                                 size_t len)
+// Run the jobs on the rcd and report every file that failed.
+static RC runJobs(RCloneRC *session, vector<RCloneJob> *jobs, vector<Path*> *files,
+                  function<void(Path*,RCloneJob*)> done)
+{
+    return rcloneRunJobs(session, jobs, max_rcd_jobs, [&](RCloneJob *job) {
+            Path *file = (*files)[job - &(*jobs)[0]];
+            if (job->result.isErr()) {
+                failure(RCLONE, "%s %s failed: %s\n", job->method.c_str(), file->c_str(), job->error.c_str());
+                return;
+            }
+            done(file, job);
+        });
+}
+
+// Returns the file that rclone reports as copied, or NULL.
+Path *parse_rclone_verbose_output(ProgressStatistics *st,
+                                  Storage *storage,
+                                  char *buf,
+                                  size_t len)
 {
     // Parse verbose output and look for:
     // 2018/01/29 20:05:36 INFO  : code/src/s01_001517180913.689221661_11659264_b6f526ca4e988180fe6289213a338ab5a4926f7189dfb9dddff5a30ab50fc7f3_0.tar: Copied (new)
     // And look for stat lines like:
     // 2019/01/29 22:32:37 INFO  :       185M / 2.370 GBytes, 8%, 3.079 MBytes/s, ETA 12m8s (xfr#0/242)
     size_t from, to;
+    // Too short to be a log line.
+    if (len < 3) return NULL;
     // Find the beginning of the file path.
     for (from=1; from<len-1; ++from) {
         if (buf[from-1] == ' ' && buf[from] == ':' && buf[from+1] == ' ') {
@@ -111,6 +175,8 @@ void parse_rclone_verbose_output(ProgressStatistics *st,
             break;
         }
     }
+    // Not a log line, for example an error message from rclone.
+    if (to < from) return NULL;
     if (from == to) {
         // Perhaps a stat line
         // Sadly the stats are currently not usable.
@@ -152,7 +218,23 @@ void parse_rclone_verbose_output(ProgressStatistics *st,
         {
             warning(RCLONE, "Error! No file size found for %s\n", path->c_str());
         }
+        // Only a copied file is known to be complete, not one that failed.
+        if (string(buf+to+2, len-to-2).find("Copied") == 0) return path;
+    }
+    return NULL;
+}
+
+// Remember how long the transfers to the storage took, to plan the next transfers.
+static void recordTransfers(Storage *storage, FileSystem *local_fs, vector<pair<size_t,double>> &samples)
+{
+    if (samples.size() == 0) return;
+    auto history = newTransferHistory(local_fs, storage->storage_location);
+    history->load();
+    for (auto &s : samples)
+    {
+        history->addSample(s.first, s.second);
     }
+    history->save();
 }
 
 RC rcloneSendFiles(Storage *storage,
@@ -160,8 +242,34 @@ RC rcloneSendFiles(Storage *storage,
                    Path *local_dir,
                    FileSystem *local_fs,
                    ptr<System> sys,
+                   Journal *journal,
                    ProgressStatistics *st)
 {
+    // The rcd has a single bandwidth limit for all its transfers, a storage
+    // with its own limit is sent to by rclone invoked with --bwlimit instead.
+    RCloneRC *session = storage->bwlimit.isSet() ? NULL : rcloneSession(sys);
+    if (session)
+    {
+        vector<RCloneJob> jobs(files->size());
+        for (size_t i = 0; i < files->size(); ++i) {
+            Path *p = (*files)[i];
+            jobs[i].method = "operations/copyfile";
+            jobs[i].params["srcFs"] = local_dir->str();
+            jobs[i].params["srcRemote"] = p->str();
+            jobs[i].params["dstFs"] = storage->storage_location->str();
+            jobs[i].params["dstRemote"] = p->str();
+        }
+        vector<pair<size_t,double>> samples;
+        RC rc = runJobs(session, &jobs, files, [&](Path *p, RCloneJob *job) {
+                Path *f = p->prepend(storage->storage_location);
+                samples.push_back({st->stats.file_sizes[f], job->secs});
+                fileTransferred(st, f);
+                if (journal) journal->stored(f, st->stats.file_sizes[f]);
+            });
+        recordTransfers(storage, local_fs, samples);
+        return rc;
+    }
+
     string files_to_send;
     for (auto& p : *files) {
         files_to_send.append(p->c_str());
@@ -174,17 +282,22 @@ RC rcloneSendFiles(Storage *storage,
     args.push_back("-v");
     args.push_back("--stats-one-line");
     args.push_back("--stats=10s");
+    if (storage->bwlimit.isSet()) {
+        args.push_back("--bwlimit");
+        args.push_back(storage->bwlimit.str());
+    }
     args.push_back("--include-from");
     args.push_back(tmp->c_str());
     args.push_back(local_dir->c_str());
     args.push_back(storage->storage_location->str());
     vector<char> output;
     RC rc = sys->invoke("rclone", args, &output, CaptureBoth,
-                        [&st, storage](char *buf, size_t len) {
-                            parse_rclone_verbose_output(st,
-                                                        storage,
-                                                        buf,
-                                                        len);
+                        [&st, storage, journal](char *buf, size_t len) {
+                            Path *copied = parse_rclone_verbose_output(st,
+                                                                       storage,
+                                                                       buf,
+                                                                       len);
+                            if (copied && journal) journal->stored(copied, st->stats.file_sizes[copied]);
                         });
 
     local_fs->deleteFile(tmp);
@@ -192,6 +305,84 @@ RC rcloneSendFiles(Storage *storage,
     return rc;
 }
 
+RC rcloneStreamFiles(Storage *storage,
+                     vector<Path*> *files,
+                     FileSystem *backup_fs,
+                     FileSystem *local_fs,
+                     ptr<System> sys,
+                     int num_uploads,
+                     Throttle *throttle,
+                     Journal *journal,
+                     ProgressStatistics *st)
+{
+    assert(storage->type == RCloneStorage);
+
+    // Prepare the remote names before uploading.
+    vector<string> targets;
+    vector<size_t> sizes;
+    for (auto p : *files)
+    {
+        Path *target = p->prepend(storage->storage_location);
+        targets.push_back(target->str());
+        sizes.push_back(st->stats.file_sizes[target]);
+    }
+
+    pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+    atomic<size_t> num_failed {0};
+    vector<pair<size_t,double>> samples;
+
+    parallelFor(files->size(), num_uploads, [&](size_t i)
+    {
+        Path *file = (*files)[i];
+        off_t offset = 0;
+        vector<string> args;
+        args.push_back("rcat");
+        args.push_back(targets[i]);
+        vector<char> output;
+        debug(RCLONE, "streaming %s\n", targets[i].c_str());
+        uint64_t start = clockGetTimeMicroSeconds();
+        RC rc = sys->invokeWithInput("rclone", args,
+                                     [&](char *buf, size_t len)
+                                     {
+                                         ssize_t n = backup_fs->pread(file, buf, len, offset);
+                                         // A tar that cannot be read completely must not be stored,
+                                         // its name would claim contents it does not have.
+                                         if (n < 0 || (n == 0 && (size_t)offset < sizes[i]))
+                                         {
+                                             failure(RCLONE, "Could not read %s at offset %jd\n",
+                                                     file->c_str(), (intmax_t)offset);
+                                             return (ssize_t)-1;
+                                         }
+                                         if (n == 0) return (ssize_t)0;
+                                         offset += n;
+                                         if (throttle) throttle->consumed(n);
+                                         LOCK(&progress_lock);
+                                         st->stats.size_files_stored += n;
+                                         st->updateProgress();
+                                         UNLOCK(&progress_lock);
+                                         return n;
+                                     },
+                                     &output, CaptureBoth);
+        if (rc.isErr())
+        {
+            output.push_back(0);
+            failure(RCLONE, "Could not upload %s: %s\n", targets[i].c_str(), &output[0]);
+            num_failed++;
+            return;
+        }
+        double secs = (clockGetTimeMicroSeconds() - start) / 1000000.0;
+        LOCK(&progress_lock);
+        st->stats.num_files_stored++;
+        st->updateProgress();
+        samples.push_back({(size_t)offset, secs});
+        UNLOCK(&progress_lock);
+        if (journal) journal->stored(file->prepend(storage->storage_location), offset);
+    });
+
+    recordTransfers(storage, local_fs, samples);
+    return num_failed > 0 ? RC::ERR : RC::OK;
+}
+
 RC rcloneFetchFiles(Storage *storage,
                     vector<Path*> *files,
                     Path *local_dir,
@@ -208,6 +399,24 @@ RC rcloneFetchFiles(Storage *storage,
     // Now create the proper target dir: /home/me/.cache/beak/s3_backups_crypt:
     Path *target_dir = rclone_storage_config->prepend(local_dir);
 
+    RCloneRC *session = rcloneSession(sys);
+    if (session)
+    {
+        vector<RCloneJob> jobs(files->size());
+        for (size_t i = 0; i < files->size(); ++i) {
+            Path *pp = (*files)[i]->subpath(1);
+            jobs[i].method = "operations/copyfile";
+            jobs[i].params["srcFs"] = rclone_storage_config->str();
+            jobs[i].params["srcRemote"] = pp->str();
+            jobs[i].params["dstFs"] = target_dir->str();
+            jobs[i].params["dstRemote"] = pp->str();
+            debug(RCLONE, "fetch \"%s\"\n", pp->c_str());
+        }
+        return runJobs(session, &jobs, files, [&](Path *p, RCloneJob *job) {
+                fileTransferred(progress, p);
+            });
+    }
+
     string files_to_fetch;
     for (auto& p : *files) {
         // Drop the leading storage location (eg s3_work_crypt:).
@@ -249,31 +458,58 @@ RC rcloneDeleteFiles(Storage *storage,
                      ptr<System> sys,
                      ProgressStatistics *progress)
 {
-    string files_to_delete;
-    for (auto& p : *files) {
-        files_to_delete.append(p->c_str());
-        files_to_delete.append("\n");
-        debug(RCLONE, "delete \"%s\"\n", p->c_str());
+    RCloneRC *session = rcloneSession(sys);
+    if (session)
+    {
+        vector<RCloneJob> jobs(files->size());
+        for (size_t i = 0; i < files->size(); ++i) {
+            string remote = (*files)[i]->str();
+            if (remote.length() > 0 && remote[0] == '/') remote = remote.substr(1);
+            jobs[i].method = "operations/deletefile";
+            jobs[i].params["fs"] = storage->storage_location->str();
+            jobs[i].params["remote"] = remote;
+            debug(RCLONE, "delete \"%s\"\n", remote.c_str());
+        }
+        return runJobs(session, &jobs, files, [](Path *p, RCloneJob *job) {});
     }
 
-    Path *tmp = local_fs->mkTempFile("beak_deleting_", files_to_delete);
-
-    RC rc = RC::OK;
-    vector<string> args;
-    args.push_back("delete");
-    args.push_back("--include-from");
-    args.push_back(tmp->c_str());
-    args.push_back(storage->storage_location->c_str());
-    vector<char> output;
-    rc = sys->invoke("rclone", args, &output, CaptureBoth,
-                     [&progress, storage](char *buf, size_t len) {
-                         parse_rclone_verbose_output(progress,
-                                                     storage,
-                                                     buf,
-                                                     len);
-                     });
+    // Without a session, the files are deleted in chunks by concurrent rclone processes.
+    // The chunks use --files-from so that rclone does not list the whole storage.
+    size_t num_chunks = (files->size() + delete_chunk_size - 1) / delete_chunk_size;
+    pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+    atomic<size_t> num_failed {0};
 
-    local_fs->deleteFile(tmp);
+    parallelFor(num_chunks, num_concurrent_deletes, [&](size_t c)
+    {
+        string files_to_delete;
+        size_t to = min(files->size(), (c+1)*delete_chunk_size);
+        for (size_t i = c*delete_chunk_size; i < to; ++i) {
+            files_to_delete.append((*files)[i]->c_str());
+            files_to_delete.append("\n");
+            debug(RCLONE, "delete \"%s\"\n", (*files)[i]->c_str());
+        }
 
-    return rc;
+        Path *tmp = local_fs->mkTempFile("beak_deleting_", files_to_delete);
+
+        vector<string> args;
+        args.push_back("delete");
+        args.push_back("--files-from");
+        args.push_back(tmp->c_str());
+        args.push_back(storage->storage_location->c_str());
+        vector<char> output;
+        RC rc = sys->invoke("rclone", args, &output, CaptureBoth,
+                            [&progress, &progress_lock, storage](char *buf, size_t len) {
+                                LOCK(&progress_lock);
+                                parse_rclone_verbose_output(progress,
+                                                            storage,
+                                                            buf,
+                                                            len);
+                                UNLOCK(&progress_lock);
+                            });
+        if (rc.isErr()) num_failed++;
+
+        local_fs->deleteFile(tmp);
+    });
+
+    return num_failed > 0 ? RC::ERR : RC::OK;
 }
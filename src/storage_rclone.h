@@ -18,21 +18,48 @@
 #include "always.h"
 
 #include "configuration.h"
+#include "journal.h"
 #include "monitor.h"
+#include "scheduler.h"
 #include "system.h"
 #include "tarfile.h"
 
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
 
-RC rcloneListBeakFiles(Storage *storage,
-                       std::vector<TarFileName> *files,
-                       std::vector<TarFileName> *bad_files,
-                       std::vector<std::string> *other_files,
-                       std::map<Path*,FileStat> *contents,
-                       ptr<System> sys,
-                       ProgressStatistics *progress);
+// Invoke cb for every file in the storage, with its name relative to the storage and its size.
+// The listing is parsed as it arrives, it is never held in memory as a whole.
+// When not recursive, only the files in the root of the storage are listed.
+RC rcloneListFiles(Storage *storage,
+                   ptr<System> sys,
+                   std::function<void(std::string &file, size_t size)> cb,
+                   bool recursive = true);
+
+// Sort a listed file into beak files, beak files with the wrong size and other files.
+// The beak files are also added to contents.
+void rcloneAddListedFile(Storage *storage,
+                         std::string &file,
+                         size_t size,
+                         std::vector<TarFileName> *files,
+                         std::vector<TarFileName> *bad_files,
+                         std::vector<std::string> *other_files,
+                         std::map<Path*,FileStat> *contents);
+
+// Upload the files, in order, by streaming them from the backup file system into rclone rcat,
+// running num_uploads uploads concurrently. The throttle can be NULL. The time each upload took
+// is added to the transfer history of the storage, kept in the cache dir of the local fs.
+// Each completed upload is added to the journal, unless it is NULL.
+RC rcloneStreamFiles(Storage *storage,
+                     std::vector<Path*> *files,
+                     FileSystem *backup_fs,
+                     FileSystem *local_fs,
+                     ptr<System> sys,
+                     int num_uploads,
+                     Throttle *throttle,
+                     Journal *journal,
+                     ProgressStatistics *progress);
 
 RC rcloneFetchFiles(Storage *storage,
                     std::vector<Path*> *files,
@@ -41,11 +68,13 @@ RC rcloneFetchFiles(Storage *storage,
                     FileSystem *local_fs,
                     ProgressStatistics *progress);
 
+// Each completed upload is added to the journal, unless it is NULL.
 RC rcloneSendFiles(Storage *storage,
                    std::vector<Path*> *files,
                    Path *local_dir,
                    FileSystem *local_fs,
                    ptr<System> sys,
+                   Journal *journal,
                    ProgressStatistics *progress);
 
 RC rcloneDeleteFiles(Storage *storage,
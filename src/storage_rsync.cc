@@ -19,6 +19,8 @@
 
 #include "log.h"
 
+#include <algorithm>
+
 using namespace std;
 
 static ComponentId RSYNC = registerLogComponent("rsync");
@@ -51,77 +53,81 @@ void parse_rsync_verbose_output_(ProgressStatistics *st,
     }
 }
 
-RC rsyncListBeakFiles(Storage *storage,
-                      vector<TarFileName> *files,
-                      vector<TarFileName> *bad_files,
-                      vector<string> *other_files,
-                      map<Path*,FileStat> *contents,
-                      ptr<System> sys,
-                      ProgressStatistics *progress)
+void rsyncAddListedFile(Storage *storage,
+                        string &file_name,
+                        size_t siz,
+                        vector<TarFileName> *files,
+                        vector<TarFileName> *bad_files,
+                        vector<string> *other_files,
+                        map<Path*,FileStat> *contents)
+{
+    TarFileName tfn;
+    bool ok = tfn.parseFileName(file_name);
+    // Only files that have proper beakfs names are included.
+    if (ok) {
+        // Check that the remote size equals the content. If there is a mismatch,
+        // then for sure the file must be overwritte/updated. Perhaps there was an earlier
+        // transfer interruption....
+        if ( (tfn.type != TarContents::INDEX_FILE && tfn.size == siz) ||
+             (tfn.type == TarContents::INDEX_FILE && tfn.size == 0) )
+        {
+            files->push_back(tfn);
+            Path *p = tfn.asPathWithDir(storage->storage_location);
+            FileStat fs;
+            fs.st_size = (off_t)siz;
+            fs.st_mtim.tv_sec = tfn.sec;
+            fs.st_mtim.tv_nsec = tfn.nsec;
+            fs.st_mode |= S_IRUSR;
+            fs.st_mode |= S_IFREG;
+            (*contents)[p] = fs;
+        }
+        else
+        {
+            bad_files->push_back(tfn);
+        }
+    } else {
+        other_files->push_back(file_name);
+    }
+}
+
+RC rsyncListFiles(Storage *storage,
+                  ptr<System> sys,
+                  function<void(string &file, size_t size)> cb,
+                  bool recursive)
 {
     assert(storage->type == RSyncStorage);
 
-    RC rc = RC::OK;
-    vector<char> out;
     vector<string> args;
-
-    args.push_back("-r");
+    // Without -r, rsync lists the root dir itself as "." and its files and subdirs.
+    if (recursive) args.push_back("-r");
     string p = storage->storage_location->str()+"/"; // rsync needs the trailing slash
     args.push_back(p.c_str());
-    rc = sys->invoke("rsync", args, &out);
-
-    if (rc.isErr()) return RC::ERR;
-
-    auto i = out.begin();
-    bool eof = false, err = false;
-
-    for (;;) {
-	// Example line:
-        // -r--------         43,008 2017/10/28 17:58:22 apis/z01_001509206302.681804342_0_1a599a3c00aec163169081a7e7b6dcdda25b2792daa80ba6454f81c6802d8ec4_0.gz
-        eatWhitespace(out, i, &eof); if (eof) break;
-        string permissions = eatTo(out, i, ' ', 64, &eof, &err); if (eof || err) break;
-        eatWhitespace(out, i, &eof); if (eof) break;
-        string size = eatTo(out, i, ' ', 64, &eof, &err); if (eof || err) break;
-        size = keepDigits(size); // Remove commas
-        eatWhitespace(out, i, &eof); if (eof) break;
-        string date = eatTo(out, i, ' ', 64, &eof, &err); if (eof || err) break;
-        string time = eatTo(out, i, ' ', 64, &eof, &err); if (eof || err) break;
-        string file_name = eatTo(out, i, '\n', 1024, &eof, &err); if (err) break;
-
-        TarFileName tfn;
-        bool ok = tfn.parseFileName(file_name);
-        // Only files that have proper beakfs names are included.
-        if (ok) {
-            // Check that the remote size equals the content. If there is a mismatch,
-            // then for sure the file must be overwritte/updated. Perhaps there was an earlier
-            // transfer interruption....
-            size_t siz = (size_t)atol(size.c_str());
-            if (rc.isErr()) {
-                siz = -1;
-            }
-            if ( (tfn.type != TarContents::INDEX_FILE && tfn.size == siz) ||
-                 (tfn.type == TarContents::INDEX_FILE && tfn.size == 0) )
-            {
-                files->push_back(tfn);
-                Path *p = tfn.asPathWithDir(storage->storage_location);
-                FileStat fs;
-                fs.st_size = (off_t)siz;
-                fs.st_mtim.tv_sec = tfn.sec;
-                fs.st_mtim.tv_nsec = tfn.nsec;
-                fs.st_mode |= S_IRUSR;
-                fs.st_mode |= S_IFREG;
-                (*contents)[p] = fs;
-            }
-            else
-            {
-                bad_files->push_back(tfn);
-            }
-        } else {
-            other_files->push_back(file_name);
-        }
-    }
-    if (err) return RC::ERR;
 
+    // Parse each line as it arrives, a listing of a large storage can be huge.
+    bool err = false;
+    LineSplitter lines([&](string &line) {
+            // Example line:
+            // -r--------         43,008 2017/10/28 17:58:22 apis/z01_001509206302.681804342_0_1a599a3c00aec163169081a7e7b6dcdda25b2792daa80ba6454f81c6802d8ec4_0.gz
+            vector<char> v(line.begin(), line.end());
+            v.push_back('\n');
+            auto i = v.begin();
+            bool eof = false, e = false;
+            eatWhitespace(v, i, &eof); if (eof) return;
+            string permissions = eatTo(v, i, ' ', 64, &eof, &e); if (eof || e) { err = true; return; }
+            eatWhitespace(v, i, &eof); if (eof) { err = true; return; }
+            string size = eatTo(v, i, ' ', 64, &eof, &e); if (eof || e) { err = true; return; }
+            size = keepDigits(size); // Remove commas
+            eatWhitespace(v, i, &eof); if (eof) { err = true; return; }
+            string date = eatTo(v, i, ' ', 64, &eof, &e); if (eof || e) { err = true; return; }
+            string time = eatTo(v, i, ' ', 64, &eof, &e); if (eof || e) { err = true; return; }
+            string file_name = eatTo(v, i, '\n', 1024, &eof, &e); if (e) { err = true; return; }
+            cb(file_name, (size_t)atol(size.c_str()));
+        });
+    RC rc = sys->invoke("rsync", args, NULL, CaptureStdout,
+                        [&](char *buf, size_t len) { lines.feed(buf, len); });
+    lines.flush();
+
+    if (rc.isErr() || err) return RC::ERR;
     return RC::OK;
 }
 
@@ -143,6 +149,11 @@ RC rsyncSendFiles(Storage *storage,
     vector<string> args;
     args.push_back("-a");
     args.push_back("-v");
+    size_t bwlimit = storage->bwlimit.bytesPerSecond(time(NULL));
+    if (bwlimit > 0) {
+        // Rsync has no timetable, use the limit in effect now, in KiB/s.
+        args.push_back("--bwlimit="+to_string(max(bwlimit/1024, (size_t)1)));
+    }
     args.push_back("--files-from");
     args.push_back(tmp->c_str());
 
@@ -22,17 +22,28 @@
 #include "system.h"
 #include "tarfile.h"
 
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
 
-RC rsyncListBeakFiles(Storage *storage,
-                      std::vector<TarFileName> *files,
-                      std::vector<TarFileName> *bad_files,
-                      std::vector<std::string> *other_files,
-                      std::map<Path*,FileStat> *contents,
-                      ptr<System> sys,
-                      ProgressStatistics *progress);
+// Invoke cb for every file in the storage, with its name relative to the storage and its size.
+// The listing is parsed as it arrives, it is never held in memory as a whole.
+// When not recursive, only the files in the root of the storage are listed.
+RC rsyncListFiles(Storage *storage,
+                  ptr<System> sys,
+                  std::function<void(std::string &file, size_t size)> cb,
+                  bool recursive = true);
+
+// Sort a listed file into beak files, beak files with the wrong size and other files.
+// The beak files are also added to contents.
+void rsyncAddListedFile(Storage *storage,
+                        std::string &file,
+                        size_t size,
+                        std::vector<TarFileName> *files,
+                        std::vector<TarFileName> *bad_files,
+                        std::vector<std::string> *other_files,
+                        std::map<Path*,FileStat> *contents);
 
 RC rsyncFetchFiles(Storage *storage,
                    std::vector<Path*> *files,
@@ -19,14 +19,24 @@
 
 #include "backup.h"
 #include "filesystem_helpers.h"
+#include "journal.h"
+#include "listingcache.h"
+#include "lock.h"
 #include "log.h"
 #include "monitor.h"
 #include "prune.h"
+#include "scheduler.h"
 #include "system.h"
 #include "storage_rclone.h"
 #include "storage_rsync.h"
+#include "threads.h"
 
 #include <algorithm>
+#include <deque>
+#include <errno.h>
+#include <map>
+#include <pthread.h>
+#include <set>
 #include <unistd.h>
 
 static ComponentId STORAGETOOL = registerLogComponent("storagetool");
@@ -35,6 +45,8 @@ static ComponentId DELTA = registerLogComponent("delta");
 
 using namespace std;
 
+struct StoredFiles;
+
 struct StorageToolImplementation : public StorageTool
 {
     StorageToolImplementation(ptr<System> sys, ptr<FileSystem> local_fs);
@@ -53,16 +65,53 @@ struct StorageToolImplementation : public StorageTool
                              Settings *settings,
                              ProgressStatistics *progress);
 
+    RC storeBackupLocallyThenRemotely(FileSystem *backup_fs,
+                                      FileSystem *origin_fs,
+                                      Backup *backup,
+                                      Storage *local,
+                                      vector<Storage*> &remotes,
+                                      Settings *settings,
+                                      ProgressStatistics *progress,
+                                      vector<ProgressStatistics*> &remote_progress,
+                                      function<void()> local_stored);
+
     RC removeBackupFiles(Storage *storage,
                          std::vector<Path*>& files,
                          ProgressStatistics *progress);
 
+    unique_ptr<SubtreeStore> newSubtreeStore(FileSystem *origin_fs,
+                                             Storage *storage,
+                                             Settings *settings,
+                                             ProgressStatistics *progress);
+
     FileSystem *asCachedReadOnlyFS(Storage *storage,
-                                   Monitor *monitor);
+                                   Monitor *monitor,
+                                   bool prefetch_index_files,
+                                   bool fresh);
 
     FileSystem *asStatOnlyFS(Storage *storage,
                              Monitor *monitor);
 
+    RC listPointsInTime(Storage *storage,
+                        vector<string> *index_files,
+                        bool fresh);
+
+    RC relistStorage(Storage *storage,
+                     size_t *num_differences);
+
+    void updateListingCache_(Storage *storage,
+                             vector<Path*> &files,
+                             bool removed,
+                             RC rc,
+                             Journal *journal,
+                             ProgressStatistics *progress);
+
+    RC copyStoredFiles_(StoredFiles *stored,
+                        Path *local_dir,
+                        Storage *storage,
+                        Settings *settings,
+                        ProgressStatistics *progress);
+
     System *sys_;
     FileSystem *local_fs_;
 };
@@ -80,6 +129,115 @@ StorageToolImplementation::StorageToolImplementation(ptr<System>sys,
 
 }
 
+// The storage is listed again when the cached listing is older than this.
+static const uint64_t max_listing_age = 24*3600;
+
+// List the files in an rclone or rsync storage into the cache.
+static RC listStorage(Storage *storage, System *sys, ListingCache *cache)
+{
+    cache->clear();
+    auto add = [cache](string &file, size_t size) { cache->add(file, size); };
+    if (storage->type == RCloneStorage)
+    {
+        return rcloneListFiles(storage, sys, add);
+    }
+    return rsyncListFiles(storage, sys, add);
+}
+
+// List the index files in the root of an rclone or rsync storage, ie the points in time.
+// This is a cheap listing compared to listing all the files in the storage.
+static RC listRootIndexFiles(Storage *storage, System *sys, map<string,size_t> *index_files)
+{
+    auto add = [index_files](string &file, size_t size) {
+        if (file.find('/') == string::npos && TarFileName::isIndexFile(Path::lookup(file)))
+        {
+            (*index_files)[file] = size;
+        }
+    };
+    debug(STORAGETOOL, "listing the root of %s\n", storage->storage_location->c_str());
+    if (storage->type == RCloneStorage)
+    {
+        return rcloneListFiles(storage, sys, add, false);
+    }
+    return rsyncListFiles(storage, sys, add, false);
+}
+
+// List the beak files in an rclone or rsync storage. The cached listing is used
+// if it is recent enough, otherwise the storage is listed and the cache rewritten.
+// Store skips the files found in the listing, thus the cached listing is only trusted
+// if the points in time in the root of the storage are still the ones it lists.
+// A store or prune made by another host always adds or removes a point in time.
+// A fresh listing is always made when requested.
+static RC listBeakFiles(Storage *storage,
+                        System *sys,
+                        FileSystem *local_fs,
+                        vector<TarFileName> *files,
+                        vector<TarFileName> *bad_files,
+                        vector<string> *other_files,
+                        map<Path*,FileStat> *contents,
+                        bool fresh = false)
+{
+    auto cache = newListingCache(local_fs, storage->storage_location);
+    if (fresh || cache->load().isErr() || cache->age() > max_listing_age)
+    {
+        RC rc = listStorage(storage, sys, cache.get());
+        if (rc.isErr()) return rc;
+        cache->save();
+    }
+    else
+    {
+        debug(STORAGETOOL, "using cached listing of %s with %zu files\n",
+              storage->storage_location->c_str(), cache->size());
+        // An interrupted upload journaled the files it completed,
+        // they are in the storage even though the listing lacks them.
+        auto journal = newJournal(sys, local_fs, storage->storage_location);
+        if (journal->load().isOk())
+        {
+            int depth = storage->storage_location->depth();
+            size_t n = 0;
+            journal->forEachStored([&](Path *file, size_t size) {
+                    cache->add(file->subpath(depth)->str(), size);
+                    n++;
+                });
+            if (n > 0)
+            {
+                info(STORAGETOOL, "Resuming upload to %s, skipping %zu already uploaded files.\n",
+                     storage->storage_location->c_str(), n);
+                cache->save();
+            }
+        }
+        map<string,size_t> listed, cached;
+        RC rc = listRootIndexFiles(storage, sys, &listed);
+        if (rc.isErr()) return rc;
+        cache->forEach([&](string &file, size_t size) {
+                if (file.find('/') == string::npos && TarFileName::isIndexFile(Path::lookup(file)))
+                {
+                    cached[file] = size;
+                }
+            });
+        if (listed != cached)
+        {
+            verbose(STORAGETOOL, "The points in time in %s changed since it was listed, listing it again.\n",
+                    storage->storage_location->c_str());
+            rc = listStorage(storage, sys, cache.get());
+            if (rc.isErr()) return rc;
+            cache->save();
+        }
+    }
+
+    cache->forEach([=](string &file, size_t size) {
+            if (storage->type == RCloneStorage)
+            {
+                rcloneAddListedFile(storage, file, size, files, bad_files, other_files, contents);
+            }
+            else
+            {
+                rsyncAddListedFile(storage, file, size, files, bad_files, other_files, contents);
+            }
+        });
+    return RC::OK;
+}
+
 void add_backup_work(ProgressStatistics *progress,
                      vector<Path*> *files_to_backup,
                      Path *path,
@@ -124,15 +282,39 @@ void add_backup_work(ProgressStatistics *progress,
     }
 }
 
-void store_local_backup_file(Backup *backup,
+// Recurse the files to store with the index files last, and the index files of
+// a dir after those of its subdirs. A point in time is then never stored before its tars.
+static RC recurseIndexFilesLast(FileSystem *fs, Path *dir, function<RecurseOption(Path*,FileStat*)> cb)
+{
+    vector<pair<Path*,FileStat>> index_files;
+    RC rc = fs->recurse(dir, [&](Path *path, FileStat *stat) {
+            if (stat->isRegularFile() && TarFileName::isIndexFile(path))
+            {
+                index_files.push_back({path, *stat});
+                return RecurseContinue;
+            }
+            return cb(path, stat);
+        });
+    stable_sort(index_files.begin(), index_files.end(),
+                [](const pair<Path*,FileStat> &a, const pair<Path*,FileStat> &b) {
+                    return a.first->depth() > b.first->depth();
+                });
+    for (auto &i : index_files) cb(i.first, &i.second);
+    return rc;
+}
+
+RC store_local_backup_file(Backup *backup,
                              FileSystem *origin_fs,
                              FileSystem *storage_fs,
                              Path *path,
                              FileStat *stat,
                              Settings *settings,
+                             Journal *journal,
+                             StagedFiles *staged,
+                             function<void()> stored,
                              ProgressStatistics *progress)
 {
-    if (!stat->isRegularFile()) return;
+    if (!stat->isRegularFile()) return RC::OK;
 
     uint partnr;
     TarFile *tarr = backup->findTarFromPath(path, &partnr);
@@ -148,30 +330,70 @@ void store_local_backup_file(Backup *backup,
         stat->sameMTime(&old_stat))
     {
         verbose(STORAGETOOL, "up to date %s\n", file_name->c_str());
+        stored();
     }
     else
     {
-        if (rc.isOk())
-        {
-            storage_fs->deleteFile(file_name);
-        }
+        // The tar file gets its proper name when it is completely written.
+        Path *staging = staged->stagingName(file_name);
         // The size gets incrementally update while the tar file is written!
         auto func = [&progress](size_t n){ progress->stats.size_files_stored += n; };
-        tarr->createFilee(file_name, stat, partnr, origin_fs, storage_fs, 0, func);
+        auto write_tar = [&] (off_t o, char *buffer, size_t len) {
+            size_t n = tarr->readVirtualTar(buffer, len, o, origin_fs, partnr);
+            journal->written(file_name, stat, o+n, buffer, n);
+            func(n);
+            return n;
+        };
+        size_t offset = journal->resumeOffset(file_name, stat, storage_fs, staging);
+        bool continued = false;
+        if (offset > 0)
+        {
+            // Continue the tar file where the interrupted store stopped.
+            continued = storage_fs->continueFile(staging, stat, offset, write_tar);
+            if (continued)
+            {
+                func(offset);
+                verbose(STORAGETOOL, "continued %s from %zu\n", file_name->c_str(), offset);
+            }
+        }
+        if (!continued && !storage_fs->createFile(staging, stat, write_tar))
+        {
+            // A partially written tar must never get its proper name.
+            failure(STORAGETOOL, "Could not write %s\n", file_name->c_str());
+            storage_fs->deleteFile(staging);
+            return RC::ERR;
+        }
+        if (backup->numChangedContents() > 0)
+        {
+            // The index would have the wrong content hash for a changed file.
+            failure(STORAGETOOL, "Could not store %s since file contents changed after they were hashed.\n",
+                    file_name->c_str());
+            storage_fs->deleteFile(staging);
+            return RC::ERR;
+        }
 
-        storage_fs->utime(file_name, stat);
+        storage_fs->utime(staging, stat);
+        if (staged->written(file_name, stored).isErr())
+        {
+            failure(STORAGETOOL, "Could not commit the files stored before %s\n", file_name->c_str());
+            return RC::ERR;
+        }
         progress->stats.num_files_stored++;
         progress->updateProgress();
         verbose(STORAGETOOL, "stored %s\n", file_name->c_str());
     }
+    return RC::OK;
 }
 
-void copy_local_backup_file(Path *relpath,
+RC copy_local_backup_file(Path *relpath,
                             Path *source_location,
                             FileSystem *source_fs,
                             FileStat *stat,
                             Path *dest_location,
                             FileSystem *dest_fs,
+                            Throttle *throttle,
+                            Journal *journal,
+                            StagedFiles *staged,
                             ProgressStatistics *progress)
 {
     debug(STORAGETOOL, "copy %s ## %s to %s ## %s\n",
@@ -180,7 +402,7 @@ void copy_local_backup_file(Path *relpath,
           dest_location->c_str(),
           relpath->c_str());
 
-    if (!stat->isRegularFile()) return;
+    if (!stat->isRegularFile()) return RC::OK;
 
     Path *from_file_name = relpath->prepend(source_location);
     Path *to_file_name = relpath->prepend(dest_location);
@@ -196,26 +418,95 @@ void copy_local_backup_file(Path *relpath,
     }
     else
     {
-        if (rc.isOk())
-        {
-            dest_fs->deleteFile(to_file_name);
-        }
         // The size gets incrementally update while the tar file is written!
         auto update_progress = [&progress](size_t n){ progress->stats.size_files_stored += n; };
-        dest_fs->createFile(to_file_name, stat,
-                            [&] (off_t offset, char *buffer, size_t len) {
-                                debug(STORAGETOOL,"Copy %ju bytes to file %s\n", len, to_file_name->c_str());
-                                size_t n = source_fs->pread(from_file_name, buffer, len, offset);
-                                debug(STORAGETOOL, "Copied %ju bytes from %ju.\n", n, offset);
-                                update_progress(n);
-                                return n;
-                               });
-
-        dest_fs->utime(to_file_name, stat);
+        auto copy = [&] (off_t offset, char *buffer, size_t len) {
+            debug(STORAGETOOL,"Copy %ju bytes to file %s\n", len, to_file_name->c_str());
+            ssize_t r = source_fs->pread(from_file_name, buffer, len, offset);
+            // Nothing is written when the source cannot be read.
+            size_t n = r > 0 ? r : 0;
+            debug(STORAGETOOL, "Copied %ju bytes from %ju.\n", n, offset);
+            if (throttle) throttle->consumed(n);
+            journal->written(to_file_name, stat, offset+n, buffer, n);
+            update_progress(n);
+            return n;
+        };
+        // The copy gets its proper name when it is completely written.
+        Path *staging = staged->stagingName(to_file_name);
+        size_t offset = journal->resumeOffset(to_file_name, stat, dest_fs, staging);
+        bool continued = false;
+        if (offset > 0)
+        {
+            // Continue the copy where the interrupted copy stopped.
+            continued = dest_fs->continueFile(staging, stat, offset, copy);
+            if (continued)
+            {
+                update_progress(offset);
+                verbose(STORAGETOOL, "continued %s from %zu\n", to_file_name->c_str(), offset);
+            }
+        }
+        if (!continued && !dest_fs->createFile(staging, stat, copy))
+        {
+            // A partial copy must never get its proper name.
+            failure(STORAGETOOL, "Could not write %s\n", to_file_name->c_str());
+            dest_fs->deleteFile(staging);
+            return RC::ERR;
+        }
+
+        dest_fs->utime(staging, stat);
+        if (staged->written(to_file_name, [](){}).isErr())
+        {
+            failure(STORAGETOOL, "Could not commit the files copied before %s\n", to_file_name->c_str());
+            return RC::ERR;
+        }
         progress->stats.num_files_stored++;
         progress->updateProgress();
         verbose(STORAGETOOL, "copied %s\n", to_file_name->c_str());
     }
+    return RC::OK;
+}
+
+// Without a measured history, upload this many files concurrently.
+static const int default_uploads = 4;
+// Never upload more files concurrently than this.
+static const int max_uploads = 16;
+
+// Reorder the files to upload according to a plan based on the measured
+// transfers to the storage. Returns the number of uploads to run concurrently.
+static int planUploads(Storage *storage,
+                       vector<Path*> *files,
+                       FileSystem *local_fs,
+                       Settings *settings,
+                       ProgressStatistics *progress)
+{
+    auto history = newTransferHistory(local_fs, storage->storage_location);
+    history->load();
+
+    vector<size_t> sizes;
+    for (auto f : *files)
+    {
+        sizes.push_back(progress->stats.file_sizes[f->prepend(storage->storage_location)]);
+    }
+    TransferPlan plan;
+    planTransfers(history.get(), sizes, default_uploads, max_uploads,
+                  storage->bwlimit.bytesPerSecond(time(NULL)), &plan);
+
+    vector<Path*> ordered;
+    for (size_t i : plan.order)
+    {
+        ordered.push_back((*files)[i]);
+    }
+    files->swap(ordered);
+
+    if (plan.secs > 0)
+    {
+        verbose(STORAGETOOL, "Planned %zu uploads to %s over %d connections, estimated %s.\n",
+                files->size(), storage->storage_location->c_str(), plan.connections,
+                humanReadableTime((int)plan.secs, true).c_str());
+    }
+    // The thread count on the command line overrides the plan.
+    if (settings->threads_supplied) return settings->threads;
+    return plan.connections;
 }
 
 RC StorageToolImplementation::storeBackupIntoStorage(FileSystem *backup_fs,
@@ -238,6 +529,11 @@ RC StorageToolImplementation::storeBackupIntoStorage(FileSystem *backup_fs,
     map<Path*,FileStat> contents;
     // Read only file system to list the beak files in the storage.
     unique_ptr<FileSystem> fs;
+    // The origin is read with the io priority of the storage.
+    if (storage->ionice != NormalIO) sys_->setIOPriority(storage->ionice);
+    // Continue an interrupted store into the same storage.
+    auto journal = newJournal(sys_, local_fs_, storage->storage_location);
+    journal->load();
 
     if (storage->type == FileSystemStorage)
     {
@@ -248,15 +544,7 @@ RC StorageToolImplementation::storeBackupIntoStorage(FileSystem *backup_fs,
     {
         vector<TarFileName> files, bad_files;
         vector<string> other_files;
-        RC rc = RC::OK;
-        if (storage->type == RCloneStorage)
-        {
-            rc = rcloneListBeakFiles(storage, &files, &bad_files, &other_files, &contents, sys_, progress);
-        }
-        else
-        {
-            rc = rsyncListBeakFiles(storage, &files, &bad_files, &other_files, &contents, sys_, progress);
-        }
+        RC rc = listBeakFiles(storage, sys_, local_fs_, &files, &bad_files, &other_files, &contents);
         if (rc.isErr())
         {
             error(STORAGETOOL, "Could not list files in rclone storage %s\n", storage->storage_location->c_str());
@@ -284,7 +572,7 @@ RC StorageToolImplementation::storeBackupIntoStorage(FileSystem *backup_fs,
         if (storage->type == RCloneStorage ||
             storage->type == RSyncStorage)
         {
-            storage_fs = asCachedReadOnlyFS(storage, monitor);
+            storage_fs = asCachedReadOnlyFS(storage, monitor, true, false);
         }
         unique_ptr<Restore> restore  = newRestore(storage_fs);
 
@@ -373,46 +661,81 @@ RC StorageToolImplementation::storeBackupIntoStorage(FileSystem *backup_fs,
     switch (storage->type) {
     case FileSystemStorage:
     {
-        backup_fs->recurse(Path::lookupRoot(), [=]
+        Journal *j = journal.get();
+        auto staged = newStagedFiles(storage_fs);
+        StagedFiles *sf = staged.get();
+        bool failed = false;
+        recurseIndexFilesLast(backup_fs, Path::lookupRoot(), [=,&failed]
                            (Path *path, FileStat *stat) {
-                               store_local_backup_file(backupp,
-                                                       origin_fs,
-                                                       storage_fs,
-                                                       path,
-                                                       stat,
-                                                       settings,
-                                                       progress);
+                               // A point in time missing a tar is never stored.
+                               if (failed) return RecurseContinue;
+                               if (store_local_backup_file(backupp,
+                                                           origin_fs,
+                                                           storage_fs,
+                                                           path,
+                                                           stat,
+                                                           settings,
+                                                           j,
+                                                           sf,
+                                                           [](){},
+                                                           progress).isErr()) failed = true;
                                return RecurseContinue; });
+        if (failed) staged->abandon();
+        if (staged->commit().isErr() || failed)
+        {
+            error(STORAGETOOL, "Could not store into %s\n", storage->storage_location->c_str());
+        }
         break;
     }
-    case RSyncStorage:
     case RCloneStorage:
+    {
+        progress->updateProgress();
+        // Stream the virtual tars directly into rclone, no fuse mount needed.
+        vector<Path*> files_to_stream = beak_files_to_backup;
+        int num_uploads = planUploads(storage, &files_to_stream, local_fs_, settings, progress);
+        auto throttle = newThrottle(&storage->bwlimit);
+        RC rc = rcloneStreamFiles(storage,
+                                  &files_to_stream,
+                                  backup_fs,
+                                  local_fs_,
+                                  sys_,
+                                  num_uploads,
+                                  throttle.get(),
+                                  journal.get(),
+                                  progress);
+        updateListingCache_(storage, beak_files_to_backup, false, rc, journal.get(), progress);
+        if (rc.isErr()) {
+            error(STORAGETOOL, "Error when invoking rclone.\n");
+        }
+        if (backupp->numChangedContents() > 0) {
+            error(STORAGETOOL, "File contents changed after they were hashed, the index in %s has the wrong hashes.\n",
+                  storage->storage_location->c_str());
+        }
+        break;
+    }
+    case RSyncStorage:
     {
         progress->updateProgress();
         Path *mount = local_fs_->mkTempDir("beak_send_");
         unique_ptr<FuseMount> fuse_mount = sys_->mount(mount, backupp->asFuseAPI(), settings->fusedebug);
 
         if (!fuse_mount) {
-            error(STORAGETOOL, "Could not mount beak filesystem for rclone/rsync.\n");
+            error(STORAGETOOL, "Could not mount beak filesystem for rsync.\n");
         }
 
-        RC rc = RC::OK;
-        if (storage->type == RCloneStorage) {
-            rc = rcloneSendFiles(storage,
-                                 &beak_files_to_backup,
-                                 mount,
-                                 local_fs_,
-                                 sys_, progress);
-        } else {
-            rc = rsyncSendFiles(storage,
-                                &beak_files_to_backup,
-                                mount,
-                                local_fs_,
-                                sys_, progress);
-        }
+        RC rc = rsyncSendFiles(storage,
+                               &beak_files_to_backup,
+                               mount,
+                               local_fs_,
+                               sys_, progress);
+        updateListingCache_(storage, beak_files_to_backup, false, rc, NULL, progress);
 
         if (rc.isErr()) {
-            error(STORAGETOOL, "Error when invoking rclone/rsync.\n");
+            error(STORAGETOOL, "Error when invoking rsync.\n");
+        }
+        if (backupp->numChangedContents() > 0) {
+            error(STORAGETOOL, "File contents changed after they were hashed, the index in %s has the wrong hashes.\n",
+                  storage->storage_location->c_str());
         }
 
         // Unmount virtual filesystem.
@@ -429,6 +752,8 @@ RC StorageToolImplementation::storeBackupIntoStorage(FileSystem *backup_fs,
     }
 
     progress->finishProgress();
+    if (storage->ionice != NormalIO) sys_->setIOPriority(NormalIO);
+    journal->remove();
 
     return RC::OK;
 }
@@ -443,6 +768,10 @@ RC StorageToolImplementation::copyBackupIntoStorage(FileSystem *backup_fs,
     FileSystem *storage_fs = NULL;
     // This is the list of files to be sent to the storage.
     vector<Path*> beak_files_to_backup;
+    if (storage->ionice != NormalIO) sys_->setIOPriority(storage->ionice);
+    // Continue an interrupted copy into the same storage.
+    auto journal = newJournal(sys_, local_fs_, storage->storage_location);
+    journal->load();
 
     map<Path*,FileStat> contents;
     unique_ptr<FileSystem> fs;
@@ -455,15 +784,7 @@ RC StorageToolImplementation::copyBackupIntoStorage(FileSystem *backup_fs,
     {
         vector<TarFileName> files, bad_files;
         vector<string> other_files;
-        RC rc = RC::OK;
-        if (storage->type == RCloneStorage)
-        {
-            rc = rcloneListBeakFiles(storage, &files, &bad_files, &other_files, &contents, sys_, progress);
-        }
-        else
-        {
-            rc = rsyncListBeakFiles(storage, &files, &bad_files, &other_files, &contents, sys_, progress);
-        }
+        RC rc = listBeakFiles(storage, sys_, local_fs_, &files, &bad_files, &other_files, &contents);
         if (rc.isErr())
         {
             error(STORAGETOOL, "Could not list files in rclone storage %s\n", storage->storage_location->c_str());
@@ -488,17 +809,33 @@ RC StorageToolImplementation::copyBackupIntoStorage(FileSystem *backup_fs,
     switch (storage->type) {
     case FileSystemStorage:
     {
-        backup_fs->recurse(backup_dir, [=]
+        auto throttle = newThrottle(&storage->bwlimit);
+        Throttle *t = throttle.get();
+        Journal *j = journal.get();
+        auto staged = newStagedFiles(storage_fs);
+        StagedFiles *sf = staged.get();
+        bool failed = false;
+        recurseIndexFilesLast(backup_fs, backup_dir, [=,&failed]
                            (Path *path, FileStat *stat) {
+                               // A point in time missing a tar is never copied.
+                               if (failed) return RecurseContinue;
                                Path *pp = path->subpath(backup_dir->depth());
-                               copy_local_backup_file(pp,
-                                                      backup_dir,
-                                                      backup_fs,
-                                                      stat,
-                                                      storage->storage_location,
-                                                      storage_fs,
-                                                      progress);
+                               if (copy_local_backup_file(pp,
+                                                          backup_dir,
+                                                          backup_fs,
+                                                          stat,
+                                                          storage->storage_location,
+                                                          storage_fs,
+                                                          t,
+                                                          j,
+                                                          sf,
+                                                          progress).isErr()) failed = true;
                                return RecurseContinue; });
+        if (failed) staged->abandon();
+        if (staged->commit().isErr() || failed)
+        {
+            error(STORAGETOOL, "Could not copy into %s\n", storage->storage_location->c_str());
+        }
         break;
     }
     case RSyncStorage:
@@ -507,12 +844,15 @@ RC StorageToolImplementation::copyBackupIntoStorage(FileSystem *backup_fs,
         progress->updateProgress();
 
         RC rc = RC::OK;
+        // Rsync itself skips the files it already sent, only rclone uploads are journaled.
+        Journal *j = NULL;
         if (storage->type == RCloneStorage) {
+            j = journal.get();
             rc = rcloneSendFiles(storage,
                                  &beak_files_to_backup,
                                  backup_dir,
                                  local_fs_,
-                                 sys_, progress);
+                                 sys_, j, progress);
         } else {
             rc = rsyncSendFiles(storage,
                                 &beak_files_to_backup,
@@ -520,6 +860,7 @@ RC StorageToolImplementation::copyBackupIntoStorage(FileSystem *backup_fs,
                                 local_fs_,
                                 sys_, progress);
         }
+        updateListingCache_(storage, beak_files_to_backup, false, rc, j, progress);
 
         if (rc.isErr()) {
             error(STORAGETOOL, "Error when invoking rclone/rsync.\n");
@@ -531,6 +872,8 @@ RC StorageToolImplementation::copyBackupIntoStorage(FileSystem *backup_fs,
     }
 
     progress->finishProgress();
+    if (storage->ionice != NormalIO) sys_->setIOPriority(NormalIO);
+    journal->remove();
     return RC::OK;
 }
 
@@ -543,15 +886,41 @@ RC StorageToolImplementation::removeBackupFiles(Storage *storage,
     switch (storage->type) {
     case FileSystemStorage:
     {
+        // The files of a directory are unlinked by the same thread, so that
+        // the threads do not contend for the lock of the same directory.
+        map<Path*,vector<Path*>> dirs;
         for (auto p : files_to_remove)
         {
-            Path *pp = p->prepend(storage->storage_location);
-            debug(STORAGETOOL, "removing backup file %s\n", pp->c_str());
-
-            bool ok = local_fs_->deleteFile(pp);
-            if (!ok) {
-                error(STORAGETOOL, "Could not delete local backup file: %s\n", p->c_str());
-            }
+            dirs[p->parent()].push_back(p);
+        }
+        vector<vector<Path*>*> batches;
+        for (auto &d : dirs) batches.push_back(&d.second);
+
+        // The failures are reported once all deletes are done.
+        pthread_mutex_t failed_lock = PTHREAD_MUTEX_INITIALIZER;
+        vector<Path*> failed;
+        parallelFor(batches.size(), numCores()*2, [&](size_t i) {
+                for (auto p : *batches[i])
+                {
+                    Path *pp = p->prepend(storage->storage_location);
+                    debug(STORAGETOOL, "removing backup file %s\n", pp->c_str());
+
+                    bool ok = local_fs_->deleteFile(pp);
+                    if (!ok) {
+                        LOCK(&failed_lock);
+                        failed.push_back(p);
+                        UNLOCK(&failed_lock);
+                    }
+                }
+            });
+        for (auto p : failed)
+        {
+            failure(STORAGETOOL, "Could not delete local backup file: %s\n", p->c_str());
+        }
+        if (failed.size() > 0)
+        {
+            progress->finishProgress();
+            return RC::ERR;
         }
         break;
     }
@@ -571,6 +940,7 @@ RC StorageToolImplementation::removeBackupFiles(Storage *storage,
                                   local_fs_,
                                   sys_, progress);
         }
+        updateListingCache_(storage, files_to_remove, true, rc, NULL, progress);
 
         if (rc.isErr()) {
             error(STORAGETOOL, "Error when invoking rclone/rsync.\n");
@@ -587,11 +957,474 @@ RC StorageToolImplementation::removeBackupFiles(Storage *storage,
     return RC::OK;
 }
 
+// The worker is allowed to fall this many subtrees behind the scan.
+static const size_t max_queued_subtrees = 4;
+
+struct SubtreeStoreImplementation : public SubtreeStore
+{
+    SubtreeStoreImplementation(System *sys, FileSystem *origin_fs, FileSystem *storage_fs,
+                               Storage *storage, Settings *settings, ProgressStatistics *progress);
+    ~SubtreeStoreImplementation();
+
+    void add(unique_ptr<Backup> partial, Path *dir);
+    RC finish();
+
+    void work();
+    void store(Backup *partial, Path *dir);
+
+private:
+
+    FileSystem *origin_fs_ {};
+    FileSystem *storage_fs_ {};
+    Storage *storage_ {};
+    Settings *settings_ {};
+    ProgressStatistics *progress_ {};
+    unique_ptr<Journal> journal_;
+    unique_ptr<StagedFiles> staged_;
+
+    pthread_t thread_ {};
+    bool running_ {};
+    pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t changed_ = PTHREAD_COND_INITIALIZER;
+    deque<pair<unique_ptr<Backup>,Path*>> queue_;
+    bool done_ {};
+    RC rc_ = RC::OK;
+};
+
+static void *subtreeStoreThread(void *data)
+{
+    ((SubtreeStoreImplementation*)data)->work();
+    return NULL;
+}
+
+unique_ptr<SubtreeStore> StorageToolImplementation::newSubtreeStore(FileSystem *origin_fs,
+                                                                    Storage *storage,
+                                                                    Settings *settings,
+                                                                    ProgressStatistics *progress)
+{
+    if (storage->type != FileSystemStorage) return NULL;
+    return unique_ptr<SubtreeStore>(new SubtreeStoreImplementation(sys_, origin_fs, local_fs_,
+                                                                   storage, settings, progress));
+}
+
+SubtreeStoreImplementation::SubtreeStoreImplementation(System *sys, FileSystem *origin_fs, FileSystem *storage_fs,
+                                                       Storage *storage, Settings *settings, ProgressStatistics *progress)
+    : origin_fs_(origin_fs), storage_fs_(storage_fs), storage_(storage), settings_(settings), progress_(progress)
+{
+    // The store of the full backup picks up this journal when the subtrees are stored.
+    journal_ = newJournal(sys, storage_fs, storage->storage_location);
+    journal_->load();
+    staged_ = newStagedFiles(storage_fs);
+    running_ = pthread_create(&thread_, NULL, subtreeStoreThread, this) == 0;
+}
+
+SubtreeStoreImplementation::~SubtreeStoreImplementation()
+{
+    finish();
+}
+
+void SubtreeStoreImplementation::add(unique_ptr<Backup> partial, Path *dir)
+{
+    // Without a worker the subtrees are simply stored with the rest of the backup.
+    if (!running_) return;
+    LOCK(&lock_);
+    while (queue_.size() >= max_queued_subtrees)
+    {
+        pthread_cond_wait(&changed_, &lock_);
+    }
+    queue_.push_back({move(partial), dir});
+    pthread_cond_broadcast(&changed_);
+    UNLOCK(&lock_);
+}
+
+RC SubtreeStoreImplementation::finish()
+{
+    if (!running_) return rc_;
+    LOCK(&lock_);
+    done_ = true;
+    pthread_cond_broadcast(&changed_);
+    UNLOCK(&lock_);
+    pthread_join(thread_, NULL);
+    running_ = false;
+    return rc_;
+}
+
+void SubtreeStoreImplementation::work()
+{
+    for (;;)
+    {
+        LOCK(&lock_);
+        while (queue_.size() == 0 && !done_)
+        {
+            pthread_cond_wait(&changed_, &lock_);
+        }
+        if (queue_.size() == 0)
+        {
+            UNLOCK(&lock_);
+            break;
+        }
+        unique_ptr<Backup> partial = move(queue_.front().first);
+        Path *dir = queue_.front().second;
+        queue_.pop_front();
+        pthread_cond_broadcast(&changed_);
+        UNLOCK(&lock_);
+
+        store(partial.get(), dir);
+    }
+}
+
+void SubtreeStoreImplementation::store(Backup *partial, Path *dir)
+{
+    size_t num_tars = partial->organizeFiles();
+    if (partial->numContentHashFailures() > 0)
+    {
+        failure(STORAGETOOL, "The contents of %zu files in %s could not be hashed.\n",
+                partial->numContentHashFailures(), dir->c_str());
+        rc_ = RC::ERR;
+    }
+    Path *safe_dir = partial->directories[dir]->safepath();
+    debug(STORAGETOOL, "storing subtree %s with %zu virtual tars\n", dir->c_str(), num_tars);
+
+    bool failed = false;
+    recurseIndexFilesLast(partial->asFileSystem(), Path::lookupRoot(), [=,&failed]
+                                     (Path *path, FileStat *stat) {
+        // The parents of the subtree are only there to hang the subtree from.
+        if (!stat->isRegularFile() || !path->parent()->isBelowOrEqual(safe_dir)) return RecurseContinue;
+        if (failed) return RecurseContinue;
+        size_t num_stored = progress_->stats.num_files_stored;
+        if (store_local_backup_file(partial,
+                                    origin_fs_,
+                                    storage_fs_,
+                                    path,
+                                    stat,
+                                    settings_,
+                                    journal_.get(),
+                                    staged_.get(),
+                                    [](){},
+                                    progress_).isErr()) failed = true;
+        if (progress_->stats.num_files_stored != num_stored)
+        {
+            progress_->stats.num_files_to_store++;
+            progress_->stats.size_files_to_store += stat->st_size;
+        }
+        return RecurseContinue; });
+
+    if (failed)
+    {
+        staged_->abandon();
+        rc_ = RC::ERR;
+    }
+    if (staged_->commit().isErr())
+    {
+        failure(STORAGETOOL, "Could not store %s into %s\n", dir->c_str(), storage_->storage_location->c_str());
+        rc_ = RC::ERR;
+    }
+}
+
+// Every batch sent to a remote storage starts an rclone or rsync process.
+// Thus the files are sent when enough of them are stored, or when the
+// first of them has waited long enough.
+static const size_t min_remote_batch_size = 64*1024*1024;
+static const int max_remote_batch_wait_secs = 10;
+
+// The files written to the local storage, in the order they were written.
+// The threads copying to the remote storages each keep their own position
+// in the list and wait for more files until the local store is done.
+struct StoredFiles
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t added = PTHREAD_COND_INITIALIZER;
+    // Relative to the local storage location.
+    vector<pair<Path*,FileStat>> files;
+    // The sum of the sizes of the files before each file.
+    vector<size_t> size_before;
+    size_t size {};
+    set<Path*> known;
+    bool done {};
+
+    void add(Path *file, FileStat *stat)
+    {
+        LOCK(&lock);
+        if (known.count(file) == 0)
+        {
+            known.insert(file);
+            files.push_back({file, *stat});
+            size_before.push_back(size);
+            size += stat->st_size;
+            pthread_cond_broadcast(&added);
+        }
+        UNLOCK(&lock);
+    }
+
+    void finish()
+    {
+        LOCK(&lock);
+        done = true;
+        pthread_cond_broadcast(&added);
+        UNLOCK(&lock);
+    }
+
+    // Wait for the files stored after the first from files, until they are at least
+    // min_size bytes or have waited max_wait_secs. Returns false when there are no
+    // more files to come.
+    bool waitFor(size_t from, size_t min_size, int max_wait_secs, vector<pair<Path*,FileStat>> *batch)
+    {
+        batch->clear();
+        LOCK(&lock);
+        while (files.size() <= from && !done)
+        {
+            pthread_cond_wait(&added, &lock);
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += max_wait_secs;
+        while (!done && size-size_before[from] < min_size)
+        {
+            if (pthread_cond_timedwait(&added, &lock, &deadline) == ETIMEDOUT) break;
+        }
+        batch->insert(batch->end(), files.begin()+min(from, files.size()), files.end());
+        UNLOCK(&lock);
+        return batch->size() > 0;
+    }
+};
+
+struct RemoteCopy
+{
+    StorageToolImplementation *tool {};
+    StoredFiles *stored {};
+    Path *local_dir {};
+    Storage *storage {};
+    Settings *settings {};
+    ProgressStatistics *progress {};
+    RC rc = RC::OK;
+};
+
+static void *remoteCopyThread(void *data)
+{
+    RemoteCopy *rcp = (RemoteCopy*)data;
+    rcp->rc = rcp->tool->copyStoredFiles_(rcp->stored, rcp->local_dir, rcp->storage, rcp->settings, rcp->progress);
+    return NULL;
+}
+
+RC StorageToolImplementation::storeBackupLocallyThenRemotely(FileSystem *backup_fs,
+                                                             FileSystem *origin_fs,
+                                                             Backup *backupp,
+                                                             Storage *local,
+                                                             vector<Storage*> &remotes,
+                                                             Settings *settings,
+                                                             ProgressStatistics *progress,
+                                                             vector<ProgressStatistics*> &remote_progress,
+                                                             function<void()> local_stored)
+{
+    assert(local->type == FileSystemStorage);
+    assert(remotes.size() == remote_progress.size());
+
+    StoredFiles stored;
+    // Start the remote copies first, they can list their storages while the local store runs.
+    vector<RemoteCopy> copies(remotes.size());
+    vector<pthread_t> threads;
+    for (size_t i = 0; i < remotes.size(); ++i)
+    {
+        copies[i].tool = this;
+        copies[i].stored = &stored;
+        copies[i].local_dir = local->storage_location;
+        copies[i].storage = remotes[i];
+        copies[i].settings = settings;
+        copies[i].progress = remote_progress[i];
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, remoteCopyThread, &copies[i]) != 0)
+        {
+            // Could not start a thread, copy to this storage when the local store is done.
+            copies[i].tool = NULL;
+            continue;
+        }
+        threads.push_back(thread);
+    }
+
+    // Continue an interrupted store into the local storage.
+    auto journal = newJournal(sys_, local_fs_, local->storage_location);
+    journal->load();
+    Journal *j = journal.get();
+    auto staged = newStagedFiles(local_fs_);
+    StagedFiles *sf = staged.get();
+
+    vector<Path*> files_to_store;
+    backup_fs->recurse(Path::lookupRoot(), [=,&files_to_store]
+                       (Path *path, FileStat *stat) {
+                           add_backup_work(progress, &files_to_store, path, stat,
+                                           local->storage_location, local_fs_);
+                           return RecurseContinue;
+                       });
+
+    bool failed = false;
+    recurseIndexFilesLast(backup_fs, Path::lookupRoot(), [=,&stored,&failed]
+                       (Path *path, FileStat *stat) {
+                           // A point in time missing a tar is never stored.
+                           if (failed) return RecurseContinue;
+                           Path *file = path->unRoot();
+                           FileStat st = *stat;
+                           if (store_local_backup_file(backupp,
+                                                       origin_fs,
+                                                       local_fs_,
+                                                       path,
+                                                       stat,
+                                                       settings,
+                                                       j,
+                                                       sf,
+                                                       // Stored or already up to date, let the remote copies have it.
+                                                       [&stored,file,st]() mutable { stored.add(file, &st); },
+                                                       progress).isErr()) failed = true;
+                           return RecurseContinue; });
+    if (failed) staged->abandon();
+    RC commit_rc = staged->commit();
+    if (failed) commit_rc = RC::ERR;
+    progress->finishProgress();
+    if (commit_rc.isErr())
+    {
+        failure(STORAGETOOL, "Could not store into %s\n", local->storage_location->c_str());
+        stored.finish();
+        for (auto &thread : threads) pthread_join(thread, NULL);
+        return RC::ERR;
+    }
+
+    // The local storage can hold files from earlier backups that a remote might lack.
+    Path *local_dir = local->storage_location;
+    local_fs_->recurse(local_dir, [=,&stored]
+                       (Path *path, FileStat *stat) {
+                           if (stat->isRegularFile() && !StagedFiles::isStagingName(path))
+                           {
+                               stored.add(path->subpath(local_dir->depth()), stat);
+                           }
+                           return RecurseContinue;
+                       });
+    stored.finish();
+    journal->remove();
+
+    local_stored();
+
+    for (auto &c : copies)
+    {
+        if (c.tool == NULL) c.rc = copyStoredFiles_(&stored, local_dir, c.storage, settings, c.progress);
+    }
+    for (auto &thread : threads)
+    {
+        pthread_join(thread, NULL);
+    }
+
+    RC rc = RC::OK;
+    for (auto &c : copies)
+    {
+        if (c.rc.isErr()) rc = RC::ERR;
+    }
+    return rc;
+}
+
+RC StorageToolImplementation::copyStoredFiles_(StoredFiles *stored,
+                                               Path *local_dir,
+                                               Storage *storage,
+                                               Settings *settings,
+                                               ProgressStatistics *progress)
+{
+    // This thread only serves this storage, it can keep the io priority of the storage.
+    if (storage->ionice != NormalIO) sys_->setIOPriority(storage->ionice);
+    auto throttle = newThrottle(&storage->bwlimit);
+    // Continue an interrupted copy into the storage. Rsync itself
+    // skips the files it already sent, it needs no journal.
+    auto journal = newJournal(sys_, local_fs_, storage->storage_location);
+    journal->load();
+    Journal *j = storage->type == RSyncStorage ? NULL : journal.get();
+    auto staged = newStagedFiles(local_fs_);
+
+    FileSystem *storage_fs = NULL;
+    map<Path*,FileStat> contents;
+    unique_ptr<FileSystem> fs;
+    if (storage->type == FileSystemStorage)
+    {
+        storage_fs = local_fs_;
+    }
+    else
+    {
+        vector<TarFileName> files, bad_files;
+        vector<string> other_files;
+        RC rc = listBeakFiles(storage, sys_, local_fs_, &files, &bad_files, &other_files, &contents);
+        if (rc.isErr())
+        {
+            failure(STORAGETOOL, "Could not list files in storage %s\n", storage->storage_location->c_str());
+            return RC::ERR;
+        }
+        fs = newStatOnlyFileSystem(sys_, contents);
+        storage_fs = fs.get();
+    }
+
+    RC rc = RC::OK;
+    size_t next = 0;
+    vector<pair<Path*,FileStat>> batch;
+    // A copy within the local file system is cheap, it needs no batching.
+    size_t min_size = storage->type == FileSystemStorage ? 0 : min_remote_batch_size;
+    bool started = false;
+    while (stored->waitFor(next, min_size, max_remote_batch_wait_secs, &batch))
+    {
+        next += batch.size();
+        vector<Path*> files_to_copy;
+        for (auto &f : batch)
+        {
+            add_backup_work(progress, &files_to_copy, f.first, &f.second,
+                            storage->storage_location, storage_fs);
+        }
+        if (files_to_copy.size() == 0) continue;
+        if (!started)
+        {
+            info(STORAGETOOL, "Copying local backup into %s\n", storage->storage_location->c_str());
+            started = true;
+        }
+        progress->updateProgress();
+
+        switch (storage->type) {
+        case FileSystemStorage:
+        {
+            for (auto &f : batch)
+            {
+                if (copy_local_backup_file(f.first, local_dir, local_fs_, &f.second,
+                                           storage->storage_location, storage_fs, throttle.get(), j, staged.get(),
+                                           progress).isErr()) rc = RC::ERR;
+            }
+            if (staged->commit().isErr()) rc = RC::ERR;
+            break;
+        }
+        case RSyncStorage:
+        case RCloneStorage:
+        {
+            RC r = RC::OK;
+            if (storage->type == RCloneStorage) {
+                // The rcd runs its own number of transfers, only the order of the plan is used.
+                planUploads(storage, &files_to_copy, local_fs_, settings, progress);
+                r = rcloneSendFiles(storage, &files_to_copy, local_dir, local_fs_, sys_, j, progress);
+            } else {
+                r = rsyncSendFiles(storage, &files_to_copy, local_dir, local_fs_, sys_, progress);
+            }
+            updateListingCache_(storage, files_to_copy, false, r, j, progress);
+            if (r.isErr()) {
+                failure(STORAGETOOL, "Error when invoking rclone/rsync.\n");
+                rc = RC::ERR;
+            }
+            break;
+        }
+        case NoSuchStorage:
+            assert(0);
+        }
+    }
+
+    progress->finishProgress();
+    if (rc.isOk()) journal->remove();
+    return rc;
+}
+
 struct CacheFS : ReadOnlyCacheFileSystemBaseImplementation
 {
-    CacheFS(ptr<FileSystem> cache_fs, Path *cache_dir, Storage *storage, System *sys, Monitor *monitor) :
+    CacheFS(ptr<FileSystem> cache_fs, Path *cache_dir, Storage *storage, System *sys, Monitor *monitor,
+            bool prefetch_index_files, bool fresh) :
         ReadOnlyCacheFileSystemBaseImplementation("CacheFS", cache_fs, cache_dir, storage->storage_location->depth(), monitor),
-        sys_(sys), storage_(storage) {
+        sys_(sys), storage_(storage), prefetch_index_files_(prefetch_index_files), fresh_(fresh) {
     }
 
     void refreshCache();
@@ -605,6 +1438,10 @@ protected:
 
     System *sys_ {};
     Storage *storage_ {};
+    // Otherwise the index files are fetched one at a time when read.
+    bool prefetch_index_files_ {};
+    // List the storage now, instead of using the cached listing.
+    bool fresh_ {};
 };
 
 void CacheFS::refreshCache() {
@@ -651,10 +1488,8 @@ RC CacheFS::loadDirectoryStructure(map<Path*,CacheEntry> *entries)
     case FileSystemStorage:
         break;
     case RSyncStorage:
-        rc = rsyncListBeakFiles(storage_, &files, &bad_files, &other_files, &contents, sys_, progress.get());
-        break;
     case RCloneStorage:
-        rc = rcloneListBeakFiles(storage_, &files, &bad_files, &other_files, &contents, sys_, progress.get());
+        rc = listBeakFiles(storage_, sys_, cache_fs_, &files, &bad_files, &other_files, &contents, fresh_);
         break;
     }
 
@@ -687,7 +1522,8 @@ RC CacheFS::loadDirectoryStructure(map<Path*,CacheEntry> *entries)
         (*entries)[p.first] = CacheEntry(p.second, p.first, false);
         CacheEntry *ce = &(*entries)[p.first];
         debug(CACHE, "adding %s to cache index\n", p.first->c_str());
-        if (TarFileName::isIndexFile(p.first) && !ce->isCached(cache_fs_, cache_dir_, p.first))
+        if (prefetch_index_files_ &&
+            TarFileName::isIndexFile(p.first) && !ce->isCached(cache_fs_, cache_dir_, p.first))
         {
             index_files.push_back(p.first);
             debug(CACHE, "needs index %s\n", p.first->c_str());
@@ -736,11 +1572,12 @@ RC CacheFS::fetchFiles(vector<Path*> *files)
     return RC::ERR;
 }
 
-FileSystem *StorageToolImplementation::asCachedReadOnlyFS(Storage *storage, Monitor *monitor)
+FileSystem *StorageToolImplementation::asCachedReadOnlyFS(Storage *storage, Monitor *monitor,
+                                                          bool prefetch_index_files, bool fresh)
 {
     Path *cache_dir = cacheDir();
     local_fs_->mkDirpWriteable(cache_dir);
-    CacheFS *fs = new CacheFS(local_fs_, cache_dir, storage, sys_, monitor);
+    CacheFS *fs = new CacheFS(local_fs_, cache_dir, storage, sys_, monitor, prefetch_index_files, fresh);
     fs->refreshCache();
     return fs;
 }
@@ -749,3 +1586,83 @@ FileSystem *StorageToolImplementation::asStatOnlyFS(Storage *storage, Monitor *m
 {
     return NULL;
 }
+
+RC StorageToolImplementation::listPointsInTime(Storage *storage, vector<string> *index_files, bool fresh)
+{
+    if (storage->type == FileSystemStorage)
+    {
+        vector<Path*> contents;
+        if (!local_fs_->readdir(storage->storage_location, &contents)) return RC::ERR;
+        for (auto f : contents)
+        {
+            if (TarFileName::isIndexFile(f)) index_files->push_back(f->str());
+        }
+        return RC::OK;
+    }
+    if (storage->type != RCloneStorage && storage->type != RSyncStorage) return RC::ERR;
+
+    auto cache = newListingCache(local_fs_, storage->storage_location);
+    if (!fresh && cache->loadPointsInTime(index_files).isOk() && cache->age() <= max_listing_age)
+    {
+        debug(STORAGETOOL, "using %zu cached points in time of %s\n",
+              index_files->size(), storage->storage_location->c_str());
+        return RC::OK;
+    }
+    index_files->clear();
+
+    // The manifest is only saved with a full listing, this partial listing is not saved.
+    map<string,size_t> listed;
+    RC rc = listRootIndexFiles(storage, sys_, &listed);
+    for (auto &p : listed) index_files->push_back(p.first);
+    return rc;
+}
+
+RC StorageToolImplementation::relistStorage(Storage *storage, size_t *num_differences)
+{
+    *num_differences = 0;
+    if (storage->type != RCloneStorage && storage->type != RSyncStorage) return RC::OK;
+
+    auto cached = newListingCache(local_fs_, storage->storage_location);
+    bool had_cache = cached->load().isOk();
+    auto listed = newListingCache(local_fs_, storage->storage_location);
+    RC rc = listStorage(storage, sys_, listed.get());
+    if (rc.isErr()) return rc;
+    if (had_cache)
+    {
+        *num_differences = cached->numDifferences(listed.get());
+    }
+    return listed->save();
+}
+
+void StorageToolImplementation::updateListingCache_(Storage *storage,
+                                                    vector<Path*> &files,
+                                                    bool removed,
+                                                    RC rc,
+                                                    Journal *journal,
+                                                    ProgressStatistics *progress)
+{
+    auto cache = newListingCache(local_fs_, storage->storage_location);
+    // Without a complete listing to start from, there is nothing to update.
+    if (cache->load().isErr()) return;
+    if (rc.isErr())
+    {
+        // The journal knows which of the uploads made it, they are added
+        // to the listing by the next command.
+        if (journal && !removed) return;
+        // It is not known which of the files made it, list the storage next time.
+        cache->invalidate();
+        return;
+    }
+    for (auto p : files)
+    {
+        if (removed)
+        {
+            cache->remove(p->str());
+        }
+        else
+        {
+            cache->add(p->str(), progress->stats.file_sizes[p->prepend(storage->storage_location)]);
+        }
+    }
+    cache->save();
+}
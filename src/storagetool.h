@@ -27,10 +27,24 @@
 #include "tarfile.h"
 #include "monitor.h"
 
+#include<functional>
 #include<memory>
 #include<string>
 #include<vector>
 
+// Stores the completed subtrees handed over by Backup::scanFileSystem into a
+// local storage, while the scan continues. A worker thread organizes each partial
+// backup and stores its tars. The store of the full backup then finds them up to date.
+struct SubtreeStore
+{
+    // Blocks while the worker is too far behind.
+    virtual void add(std::unique_ptr<Backup> partial, Path *dir) = 0;
+    // Wait until the added subtrees are stored.
+    virtual RC finish() = 0;
+
+    virtual ~SubtreeStore() = default;
+};
+
 struct StorageTool
 {
     virtual RC storeBackupIntoStorage(FileSystem *backup_fs,
@@ -47,8 +61,36 @@ struct StorageTool
                                      Settings *settings,
                                      ProgressStatistics *progress) = 0;
 
+    // Store the backup into the local storage and copy each file on to the remote
+    // storages as soon as it has been written locally. Every remote is fed from its
+    // own thread, with its own progress. Files already in the local storage, from
+    // earlier backups, are copied as well. The local_stored callback is invoked on
+    // the calling thread when the local store is complete, while the copying continues.
+    virtual RC storeBackupLocallyThenRemotely(FileSystem *backup_fs,
+                                              FileSystem *origin_fs,
+                                              Backup *backup,
+                                              Storage *local,
+                                              std::vector<Storage*> &remotes,
+                                              Settings *settings,
+                                              ProgressStatistics *progress,
+                                              std::vector<ProgressStatistics*> &remote_progress,
+                                              std::function<void()> local_stored) = 0;
+
+    // Returns NULL unless the storage is a local file system storage.
+    virtual std::unique_ptr<SubtreeStore> newSubtreeStore(FileSystem *origin_fs,
+                                                          Storage *storage,
+                                                          Settings *settings,
+                                                          ProgressStatistics *progress) = 0;
+
+    // A read only view of an rclone/rsync storage, the files are fetched into
+    // the cache dir when read. The index files of all points in time are fetched
+    // up front, unless only a few of them are going to be read.
+    // The cached listing of the storage does not see the uploads and deletes of
+    // other hosts, a command that deletes or syncs must have it fresh, ie listed now.
     virtual FileSystem *asCachedReadOnlyFS(Storage *storage,
-                                           Monitor *monitor) = 0;
+                                           Monitor *monitor,
+                                           bool prefetch_index_files,
+                                           bool fresh) = 0;
 
     virtual FileSystem *asStatOnlyFS(Storage *storage,
                                      Monitor *monitor) = 0;
@@ -57,6 +99,20 @@ struct StorageTool
                                  std::vector<Path*>& files,
                                  ProgressStatistics *progress) = 0;
 
+    // The names of the index files in the root of the storage, ie its points in time.
+    // For an rclone/rsync storage they are taken from the manifest saved with the
+    // cached listing, without a recent manifest only the root of the storage is listed.
+    // Fresh always lists the root, the manifest does not have the points in time
+    // stored by other hosts. Anything that deletes based on the points must be fresh.
+    virtual RC listPointsInTime(Storage *storage,
+                                std::vector<std::string> *index_files,
+                                bool fresh) = 0;
+
+    // Fully list an rclone/rsync storage and replace its cached listing.
+    // Returns the number of files where the cached listing was wrong.
+    virtual RC relistStorage(Storage *storage,
+                             size_t *num_differences) = 0;
+
     virtual ~StorageTool() = default;
 };
 
@@ -32,6 +32,17 @@ enum Capture {
     CaptureBoth
 };
 
+#define LIST_OF_IO_PRIORITIES \
+    X(NormalIO, "Normal io priority")                              \
+    X(LowIO,    "Lowest best effort io priority")                  \
+    X(IdleIO,   "Only do io when the disks are otherwise idle")    \
+
+enum IOPriority : short {
+#define X(name,info) name,
+LIST_OF_IO_PRIORITIES
+#undef X
+};
+
 struct ThreadCallback
 {
     virtual void stop() = 0;
@@ -43,13 +54,37 @@ std::unique_ptr<ThreadCallback> newRegularThreadCallback(int millis, std::functi
 
 struct System
 {
-    // Invoke another program within the OS
+    // Invoke another program within the OS. The output is stored in output and/or
+    // handed to output_cb as it arrives.
     virtual RC invoke(std::string program,
                        std::vector<std::string> args,
                        std::vector<char> *output = NULL,
                        Capture capture = CaptureStdout,
                        std::function<void(char *buf, size_t len)> output_cb = NULL) = 0;
 
+    // Invoke another program and feed its stdin with the data returned by input_cb,
+    // until input_cb returns 0. The output is captured as with invoke.
+    // If input_cb returns -1 the program is killed before it sees the end of its input,
+    // thus it cannot mistake the input for complete, and the invoke fails.
+    virtual RC invokeWithInput(std::string program,
+                               std::vector<std::string> args,
+                               std::function<ssize_t(char *buf, size_t len)> input_cb,
+                               std::vector<char> *output = NULL,
+                               Capture capture = CaptureStdout) = 0;
+
+    // Start a program that keeps running in the background, its output is discarded.
+    // It is stopped when the System is destroyed, if not stopped before that.
+    virtual RC startDaemon(std::string program,
+                           std::vector<std::string> args,
+                           pid_t *pid) = 0;
+    // Terminate a program started with startDaemon and wait for it to exit.
+    virtual RC stopDaemon(pid_t pid) = 0;
+    // Connect to a unix domain socket, send the request and read the reply until the
+    // other end closes the connection. Fails if the whole exchange takes longer than
+    // the timeout, a wedged daemon must not block beak forever.
+    virtual RC exchangeUnixSocket(Path *socket, std::string &request, std::vector<char> *reply,
+                                  int timeout_ms) = 0;
+
     virtual RC invokeShell(Path *init_file) = 0;
     // Check if pid exists.
     virtual bool processExists(pid_t pid) = 0;
@@ -63,12 +98,18 @@ struct System
     virtual RC umount(ptr<FuseMount> fuse_mount) = 0;
     // The current user running the beak software.
     virtual std::string userName() = 0;
+    // Set the io priority of the calling thread, programs invoked
+    // from the thread inherit the priority.
+    virtual RC setIOPriority(IOPriority prio) = 0;
 
     virtual ~System() = default;
 };
 
 std::unique_ptr<System> newSystem();
 
+// Invoke cb when the process is told to terminate, for example with SIGTERM.
+void onTerminated(std::string msg, std::function<void()> cb);
+
 static RC invoke(std::string program,
                  std::vector<std::string> args,
                  std::vector<char> *output,
@@ -19,16 +19,24 @@
 
 #include "filesystem.h"
 #include "log.h"
+#include "util.h"
 
+#include <algorithm>
+#include <fcntl.h>
 #include <memory.h>
+#include <poll.h>
 #include <pthread.h>
 #include <pwd.h>
 #include <sys/errno.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #ifdef OSX64
 #include <signal.h>
 #include <sys/wait.h>
 #else
+#include <sys/prctl.h>
 #include <wait.h>
 #endif
 
@@ -212,6 +220,15 @@ struct SystemImplementation : System
               std::vector<char> *output = NULL,
               Capture capture = CaptureStdout,
               std::function<void(char *buf, size_t len)> output_cb = NULL);
+    RC invokeWithInput(string program,
+                       vector<string> args,
+                       function<ssize_t(char *buf, size_t len)> input_cb,
+                       vector<char> *output = NULL,
+                       Capture capture = CaptureStdout);
+
+    RC startDaemon(string program, vector<string> args, pid_t *pid);
+    RC stopDaemon(pid_t pid);
+    RC exchangeUnixSocket(Path *socket, string &request, vector<char> *reply, int timeout_ms);
 
     RC invokeShell(Path *init_file);
     bool processExists(pid_t pid);
@@ -221,17 +238,21 @@ struct SystemImplementation : System
     std::unique_ptr<FuseMount> mount(Path *dir, FuseAPI *fuseapi, bool debug);
     RC umount(ptr<FuseMount> fuse_mount);
     string userName();
+    RC setIOPriority(IOPriority prio);
 
     RC mountInternal(Path *dir, FuseAPI *fuseapi,
                      bool daemon, unique_ptr<FuseMount> &fm,
                      bool foreground, bool debug);
 
     SystemImplementation();
-    ~SystemImplementation() = default;
+    ~SystemImplementation();
 
     private:
 
     pid_t running_shell_pid_ {};
+    // Daemons started by this process, they are stopped when the system is destroyed.
+    vector<pid_t> daemons_;
+    pid_t daemons_owner_ {};
     string user_name_;
 };
 
@@ -265,6 +286,16 @@ SystemImplementation::SystemImplementation()
     */
 }
 
+SystemImplementation::~SystemImplementation()
+{
+    // A forked child must not stop the daemons of its parent.
+    if (daemons_owner_ != getpid()) return;
+    while (daemons_.size() > 0)
+    {
+        stopDaemon(daemons_.back());
+    }
+}
+
 static RC invoke(string program,
                  vector<string> args,
                  vector<char> *output,
@@ -283,8 +314,12 @@ static RC invoke(string program,
     }
     argv[i] = NULL;
 
-    if (output) {
-        if (pipe(link) == -1) {
+    // Without an output vector, the output can still be streamed to the callback.
+    bool capture_output = output != NULL || cb != NULL;
+    if (capture_output) {
+        // Other threads fork as well, their children must not inherit the pipe,
+        // or the read end would not see the end of the output until they exit.
+        if (pipe2(link, O_CLOEXEC) == -1) {
             error(SYSTEM, "Could not create pipe!\n");
         }
     }
@@ -292,7 +327,7 @@ static RC invoke(string program,
     int status;
     if (pid == 0) {
         // I am the child!
-        if (output) {
+        if (capture_output) {
             if (capture == CaptureBoth || capture == CaptureStdout) {
                 dup2 (link[1], STDOUT_FILENO);
             }
@@ -311,7 +346,7 @@ static RC invoke(string program,
             error(SYSTEM, "Could not fork!\n");
         }
 
-        if (output) {
+        if (capture_output) {
             close(link[1]);
 
             char buf[4096 + 1];
@@ -322,7 +357,7 @@ static RC invoke(string program,
                 memset(buf, 0, sizeof(buf));
                 n = read(link[0], buf, sizeof(buf));
                 if (n > 0) {
-                    output->insert(output->end(), buf, buf+n);
+                    if (output) { output->insert(output->end(), buf, buf+n); }
                     if (cb) { cb(buf, n); }
                     debug(SYSTEMIO, "%s: \"%*s\"\n", program.c_str(), n, buf);
                 } else {
@@ -344,6 +379,10 @@ static RC invoke(string program,
                 delete[] argv;
                 return RC::ERR;
             }
+        } else {
+            warning(SYSTEM,"%s was killed by signal %d\n", program.c_str(), WTERMSIG(status));
+            delete[] argv;
+            return RC::ERR;
         }
     }
     delete[] argv;
@@ -359,6 +398,287 @@ RC SystemImplementation::invoke(string program,
     return ::invoke(program, args, output, capture, cb);
 }
 
+RC SystemImplementation::invokeWithInput(string program,
+                                         vector<string> args,
+                                         function<ssize_t(char *buf, size_t len)> input_cb,
+                                         vector<char> *output,
+                                         Capture capture)
+{
+    int in[2], out[2];
+    const char **argv = new const char*[args.size()+2];
+    argv[0] = program.c_str();
+    int i = 1;
+    debug(SYSTEM, "exec with input \"%s\"\n", program.c_str());
+    for (auto &a : args) {
+        argv[i] = a.c_str();
+        i++;
+        debug(SYSTEM, "arg \"%s\"\n", a.c_str());
+    }
+    argv[i] = NULL;
+
+    // Uploads run in parallel threads, every child must only have its own stdin,
+    // otherwise an inherited write end keeps another child from ever seeing eof.
+    if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1) {
+        error(SYSTEM, "Could not create pipe!\n");
+    }
+    // A child that exits early must not kill us while we write to it.
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t pid = fork();
+    int status;
+    if (pid == 0) {
+        // I am the child!
+        dup2(in[0], STDIN_FILENO);
+        if (capture == CaptureBoth || capture == CaptureStdout) {
+            dup2(out[1], STDOUT_FILENO);
+        }
+        if (capture == CaptureBoth || capture == CaptureStderr) {
+            dup2(out[1], STDERR_FILENO);
+        }
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execvp(program.c_str(), (char*const*)argv);
+        // The child of a threaded process must not run the exit handlers of its parent.
+        _exit(127);
+    }
+    if (pid == -1) {
+        error(SYSTEM, "Could not fork!\n");
+    }
+    close(in[0]);
+    close(out[1]);
+    delete[] argv;
+
+    // Feed the input and drain the output at the same time, since the child
+    // might block on a full output pipe before it has consumed all input.
+    vector<char> buf(128*1024);
+    size_t buf_len = 0, buf_pos = 0;
+    bool input_done = false, input_failed = false, input_aborted = false;
+    int to_child = in[1];
+    fcntl(to_child, F_SETFL, fcntl(to_child, F_GETFL) | O_NONBLOCK);
+    for (;;) {
+        struct pollfd fds[2];
+        int nfds = 0;
+        fds[nfds].fd = out[0];
+        fds[nfds].events = POLLIN;
+        nfds++;
+        if (to_child != -1) {
+            fds[nfds].fd = to_child;
+            fds[nfds].events = POLLOUT;
+            nfds++;
+        }
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents) {
+            char tmp[4096];
+            ssize_t n = read(out[0], tmp, sizeof(tmp));
+            if (n > 0) {
+                if (output) output->insert(output->end(), tmp, tmp+n);
+                debug(SYSTEMIO, "%s: \"%*s\"\n", program.c_str(), (int)n, tmp);
+            } else if (n == 0 || errno != EINTR) {
+                // The child closed its output, it has exited or is about to.
+                if (to_child != -1) {
+                    input_failed = !input_done;
+                    close(to_child);
+                    to_child = -1;
+                }
+                break;
+            }
+        }
+        if (to_child != -1 && nfds > 1 && fds[1].revents) {
+            if (buf_pos == buf_len) {
+                ssize_t n = input_cb(&buf[0], buf.size());
+                if (n < 0) {
+                    // Kill the child before closing its input, it must not finish with partial input.
+                    input_aborted = true;
+                    kill(pid, SIGKILL);
+                    close(to_child);
+                    to_child = -1;
+                    break;
+                }
+                buf_len = n;
+                buf_pos = 0;
+                if (buf_len == 0) {
+                    input_done = true;
+                    close(to_child);
+                    to_child = -1;
+                    continue;
+                }
+            }
+            ssize_t n = write(to_child, &buf[buf_pos], buf_len-buf_pos);
+            if (n > 0) {
+                buf_pos += n;
+            } else if (errno != EINTR && errno != EAGAIN) {
+                input_failed = true;
+                close(to_child);
+                to_child = -1;
+            }
+        }
+    }
+    if (to_child != -1) close(to_child);
+    close(out[0]);
+
+    debug(SYSTEM,"waiting for child %d.\n", pid);
+    waitpid(pid, &status, 0);
+    if (input_aborted) {
+        warning(SYSTEM,"%s was killed since its input could not be read.\n", program.c_str());
+        return RC::ERR;
+    }
+    if (WIFEXITED(status)) {
+        int rc = WEXITSTATUS(status);
+        debug(SYSTEM,"%s: return code %d\n", program.c_str(), rc);
+        if (rc == 127) {
+            warning(SYSTEM,"Invoking %s failed!\n", program.c_str());
+            return RC::ERR;
+        }
+        if (rc != 0) {
+            warning(SYSTEM,"%s exited with non-zero return code: %d\n", program.c_str(), rc);
+            return RC::ERR;
+        }
+    } else {
+        warning(SYSTEM,"%s was killed by signal %d\n", program.c_str(), WTERMSIG(status));
+        return RC::ERR;
+    }
+    if (input_failed) {
+        warning(SYSTEM,"%s did not consume all of its input.\n", program.c_str());
+        return RC::ERR;
+    }
+    return RC::OK;
+}
+
+RC SystemImplementation::startDaemon(string program, vector<string> args, pid_t *pid)
+{
+    vector<const char*> argv;
+    argv.push_back(program.c_str());
+    debug(SYSTEM, "start daemon \"%s\"\n", program.c_str());
+    for (auto &a : args) {
+        argv.push_back(a.c_str());
+        debug(SYSTEM, "arg \"%s\"\n", a.c_str());
+    }
+    argv.push_back(NULL);
+
+    pid_t parent = getpid();
+#ifndef OSX64
+    // Linux sends the death signal when the forking thread exits, not the process.
+    // Thus only a daemon started from the main thread can be tied to our lifetime.
+    bool main_thread = syscall(SYS_gettid) == parent;
+#endif
+    pid_t p = fork();
+    if (p == -1) {
+        warning(SYSTEM, "Could not fork!\n");
+        return RC::ERR;
+    }
+    if (p == 0) {
+#ifndef OSX64
+        // A daemon must not outlive beak when it is killed by a signal.
+        if (main_thread) {
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != parent) _exit(127);
+        }
+#endif
+        // I am the child! Detach from the terminal io.
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(null);
+        execvp(program.c_str(), (char*const*)&argv[0]);
+        _exit(127);
+    }
+    debug(SYSTEM, "daemon %s has pid %d\n", program.c_str(), p);
+    daemons_.push_back(p);
+    daemons_owner_ = getpid();
+    *pid = p;
+    return RC::OK;
+}
+
+RC SystemImplementation::stopDaemon(pid_t pid)
+{
+    debug(SYSTEM, "stopping daemon %d\n", pid);
+    daemons_.erase(remove(daemons_.begin(), daemons_.end(), pid), daemons_.end());
+    if (kill(pid, SIGTERM) != 0) {
+        return RC::ERR;
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return RC::OK;
+}
+
+RC SystemImplementation::exchangeUnixSocket(Path *socket_path, string &request, vector<char> *reply,
+                                            int timeout_ms)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path->c_str()) >= sizeof(addr.sun_path)) {
+        warning(SYSTEM, "Socket path too long: %s\n", socket_path->c_str());
+        return RC::ERR;
+    }
+    strcpy(addr.sun_path, socket_path->c_str());
+
+    // A daemon that dies must not kill us with a SIGPIPE.
+    signal(SIGPIPE, SIG_IGN);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return RC::ERR;
+    // The connect and the writes block at most this long, the reads are polled
+    // until the deadline of the whole exchange.
+    uint64_t deadline = clockGetTimeMicroSeconds() + (uint64_t)timeout_ms*1000;
+    struct timeval tv;
+    tv.tv_sec = timeout_ms/1000;
+    tv.tv_usec = (timeout_ms%1000)*1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        debug(SYSTEM, "could not connect to %s\n", socket_path->c_str());
+        close(fd);
+        return RC::ERR;
+    }
+
+    size_t sent = 0;
+    while (sent < request.size()) {
+        ssize_t n = write(fd, request.c_str()+sent, request.size()-sent);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                warning(SYSTEM, "Timeout when sending to %s\n", socket_path->c_str());
+            }
+            close(fd);
+            return RC::ERR;
+        }
+        sent += n;
+    }
+    debug(SYSTEMIO, "sent %zu bytes to %s\n", sent, socket_path->c_str());
+
+    char buf[4096];
+    for (;;) {
+        uint64_t now = clockGetTimeMicroSeconds();
+        int left_ms = now >= deadline ? 0 : (int)((deadline-now+999)/1000);
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int p = left_ms > 0 ? poll(&pfd, 1, left_ms) : 0;
+        if (p == -1 && errno == EINTR) continue;
+        if (p <= 0) {
+            warning(SYSTEM, "No reply from %s within %d s\n", socket_path->c_str(), timeout_ms/1000);
+            close(fd);
+            return RC::ERR;
+        }
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            close(fd);
+            return RC::ERR;
+        }
+        if (n == 0) break;
+        reply->insert(reply->end(), buf, buf+n);
+    }
+    debug(SYSTEMIO, "received %zu bytes from %s\n", reply->size(), socket_path->c_str());
+    close(fd);
+    return RC::OK;
+}
+
 RC SystemImplementation::invokeShell(Path *init_file)
 {
     const char **argv = new const char*[4];
@@ -385,6 +705,9 @@ RC SystemImplementation::invokeShell(Path *init_file)
 
 bool SystemImplementation::processExists(pid_t pid)
 {
+    // A child that has exited lingers as a zombie until it is reaped.
+    int status;
+    if (waitpid(pid, &status, WNOHANG) == pid) return false;
     return kill(pid, 0) == 0;
 }
 
@@ -561,3 +884,31 @@ string SystemImplementation::userName()
 {
     return user_name_;
 }
+
+RC SystemImplementation::setIOPriority(IOPriority prio)
+{
+#ifdef OSX64
+    debug(SYSTEM, "io priorities are not supported\n");
+    return RC::ERR;
+#else
+    // There is no glibc wrapper for ioprio_set, these are from linux/ioprio.h.
+    const int ioprio_who_process = 1;
+    const int ioprio_class_shift = 13;
+    const int ioprio_class_be = 2;
+    const int ioprio_class_idle = 3;
+
+    int ioprio = 0; // No class, the io priority follows the cpu nice level.
+    if (prio == LowIO) ioprio = (ioprio_class_be << ioprio_class_shift) | 7;
+    if (prio == IdleIO) ioprio = (ioprio_class_idle << ioprio_class_shift);
+
+    // Who 0 is the calling thread.
+    int rc = syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio);
+    if (rc == -1)
+    {
+        debug(SYSTEM, "could not set io priority %d: %s\n", prio, strerror(errno));
+        return RC::ERR;
+    }
+    debug(SYSTEM, "io priority set to %d\n", prio);
+    return RC::OK;
+#endif
+}
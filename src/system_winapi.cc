@@ -31,6 +31,15 @@ struct SystemImplementationWinapi : System
                vector<char> *output,
                Capture capture,
                function<void(char *buffer, size_t len)> cb);
+    RC invokeWithInput(string program,
+                       vector<string> args,
+                       function<ssize_t(char *buf, size_t len)> input_cb,
+                       vector<char> *output,
+                       Capture capture);
+
+    RC startDaemon(string program, vector<string> args, pid_t *pid);
+    RC stopDaemon(pid_t pid);
+    RC exchangeUnixSocket(Path *socket, string &request, vector<char> *reply, int timeout_ms);
 
     RC invokeShell(Path *init_file);
     bool processExists(pid_t pid);
@@ -40,6 +49,7 @@ struct SystemImplementationWinapi : System
     std::unique_ptr<FuseMount> mount(Path *dir, FuseAPI *fuseapi, bool debug);
     RC umount(ptr<FuseMount> fuse_mount);
     string userName();
+    RC setIOPriority(IOPriority prio);
 
 private:
     int *rooot {};
@@ -65,6 +75,31 @@ RC SystemImplementationWinapi::invoke(string program,
     return RC::ERR;
 }
 
+RC SystemImplementationWinapi::invokeWithInput(string program,
+                                                vector<string> args,
+                                                function<ssize_t(char *buf, size_t len)> input_cb,
+                                                vector<char> *output,
+                                                Capture capture)
+{
+    return RC::ERR;
+}
+
+RC SystemImplementationWinapi::startDaemon(string program, vector<string> args, pid_t *pid)
+{
+    return RC::ERR;
+}
+
+RC SystemImplementationWinapi::stopDaemon(pid_t pid)
+{
+    return RC::ERR;
+}
+
+RC SystemImplementationWinapi::exchangeUnixSocket(Path *socket, string &request, vector<char> *reply,
+                                                   int timeout_ms)
+{
+    return RC::ERR;
+}
+
 RC SystemImplementationWinapi::invokeShell(Path *init_file)
 {
     return RC::ERR;
@@ -75,6 +110,9 @@ bool SystemImplementationWinapi::processExists(pid_t pid)
     return false;
 }
 
+void onTerminated(string msg, function<void()> cb)
+{
+}
 
 unique_ptr<ThreadCallback> newRegularThreadCallback(int millis, std::function<bool()> thread_cb)
 {
@@ -105,3 +143,8 @@ string SystemImplementationWinapi::userName()
 {
     return "";
 }
+
+RC SystemImplementationWinapi::setIOPriority(IOPriority prio)
+{
+    return RC::ERR;
+}
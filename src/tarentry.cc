@@ -28,11 +28,12 @@
 #include <cstdio>
 #include <cstdlib>
 #include <iterator>
-#include <openssl/sha.h>
 #include <zlib.h>
 
 #include "tarfile.h"
+#include "lock.h"
 #include "log.h"
+#include "sha256.h"
 #include "util.h"
 
 using namespace std;
@@ -152,6 +153,47 @@ void TarEntry::createLargeTar(uint32_t hash) {
     tars_.push_back(large_tars_[hash]);
 }
 
+void TarEntry::writeHeader(char *tmp)
+{
+    memset(tmp, 0, header_size_);
+    int p = 0;
+
+    TarHeader th(&fs_, tarpath_, link_, is_hard_linked_, tar_header_style_ == TarHeaderStyle::Full);
+
+    if (th.numLongLinkBlocks() > 0)
+    {
+        TarHeader llh;
+        llh.setLongLinkType(&th);
+        llh.setSize(link_->c_str_len());
+        llh.calculateChecksum();
+
+        memcpy(tmp+p, llh.buf(), T_BLOCKSIZE);
+        memcpy(tmp+p+T_BLOCKSIZE, link_->c_str(), link_->c_str_len());
+        p += th.numLongLinkBlocks()*T_BLOCKSIZE;
+        debug(TARENTRY, "wrote long link header for %s\n", link_->c_str());
+    }
+
+    if (th.numLongPathBlocks() > 0)
+    {
+        TarHeader lph;
+        lph.setLongPathType(&th);
+        lph.setSize(tarpath_->c_str_len()+1);
+        lph.calculateChecksum();
+
+        memcpy(tmp+p, lph.buf(), T_BLOCKSIZE);
+        memcpy(tmp+p+T_BLOCKSIZE, tarpath_->c_str(), tarpath_->c_str_len());
+        p += th.numLongPathBlocks()*T_BLOCKSIZE;
+        debug(TARENTRY, "wrote long path header for %s\n", tarpath_->c_str());
+    }
+
+    memcpy(tmp+p, th.buf(), T_BLOCKSIZE);
+}
+
+void TarEntry::freezeHeader()
+{
+    header_frozen_ = true;
+}
+
 size_t TarEntry::copy(char *buf, size_t size, size_t from, FileSystem *fs)
 {
     size_t copied = 0;
@@ -164,40 +206,28 @@ size_t TarEntry::copy(char *buf, size_t size, size_t from, FileSystem *fs)
         debug(TARENTRY, "copying max %zu from %zu, now inside header (header size=%ju)\n", size, from,
               header_size_);
 
+        const char *hdr;
         char tmp[header_size_];
-        memset(tmp, 0, header_size_);
-        int p = 0;
-
-        TarHeader th(&fs_, tarpath_, link_, is_hard_linked_, tar_header_style_ == TarHeaderStyle::Full);
-
-        if (th.numLongLinkBlocks() > 0)
+        shared_ptr<vector<char>> cached;
+        if (header_frozen_)
         {
-            TarHeader llh;
-            llh.setLongLinkType(&th);
-            llh.setSize(link_->c_str_len());
-            llh.calculateChecksum();
-
-            memcpy(tmp+p, llh.buf(), T_BLOCKSIZE);
-            memcpy(tmp+p+T_BLOCKSIZE, link_->c_str(), link_->c_str_len());
-            p += th.numLongLinkBlocks()*T_BLOCKSIZE;
-            debug(TARENTRY, "wrote long link header for %s\n", link_->c_str());
+            // The layout of the tar file is frozen, the header can be cached.
+            cached = atomic_load(&header_);
+            if (!cached)
+            {
+                // Concurrent first reads might both build it, the contents are the same.
+                cached = make_shared<vector<char>>(header_size_);
+                writeHeader(&(*cached)[0]);
+                atomic_store(&header_, cached);
+            }
+            hdr = &(*cached)[0];
         }
-
-        if (th.numLongPathBlocks() > 0)
+        else
         {
-            TarHeader lph;
-            lph.setLongPathType(&th);
-            lph.setSize(tarpath_->c_str_len()+1);
-            lph.calculateChecksum();
-
-            memcpy(tmp+p, lph.buf(), T_BLOCKSIZE);
-            memcpy(tmp+p+T_BLOCKSIZE, tarpath_->c_str(), tarpath_->c_str_len());
-            p += th.numLongPathBlocks()*T_BLOCKSIZE;
-            debug(TARENTRY, "wrote long path header for %s\n", tarpath_->c_str());
+            writeHeader(tmp);
+            hdr = tmp;
         }
 
-        memcpy(tmp+p, th.buf(), T_BLOCKSIZE);
-
         // Copy the header out
         size_t len = header_size_-from;
         if (len > size) {
@@ -205,7 +235,7 @@ size_t TarEntry::copy(char *buf, size_t size, size_t from, FileSystem *fs)
         }
         debug(TARENTRY, "header out from %s %zu size=%zu\n", path_->c_str(), from, len);
         assert(from+len <= header_size_);
-        memcpy(buf, tmp+from, len);
+        memcpy(buf, hdr+from, len);
         size -= len;
         buf += len;
         copied += len;
@@ -240,6 +270,7 @@ size_t TarEntry::copy(char *buf, size_t size, size_t from, FileSystem *fs)
             if (l==-1) {
                 failure(TARENTRY, "Could not open file \"%s\"\n", abspath_->c_str());
             }
+            if (l > 0 && streamed_hash_) verifyStreamedContent(buf, l, from-header_size_);
             //assert(l>0);
             size -= l;
             buf += l;
@@ -291,6 +322,9 @@ void TarEntry::setContent(vector<char> &c) {
 
 void TarEntry::updateSizes()
 {
+    // Any cached header is stale now.
+    header_frozen_ = false;
+    header_.reset();
     size_t size = header_size_ = TarHeader::calculateHeaderSize(tarpath_, link_, is_hard_linked_);
 
     if (tar_header_style_ == TarHeaderStyle::None) {
@@ -408,13 +442,20 @@ vector<char> &TarEntry::metaHash() {
     return meta_sha256_hash_;
 }
 
+// The meta hashes are many and small, reuse one hasher per thread
+// since groupFilesIntoTars calculates them in parallel.
+static SHA256Hasher &metaHasher()
+{
+    static thread_local SHA256Hasher hasher;
+    return hasher;
+}
+
 void TarEntry::calculateSHA256Hash()
 {
-    SHA256_CTX sha256ctx;
-    SHA256_Init(&sha256ctx);
+    SHA256Hasher &hasher = metaHasher();
 
     // Hash the file name and its path within the tar.
-    SHA256_Update(&sha256ctx, tarpath_->c_str(), tarpath_->c_str_len());
+    hasher.update(tarpath_->c_str(), tarpath_->c_str_len());
 
     // Hash the file size.
     off_t filesize;
@@ -423,20 +464,84 @@ void TarEntry::calculateSHA256Hash()
     } else {
         filesize = 0;
     }
-    SHA256_Update(&sha256ctx, &filesize, sizeof(filesize));
+    hasher.update(&filesize, sizeof(filesize));
 
     // Hash the last modification time in seconds and nanoseconds.
     time_t secs  = fs_.st_mtim.tv_sec;
     long   nanos = 1000*(fs_.st_mtim.tv_nsec/1000); // Truncate to micro seconds.
 
-    SHA256_Update(&sha256ctx, &secs, sizeof(secs));
-    SHA256_Update(&sha256ctx, &nanos, sizeof(nanos));
+    hasher.update(&secs, sizeof(secs));
+    hasher.update(&nanos, sizeof(nanos));
+
+    hasher.final(&meta_sha256_hash_);
+}
+
+struct TarEntry::StreamedContentHash
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    ContentHashCache *cache {};
+    // Allocated when the streaming starts and released when it is done.
+    std::unique_ptr<SHA256Hasher> hasher;
+    size_t offset {};
+    bool done {};
+};
+
+void TarEntry::verifyStreamedContent(const char *data, size_t len, size_t offset)
+{
+    StreamedContentHash *s = streamed_hash_.get();
+    LOCK(&s->lock);
+    // Only contents streamed in order from the start can be verified,
+    // not those of a resumed store or of random reads from a mount.
+    if (!s->done && offset == s->offset)
+    {
+        if (!s->hasher) s->hasher = unique_ptr<SHA256Hasher>(new SHA256Hasher());
+        s->hasher->update(data, len);
+        s->offset += len;
+        if (s->offset >= (size_t)fs_.st_size)
+        {
+            vector<char> hash;
+            s->hasher->final(&hash);
+            s->hasher.reset();
+            s->done = true;
+            if (hash != content_sha256_hash_)
+            {
+                failure(TARENTRY, "The contents of \"%s\" changed after they were hashed.\n", abspath_->c_str());
+                if (s->cache) s->cache->changed(abspath_);
+            }
+        }
+    }
+    UNLOCK(&s->lock);
+}
 
-    meta_sha256_hash_.resize(SHA256_DIGEST_LENGTH);
-    SHA256_Final((unsigned char*)&meta_sha256_hash_[0], &sha256ctx);
+RC TarEntry::calculateContentHash(FileSystem *fs, ContentHashCache *cache)
+{
+    content_sha256_hash_.clear();
+    if (!isRegularFile() || is_hard_linked_ || virtual_file_) return RC::OK;
+    streamed_hash_ = make_shared<StreamedContentHash>();
+    streamed_hash_->cache = cache;
+    if (cache && cache->lookup(abspath_, &fs_, &content_sha256_hash_)) return RC::OK;
+
+    SHA256Hasher hasher;
+    vector<char> buf(1024*1024);
+    size_t off = 0;
+    while (off < (size_t)fs_.st_size)
+    {
+        ssize_t n = fs->pread(abspath_, &buf[0], buf.size(), off);
+        if (n <= 0)
+        {
+            failure(TARENTRY, "Could not read \"%s\" to hash its contents.\n", abspath_->c_str());
+            streamed_hash_.reset();
+            return RC::ERR;
+        }
+        hasher.update(&buf[0], n);
+        off += n;
+    }
+    hasher.final(&content_sha256_hash_);
+    if (cache) cache->add(abspath_, &fs_, content_sha256_hash_);
+    return RC::OK;
 }
 
-string cookColumns()
+string cookColumns(bool content_hash)
 {
     int i = 0;
     string s;
@@ -452,11 +557,14 @@ string cookColumns()
     s += "offset "; i++;
     s += "multipart(num,partoffset,size,last_size,disksize,last_disksize) "; i++; // eg 2,512,70000,238,70000,1000
     s += "path_size_mtime_hash "; i++;
+    if (content_hash) {
+        s += "content_hash "; i++;
+    }
 
     return "with "+to_string(i)+" columns: "+s;
 }
 
-void cookEntry(string *listing, TarEntry *entry) {
+void cookEntry(string *listing, TarEntry *entry, bool content_hash) {
 
     // -r-------- fredrik/fredrik 745 1970-01-01 01:00 testing
     // drwxrwxr-x fredrik/fredrik   0 2016-11-25 00:52 autoconf/
@@ -526,6 +634,11 @@ void cookEntry(string *listing, TarEntry *entry) {
     listing->append(separator_string);
 
     listing->append(toHex(entry->metaHash()));
+    if (content_hash) {
+        // Empty for directories, links and hard links.
+        listing->append(separator_string);
+        listing->append(toHex(entry->contentHash()));
+    }
     listing->append("\n");
     listing->append(separator_string);
 }
@@ -536,6 +649,7 @@ bool eatEntry(int beak_version, vector<char> &v, vector<char>::iterator &i,
               string *link, bool *is_sym_link, bool *is_hard_link,
               uint *num_parts, size_t *part_offset, size_t *part_size, size_t *last_part_size,
               size_t *disk_size, size_t *last_disk_size,
+              string *content_hash,
               bool *eof, bool *err)
 {
     string permission = eatTo(v, i, separator, 32, eof, err);
@@ -659,8 +773,22 @@ bool eatEntry(int beak_version, vector<char> &v, vector<char>::iterator &i,
         *last_disk_size = atol(last_disk_size_s.c_str());
     }
     string meta_hash = eatTo(v, i, separator, 65, eof, err);
-    meta_hash.pop_back(); // Last column in line has the newline
     if (*err) return false; // Accept eof here!
+    content_hash->clear();
+    if (meta_hash.length() > 0 && meta_hash.back() == '\n')
+    {
+        meta_hash.pop_back(); // Last column in line has the newline
+    }
+    else
+    {
+        // The index was made with --contenthash.
+        *content_hash = eatTo(v, i, separator, 65, eof, err);
+        if (*err) return false; // Accept eof here!
+        if (content_hash->length() > 0 && content_hash->back() == '\n')
+        {
+            content_hash->pop_back();
+        }
+    }
 
     return true;
 }
@@ -22,11 +22,13 @@
 #include <sys/stat.h>
 #include <cstdint>
 #include <map>
+#include <memory>
 #include <openssl/sha.h>
 #include <string>
 #include <vector>
 
 #include "tar.h"
+#include "contenthashcache.h"
 #include "filesystem.h"
 
 struct Atom;
@@ -130,6 +132,9 @@ struct TarEntry
     void calculateTarpath(Path *storage_dir);
     void setContent(std::vector<char> &c);
     size_t copy(char *buf, size_t size, size_t from, FileSystem *fs);
+    // The layout of the tar file is frozen, copy then builds the tar header
+    // bytes when they are first read and memcpys them on later reads.
+    void freezeHeader();
     void updateSizes();
     void rewriteIntoHardLink(TarEntry *target);
     bool calculateHardLink(Path *storage_dir);
@@ -274,6 +279,11 @@ struct TarEntry
 
     void calculateHash();
     std::vector<char> &metaHash();
+    // Read the file contents and hash them, only done for regular files.
+    // The hash is taken from the cache, when the file has not changed.
+    // A file whose streamed contents do not match the hash is reported to the cache.
+    RC calculateContentHash(FileSystem *fs, ContentHashCache *cache);
+    std::vector<char> &contentHash() { return content_sha256_hash_; }
 
     private:
 
@@ -330,24 +340,38 @@ struct TarEntry
     bool is_added_to_directory_ = false;
     bool virtual_file_ = false;
     std::vector<char> content;
+    // The tar header bytes (long link, long path and header blocks), built on the first
+    // read after freezeHeader. Concurrent reads publish it using std::atomic_load/store.
+    bool header_frozen_ {};
+    std::shared_ptr<std::vector<char>> header_;
+
+    void writeHeader(char *buf);
 
     void calculateSHA256Hash();
 
     std::vector<char> meta_sha256_hash_;
+    std::vector<char> content_sha256_hash_;
+    // The contents are hashed again while they are streamed into the tar,
+    // to verify that the content hash in the index is that of the stored contents.
+    struct StreamedContentHash;
+    std::shared_ptr<StreamedContentHash> streamed_hash_;
+    void verifyStreamedContent(const char *data, size_t len, size_t offset);
 
     bool should_content_split_;
 
-    friend void cookEntry(std::string *listing, TarEntry *entry);
+    friend void cookEntry(std::string *listing, TarEntry *entry, bool content_hash);
 };
 
-void cookEntry(std::string *listing, TarEntry *entry);
-std::string cookColumns();
+// The content_hash column is only present when the backup was made with --contenthash.
+void cookEntry(std::string *listing, TarEntry *entry, bool content_hash = false);
+std::string cookColumns(bool content_hash = false);
 
 bool eatEntry(int beak_version, std::vector<char> &v, std::vector<char>::iterator &i, Path *dir_to_prepend, Path *safedir_to_prepend,
               FileStat *fs, size_t *offset, std::string *tar, Path **path,
               std::string *link, bool *is_sym_link, bool *is_hard_link,
               uint *num_parts, size_t *part_offset, size_t *part_size, size_t *last_part_size,
               size_t *disk_size, size_t *last_disk_size,
+              std::string *content_hash,
               bool *eof, bool *err);
 
 
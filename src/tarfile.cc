@@ -17,7 +17,6 @@
 
 #include "tarfile.h"
 
-#include <openssl/sha.h>
 #include <string.h>
 #include <algorithm>
 #include <cassert>
@@ -28,6 +27,7 @@
 
 #include "lock.h"
 #include "log.h"
+#include "sha256.h"
 #include "tar.h"
 #include "tarentry.h"
 #include "util.h"
@@ -64,6 +64,7 @@ void TarFile::addEntryLast(TarEntry *entry)
     entry->registerTarFile(this, current_tar_offset_);
     contents_[current_tar_offset_] = entry;
     offsets.push_back(current_tar_offset_);
+    entries_.push_back(entry);
     debug(TARFILE, "%s: added %s at %zu\n", "GURKA",
           entry->path()->c_str(), current_tar_offset_);
     current_tar_offset_ += entry->blockedSize();
@@ -76,9 +77,11 @@ void TarFile::addEntryFirst(TarEntry *entry)
     entry->registerTarFile(this, 0);
     map<size_t, TarEntry*> newc;
     vector<size_t> newo;
+    vector<TarEntry*> newe;
 
     newc[0] = entry;
     newo.push_back(0);
+    newe.push_back(entry);
     entry->registerTarFile(this, 0);
 
     for (auto & a : contents_)
@@ -86,10 +89,12 @@ void TarFile::addEntryFirst(TarEntry *entry)
         size_t o = a.first + entry->blockedSize();
         newc[o] = a.second;
         newo.push_back(o);
+        newe.push_back(a.second);
         a.second->registerTarFile(this, o);
     }
     contents_ = newc;
     offsets = newo;
+    entries_ = newe;
 
     debug(TARFILE, "    %s    Added FIRST %s at %zu with blocked size %zu\n",
           "GURKA", entry->path()->c_str(), current_tar_offset_,
@@ -104,23 +109,15 @@ pair<TarEntry*, size_t> TarFile::findTarEntry(size_t offset)
         return pair<TarEntry*, size_t>(NULL, 0);
     }
     debug(TARFILE, "Looking for offset %zu\n", offset);
-    size_t o = 0;
 
-    vector<size_t>::iterator i = lower_bound(offsets.begin(), offsets.end(),
-                                             offset, less_equal<size_t>());
-
-    if (i == offsets.end())
-    {
-        o = *offsets.rbegin();
-        debug(TARFILE, "Is past last entry o=%zu\n", o);
-    }
-    else
-    {
-        i--;
-        o = *i;
-        debug(TARFILE, "Found entry o=%zu\n", o);
-    }
-    TarEntry *te = contents_[o];
+    // The offsets are sorted and entries_ is the parallel array of tar entries,
+    // thus the entry containing the offset is the one before the first offset
+    // that is larger than the searched for offset.
+    vector<size_t>::iterator i = upper_bound(offsets.begin(), offsets.end(), offset);
+    assert(i != offsets.begin());
+    size_t idx = (i - offsets.begin()) - 1;
+    size_t o = offsets[idx];
+    TarEntry *te = entries_[idx];
 
     debug(TARFILE, "Found it %s\n", te->path()->c_str());
     return { te, o }; // pair<TarEntry*, size_t>(te, o);
@@ -135,32 +132,24 @@ void TarFile::calculateHash()
 // Invoked for the index gz file.
 void TarFile::calculateHash(vector<pair<TarFile*,TarEntry*>> &tars, string &content)
 {
-    SHA256_CTX sha256ctx;
-    SHA256_Init(&sha256ctx);
+    SHA256Hasher hasher;
 
     // SHA256 all other tar and gz file hashes! This is the hash of this state!
     for (auto & p : tars)
     {
         TarFile *tf = p.first;
         if (tf == this) continue;
-        SHA256_Update(&sha256ctx, &tf->hash()[0], tf->hash().size());
+        hasher.update(tf->hash());
     }
     // SHA256 the detailed file listing too!
-    SHA256_Update(&sha256ctx, &content[0], content.length());
-    sha256_hash_.resize(SHA256_DIGEST_LENGTH);
-    SHA256_Final((unsigned char*)&sha256_hash_[0], &sha256ctx);
+    hasher.update(content);
+    hasher.final(&sha256_hash_);
     sha256_calculated_ = true;
 }
 
 void TarFile::calculateHashFromString(string &content)
 {
-    SHA256_CTX sha256ctx;
-    SHA256_Init(&sha256ctx);
-
-    SHA256_Update(&sha256ctx, &content[0], content.length());
-
-    sha256_hash_.resize(SHA256_DIGEST_LENGTH);
-    SHA256_Final((unsigned char*)&sha256_hash_[0], &sha256ctx);
+    sha256(content.c_str(), content.length(), &sha256_hash_);
 }
 
 vector<char> &TarFile::hash() {
@@ -169,16 +158,15 @@ vector<char> &TarFile::hash() {
 
 void TarFile::calculateSHA256Hash()
 {
-    SHA256_CTX sha256ctx;
-    SHA256_Init(&sha256ctx);
-
-    for (auto & a : contents_)
+    // The meta hashes are all the same size, concatenate them
+    // and hash them in one go.
+    vector<char> metas;
+    metas.reserve(entries_.size()*SHA256_DIGEST_LENGTH);
+    for (TarEntry *te : entries_)
     {
-        TarEntry *te = a.second;
-        SHA256_Update(&sha256ctx, &te->metaHash()[0], te->metaHash().size());
+        metas.insert(metas.end(), te->metaHash().begin(), te->metaHash().end());
     }
-    sha256_hash_.resize(SHA256_DIGEST_LENGTH);
-    SHA256_Final((unsigned char*)&sha256_hash_[0], &sha256ctx);
+    sha256(metas.size() > 0 ? &metas[0] : "", metas.size(), &sha256_hash_);
     sha256_calculated_ = true;
 }
 
@@ -559,9 +547,20 @@ size_t TarFile::onDiskSize_(size_t from, TarContents type, TarFilePaddingStyle p
     return to;
 }
 
+void TarFile::freezeLayout_()
+{
+    // The entries will not move anymore, their tar headers can be
+    // cached when they are first read by readVirtualTar.
+    for (TarEntry *te : entries_)
+    {
+        te->freezeHeader();
+    }
+}
+
 void TarFile::fixSize(size_t split_size, TarHeaderStyle ths, TarFilePaddingStyle pad, size_t target_size)
 {
     content_size_ = current_tar_offset_;
+    freezeLayout_();
     if (content_size_ <= split_size || tar_contents_ != TarContents::SINGLE_LARGE_FILE_TAR)
     {
         // No splitting needed.
@@ -240,12 +240,15 @@ private:
     size_t content_size_;
     std::map<size_t, TarEntry*> contents_;
     std::vector<size_t> offsets;
+    // The tar entries in the same order as offsets, for a quick lookup in findTarEntry.
+    std::vector<TarEntry*> entries_;
     size_t current_tar_offset_ = 0;
     // The mtim_->tv_nsec is always moved up to nearest microsecond boundary in the future.
     struct timespec mtim_;
     UpdateDisk disk_update;
 
     void calculateSHA256Hash();
+    void freezeLayout_();
 
     std::vector<char> sha256_hash_;
     // Number of parts.
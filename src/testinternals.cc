@@ -15,17 +15,36 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "backup.h"
+#include "beak.h"
+#include "blockcache.h"
+#include "changetracker.h"
+#include "contenthashcache.h"
 #include "contentsplit.h"
 #include "filesystem.h"
+#include "filesystem_helpers.h"
 #include "fileinfo.h"
 #include "fit.h"
+#include "journal.h"
+#include "listingcache.h"
 #include "log.h"
 #include "match.h"
+#include "monitor.h"
+#include "rclone_rc.h"
+#include "refindex.h"
 #include "restore.h"
+#include "scheduler.h"
+#include "sha256.h"
 #include "tar.h"
+#include "tarentry.h"
+#include "tarfile.h"
+#include "threads.h"
 #include "util.h"
 
 #include <assert.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 using namespace std;
 
@@ -41,6 +60,18 @@ static ComponentId TEST_HEXSTRING = registerLogComponent("test_hexstring");
 static ComponentId TEST_SPLIT = registerLogComponent("test_split");
 static ComponentId TEST_READSPLIT = registerLogComponent("test_readsplit");
 static ComponentId TEST_CONTENTSPLIT = registerLogComponent("test_contentsplit");
+static ComponentId TEST_SHA256 = registerLogComponent("test_sha256");
+static ComponentId TEST_REFINDEX = registerLogComponent("test_refindex");
+static ComponentId TEST_RCLONE_RC = registerLogComponent("test_rclone_rc");
+static ComponentId TEST_INVOKE = registerLogComponent("test_invoke");
+static ComponentId TEST_LISTINGCACHE = registerLogComponent("test_listingcache");
+static ComponentId TEST_SCHEDULER = registerLogComponent("test_scheduler");
+static ComponentId TEST_JOURNAL = registerLogComponent("test_journal");
+static ComponentId TEST_STAGING = registerLogComponent("test_staging");
+static ComponentId TEST_GROUPING = registerLogComponent("test_grouping");
+static ComponentId TEST_BLOCKCACHE = registerLogComponent("test_blockcache");
+static ComponentId TEST_CONTENTHASH = registerLogComponent("test_contenthash");
+static ComponentId TEST_CHANGES = registerLogComponent("test_changes");
 
 void testMatch(string pattern, const char *path, bool should_match);
 
@@ -64,8 +95,24 @@ void testSplitLogic();
 void testContentSplit();
 void testReadSplitLogic();
 void testSHA256();
+void testRefIndex();
+void testRCloneRC();
+void testInvokeWithInput();
+void testListingCache();
+void testScheduler();
+void testJournal();
+void testStagedFiles();
+void testTarGrouping();
+void testParallelGrouping();
+void testSealedTars();
+void testBlockCache();
+void testContentHash();
+void testChangeTracker();
 
 void predictor(int argc, char **argv);
+void hashSpeed();
+void writeSpeed(int argc, char **argv);
+void churn(int argc, char **argv);
 
 int main(int argc, char *argv[])
 {
@@ -81,6 +128,18 @@ int main(int argc, char *argv[])
         predictor(argc, argv);
         return 0;
     }
+    if (argc > 1 && string("--hashspeed") == argv[1]) {
+        hashSpeed();
+        return 0;
+    }
+    if (argc > 1 && string("--writespeed") == argv[1]) {
+        writeSpeed(argc, argv);
+        return 0;
+    }
+    if (argc > 1 && string("--churn") == argv[1]) {
+        churn(argc, argv);
+        return 0;
+    }
     try {
         sys = newSystem();
         fs = newDefaultFileSystem(sys.get());
@@ -99,6 +158,19 @@ int main(int argc, char *argv[])
         testReadSplitLogic();
 //        testContentSplit();
         testSHA256();
+        testRefIndex();
+        testRCloneRC();
+        testInvokeWithInput();
+        testListingCache();
+        testScheduler();
+        testJournal();
+        testStagedFiles();
+        testTarGrouping();
+        testParallelGrouping();
+        testSealedTars();
+        testBlockCache();
+        testContentHash();
+        testChangeTracker();
 
         if (!err_found_) {
             printf("OK\n");
@@ -573,14 +645,1033 @@ void testSHA256()
 {
     string gzfile_contents = "ABC";
     vector<char> sha256_hash;
-    sha256_hash.resize(SHA256_DIGEST_LENGTH);
-    {
-        SHA256_CTX sha256ctx;
-        SHA256_Init(&sha256ctx);
-        SHA256_Update(&sha256ctx, gzfile_contents.c_str(), gzfile_contents.length());
-        SHA256_Final((unsigned char*)&sha256_hash[0], &sha256ctx);
-    }
+    sha256(gzfile_contents.c_str(), gzfile_contents.length(), &sha256_hash);
     string hex = toHex(sha256_hash);
     //fprintf(stderr, "sha256sum of \"%s\" is %s\n", gzfile_contents.c_str(), hex.c_str());
+    if (hex != "b5d4045c3f466fa91fe2cc6abe79232a1a57cdf104f7a26e716e0a1e2789df78") {
+        verbose(TEST_SHA256, "Expected sha256sum of ABC but got %s\n", hex.c_str());
+        err_found_ = true;
+    }
+
+    // Hashing in several updates must give the same result.
+    SHA256Hasher hasher;
+    hasher.update("A", 1);
+    hasher.update("BC", 2);
+    vector<char> incremental;
+    hasher.final(&incremental);
+    if (incremental != sha256_hash) {
+        verbose(TEST_SHA256, "Incremental sha256 differs %s\n", toHex(incremental).c_str());
+        err_found_ = true;
+    }
+
+    // Hashing many in parallel must give the same result as one at a time.
+    vector<string> inputs;
+    for (int i=0; i<1000; ++i) {
+        inputs.push_back(string("entry")+to_string(i));
+    }
+    vector<vector<char>> hashes(inputs.size());
+    sha256Many(inputs.size(), 4,
+               [&](size_t i, SHA256Hasher *h) { h->update(inputs[i]); },
+               [&](size_t i, vector<char> &h) { hashes[i] = h; });
+    for (size_t i=0; i<inputs.size(); ++i) {
+        vector<char> h;
+        sha256(inputs[i].c_str(), inputs[i].length(), &h);
+        if (h != hashes[i]) {
+            verbose(TEST_SHA256, "Parallel sha256 of %s differs\n", inputs[i].c_str());
+            err_found_ = true;
+        }
+    }
+}
+
+void testRefIndex()
+{
+    Path *a = Path::lookup("a/beak_s_a.tar");
+    Path *b = Path::lookup("a/beak_s_b.tar");
+    Path *c = Path::lookup("beak_z_c.gz");
+    Path *d = Path::lookup("beak_z_d.gz");
+    Path *e = Path::lookup("beak_z_e.gz");
+
+    auto refs = newRefIndex();
+    vector<Path*> p0 = { a, b }, p1 = { a, b }, p2 = { a, c }, p3 = { a, d };
+    refs->addPointInTime("p0", 100, p0);
+    refs->addPointInTime("p1", 101, p1);
+    refs->addPointInTime("p2", 102, p2);
+    refs->addPointInTime("p3", 103, p3);
+
+    if (refs->numReferences(a) != 4 || refs->numReferences(b) != 2 || refs->numReferences(e) != 0) {
+        verbose(TEST_REFINDEX, "Wrong number of references.\n");
+        err_found_ = true;
+    }
+
+    // Removing the two oldest points frees only b.
+    vector<bool> remove = { true, true, false, false };
+    vector<Path*> freed;
+    refs->filesFreedByRemoving(remove, &freed);
+    if (freed.size() != 1 || freed[0] != b) {
+        verbose(TEST_REFINDEX, "Expected only b to be freed.\n");
+        err_found_ = true;
+    }
+
+    // The saved index loads into the same references.
+    Path *tmp = fs->mkTempFile("beak_test_refindex", "");
+    refs->save(fs.get(), tmp);
+    auto loaded = newRefIndex();
+    RC rc = loaded->load(fs.get(), tmp);
+    fs->deleteFile(tmp);
+    if (rc.isErr() || loaded->numPointsInTime() != 4 || loaded->pointSize(2) != 102 ||
+        loaded->numReferences(a) != 4 || loaded->numReferences(c) != 1) {
+        verbose(TEST_REFINDEX, "Loaded reference index differs.\n");
+        err_found_ = true;
+    }
+
+    // Dropping p0 and adding p4 renumbers the points, only p4 is loaded.
+    vector<string> filenames = { "p1", "p2", "p3", "p4" };
+    size_t n = 0;
+    vector<string> failed;
+    // A point that cannot be loaded leaves the index unchanged.
+    rc = loaded->updatePointsInTime(filenames,
+                                    [=](string &filename, size_t *size, vector<Path*> *files)
+                                    {
+                                        return RC::ERR;
+                                    }, &n, &failed);
+    if (rc.isOk() || failed.size() != 1 || failed[0] != "p4" || loaded->numPointsInTime() != 4 ||
+        loaded->pointFileName(0) != "p0" || loaded->numReferences(a) != 4) {
+        verbose(TEST_REFINDEX, "Failed update changed the reference index.\n");
+        err_found_ = true;
+    }
+    failed.clear();
+    rc = loaded->updatePointsInTime(filenames,
+                                    [=](string &filename, size_t *size, vector<Path*> *files)
+                                    {
+                                        *size = 104;
+                                        files->push_back(a);
+                                        files->push_back(e);
+                                        return RC::OK;
+                                    }, &n, &failed);
+    vector<size_t> points;
+    loaded->pointsReferencing(b, &points);
+    if (rc.isErr() || n != 1 || loaded->numReferences(a) != 4 || points.size() != 1 || points[0] != 0 ||
+        loaded->pointSize(3) != 104 || loaded->numReferences(e) != 1) {
+        verbose(TEST_REFINDEX, "Updated reference index is wrong.\n");
+        err_found_ = true;
+    }
+}
+
+void testRCloneRC()
+{
+    Json j;
+    // Members are serialized in sorted order.
+    string in = "{\"list\":[{\"IsDir\":false,\"Path\":\"a/b \\\"c\\\"\",\"Size\":4711}],\"x\":null}";
+    RC rc = parseJson(in.c_str(), in.size(), &j);
+    if (rc.isErr() || j["list"].items.size() != 1 ||
+        j["list"].items[0].getString("Path") != "a/b \"c\"" ||
+        j["list"].items[0].getNumber("Size") != 4711 ||
+        j.serialize() != in) {
+        verbose(TEST_RCLONE_RC, "Json parse/serialize failed: %s\n", j.serialize().c_str());
+        err_found_ = true;
+    }
+
+    string r = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\n{\"a\r\n4\r\n\":1}\r\n0\r\n\r\n";
+    vector<char> reply(r.begin(), r.end());
+    int status = 0;
+    string body;
+    rc = parseHttpReply(reply, &status, &body);
+    if (rc.isErr() || status != 200 || body != "{\"a\":1}") {
+        verbose(TEST_RCLONE_RC, "Chunked http reply parsed as \"%s\"\n", body.c_str());
+        err_found_ = true;
+    }
+
+    // Upload a file to the fake remote, list it, fetch it back and delete it.
+    Path *root = fs->mkTempDir("beak_test_rcd");
+    Path *local = root->append("local");
+    fs->mkDirpWriteable(local);
+    vector<char> data = { 'b', 'e', 'a', 'k' };
+    fs->createFile(local->append("x.tar"), &data);
+    auto rcd = newFakeRCloneDaemon(fs.get(), root);
+
+    vector<RCloneJob> jobs(2);
+    jobs[0].method = "operations/copyfile";
+    jobs[0].params["srcFs"] = local->str();
+    jobs[0].params["srcRemote"] = "x.tar";
+    jobs[0].params["dstFs"] = "remote:backups";
+    jobs[0].params["dstRemote"] = "d/x.tar";
+    jobs[1] = jobs[0];
+    jobs[1].params["srcRemote"] = "missing.tar";
+    int num_done = 0;
+    rc = rcloneRunJobs(rcd.get(), &jobs, 1, [&](RCloneJob *job) { num_done++; });
+    if (rc.isOk() || num_done != 2 || jobs[0].result.isErr() || jobs[1].result.isOk() || jobs[1].error == "") {
+        verbose(TEST_RCLONE_RC, "Expected the first copy to succeed and the second to fail.\n");
+        err_found_ = true;
+    }
+
+    vector<RCloneEntry> entries;
+    rc = rcloneList(rcd.get(), "remote:backups", &entries);
+    if (rc.isErr() || entries.size() != 1 || entries[0].path != "d/x.tar" || entries[0].size != 4) {
+        verbose(TEST_RCLONE_RC, "Listing of fake remote is wrong.\n");
+        err_found_ = true;
+    }
+
+    vector<RCloneJob> deletes(1);
+    deletes[0].method = "operations/deletefile";
+    deletes[0].params["fs"] = "remote:backups";
+    deletes[0].params["remote"] = "d/x.tar";
+    rc = rcloneRunJobs(rcd.get(), &deletes, 4, [](RCloneJob *job) {});
+    entries.clear();
+    rcloneList(rcd.get(), "remote:backups", &entries);
+    if (rc.isErr() || entries.size() != 0) {
+        verbose(TEST_RCLONE_RC, "Delete on fake remote failed.\n");
+        err_found_ = true;
+    }
+
+    fs->deleteFile(local->append("x.tar"));
+    fs->rmDir(root->append("remote")->append("backups")->append("d"));
+    fs->rmDir(root->append("remote")->append("backups"));
+    fs->rmDir(root->append("remote"));
+    fs->rmDir(local);
+    fs->rmDir(root);
+}
+
+void testInvokeWithInput()
+{
+    string in = "HEJSAN";
+    bool fed = false;
+    auto feed = [&](char *buf, size_t len) -> ssize_t {
+        if (fed) return 0;
+        fed = true;
+        memcpy(buf, in.c_str(), in.size());
+        return in.size();
+    };
+    vector<char> out;
+    RC rc = sys->invokeWithInput("cat", {}, feed, &out);
+    if (rc.isErr() || string(out.begin(), out.end()) != in) {
+        verbose(TEST_INVOKE, "cat did not echo its input.\n");
+        err_found_ = true;
+    }
+    // A program that cannot be executed is a failure, not an exit of the child.
+    fed = false;
+    rc = sys->invokeWithInput("beak_test_no_such_program", {}, feed);
+    if (rc.isOk()) {
+        verbose(TEST_INVOKE, "Invoking a missing program succeeded.\n");
+        err_found_ = true;
+    }
+}
+
+void testListingCache()
+{
+    vector<string> lines;
+    LineSplitter splitter([&](string &line) { lines.push_back(line); });
+    splitter.feed("  12 a/b\n 3", 11);
+    splitter.feed("4 c\n5 d", 7);
+    splitter.flush();
+    if (lines.size() != 3 || lines[0] != "  12 a/b" || lines[1] != " 34 c" || lines[2] != "5 d") {
+        verbose(TEST_LISTINGCACHE, "Lines were not split properly.\n");
+        err_found_ = true;
+    }
+
+    Path *storage = Path::lookup("/beak_test_listing_storage");
+    auto cache = newListingCache(fs.get(), storage);
+    cache->clear();
+    cache->add("/a/beak_s_1.tar", 100);
+    cache->add("beak_z_2.gz", 20);
+    cache->add("a/beak_z_4.gz", 40);
+    cache->save();
+
+    // Only the index files in the root are points in time.
+    vector<string> points;
+    auto manifest = newListingCache(fs.get(), storage);
+    if (manifest->loadPointsInTime(&points).isErr() || points.size() != 1 || points[0] != "beak_z_2.gz" ||
+        manifest->age() > 60) {
+        verbose(TEST_LISTINGCACHE, "Points in time manifest did not load properly.\n");
+        err_found_ = true;
+    }
+
+    auto loaded = newListingCache(fs.get(), storage);
+    RC rc = loaded->load();
+    loaded->remove("beak_z_2.gz");
+    loaded->add("b/beak_s_3.tar", 300);
+    loaded->add("a/beak_s_1.tar", 101);
+    // One file removed, one added and one with a new size.
+    if (rc.isErr() || loaded->size() != 3 || loaded->age() > 60 || loaded->numDifferences(cache.get()) != 3) {
+        verbose(TEST_LISTINGCACHE, "Listing cache did not load or update properly.\n");
+        err_found_ = true;
+    }
+    loaded->invalidate();
+    points.clear();
+    if (cache->load().isOk() || cache->loadPointsInTime(&points).isOk()) {
+        verbose(TEST_LISTINGCACHE, "Invalidated listing cache still loads.\n");
+        err_found_ = true;
+    }
+}
+
+void testBwLimit(string s, bool ok, string expected, int hour, size_t expected_bps)
+{
+    BandwidthLimit limit;
+    bool parsed = limit.parse(s);
+    if (parsed != ok || (ok && limit.str() != expected)) {
+        verbose(TEST_SCHEDULER, "Expected bandwidth limit \"%s\" to parse %s as \"%s\" but got \"%s\".\n",
+                s.c_str(), ok?"ok":"bad", expected.c_str(), limit.str().c_str());
+        err_found_ = true;
+    }
+    if (!ok) return;
+    struct tm tm {};
+    tm.tm_year = 119;
+    tm.tm_mon = 5;
+    tm.tm_mday = 1;
+    tm.tm_hour = hour;
+    tm.tm_isdst = -1;
+    size_t bps = limit.bytesPerSecond(mktime(&tm));
+    if (bps != expected_bps) {
+        verbose(TEST_SCHEDULER, "Expected bandwidth limit \"%s\" at %02d:00 to be %zu but got %zu.\n",
+                s.c_str(), hour, expected_bps, bps);
+        err_found_ = true;
+    }
+}
+
+void testScheduler()
+{
+    testBwLimit("10M", true, "10240K", 3, 10*1024*1024);
+    testBwLimit("off", true, "", 3, 0);
+    testBwLimit("08:00,512K 18:00,off", true, "08:00,512K 18:00,off", 12, 512*1024);
+    testBwLimit("18:00,off 08:00,512K", true, "08:00,512K 18:00,off", 20, 0);
+    // Before the first slot the last slot of yesterday applies.
+    testBwLimit("08:00,512K 18:00,1M", true, "08:00,512K 18:00,1024K", 3, 1024*1024);
+    testBwLimit("25:00,1M", false, "", 0, 0);
+    testBwLimit("1M 2M", false, "", 0, 0);
+    testBwLimit("08:00,", false, "", 0, 0);
+
+    // A storage with 1s latency and 1MiB/s per connection.
+    auto history = newTransferHistory(fs.get(), Path::lookup("/beak_test_scheduler_storage"));
+    TransferPlan plan;
+    vector<size_t> sizes = { 1000, 3000000, 2000 };
+    planTransfers(history.get(), sizes, 4, 16, 0, &plan);
+    if (plan.connections != 3 || plan.secs != 0 || plan.order != vector<size_t>({1, 2, 0})) {
+        verbose(TEST_SCHEDULER, "Expected the default plan without history.\n");
+        err_found_ = true;
+    }
+    for (size_t b = 0; b < 8; ++b) {
+        history->addSample(b*1024*1024, 1.0 + b);
+    }
+    double latency, bps;
+    if (!history->estimate(&latency, &bps) || fabs(latency-1.0) > 0.001 || fabs(bps-1024*1024) > 1) {
+        verbose(TEST_SCHEDULER, "Expected latency 1s and bandwidth 1MiB/s.\n");
+        err_found_ = true;
+    }
+    // Small files need many connections to hide the latency.
+    vector<size_t> small(100, 64*1024);
+    planTransfers(history.get(), small, 4, 16, 0, &plan);
+    if (plan.connections != 16) {
+        verbose(TEST_SCHEDULER, "Expected 16 connections for small files, got %d.\n", plan.connections);
+        err_found_ = true;
+    }
+    // Large files need few connections.
+    vector<size_t> large(10, 64*1024*1024);
+    planTransfers(history.get(), large, 4, 16, 0, &plan);
+    if (plan.connections != 2 || fabs(plan.secs - 5*65.0) > 0.001) {
+        verbose(TEST_SCHEDULER, "Expected 2 connections and 325s for large files, got %d %.1fs.\n",
+                plan.connections, plan.secs);
+        err_found_ = true;
+    }
+    // A bandwidth limit of 2MiB/s is reached with two connections.
+    planTransfers(history.get(), small, 4, 16, 2*1024*1024, &plan);
+    if (plan.connections != 2) {
+        verbose(TEST_SCHEDULER, "Expected 2 connections with a bandwidth limit, got %d.\n", plan.connections);
+        err_found_ = true;
+    }
+}
+
+void testJournal()
+{
+    Path *dest = Path::lookup("/beak_test_journal_destination");
+    Path *big = fs->mkTempFile("beak_test_journal_big_", "");
+    Path *up = Path::lookup("/beak_test_journal_destination/up.tar");
+    FileStat target;
+    target.st_size = 100*1024*1024;
+    target.st_mtim.tv_sec = 1234;
+    target.st_mtim.tv_nsec = 5678;
+
+    auto journal = newJournal(sys, fs, dest);
+    journal->remove();
+    // The interrupted job wrote the first 20MiB of the big file.
+    FileStat partial;
+    partial.st_size = 20*1024*1024;
+    fs->createFile(big, &partial, [&](off_t offset, char *buffer, size_t len) {
+            memset(buffer, 'a', len);
+            journal->written(big, &target, offset+len, buffer, len);
+            return len;
+        });
+    journal->stored(up, 4711);
+
+    auto loaded = newJournal(sys, fs, dest);
+    RC rc = loaded->load();
+    size_t stored = 0;
+    loaded->forEachStored([&](Path *file, size_t size) { if (file == up) stored = size; });
+    // Progress is journaled in steps, the last step was at 16MiB.
+    if (rc.isErr() || loaded->resumeOffset(big, &target, fs.get(), big) != 16*1024*1024 || stored != 4711) {
+        verbose(TEST_JOURNAL, "Journal did not load properly.\n");
+        err_found_ = true;
+    }
+    // Another version of the file cannot be continued.
+    target.st_mtim.tv_nsec++;
+    if (loaded->resumeOffset(big, &target, fs.get(), big) != 0) {
+        verbose(TEST_JOURNAL, "Journal continues another version of the file.\n");
+        err_found_ = true;
+    }
+    target.st_mtim.tv_nsec--;
+    // Nor can a partially written file that was changed afterwards.
+    FILE *f = fs->openAsFILE(big, "r+");
+    fseek(f, 4711, SEEK_SET);
+    fputc('b', f);
+    fclose(f);
+    if (loaded->resumeOffset(big, &target, fs.get(), big) != 0) {
+        verbose(TEST_JOURNAL, "Journal continues a changed file.\n");
+        err_found_ = true;
+    }
+    fs->deleteFile(big);
+    loaded->remove();
+    if (newJournal(sys, fs, dest)->load().isOk()) {
+        verbose(TEST_JOURNAL, "Removed journal still loads.\n");
+        err_found_ = true;
+    }
+
+    // Continue a file, keeping its first bytes.
+    Path *file = fs->mkTempFile("beak_test_continue_", "aaaaxxxx");
+    FileStat st;
+    st.st_size = 8;
+    fs->continueFile(file, &st, 4, [](off_t offset, char *buffer, size_t len) {
+            memset(buffer, 'b', len);
+            return len;
+        });
+    vector<char> buf;
+    fs->loadVector(file, 64, &buf);
+    if (string(buf.begin(), buf.end()) != "aaaabbbb") {
+        verbose(TEST_JOURNAL, "Expected continued file to be aaaabbbb.\n");
+        err_found_ = true;
+    }
+    fs->deleteFile(file);
+}
+
+void testStagedFiles()
+{
+    Path *dir = fs->mkTempDir("beak_test_staged_");
+    Path *file = dir->append("file");
+    vector<char> old_content = { 'o', 'l', 'd' };
+    fs->createFile(file, &old_content);
+    // Left behind by a crashed job.
+    Path *leftover = dir->append(".crashed.staged");
+    fs->createFile(leftover, &old_content);
+    FileStat st;
+    auto staged = newStagedFiles(fs.get());
+    Path *staging = staged->stagingName(file);
+    if (!StagedFiles::isStagingName(staging) || StagedFiles::isStagingName(file)) {
+        verbose(TEST_STAGING, "Bad staging name %s\n", staging->c_str());
+        err_found_ = true;
+    }
+    vector<char> content = { 'n', 'e', 'w' };
+    fs->createFile(staging, &content);
+    bool committed = false;
+    staged->written(file, [&]() { committed = true; });
+    vector<char> buf;
+    fs->loadVector(file, 64, &buf);
+    // The old contents stay until the commit.
+    if (committed || string(buf.begin(), buf.end()) != "old") {
+        verbose(TEST_STAGING, "Staged file replaced before commit.\n");
+        err_found_ = true;
+    }
+    RC rc = staged->commit();
+    buf.clear();
+    fs->loadVector(file, 64, &buf);
+    if (rc.isErr() || !committed || string(buf.begin(), buf.end()) != "new" || fs->stat(staging, &st).isOk()) {
+        verbose(TEST_STAGING, "Staged file not committed properly.\n");
+        err_found_ = true;
+    }
+    if (fs->stat(leftover, &st).isOk()) {
+        verbose(TEST_STAGING, "Staged file left behind by a crash was not removed.\n");
+        err_found_ = true;
+    }
+
+    // A file that cannot be committed, since it was never staged, fails the
+    // implicit commit when a file is written into another dir, and the next commit.
+    Path *sub = fs->mkDir(dir, "sub");
+    Path *missing = dir->append("missing");
+    Path *other = sub->append("other");
+    staged->written(missing, [](){});
+    fs->createFile(staged->stagingName(other), &content);
+    RC written_rc = staged->written(other, [](){});
+    rc = staged->commit();
+    if (written_rc.isOk() || rc.isOk() || fs->stat(other, &st).isErr()) {
+        verbose(TEST_STAGING, "Failed commit was not reported.\n");
+        err_found_ = true;
+    }
+    if (staged->commit().isErr()) {
+        verbose(TEST_STAGING, "Failed commit was reported twice.\n");
+        err_found_ = true;
+    }
+    fs->deleteFile(other);
+    fs->rmDir(sub);
+    fs->deleteFile(file);
+    fs->rmDir(dir);
+}
+
+void testBlockCache()
+{
+    string content;
+    for (int i = 0; i < 10000; ++i) content += to_string(i) + ",";
+    Path *file = fs->mkTempFile("beak_test_blockcache_", content);
+    pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+    // Blocks of 1000 bytes, room for 8 of them, read ahead 4 blocks.
+    auto cache = newBlockCache(fs, &fs_lock, 1000, 8, 4);
+
+    char buf[3000];
+    // A read spanning blocks and a read past the end of the file.
+    ssize_t n = cache->pread(file, buf, 2500, 1700);
+    if (n != 2500 || string(buf, n) != content.substr(1700, 2500)) {
+        verbose(TEST_BLOCKCACHE, "Read across blocks returned the wrong bytes.\n");
+        err_found_ = true;
+    }
+    n = cache->pread(file, buf, 3000, content.length()-100);
+    if (n != 100 || string(buf, n) != content.substr(content.length()-100)) {
+        verbose(TEST_BLOCKCACHE, "Read past the end of the file returned %zd bytes.\n", n);
+        err_found_ = true;
+    }
+
+    // Two reads in a row are sequential, the following blocks are then read ahead.
+    cache->pread(file, buf, 1000, 20000);
+    cache->pread(file, buf, 1000, 21000);
+    if (!cache->isSequential(file)) {
+        verbose(TEST_BLOCKCACHE, "Expected the reads to be sequential.\n");
+        err_found_ = true;
+    }
+    cache->waitForReadAhead();
+    size_t misses = cache->numMisses();
+    for (off_t offset = 22000; offset < 26000; offset += 1000) {
+        n = cache->pread(file, buf, 1000, offset);
+        if (n != 1000 || string(buf, n) != content.substr(offset, 1000)) {
+            verbose(TEST_BLOCKCACHE, "Read ahead block at %jd has the wrong bytes.\n", (intmax_t)offset);
+            err_found_ = true;
+        }
+    }
+    if (cache->numMisses() != misses) {
+        verbose(TEST_BLOCKCACHE, "Read ahead blocks were read again.\n");
+        err_found_ = true;
+    }
+    fs->deleteFile(file);
+}
+
+void hashSpeed()
+{
+    // Bulk hashing speed, like when hashing file contents.
+    vector<char> buf(64*1024*1024);
+    for (size_t i=0; i<buf.size(); ++i) buf[i] = (char)i;
+    vector<char> hash;
+    uint64_t start = clockGetTimeMicroSeconds();
+    sha256(&buf[0], buf.size(), &hash);
+    uint64_t stop = clockGetTimeMicroSeconds();
+    double secs = (stop-start)/1000000.0;
+    printf("bulk sha256 %.1f MB/s\n", buf.size()/secs/1000000.0);
+
+    // Meta hashing speed, many small inputs like TarEntry::metaHash.
+    size_t n = 1000000;
+    char meta[64];
+    memset(meta, 0, sizeof(meta));
+    vector<vector<char>> hashes(n);
+    for (int threads = 1; threads <= numCores(); threads *= 2) {
+        start = clockGetTimeMicroSeconds();
+        sha256Many(n, threads,
+                   [&](size_t i, SHA256Hasher *h) { h->update(meta, sizeof(meta)); h->update(&i, sizeof(i)); },
+                   [&](size_t i, vector<char> &h) { hashes[i] = h; });
+        stop = clockGetTimeMicroSeconds();
+        secs = (stop-start)/1000000.0;
+        printf("meta sha256 with %d threads %.0f entries/s\n", threads, n/secs);
+    }
+}
+
+void writeSpeed(int argc, char **argv)
+{
+    // The cost of the atomic local storage writes, tar sized files written
+    // directly, staged and synced one at a time, and staged with batched syncs.
+    sys = newSystem();
+    fs = newDefaultFileSystem(sys.get());
+    Path *dir = Path::lookup(argc > 2 ? argv[2] : "/tmp")->append("beak_writespeed");
+    size_t n = 64;
+    vector<char> buf(1024*1024);
+    for (size_t i=0; i<buf.size(); ++i) buf[i] = (char)i;
+
+    for (int mode = 0; mode < 3; ++mode) {
+        fs->mkDirpWriteable(dir);
+        auto staged = newStagedFiles(fs.get());
+        uint64_t start = clockGetTimeMicroSeconds();
+        for (size_t i = 0; i < n; ++i) {
+            Path *file = dir->append("file"+to_string(i));
+            if (mode == 0) {
+                fs->createFile(file, &buf);
+                continue;
+            }
+            fs->createFile(staged->stagingName(file), &buf);
+            staged->written(file, [](){});
+            if (mode == 1) staged->commit();
+        }
+        staged->commit();
+        uint64_t stop = clockGetTimeMicroSeconds();
+        double secs = (stop-start)/1000000.0;
+        const char *what[] = { "direct", "staged, synced per file", "staged, batched sync" };
+        printf("%s %.1f MB/s\n", what[mode], n*buf.size()/secs/1000000.0);
+        for (size_t i = 0; i < n; ++i) fs->deleteFile(dir->append("file"+to_string(i)));
+    }
+    fs->rmDir(dir);
+}
+
+void testTarGrouping()
+{
+    for (size_t n = 1; n < 100; ++n) {
+        // The tar that is split when going from n to n+1 tars.
+        size_t p = 1;
+        while (p < n+1) p *= 2;
+        size_t split = n - p/2;
+        for (int i = 0; i < 2000; ++i) {
+            uint32_t hash = hashString(to_string(i));
+            size_t from = findTarFromHash(hash, n);
+            size_t to = findTarFromHash(hash, n+1);
+            if (from >= n || to >= n+1) {
+                error(TEST_GROUPING, "Tar %zu out of range for %zu tars.\n", from >= n ? from : to, from >= n ? n : n+1);
+            }
+            if (from != to && (from != split || to != n)) {
+                error(TEST_GROUPING, "Going from %zu to %zu tars moved a file from tar %zu to %zu.\n",
+                      n, n+1, from, to);
+            }
+        }
+    }
+}
+
+// The tar names and the index files of the backup of dir, grouped and indexed by num_threads.
+static map<Path*,vector<char>> groupedBackup(Path *dir, int num_threads)
+{
+    Settings settings;
+    settings.from.type = ArgOrigin;
+    settings.from.origin = dir;
+    settings.depth = 2;
+    unique_ptr<Backup> backup = newBackup(fs.get());
+    backup->setNumThreads(num_threads);
+    // Without the progress of the scan.
+    LogLevel level = logLevel();
+    if (level == INFO) setLogLevel(QUITE);
+    backup->scanFileSystem(&settings.from, &settings, NULL);
+    setLogLevel(level);
+
+    map<Path*,vector<char>> files;
+    FileSystem *bfs = backup->asFileSystem();
+    bfs->recurse(Path::lookupRoot(), [&](Path *path, FileStat *st) {
+            if (!st->isRegularFile()) return RecurseContinue;
+            vector<char> &buf = files[path];
+            if (path->name()->str().find("beak_z_") == 0) {
+                buf.resize(st->st_size);
+                ssize_t n = bfs->pread(path, &buf[0], buf.size(), 0);
+                if (n != st->st_size) buf.clear();
+            }
+            return RecurseContinue;
+        });
+    return files;
+}
+
+void testParallelGrouping()
+{
+    Path *dir = fs->mkTempDir("beak_test_grouping_");
+    vector<Path*> paths = { dir };
+    for (int d = 0; d < 6; ++d) {
+        Path *sub = fs->mkDir(dir, ("d"+to_string(d)).c_str());
+        paths.push_back(sub);
+        for (int e = 0; e < 3; ++e) {
+            Path *subsub = fs->mkDir(sub, ("e"+to_string(e)).c_str());
+            paths.push_back(subsub);
+        }
+    }
+    // Small files everywhere and a few medium and large ones.
+    vector<Path*> files;
+    for (size_t i = 0; i < paths.size()*20; ++i) {
+        size_t size = 100 + (i*7919)%5000;
+        if (i % 37 == 0) size = 300000;
+        if (i % 101 == 0) size = 3000000;
+        vector<char> content(size, (char)i);
+        Path *f = paths[i%paths.size()]->append("f"+to_string(i));
+        fs->createFile(f, &content);
+        files.push_back(f);
+    }
+
+    captureStartTime();
+    auto serial = groupedBackup(dir, 1);
+    auto parallel = groupedBackup(dir, 8);
+    size_t num_indexes = 0;
+    for (auto &f : serial) {
+        if (f.second.size() > 0) num_indexes++;
+    }
+    // The root and the first level subdirs have indexes.
+    if (num_indexes != 7 || serial != parallel) {
+        verbose(TEST_GROUPING, "Grouping in parallel gave %zu files, serially %zu files with %zu indexes.\n",
+                parallel.size(), serial.size(), num_indexes);
+        err_found_ = true;
+    }
+
+    for (Path *f : files) fs->deleteFile(f);
+    for (auto i = paths.rbegin(); i != paths.rend(); ++i) fs->rmDir(*i);
+}
+
+static void churnWrite(Path *file, size_t size, int seed)
+{
+    vector<char> buf(size);
+    for (size_t i=0; i<size; ++i) buf[i] = (char)(i*seed);
+    fs->createFile(file, &buf);
+    // Pretend that every write happened at its own second in the past.
+    FileStat st;
+    fs->stat(file, &st);
+    st.st_mtim.tv_sec = 1500000000 + seed;
+    st.st_mtim.tv_nsec = 0;
+    fs->utime(file, &st);
+}
+
+// The names of the tars in the sealed dir /work of origin.
+static set<string> sealedTars(Path *origin)
+{
+    captureStartTime();
+    Settings settings;
+    settings.from.type = ArgOrigin;
+    settings.from.origin = origin;
+    settings.sealglob = { "/work" };
+    settings.targetsize = 100000;
+    settings.targetsize_supplied = true;
+    unique_ptr<Backup> backup = newBackup(fs.get());
+    LogLevel level = logLevel();
+    if (level == INFO) setLogLevel(QUITE);
+    backup->scanFileSystem(&settings.from, &settings, NULL);
+    setLogLevel(level);
+
+    set<string> tars;
+    backup->asFileSystem()->recurse(Path::lookupRoot(), [&](Path *path, FileStat *st) {
+            if (st->isRegularFile() && path->name()->str().find("beak_s_") == 0) tars.insert(path->str());
+            return RecurseContinue;
+        });
+    return tars;
+}
+
+static size_t numMissing(set<string> &from, set<string> &in)
+{
+    size_t n = 0;
+    for (auto &t : from) if (in.count(t) == 0) n++;
+    return n;
+}
+
+void testSealedTars()
+{
+    Path *origin = fs->mkTempDir("beak_test_sealed_");
+    Path *dir = origin->append("work");
+    fs->mkDirpWriteable(dir);
+    vector<Path*> files;
+    int seed = 0;
+    auto add = [&](int num) {
+        for (int i = 0; i < num; ++i) {
+            Path *f = dir->append("file"+to_string(seed));
+            churnWrite(f, 1000+(seed*7919)%9000, ++seed);
+            files.push_back(f);
+        }
+    };
+    add(200);
+    set<string> before = sealedTars(origin);
+
+    // The new files have the most recent mtimes, only the last tar can change.
+    add(20);
+    set<string> appended = sealedTars(origin);
+    if (before.size() < 5 || numMissing(before, appended) > 1) {
+        verbose(TEST_GROUPING, "Appending files changed %zu of %zu sealed tars.\n",
+                numMissing(before, appended), before.size());
+        err_found_ = true;
+    }
+
+    // Removing an old file only changes the tar it was in and the next one.
+    fs->deleteFile(files[50]);
+    set<string> removed = sealedTars(origin);
+    size_t changed = numMissing(appended, removed);
+    if (changed == 0 || changed > 2) {
+        verbose(TEST_GROUPING, "Removing a file changed %zu of %zu sealed tars.\n", changed, appended.size());
+        err_found_ = true;
+    }
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (i != 50) fs->deleteFile(files[i]);
+    }
+    fs->rmDir(dir);
+    fs->rmDir(origin);
+}
+
+static size_t churnReplay(Path *origin, bool append_only, vector<string> sealglob)
+{
+    Path *dir = origin->append("work");
+    fs->mkDirpWriteable(dir);
+    auto monitor = newMonitor(sys.get(), fs.get(), ProgressDisplayType::None);
+
+    srand(4711);
+    vector<Path*> files;
+    int seed = 0;
+    auto add = [&](int num, size_t min_size, size_t max_size) {
+        for (int i = 0; i < num; ++i) {
+            Path *f = dir->append("file"+to_string(seed));
+            churnWrite(f, min_size+rand()%(max_size-min_size), ++seed);
+            files.push_back(f);
+        }
+    };
+    add(3000, 1000, 60000);
+
+    map<Path*,size_t> previous;
+    size_t total_stored = 0;
+    for (int step = 0; step <= 20; ++step) {
+        if (step > 0 && append_only) {
+            // New mails or log files arrive.
+            add(40, 1000, 60000);
+        }
+        else if (step > 0) {
+            // Grow the directory with a few larger files, change a file and remove a file.
+            add(3, 1000000, 3000000);
+            churnWrite(files[rand()%files.size()], 1000+rand()%60000, ++seed);
+            size_t j = rand()%files.size();
+            fs->deleteFile(files[j]);
+            files.erase(files.begin()+j);
+        }
+
+        // Every backup is a new beak process.
+        captureStartTime();
+        Settings settings;
+        settings.from.type = ArgOrigin;
+        settings.from.origin = origin;
+        settings.sealglob = sealglob;
+        auto progress = monitor->newProgressStatistics("churn");
+        unique_ptr<Backup> backup = newBackup(fs.get());
+        backup->scanFileSystem(&settings.from, &settings, progress.get());
+
+        map<Path*,size_t> current;
+        size_t size = 0, stored = 0;
+        backup->asFileSystem()->recurse(Path::lookupRoot(), [&](Path *path, FileStat *st) {
+                if (!st->isRegularFile()) return RecurseContinue;
+                current[path] = st->st_size;
+                size += st->st_size;
+                if (previous.count(path) == 0) stored += st->st_size;
+                return RecurseContinue;
+            });
+        if (step > 0) total_stored += stored;
+        printf("backup %2d %zu files in %zu tars of %s, stored again %s (%.0f%%)\n",
+               step, files.size(), current.size(), humanReadable(size).c_str(),
+               humanReadable(stored).c_str(), 100.0*stored/size);
+        previous = current;
+    }
+
+    for (Path *f : files) fs->deleteFile(f);
+    fs->rmDir(dir);
+    return total_stored;
+}
+
+void churn(int argc, char **argv)
+{
+    // Replay a directory that changes over 20 backups and report the bytes
+    // in tars that have to be stored again after every backup.
+    // Only tars with new names, ie new contents, are stored.
+    sys = newSystem();
+    fs = newDefaultFileSystem(sys.get());
+    setLogLevel(QUITE);
+    Path *origin = Path::lookup(argc > 2 ? argv[2] : "/tmp")->append("beak_churn");
+
+    printf("Growing and changing directory:\n");
+    size_t growing = churnReplay(origin, false, {});
+    printf("Directory that only gains new files:\n");
+    size_t append = churnReplay(origin, true, {});
+    printf("Directory that only gains new files, with sealed tars -sx /work:\n");
+    size_t sealed = churnReplay(origin, true, { "/work" });
+    fs->rmDir(origin);
+
+    printf("stored again in total: growing %s, appended %s, appended and sealed %s\n",
+           humanReadable(growing).c_str(), humanReadable(append).c_str(), humanReadable(sealed).c_str());
+}
+
+void testContentHash()
+{
+    Path *dir = fs->mkTempDir("beak_test_contenthash_");
+    Path *file = dir->append("file");
+    vector<char> content = { 'A', 'B', 'C' };
+    fs->createFile(file, &content);
+    FileStat st;
+    fs->stat(file, &st);
+
+    auto cache = newContentHashCache(fs.get(), dir);
+    TarEntry entry(file, Path::lookup("file"), &st, TarHeaderStyle::Simple, false);
+    TarFile tar(TarContents::SMALL_FILES_TAR);
+    tar.addEntryLast(&entry);
+    tar.fixSize(1024*1024, TarHeaderStyle::Simple, TarFilePaddingStyle::None, 1024*1024);
+    entry.calculateHash();
+    RC rc = entry.calculateContentHash(fs.get(), cache.get());
+    string abc = "b5d4045c3f466fa91fe2cc6abe79232a1a57cdf104f7a26e716e0a1e2789df78";
+    if (rc.isErr() || toHex(entry.contentHash()) != abc) {
+        verbose(TEST_CONTENTHASH, "Bad content hash %s\n", toHex(entry.contentHash()).c_str());
+        err_found_ = true;
+    }
+
+    // The hash recorded in the index is loaded back.
+    string listing;
+    cookEntry(&listing, &entry, true);
+    vector<char> v(listing.begin(), listing.end());
+    auto i = v.begin();
+    FileStat efs;
+    size_t offset, part_offset, part_size, last_part_size, disk_size, last_disk_size;
+    string tarr, link, content_hash;
+    Path *path;
+    bool is_sym_link, is_hard_link, eof = false, err = false;
+    uint num_parts;
+    bool got = eatEntry(90, v, i, NULL, NULL, &efs, &offset, &tarr, &path, &link, &is_sym_link, &is_hard_link,
+                        &num_parts, &part_offset, &part_size, &last_part_size, &disk_size, &last_disk_size,
+                        &content_hash, &eof, &err);
+    if (!got || err || content_hash != abc) {
+        verbose(TEST_CONTENTHASH, "Content hash \"%s\" not loaded from the index.\n", content_hash.c_str());
+        err_found_ = true;
+    }
+
+    // An unchanged file is not read again.
+    cache->save();
+    vector<char> other;
+    sha256("other", 5, &other);
+    auto loaded = newContentHashCache(fs.get(), dir);
+    if (loaded->load().isErr()) {
+        verbose(TEST_CONTENTHASH, "Content hash cache did not load.\n");
+        err_found_ = true;
+    }
+    loaded->add(file, &st, other);
+    entry.calculateContentHash(fs.get(), loaded.get());
+    if (entry.contentHash() != other) {
+        verbose(TEST_CONTENTHASH, "Unchanged file was hashed again.\n");
+        err_found_ = true;
+    }
+    // The cached hash is wrong, as if the file changed without changing its stat.
+    // Streaming the contents into the tar finds it.
+    vector<char> hash;
+    char buf[1024];
+    entry.copy(buf, sizeof(buf), 0, fs.get());
+    if (loaded->numChanged() != 1 || loaded->lookup(file, &st, &hash)) {
+        verbose(TEST_CONTENTHASH, "Silently changed file not found when streamed.\n");
+        err_found_ = true;
+    }
+    // A changed file is hashed again.
+    loaded->add(file, &st, other);
+    st.st_mtim.tv_sec--;
+    if (loaded->lookup(file, &st, &hash)) {
+        verbose(TEST_CONTENTHASH, "Changed file found in the content hash cache.\n");
+        err_found_ = true;
+    }
+    loaded->remove();
+    fs->deleteFile(file);
+    fs->rmDir(dir);
+}
+
+static bool sameTime(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static Path *fakeBackup(Path *storage)
+{
+    // Only the name of the index file is used to find the point in time of the backup.
+    TarFileName tfn;
+    tfn.type = TarContents::INDEX_FILE;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    tfn.sec = now.tv_sec;
+    tfn.nsec = now.tv_nsec - now.tv_nsec % 1000;
+    tfn.header_hash = string(64, '0');
+    tfn.num_parts = 1;
+    Path *index = tfn.asPathWithDir(storage);
+    vector<char> content;
+    fs->createFile(index, &content);
+    return index;
+}
+
+void testChangeTracker()
+{
+    Path *origin = fs->mkTempDir("beak_test_changes_origin_");
+    Path *storage = fs->mkTempDir("beak_test_changes_storage_");
+    Path *sub = origin->append("sub");
+    fs->mkDir(sub, "", 0755);
+    Path *old_file = origin->append("old");
+    Path *new_file = sub->append("new");
+    vector<char> old_content(100, 'a');
+    vector<char> new_content(4711, 'b');
+    fs->createFile(old_file, &old_content);
+
+    // The file system timestamps are coarser than the clock.
+    usleep(50*1000);
+    Path *index = fakeBackup(storage);
+    usleep(50*1000);
+    fs->createFile(new_file, &new_content);
+
+    OriginChanges scanned;
+    RC rc = newChangeTracker(sys, fs, origin, storage)->scan(&scanned);
+    if (rc.isErr() || scanned.num_files != 1 || scanned.size_files != 4711 ||
+        scanned.dirs.size() != 1 || scanned.dirs[0] != sub || scanned.since.tv_sec == 0)
+    {
+        verbose(TEST_CHANGES, "Expected 1 file (4711 bytes) changed in %s, got %zu files (%zu bytes) in %zu dirs.\n",
+                sub->c_str(), scanned.num_files, scanned.size_files, scanned.dirs.size());
+        err_found_ = true;
+    }
+
+    // Without a backup every file is changed.
+    OriginChanges all;
+    newChangeTracker(sys, fs, origin, NULL)->scan(&all);
+    if (all.num_files != 2 || all.size_files != 4811 || all.since.tv_sec != 0)
+    {
+        verbose(TEST_CHANGES, "Expected 2 files (4811 bytes) without a backup, got %zu files (%zu bytes).\n",
+                all.num_files, all.size_files);
+        err_found_ = true;
+    }
+
+    // The changes saved by a running tracker are loaded back.
+    auto tracker = newChangeTracker(sys, fs, origin, storage);
+    OriginChanges loaded;
+    if (tracker->load(&loaded).isOk())
+    {
+        verbose(TEST_CHANGES, "Loaded changes without a running tracker.\n");
+        err_found_ = true;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (!verbose_) setLogLevel(QUITE);
+        _exit(newChangeTracker(sys, fs, origin, storage)->track().isOk() ? 0 : 1);
+    }
+    rc = RC::ERR;
+    for (int i = 0; i < 100 && rc.isErr() && sys->processExists(pid); ++i)
+    {
+        usleep(100*1000);
+        rc = tracker->load(&loaded);
+    }
+    if (rc.isErr() ||
+        loaded.tracker != pid ||
+        !sameTime(loaded.since, scanned.since) ||
+        !sameTime(loaded.mtim_max, scanned.mtim_max) ||
+        !sameTime(loaded.ctim_max, scanned.ctim_max) ||
+        loaded.num_files != scanned.num_files ||
+        loaded.size_files != scanned.size_files ||
+        loaded.dirs != scanned.dirs)
+    {
+        verbose(TEST_CHANGES, "The changes saved by the tracker differ from the scanned changes.\n");
+        err_found_ = true;
+    }
+    kill(pid, SIGTERM);
+    int status;
+    waitpid(pid, &status, 0);
+    if (tracker->load(&loaded).isOk())
+    {
+        verbose(TEST_CHANGES, "Loaded changes of a terminated tracker.\n");
+        err_found_ = true;
+    }
 
+    char name[32];
+    snprintf(name, sizeof(name), "changes_%08x", hashString(origin->str()));
+    fs->deleteFile(beakSharedDir(sys.get(), fs.get())->append(name));
+    fs->deleteFile(index);
+    fs->rmDir(storage);
+    fs->deleteFile(new_file);
+    fs->rmDir(sub);
+    fs->deleteFile(old_file);
+    fs->rmDir(origin);
 }
@@ -0,0 +1,76 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "threads.h"
+
+#include <atomic>
+#include <pthread.h>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+int numCores()
+{
+    unsigned int n = thread::hardware_concurrency();
+    if (n < 1) return 1;
+    return (int)n;
+}
+
+struct ParallelFor
+{
+    size_t n;
+    function<void(size_t)> *cb;
+    atomic<size_t> next;
+};
+
+static void *parallelForThread(void *data)
+{
+    ParallelFor *pf = (ParallelFor*)data;
+    for (;;)
+    {
+        size_t i = pf->next++;
+        if (i >= pf->n) break;
+        (*pf->cb)(i);
+    }
+    return NULL;
+}
+
+void parallelFor(size_t n, int num_threads, function<void(size_t)> cb)
+{
+    if (num_threads < 1) num_threads = 1;
+    if ((size_t)num_threads > n) num_threads = (int)n;
+
+    ParallelFor pf;
+    pf.n = n;
+    pf.cb = &cb;
+    pf.next = 0;
+
+    vector<pthread_t> threads;
+    for (int t = 1; t < num_threads; ++t)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, parallelForThread, &pf) != 0) break;
+        threads.push_back(thread);
+    }
+    // The calling thread does its share of the work as well.
+    parallelForThread(&pf);
+    for (auto &thread : threads)
+    {
+        pthread_join(thread, NULL);
+    }
+}
@@ -0,0 +1,31 @@
+/*
+ Copyright (C) 2019 Fredrik Öhrström
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <functional>
+#include <stddef.h>
+
+// The number of cpu cores, at least 1.
+int numCores();
+
+// Invoke cb(i) for i from 0 to n-1 using up to num_threads threads,
+// the calling thread included. Returns when all invocations have finished.
+void parallelFor(size_t n, int num_threads, std::function<void(size_t)> cb);
+
+#endif
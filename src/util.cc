@@ -16,6 +16,7 @@
  */
 
 #include"log.h"
+#include"sha256.h"
 #include"util.h"
 
 #include <cassert>
@@ -464,6 +465,33 @@ void trimWhitespace(string *s)
     s->erase(s->find_last_not_of(ws) + 1);
 }
 
+void LineSplitter::feed(const char *buf, size_t len)
+{
+    const char *end = buf+len;
+    while (buf < end)
+    {
+        const char *nl = (const char*)memchr(buf, '\n', end-buf);
+        if (nl == NULL)
+        {
+            partial_.append(buf, end);
+            return;
+        }
+        partial_.append(buf, nl);
+        cb_(partial_);
+        partial_.clear();
+        buf = nl+1;
+    }
+}
+
+void LineSplitter::flush()
+{
+    if (partial_.length() > 0)
+    {
+        cb_(partial_);
+        partial_.clear();
+    }
+}
+
 string toHexAndText(const char *b, size_t len, int line_length)
 {
     string s;
@@ -649,7 +677,7 @@ void fixEndian(long *t)
 }
 
 struct Entropy {
-    SHA256_CTX sha256ctx;
+    SHA256Hasher hasher_;
     vector<char> sha256_hash_;
     vector<char> pool_;
 
@@ -658,12 +686,9 @@ struct Entropy {
 
         a = clockGetUnixTimeSeconds();
         b = clockGetTimeMicroSeconds();
-        SHA256_Init(&sha256ctx);
-        SHA256_Update(&sha256ctx, &a, sizeof(a));
-        SHA256_Update(&sha256ctx, &b, sizeof(b));
-
-        sha256_hash_.resize(SHA256_DIGEST_LENGTH);
-        SHA256_Final((unsigned char*)&sha256_hash_[0], &sha256ctx);
+        hasher_.update(&a, sizeof(a));
+        hasher_.update(&b, sizeof(b));
+        hasher_.final(&sha256_hash_);
         pool_.resize(SHA256_DIGEST_LENGTH);
         memcpy(&pool_[0], &sha256_hash_[0], SHA256_DIGEST_LENGTH);
     }
@@ -678,9 +703,9 @@ struct Entropy {
         }
 
         uint64_t c = clockGetTimeMicroSeconds();
-        SHA256_Update(&sha256ctx, &c, sizeof(c));
-        SHA256_Update(&sha256ctx, &pool_[0], SHA256_DIGEST_LENGTH);
-        SHA256_Final((unsigned char*)&sha256_hash_[0], &sha256ctx);
+        hasher_.update(&c, sizeof(c));
+        hasher_.update(pool_);
+        hasher_.final(&sha256_hash_);
         for (int i=0; i<SHA256_DIGEST_LENGTH; ++i) {
             pool_[i] ^= sha256_hash_[i];
         }
@@ -1095,13 +1120,8 @@ Path *makeSafePath(Path *p, bool original, bool hash_only)
     // as will fit from the safe path.
     string olen = to_string(org.length());
 
-    SHA256_CTX sha256ctx;
     vector<char> sha256_hash;
-
-    SHA256_Init(&sha256ctx);
-    SHA256_Update(&sha256ctx, org.c_str(), org.length());
-    sha256_hash.resize(SHA256_DIGEST_LENGTH);
-    SHA256_Final((unsigned char*)&sha256_hash[0], &sha256ctx);
+    sha256(org.c_str(), org.length(), &sha256_hash);
     string hash = toHex(sha256_hash)+"L"+olen;
 
     if (hash_only)
@@ -22,6 +22,7 @@
 #include"configuration.h"
 
 #include<deque>
+#include<functional>
 #include<limits>
 #include<locale>
 #include<memory.h>
@@ -77,6 +78,18 @@ void eatWhitespace(std::vector<char> &v, std::vector<char>::iterator &i, bool *e
 std::string eatToSkipWhitespace(std::vector<char> &v, std::vector<char>::iterator &i, int c, size_t max, bool *eof, bool *err);
 // Remove leading and trailing white space
 void trimWhitespace(std::string *s);
+// Collect data that arrives in pieces, like the output from a program, into lines.
+// The callback receives each complete line without the newline.
+struct LineSplitter
+{
+    LineSplitter(std::function<void(std::string &line)> cb) : cb_(cb) {}
+    void feed(const char *buf, size_t len);
+    // Deliver the last line if it lacked a newline.
+    void flush();
+private:
+    std::function<void(std::string &line)> cb_;
+    std::string partial_;
+};
 // Translate binary buffer with printable strings to ascii
 // with non-printabled escaped as such: \xC0 \xFF \xEE
 std::string toHexAndText(const char *b, size_t len, int line_length);
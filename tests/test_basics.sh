@@ -734,6 +734,149 @@ if [ $do_test ]; then
     echo OK
 fi
 
+setup contenthash "Store the hashes of the file contents in the index"
+if [ $do_test ]; then
+    mkdir -p $root/Alfa/
+    echo HEJSAN > $root/Alfa/gurka.c
+    echo HEJSAN > $root/Alfa/tomat.c
+    # The cache of the content hashes is kept in the test dir.
+    HOME=$dir performStore "--contenthash"
+    HASH=$(echo HEJSAN | sha256sum | cut -f 1 -d ' ')
+    COUNT=$(zcat $store/Alfa/beak_z_*.gz | tr '\0' '\n' | grep -c $HASH)
+    if [ ! "$COUNT" = "2" ]; then
+        echo "COUNT=\"$COUNT\""
+        echo Failed beak store --contenthash! Expected the hash of both files in the index. Check in $dir for more information.
+        exit 1
+    fi
+    # Same size and mtime, the changed contents must still be hashed again.
+    touch -r $root/Alfa/gurka.c $dir/mtime
+    echo SVEJSA > $root/Alfa/gurka.c
+    touch -r $dir/mtime $root/Alfa/gurka.c
+    sleep 1
+    HOME=$dir performStore "--contenthash"
+    HASH=$(echo SVEJSA | sha256sum | cut -f 1 -d ' ')
+    COUNT=$(zcat $store/Alfa/beak_z_*.gz | tr '\0' '\n' | grep -c $HASH)
+    if [ ! "$COUNT" = "1" ]; then
+        echo "COUNT=\"$COUNT\""
+        echo Failed beak store --contenthash! Expected the new hash of the changed file. Check in $dir for more information.
+        exit 1
+    fi
+    performFsckExpectOK
+    echo OK
+fi
+
+setup deepcheck "Deep check finds a corrupted file"
+if [ $do_test ]; then
+    mkdir -p $root/Alfa/
+    echo HEJSAN > $root/Alfa/gurka.c
+    echo SVEJSAN > $root/Alfa/tomat.c
+    HOME=$dir performStore "--contenthash"
+    HOME=$dir performFsckExpectOK "--deepcheck"
+    # Same size, other contents.
+    sed -i 's/HEJSAN/HEJSBN/' $store/Alfa/beak_s_*.tar
+    if HOME=$dir ${BEAK} fsck --deepcheck $store > $log 2>&1; then
+        cat $log
+        echo Failed beak fsck --deepcheck! Expected it to fail. Check in $dir for more information.
+        exit 1
+    fi
+    CHECK=$(grep -o "Content hash mismatch for [^ ]*gurka.c" $log)
+    if [ "$CHECK" = "" ]; then
+        cat $log
+        echo Failed beak fsck --deepcheck! Expected gurka.c to be reported. Check in $dir for more information.
+        exit 1
+    fi
+    echo OK
+fi
+
+setup deepcheck_resume "Deep check resumes after being interrupted"
+if [ $do_test ]; then
+    for i in $(seq 1 40); do
+        mkdir -p $root/Dir$i
+        head -c 16000000 /dev/zero > $root/Dir$i/file
+    done
+    HOME=$dir performStore "--contenthash"
+    HOME=$dir ${BEAK} fsck --deepcheck --threads 1 $store > $log 2>&1 &
+    PID=$!
+    # Interrupt the check once it has verified a tar.
+    while kill -0 $PID 2> /dev/null; do
+        if [ -s "$(ls $dir/.cache/beak/fsck_*.journal 2> /dev/null)" ]; then
+            kill -9 $PID
+            break
+        fi
+        sleep 0.01
+    done
+    { wait $PID; } 2> /dev/null
+    HOME=$dir ${BEAK} fsck --deepcheck $store > $log 2>&1
+    CHECK=$(grep -o "Resuming deep check" $log)
+    if [ ! "$CHECK" = "Resuming deep check" ]; then
+        cat $log
+        echo Failed beak fsck --deepcheck! Expected it to resume. Check in $dir for more information.
+        exit 1
+    fi
+    if [ ! "$(grep -o "Found 0 error(s)" $log)" = "Found 0 error(s)" ]; then
+        cat $log
+        echo Failed beak fsck --deepcheck! Expected no errors. Check in $dir for more information.
+        exit 1
+    fi
+    if ls $dir/.cache/beak/fsck_*.journal > /dev/null 2>&1; then
+        echo Failed beak fsck --deepcheck! Expected the journal to be removed. Check in $dir for more information.
+        exit 1
+    fi
+    echo OK
+fi
+
+setup stream_same_tars "Store with --stream writes the same tars as without"
+if [ $do_test ]; then
+    for d in Alfa Beta Gamma; do
+        mkdir -p $root/$d/Sub
+        for i in $(seq 1 20); do
+            echo $d$i > $root/$d/file$i
+            head -c $((i*1000)) /dev/urandom > $root/$d/Sub/data$i
+        done
+    done
+    # A hard link across subtrees, and a file dated in the future.
+    ln $root/Alfa/file1 $root/Gamma/Sub/hard
+    echo FUTURE > $root/Beta/Sub/future
+    touch -d '+2 days' $root/Beta/Sub/future
+    performStore "--relaxtimechecks --stream"
+    streamed=$dir/Streamed
+    mv $store $streamed
+    mkdir -p $store
+    performStore "--relaxtimechecks"
+    if ! diff -r $streamed $store > $diff; then
+        cat $diff
+        echo Failed beak store --stream! Expected the same tars as without. Check in $dir for more information.
+        exit 1
+    fi
+    echo OK
+fi
+
+setup status "Status reports the files changed since the backup"
+if [ $do_test ]; then
+    mkdir -p $root/Alfa $root/Beta
+    echo HEJSAN > $root/Alfa/gurka.c
+    echo HEJSAN > $root/Beta/tomat.c
+    # The configuration is kept in the test dir.
+    mkdir -p $dir/.config/beak
+    cat > $dir/.config/beak/beak.conf <<EOF2
+[test]
+origin = $root
+type = LocalThenRemoteBackup
+local = $store
+EOF2
+    HOME=$dir performStore
+    echo 0123456789abcdef > $root/Beta/tomat.c
+    echo 0123456789 > $root/Beta/gurka.c
+    HOME=$dir ${BEAK} status > $log 2>&1
+    CHECK=$(grep -o "2 files (28 B) in 1 directories changed since the backup" $log)
+    if [ "$CHECK" = "" ]; then
+        cat $log
+        echo Failed beak status! Expected 2 files of 28 bytes changed in Beta. Check in $dir for more information.
+        exit 1
+    fi
+    echo OK
+fi
+
 setup basicprune "Prune small simple backup"
 if [ $do_test ]; then
     mkdir -p $root/Alfa/Beta
@@ -1141,6 +1284,28 @@ if [ $do_test ]; then
     echo OK
 fi
 
+setup crossdirhardlink "Hard link between dirs with their own index files"
+if [ $do_test ]; then
+    mkdir -p $root/a/b
+    mkdir -p $root/d
+    echo 2 > $root/d/g2
+    ln $root/d/g2 $root/a/b/hard
+    performStore
+    standardStoreRestoreTest
+    if [ ! -f $check/d/g2 ] || [ "$(stat -c %h $check/d/g2)" != "2" ]; then
+        echo Failed restore! Expected d/g2 to be restored as a hard link. Check in $dir for more information.
+        exit 1
+    fi
+    performDiff
+    CHECK=$(cat $diff)
+    if [ ! "$CHECK" = "" ]; then
+        cat $diff
+        echo Failed beak diff! Expected no change. Check in $dir for more information.
+        exit 1
+    fi
+    echo OK
+fi
+
 setup fifo "FIFO"
 if [ $do_test ]; then
     mkfifo $root/fifo1
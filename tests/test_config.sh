@@ -9,6 +9,10 @@ rm -rf $dir/storage
 mkdir -p $dir/storage
 
 echo 12345678 > $dir/origin/hello.txt
+# The local storage and cache are inside the origin, create them up front and
+# date everything in the past, otherwise the origin looks changed in the future.
+mkdir -p $dir/origin/.beak/local $dir/origin/.beak/cache
+touch -d "1 minute ago" $dir/origin/hello.txt $dir/origin/.beak/local $dir/origin/.beak/cache $dir/origin/.beak $dir/origin
 
 cat > $dir/test.conf <<EOF
 [test]
@@ -24,3 +28,37 @@ remote_keep = all:1w daily:2w weekly:2m monthly:2y
 EOF
 
 $beak push --useconfig=$dir/test.conf test: > $dir/test.log
+
+# A dry run of pull only reports what it would write.
+rm $dir/origin/hello.txt
+$beak pull --dryrun --useconfig=$dir/test.conf test: > $dir/pull.log
+if [ -f $dir/origin/hello.txt ] || ! grep -q "Pull would write 1 files" $dir/pull.log; then
+    cat $dir/pull.log
+    echo Failed pull --dryrun! Expected one file to write and nothing written.
+    exit 1
+fi
+
+$beak pull --useconfig=$dir/test.conf test: > $dir/pull.log
+if [ "$(cat $dir/origin/hello.txt)" != "12345678" ]; then
+    echo Failed pull! Expected hello.txt to be restored.
+    exit 1
+fi
+
+# A file changed in the origin after the backup is kept.
+echo changed > $dir/origin/hello.txt
+$beak pull --useconfig=$dir/test.conf test: > $dir/pull.log
+if [ "$(cat $dir/origin/hello.txt)" != "changed" ]; then
+    echo Failed pull! Expected the newer hello.txt in the origin to be kept.
+    exit 1
+fi
+
+# Another host stores a more recent backup in the remote storage, it is the one pulled.
+mkdir -p $dir/other
+echo other > $dir/other/other.txt
+touch -d "1 minute ago" $dir/other/other.txt $dir/other
+$beak store $dir/other $dir/storage > $dir/store.log
+$beak pull --useconfig=$dir/test.conf test: > $dir/pull.log
+if [ "$(cat $dir/origin/other.txt)" != "other" ]; then
+    echo Failed pull! Expected the most recent backup in the remote storage to be pulled.
+    exit 1
+fi